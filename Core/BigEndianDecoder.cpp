@@ -0,0 +1,139 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "BigEndianDecoder.h"
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define ORTHANC_BIG_ENDIAN_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define ORTHANC_BIG_ENDIAN_SSE2 1
+#endif
+
+
+namespace OrthancPlugins
+{
+  static bool IsHostBigEndian()
+  {
+    const uint16_t value = 1;
+    return *reinterpret_cast<const uint8_t*>(&value) == 0;
+  }
+
+
+  static uint32_t Swap32(uint32_t v)
+  {
+    return ((v >> 24) |
+            ((v >> 8) & 0x0000ff00u) |
+            ((v << 8) & 0x00ff0000u) |
+            (v << 24));
+  }
+
+
+  static uint64_t Swap64(uint64_t v)
+  {
+    return ((static_cast<uint64_t>(Swap32(static_cast<uint32_t>(v))) << 32) |
+            static_cast<uint64_t>(Swap32(static_cast<uint32_t>(v >> 32))));
+  }
+
+
+#if defined(ORTHANC_BIG_ENDIAN_SSE2)
+  // SSE2 has no byte shuffle: The 16-bit words are first reordered,
+  // then the two bytes of each word are exchanged by shifts
+  static inline __m128i SwapBytesInWords(__m128i v)
+  {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  }
+#endif
+
+
+  void DecodeBigEndian32(int32_t* values,
+                         size_t count)
+  {
+    if (IsHostBigEndian())
+    {
+      return;
+    }
+
+    size_t i = 0;
+
+#if defined(ORTHANC_BIG_ENDIAN_AVX2)
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+    for (; i + 8 <= count; i += 8)
+    {
+      __m256i* p = reinterpret_cast<__m256i*>(values + i);
+      _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), mask));
+    }
+#elif defined(ORTHANC_BIG_ENDIAN_SSE2)
+    for (; i + 4 <= count; i += 4)
+    {
+      __m128i* p = reinterpret_cast<__m128i*>(values + i);
+      __m128i v = _mm_loadu_si128(p);
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      _mm_storeu_si128(p, SwapBytesInWords(v));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+      values[i] = static_cast<int32_t>(Swap32(static_cast<uint32_t>(values[i])));
+    }
+  }
+
+
+  void DecodeBigEndian64(int64_t* values,
+                         size_t count)
+  {
+    if (IsHostBigEndian())
+    {
+      return;
+    }
+
+    size_t i = 0;
+
+#if defined(ORTHANC_BIG_ENDIAN_AVX2)
+    const __m256i mask = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+
+    for (; i + 4 <= count; i += 4)
+    {
+      __m256i* p = reinterpret_cast<__m256i*>(values + i);
+      _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), mask));
+    }
+#elif defined(ORTHANC_BIG_ENDIAN_SSE2)
+    for (; i + 2 <= count; i += 2)
+    {
+      __m128i* p = reinterpret_cast<__m128i*>(values + i);
+      __m128i v = _mm_loadu_si128(p);
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+      _mm_storeu_si128(p, SwapBytesInWords(v));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+      values[i] = static_cast<int64_t>(Swap64(static_cast<uint64_t>(values[i])));
+    }
+  }
+}
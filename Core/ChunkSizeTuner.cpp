@@ -0,0 +1,224 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "ChunkSizeTuner.h"
+
+#include "PostgreSQLException.h"
+
+#include <limits>
+
+
+namespace OrthancPlugins
+{
+  static const size_t DEFAULT_MIN_CHUNK_SIZE = 64 * 1024;
+  static const size_t DEFAULT_MAX_CHUNK_SIZE = 16 * 1024 * 1024;
+  static const size_t INITIAL_CHUNK_SIZE = 1024 * 1024;
+  static const unsigned int DEFAULT_TARGET_DURATION = 100;  // In milliseconds
+
+  // Weight of the last operation in the smoothed throughput, and
+  // decay of the previous operations in the fit
+  static const double SMOOTHING = 0.25;
+  static const double DECAY = 0.9;
+
+
+  ChunkSizeTuner::ChunkSizeTuner() :
+    minChunkSize_(DEFAULT_MIN_CHUNK_SIZE),
+    maxChunkSize_(DEFAULT_MAX_CHUNK_SIZE),
+    targetDuration_(DEFAULT_TARGET_DURATION)
+  {
+    Reset();
+  }
+
+
+  void ChunkSizeTuner::Reset()
+  {
+    chunkSize_ = INITIAL_CHUNK_SIZE;
+    if (chunkSize_ < minChunkSize_)
+    {
+      chunkSize_ = minChunkSize_;
+    }
+    else if (chunkSize_ > maxChunkSize_)
+    {
+      chunkSize_ = maxChunkSize_;
+    }
+
+    throughput_ = 0;
+    latency_ = 0;
+    bandwidth_ = 0;
+    sumWeights_ = 0;
+    sumX_ = 0;
+    sumY_ = 0;
+    sumXX_ = 0;
+    sumXY_ = 0;
+    bytes_ = 0;
+    operations_ = 0;
+    microseconds_ = 0;
+  }
+
+
+  void ChunkSizeTuner::SetBounds(size_t minChunkSize,
+                                 size_t maxChunkSize)
+  {
+    // The chunks are given to "lo_read()" and "lo_write()", whose
+    // sizes are of type "int"
+    if (minChunkSize == 0 ||
+        minChunkSize > maxChunkSize ||
+        maxChunkSize > static_cast<size_t>(std::numeric_limits<int>::max()))
+    {
+      throw PostgreSQLException("Bad bounds for the size of the chunks of the large objects");
+    }
+
+    minChunkSize_ = minChunkSize;
+    maxChunkSize_ = maxChunkSize;
+    Reset();
+  }
+
+
+  void ChunkSizeTuner::SetTargetDuration(unsigned int milliseconds)
+  {
+    if (milliseconds == 0)
+    {
+      throw PostgreSQLException("The target duration of the chunks of the large objects must be positive");
+    }
+
+    targetDuration_ = milliseconds;
+  }
+
+
+  void ChunkSizeTuner::Record(size_t bytes,
+                              uint64_t microseconds)
+  {
+    bytes_ += bytes;
+    operations_ += 1;
+    microseconds_ += microseconds;
+
+    if (bytes == 0)
+    {
+      return;
+    }
+
+    // The clock can be too coarse for the fastest operations
+    double x = static_cast<double>(bytes);
+    double y = static_cast<double>(microseconds < 1 ? 1 : microseconds) / 1000000.0;
+
+    sumWeights_ = DECAY * sumWeights_ + 1.0;
+    sumX_ = DECAY * sumX_ + x;
+    sumY_ = DECAY * sumY_ + y;
+    sumXX_ = DECAY * sumXX_ + x * x;
+    sumXY_ = DECAY * sumXY_ + x * y;
+
+    // The size of the last chunk of an object is arbitrary: Only the
+    // full chunks are representative of the throughput
+    if (bytes >= chunkSize_ / 2)
+    {
+      double throughput = x / y;
+      throughput_ = (throughput_ == 0 ? throughput :
+                     (1.0 - SMOOTHING) * throughput_ + SMOOTHING * throughput);
+    }
+
+    // The fit is only meaningful if the sizes are diverse enough
+    // (coefficient of variation above 10%)
+    double variance = sumWeights_ * sumXX_ - sumX_ * sumX_;
+    if (variance > 0.01 * sumX_ * sumX_)
+    {
+      double slope = (sumWeights_ * sumXY_ - sumX_ * sumY_) / variance;
+      if (slope > 0)
+      {
+        double intercept = (sumY_ - slope * sumX_) / sumWeights_;
+        bandwidth_ = 1.0 / slope;
+        latency_ = (intercept > 0 ? intercept : 0);
+      }
+    }
+
+    double target = static_cast<double>(targetDuration_) / 1000.0;
+    double next;
+
+    if (bandwidth_ > 0)
+    {
+      // If the latency exceeds half of the target duration, the
+      // chunk is kept large enough for the latency not to dominate
+      next = bandwidth_ * (latency_ < target / 2.0 ? target - latency_ : latency_);
+    }
+    else if (throughput_ > 0)
+    {
+      next = throughput_ * target;
+    }
+    else
+    {
+      return;
+    }
+
+    // Change the size progressively, as the estimates are noisy
+    double current = static_cast<double>(chunkSize_);
+    if (next > 2.0 * current)
+    {
+      next = 2.0 * current;
+    }
+    else if (next < current / 2.0)
+    {
+      next = current / 2.0;
+    }
+
+    if (next <= static_cast<double>(minChunkSize_))
+    {
+      chunkSize_ = minChunkSize_;
+    }
+    else if (next >= static_cast<double>(maxChunkSize_))
+    {
+      chunkSize_ = maxChunkSize_;
+    }
+    else
+    {
+      chunkSize_ = static_cast<size_t>(next);
+    }
+  }
+
+
+  ChunkSizeTuner::Operation::Operation(ChunkSizeTuner& tuner) :
+    tuner_(tuner),
+    start_(boost::posix_time::microsec_clock::universal_time())
+  {
+  }
+
+
+  void ChunkSizeTuner::Operation::Done(size_t bytes)
+  {
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    boost::posix_time::time_duration elapsed = now - start_;
+
+    tuner_.Record(bytes, elapsed.total_microseconds() < 0 ? 0 :
+                  static_cast<uint64_t>(elapsed.total_microseconds()));
+
+    // The next operation starts now
+    start_ = now;
+  }
+
+
+  void ChunkSizeTuner::GetStatistics(Statistics& target) const
+  {
+    target.chunkSize_ = chunkSize_;
+    target.bytes_ = bytes_;
+    target.operations_ = operations_;
+    target.microseconds_ = microseconds_;
+    target.throughput_ = throughput_;
+    target.latency_ = latency_;
+  }
+}
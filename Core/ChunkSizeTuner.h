@@ -0,0 +1,140 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace OrthancPlugins
+{
+  // Size of the chunks that are exchanged with the server for the
+  // large objects, learned from the observed transfers. An operation
+  // on "b" bytes lasts about "L + b / B", where "L" is the latency of
+  // one round trip and "B" is the bandwidth. The tuner picks the
+  // chunk that lasts the target duration "T", i.e. "B * (T - L)",
+  // which bounds the share of the latency to "L / T". "L" and "B" are
+  // fitted on the recent operations (least squares with exponential
+  // decay). Until the sizes of the operations are diverse enough for
+  // the fit, the chunk lasting "T" at the smoothed throughput is
+  // used, whose fixed point is the same.
+  class ChunkSizeTuner
+  {
+  public:
+    // Measure the duration of the operations on the chunks, one after
+    // the other
+    class Operation : public boost::noncopyable
+    {
+    private:
+      ChunkSizeTuner&           tuner_;
+      boost::posix_time::ptime  start_;
+
+    public:
+      explicit Operation(ChunkSizeTuner& tuner);
+
+      void Done(size_t bytes);
+    };
+
+    struct Statistics
+    {
+      size_t    chunkSize_;
+      uint64_t  bytes_;
+      uint64_t  operations_;
+      uint64_t  microseconds_;
+      double    throughput_;   // Smoothed, in bytes per second (0 if unknown)
+      double    latency_;      // Estimated duration of a round trip, in seconds
+    };
+
+  private:
+    size_t        minChunkSize_;
+    size_t        maxChunkSize_;
+    unsigned int  targetDuration_;   // In milliseconds
+    size_t        chunkSize_;
+    double        throughput_;
+    double        latency_;
+    double        bandwidth_;   // 0 if unknown
+
+    // Decayed sums of the least-squares fit of the duration (in
+    // seconds) against the size (in bytes) of the operations
+    double        sumWeights_;
+    double        sumX_;
+    double        sumY_;
+    double        sumXX_;
+    double        sumXY_;
+
+    uint64_t      bytes_;
+    uint64_t      operations_;
+    uint64_t      microseconds_;
+
+  public:
+    ChunkSizeTuner();
+
+    // Forget the learned chunk size and the statistics, but keep the
+    // configuration
+    void Reset();
+
+    void SetBounds(size_t minChunkSize,
+                   size_t maxChunkSize);
+
+    size_t GetMinChunkSize() const
+    {
+      return minChunkSize_;
+    }
+
+    size_t GetMaxChunkSize() const
+    {
+      return maxChunkSize_;
+    }
+
+    void SetTargetDuration(unsigned int milliseconds);
+
+    unsigned int GetTargetDuration() const
+    {
+      return targetDuration_;
+    }
+
+    size_t GetChunkSize() const
+    {
+      return chunkSize_;
+    }
+
+    // Size of the next chunk, if "remaining" bytes are left
+    size_t GetChunkSize(size_t remaining) const
+    {
+      return remaining < chunkSize_ ? remaining : chunkSize_;
+    }
+
+    // Report one operation that has transferred "bytes" bytes
+    void Record(size_t bytes,
+                uint64_t microseconds);
+
+    // Bandwidth that is fitted on the recent operations, in bytes per
+    // second (0 if unknown)
+    double GetBandwidth() const
+    {
+      return bandwidth_;
+    }
+
+    void GetStatistics(Statistics& target) const;
+  };
+}
@@ -22,6 +22,8 @@
 
 #include "PostgreSQLException.h"
 
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
 #include <fstream>
 #include <json/reader.h>
 #include <memory>
@@ -124,6 +126,77 @@ namespace OrthancPlugins
   }
 
 
+  // Options that are shared by the primary and the replicas
+  static void ConfigureConnection(PostgreSQLConnection& connection,
+                                  const Json::Value& c)
+  {
+    connection.SetPipelining(GetBooleanValue(c, "EnablePipelining", true));
+
+    int maxPreparedStatements = GetIntegerValue(c, "MaximumPreparedStatements", 128);
+    if (maxPreparedStatements < 0)
+    {
+      throw PostgreSQLException("The option \"MaximumPreparedStatements\" must be positive");
+    }
+
+    connection.SetMaximumPreparedStatements(static_cast<unsigned int>(maxPreparedStatements));
+
+    int reconnectAttempts = GetIntegerValue(c, "ReconnectAttempts", 3);
+    int reconnectDelay = GetIntegerValue(c, "ReconnectDelay", 100);  // In milliseconds
+    if (reconnectAttempts < 0 ||
+        reconnectDelay < 0)
+    {
+      throw PostgreSQLException("The options \"ReconnectAttempts\" and \"ReconnectDelay\" must be positive");
+    }
+
+    connection.SetReconnectPolicy(static_cast<unsigned int>(reconnectAttempts),
+                                  static_cast<unsigned int>(reconnectDelay));
+
+    // Timeouts of the statements, in milliseconds ("0" for no limit)
+    static const struct
+    {
+      PostgreSQLStatementClass  type_;
+      const char*  option_;
+      int  defaultValue_;
+    } TIMEOUTS[] = {
+      { PostgreSQLStatementClass_Read,        "ReadTimeout",        10000 },
+      { PostgreSQLStatementClass_Scan,        "ScanTimeout",        60000 },
+      { PostgreSQLStatementClass_Write,       "WriteTimeout",       30000 },
+      { PostgreSQLStatementClass_LargeObject, "LargeObjectTimeout", 60000 }
+    };
+
+    for (size_t i = 0; i < sizeof(TIMEOUTS) / sizeof(TIMEOUTS[0]); i++)
+    {
+      int timeout = GetIntegerValue(c, TIMEOUTS[i].option_, TIMEOUTS[i].defaultValue_);
+      if (timeout < 0)
+      {
+        throw PostgreSQLException("The option \"" + std::string(TIMEOUTS[i].option_) + 
+                                  "\" must be positive");
+      }
+
+      connection.SetStatementTimeout(TIMEOUTS[i].type_, static_cast<unsigned int>(timeout));
+    }
+
+    // Bounds of the size of the chunks of the large objects (in KB),
+    // and duration of one chunk that is targeted (in milliseconds)
+    int minChunkSize = GetIntegerValue(c, "LargeObjectMinChunkSize", 64);
+    int maxChunkSize = GetIntegerValue(c, "LargeObjectMaxChunkSize", 16384);
+    int chunkDuration = GetIntegerValue(c, "LargeObjectChunkDuration", 100);
+    if (minChunkSize <= 0 ||
+        maxChunkSize <= 0 ||
+        chunkDuration <= 0)
+    {
+      throw PostgreSQLException("The options \"LargeObjectMinChunkSize\", \"LargeObjectMaxChunkSize\" "
+                                "and \"LargeObjectChunkDuration\" must be positive");
+    }
+
+    connection.GetLargeObjectChunks().SetBounds(static_cast<size_t>(minChunkSize) * 1024,
+                                                static_cast<size_t>(maxChunkSize) * 1024);
+    connection.GetLargeObjectChunks().SetTargetDuration(static_cast<unsigned int>(chunkDuration));
+
+    connection.SetLargeObjectStreaming(GetBooleanValue(c, "LargeObjectStreaming", false));
+  }
+
+
   PostgreSQLConnection* CreateConnection(bool& useLock,
                                          OrthancPluginContext* context,
                                          const Json::Value& configuration)
@@ -148,6 +221,8 @@ namespace OrthancPlugins
       }
 
       useLock = GetBooleanValue(c, "Lock", useLock);
+
+      ConfigureConnection(*connection, c);
     }
 
     if (!useLock)
@@ -161,6 +236,184 @@ namespace OrthancPlugins
   }
 
 
+  static void GetPoolParameters(unsigned int& minSize,
+                                unsigned int& maxSize,
+                                unsigned int& timeout,
+                                const Json::Value& configuration)
+  {
+    int minValue = 1;
+    int maxValue = 4;
+    int timeoutValue = 10;  // In seconds
+
+    if (configuration.isMember("PostgreSQL"))
+    {
+      Json::Value c = configuration["PostgreSQL"];
+      minValue = GetIntegerValue(c, "ConnectionPoolMinSize", minValue);
+      maxValue = GetIntegerValue(c, "ConnectionPoolMaxSize", maxValue);
+      timeoutValue = GetIntegerValue(c, "ConnectionPoolTimeout", timeoutValue);
+    }
+
+    if (minValue < 1 ||
+        maxValue < minValue ||
+        timeoutValue < 0)
+    {
+      throw PostgreSQLException("Bad configuration of the pool of PostgreSQL connections");
+    }
+
+    minSize = static_cast<unsigned int>(minValue);
+    maxSize = static_cast<unsigned int>(maxValue);
+    timeout = static_cast<unsigned int>(timeoutValue) * 1000;
+  }
+
+
+  PostgreSQLConnectionPool* CreateConnectionPool(bool& useLock,
+                                                 OrthancPluginContext* context,
+                                                 const Json::Value& configuration)
+  {
+    unsigned int minSize, maxSize, timeout;
+    GetPoolParameters(minSize, maxSize, timeout, configuration);
+
+    std::auto_ptr<PostgreSQLConnectionPool> pool
+      (new PostgreSQLConnectionPool(CreateConnection(useLock, context, configuration),
+                                    minSize, maxSize));
+
+    pool->SetTimeout(timeout);
+
+    return pool.release();
+  }
+
+
+  void ConfigureReadReplicas(PostgreSQLReadRouter& router,
+                             OrthancPluginContext* context,
+                             const Json::Value& configuration)
+  {
+    if (!configuration.isMember("PostgreSQL"))
+    {
+      return;
+    }
+
+    Json::Value c = configuration["PostgreSQL"];
+    if (!c.isMember("ReadReplicas"))
+    {
+      return;
+    }
+
+    if (c["ReadReplicas"].type() != Json::arrayValue)
+    {
+      throw PostgreSQLException("The option \"ReadReplicas\" must be a list of connection URIs");
+    }
+
+    int maxLag = GetIntegerValue(c, "MaximumReplicationLag", 1000);  // In milliseconds
+    int checkInterval = GetIntegerValue(c, "ReplicationLagCheckInterval", 1000);  // In milliseconds
+    if (maxLag < 0 ||
+        checkInterval < 0)
+    {
+      throw PostgreSQLException("The options \"MaximumReplicationLag\" and "
+                                "\"ReplicationLagCheckInterval\" must be positive");
+    }
+
+    router.SetMaximumLag(static_cast<unsigned int>(maxLag));
+    router.SetLagCheckInterval(static_cast<unsigned int>(checkInterval));
+
+    unsigned int minSize, maxSize, timeout;
+    GetPoolParameters(minSize, maxSize, timeout, configuration);
+
+    for (Json::Value::ArrayIndex i = 0; i < c["ReadReplicas"].size(); i++)
+    {
+      const Json::Value& uri = c["ReadReplicas"][i];
+      if (uri.type() != Json::stringValue)
+      {
+        throw PostgreSQLException("The option \"ReadReplicas\" must be a list of connection URIs");
+      }
+
+      std::auto_ptr<PostgreSQLConnection> connection(new PostgreSQLConnection);
+      connection->SetConnectionUri(uri.asString());
+      ConfigureConnection(*connection, c);
+
+      try
+      {
+        // A replica that is down at startup is ignored. Two
+        // connections are opened up front, as GetMainDicomTags() of
+        // the index uses a second connection of the route if idle.
+        std::auto_ptr<PostgreSQLConnectionPool> pool
+          (new PostgreSQLConnectionPool(connection.release(), std::min(2u, maxSize), maxSize));
+        pool->SetTimeout(timeout);
+        router.AddReplica(pool.release());
+      }
+      catch (PostgreSQLException& e)
+      {
+        OrthancPluginLogWarning(context, ("Ignoring a read replica of PostgreSQL: " + std::string(e.what())).c_str());
+      }
+    }
+  }
+
+
+  static PostgreSQLDurability GetDurabilityValue(const Json::Value& value)
+  {
+    if (value.type() != Json::stringValue)
+    {
+      throw PostgreSQLException("The durability must be \"Full\", \"Local\" or \"Relaxed\"");
+    }
+
+    return DurabilityPolicy::Parse(value.asString());
+  }
+
+
+  void ConfigureDurability(DurabilityPolicy& policy,
+                           const Json::Value& configuration)
+  {
+    if (!configuration.isMember("PostgreSQL") ||
+        !configuration["PostgreSQL"].isMember("Durability"))
+    {
+      return;
+    }
+
+    const Json::Value& c = configuration["PostgreSQL"]["Durability"];
+    if (c.type() != Json::objectValue)
+    {
+      throw PostgreSQLException("The option \"Durability\" must be an object");
+    }
+
+    if (c.isMember("History"))
+    {
+      policy.SetHistory(GetDurabilityValue(c["History"]));
+    }
+
+    if (c.isMember("Bookkeeping"))
+    {
+      policy.SetBookkeeping(GetDurabilityValue(c["Bookkeeping"]));
+    }
+
+    if (c.isMember("Attachments"))
+    {
+      // Maps a content type to its durability, e.g. { "2" : "Relaxed" }
+      // for the DICOM-as-JSON summaries that Orthanc can rebuild
+      const Json::Value& attachments = c["Attachments"];
+      if (attachments.type() != Json::objectValue)
+      {
+        throw PostgreSQLException("The option \"Attachments\" must map content types to durabilities");
+      }
+
+      Json::Value::Members members = attachments.getMemberNames();
+      for (size_t i = 0; i < members.size(); i++)
+      {
+        int32_t contentType;
+
+        try
+        {
+          contentType = boost::lexical_cast<int32_t>(members[i]);
+        }
+        catch (boost::bad_lexical_cast&)
+        {
+          throw PostgreSQLException("Bad content type in the option \"Attachments\": " + members[i]);
+        }
+
+        policy.SetAttachment(contentType, GetDurabilityValue(attachments[members[i]]));
+      }
+    }
+  }
+
+
   std::string GenerateUuid()
   {
 #ifdef WIN32
@@ -20,7 +20,9 @@
 
 #pragma once
 
-#include "PostgreSQLConnection.h"
+#include "DurabilityPolicy.h"
+#include "PostgreSQLConnectionPool.h"
+#include "PostgreSQLReadRouter.h"
 
 #include <json/value.h>
 #include <orthanc/OrthancCPlugin.h>
@@ -55,6 +57,17 @@ namespace OrthancPlugins
                                          OrthancPluginContext* context,
                                          const Json::Value& configuration);
 
+  PostgreSQLConnectionPool* CreateConnectionPool(bool& useLock,
+                                                 OrthancPluginContext* context,
+                                                 const Json::Value& configuration);
+
+  void ConfigureReadReplicas(PostgreSQLReadRouter& router,
+                             OrthancPluginContext* context,
+                             const Json::Value& configuration);
+
+  void ConfigureDurability(DurabilityPolicy& policy,
+                           const Json::Value& configuration);
+
   std::string GenerateUuid();
 
   bool IsFlagInCommandLineArguments(OrthancPluginContext* context,
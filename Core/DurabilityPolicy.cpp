@@ -0,0 +1,81 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DurabilityPolicy.h"
+
+#include "PostgreSQLException.h"
+
+namespace OrthancPlugins
+{
+  DurabilityPolicy::DurabilityPolicy() :
+    history_(PostgreSQLDurability_Full),
+    bookkeeping_(PostgreSQLDurability_Full)
+  {
+  }
+
+
+  void DurabilityPolicy::SetAttachment(int32_t contentType,
+                                       PostgreSQLDurability durability)
+  {
+    if (durability == PostgreSQLDurability_Full)
+    {
+      attachments_.erase(contentType);
+    }
+    else
+    {
+      attachments_[contentType] = durability;
+    }
+  }
+
+
+  PostgreSQLDurability DurabilityPolicy::GetAttachment(int32_t contentType) const
+  {
+    Attachments::const_iterator found = attachments_.find(contentType);
+    if (found == attachments_.end())
+    {
+      return PostgreSQLDurability_Full;
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+
+  PostgreSQLDurability DurabilityPolicy::Parse(const std::string& value)
+  {
+    if (value == "Full")
+    {
+      return PostgreSQLDurability_Full;
+    }
+    else if (value == "Local")
+    {
+      return PostgreSQLDurability_Local;
+    }
+    else if (value == "Relaxed")
+    {
+      return PostgreSQLDurability_Relaxed;
+    }
+    else
+    {
+      throw PostgreSQLException("Unknown durability (must be \"Full\", \"Local\" or \"Relaxed\"): " + value);
+    }
+  }
+}
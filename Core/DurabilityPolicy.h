@@ -0,0 +1,79 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLTransaction.h"
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+namespace OrthancPlugins
+{
+  // Durability of the commits, depending on the class of the
+  // operations. By default, every commit waits for the flush of the
+  // WAL. Only the data that can be rebuilt or that is informative
+  // should be relaxed: The resource hierarchy always uses the full
+  // durability.
+  class DurabilityPolicy
+  {
+  private:
+    typedef std::map<int32_t, PostgreSQLDurability>  Attachments;
+
+    PostgreSQLDurability  history_;
+    PostgreSQLDurability  bookkeeping_;
+    Attachments           attachments_;
+
+  public:
+    DurabilityPolicy();
+
+    // Changes and exported resources
+    void SetHistory(PostgreSQLDurability durability)
+    {
+      history_ = durability;
+    }
+
+    PostgreSQLDurability GetHistory() const
+    {
+      return history_;
+    }
+
+    // Tables "DeletedFiles", "DeletedResources" and "RemainingAncestor"
+    void SetBookkeeping(PostgreSQLDurability durability)
+    {
+      bookkeeping_ = durability;
+    }
+
+    PostgreSQLDurability GetBookkeeping() const
+    {
+      return bookkeeping_;
+    }
+
+    // Attachments, depending on their content type
+    void SetAttachment(int32_t contentType,
+                       PostgreSQLDurability durability);
+
+    PostgreSQLDurability GetAttachment(int32_t contentType) const;
+
+    // "Full", "Local" or "Relaxed"
+    static PostgreSQLDurability Parse(const std::string& value);
+  };
+}
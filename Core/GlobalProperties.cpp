@@ -34,39 +34,118 @@ namespace OrthancPlugins
                                      int32_t lockKey) :
     connection_(connection),
     useLock_(useLock),
-    lockKey_(lockKey)
+    lockKey_(lockKey),
+    schema_(0)
   {
-    PostgreSQLTransaction transaction(connection_);
+  }
+
+
+  void GlobalProperties::Lock(bool allowUnlock)
+  {
+    static const char* const ELEMENTS[] = {
+      "globalproperties", "resources", "storagearea", "storageareabytea"
+    };
+
+    std::string sql = "SELECT ";
 
-    if (!connection_.DoesTableExist("GlobalProperties"))
+    for (size_t i = 0; i < sizeof(ELEMENTS) / sizeof(ELEMENTS[0]); i++)
     {
-      connection_.Execute("CREATE TABLE GlobalProperties("
-                          "property INTEGER PRIMARY KEY,"
-                          "value TEXT)");
+      sql += ("EXISTS (SELECT 1 FROM pg_catalog.pg_class c "
+              "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+              "WHERE n.nspname = 'public' AND c.relkind = 'r' "
+              "AND c.relname = '" + std::string(ELEMENTS[i]) + "'), ");
     }
 
-    transaction.Commit();
-  }
+    sql += ("EXISTS (SELECT 1 FROM pg_catalog.pg_rules WHERE schemaname = 'public' "
+            "AND tablename = 'storagearea' AND rulename = 'storageareadelete'), ");
 
+    sql += ("EXISTS (SELECT 1 FROM information_schema.columns WHERE table_schema = 'public' "
+            "AND table_name = 'storagearea' AND column_name = 'size')");
 
-  void GlobalProperties::Lock(bool allowUnlock)
-  {
+#if USE_ADVISORY_LOCK == 1
     if (useLock_)
     {
-      PostgreSQLTransaction transaction(connection_);
+      sql += ", pg_try_advisory_lock($1)";
+    }
+#endif
+
+    PostgreSQLStatement s(connection_, sql);
 
 #if USE_ADVISORY_LOCK == 1
-      PostgreSQLStatement s(connection_, "select pg_try_advisory_lock($1);");
+    if (useLock_)
+    {
       s.DeclareInputInteger(0);
       s.BindInteger(0, lockKey_);
+    }
+#endif
 
+    {
       PostgreSQLResult result(s);
-      if (result.IsDone() ||
-          !result.GetBoolean(0))
+      if (result.IsDone())
       {
-        throw PostgreSQLException("The database is locked by another instance of Orthanc.");
+        throw PostgreSQLException("Cannot probe the catalog of the database");
       }
-#else
+
+      schema_ = 0;
+      if (result.GetBoolean(0))
+      {
+        schema_ |= SchemaElement_GlobalProperties;
+      }
+
+      if (result.GetBoolean(1))
+      {
+        schema_ |= SchemaElement_Index;
+      }
+
+      if (result.GetBoolean(2))
+      {
+        schema_ |= SchemaElement_StorageArea;
+      }
+
+      if (result.GetBoolean(3))
+      {
+        schema_ |= SchemaElement_StorageAreaBytea;
+      }
+
+      if (result.GetBoolean(4))
+      {
+        schema_ |= SchemaElement_StorageAreaRule;
+      }
+
+      if (result.GetBoolean(5))
+      {
+        schema_ |= SchemaElement_StorageAreaSize;
+      }
+
+#if USE_ADVISORY_LOCK == 1
+      if (useLock_)
+      {
+        if (!result.GetBoolean(6))
+        {
+          throw PostgreSQLException("The database is locked by another instance of Orthanc.");
+        }
+
+        // The lock must be taken again if the session is lost
+        connection_.RegisterAdvisoryLock(lockKey_);
+      }
+#endif
+    }
+
+    if (!HasSchemaElement(SchemaElement_GlobalProperties))
+    {
+      // "IF NOT EXISTS", as another plugin might be starting concurrently
+      PostgreSQLTransaction transaction(connection_);
+      connection_.Execute("CREATE TABLE IF NOT EXISTS GlobalProperties("
+                          "property INTEGER PRIMARY KEY,"
+                          "value TEXT)");
+      transaction.Commit();
+
+      schema_ |= SchemaElement_GlobalProperties;
+    }
+
+#if USE_ADVISORY_LOCK != 1
+    if (useLock_)
+    {
       PostgreSQLTransaction transaction(connection_);
 
       // Check the lock
@@ -83,10 +162,10 @@ namespace OrthancPlugins
 
       // Lock the database
       SetGlobalProperty(lockKey_, "1");             
-#endif
 
       transaction.Commit();
     }
+#endif
   }
 
 
@@ -99,6 +178,7 @@ namespace OrthancPlugins
         (new PostgreSQLStatement
          (connection_, "SELECT value FROM GlobalProperties WHERE property=$1"));
       lookupGlobalProperty_->DeclareInputInteger(0);
+      lookupGlobalProperty_->SetReadOnly(true);
     }
 
     lookupGlobalProperty_->BindInteger(0, static_cast<int>(property));
@@ -28,12 +28,25 @@
 
 namespace OrthancPlugins
 {
+  // The elements of the schema whose presence is reported by the
+  // catalog probe that is run at startup
+  enum SchemaElement
+  {
+    SchemaElement_GlobalProperties = (1 << 0),
+    SchemaElement_Index = (1 << 1),            // Table "Resources" and its siblings
+    SchemaElement_StorageArea = (1 << 2),
+    SchemaElement_StorageAreaRule = (1 << 3),  // Removal of the large objects
+    SchemaElement_StorageAreaSize = (1 << 4),  // Column "size" of "StorageArea"
+    SchemaElement_StorageAreaBytea = (1 << 5)  // Table "StorageAreaBytea"
+  };
+
   class GlobalProperties
   {
   private:
     PostgreSQLConnection& connection_;
     bool useLock_;
     int32_t lockKey_;
+    unsigned int schema_;   // Combination of SchemaElement flags
 
     std::auto_ptr<PostgreSQLStatement> lookupGlobalProperty_;
     std::auto_ptr<PostgreSQLStatement> setGlobalProperty1_;
@@ -44,8 +57,17 @@ namespace OrthancPlugins
                      bool useLock,
                      int32_t lockKey);
 
+    // Probe the catalog of the database in a single round trip,
+    // which also takes the advisory lock if locking is enabled. The
+    // table "GlobalProperties" is only created if it is missing.
     void Lock(bool allowUnlock);
 
+    // Whether the element was found by Lock() in the schema
+    bool HasSchemaElement(SchemaElement element) const
+    {
+      return (schema_ & element) != 0;
+    }
+
     void Unlock();
 
     bool LookupGlobalProperty(std::string& target,
@@ -0,0 +1,151 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLAsyncQuery.h"
+
+#include "PostgreSQLException.h"
+
+#include <cassert>
+
+// PostgreSQL includes
+#include <libpq-fe.h>
+
+
+namespace OrthancPlugins
+{
+  PostgreSQLAsyncQuery::PostgreSQLAsyncQuery(PostgreSQLStatement& statement) :
+    statement_(statement),
+    callback_(NULL),
+    state_(State_Created),
+    timeout_(false)
+  {
+  }
+
+
+  void PostgreSQLAsyncQuery::SetCallback(ICallback* callback)
+  {
+    if (state_ != State_Created)
+    {
+      throw PostgreSQLException("Cannot change the callback of a submitted query");
+    }
+
+    callback_ = callback;
+  }
+
+
+  void PostgreSQLAsyncQuery::Send()
+  {
+    if (state_ != State_Created)
+    {
+      throw PostgreSQLException("This query has already been submitted");
+    }
+
+    statement_.GetConnection().FlushPipeline();
+    statement_.Send();
+    state_ = State_Pending;
+  }
+
+
+  void PostgreSQLAsyncQuery::Complete(void* result)
+  {
+    assert(state_ == State_Pending);
+
+    if (result == NULL)
+    {
+      Fail("No result was received from PostgreSQL", false);
+      return;
+    }
+
+    switch (PQresultStatus(reinterpret_cast<PGresult*>(result)))
+    {
+      case PGRES_TUPLES_OK:
+        try
+        {
+          result_.reset(new PostgreSQLResult(statement_.GetConnection(), result));
+        }
+        catch (PostgreSQLException& e)
+        {
+          Fail(e.what(), false);
+          return;
+        }
+        break;
+
+      case PGRES_COMMAND_OK:
+        PQclear(reinterpret_cast<PGresult*>(result));
+        break;
+
+      default:
+      {
+        std::string error = PQresultErrorMessage(reinterpret_cast<PGresult*>(result));
+        PQclear(reinterpret_cast<PGresult*>(result));
+        Fail(error.empty() ? "Unknown error in an asynchronous query" : error, false);
+        return;
+      }
+    }
+
+    state_ = State_Done;
+
+    if (callback_ != NULL)
+    {
+      callback_->Apply(*this);
+    }
+  }
+
+
+  void PostgreSQLAsyncQuery::Fail(const std::string& error,
+                                  bool timeout)
+  {
+    result_.reset(NULL);
+    error_ = error;
+    timeout_ = timeout;
+    state_ = State_Done;
+
+    if (callback_ != NULL)
+    {
+      callback_->Apply(*this);
+    }
+  }
+
+
+  PostgreSQLResult& PostgreSQLAsyncQuery::GetResult()
+  {
+    if (state_ != State_Done)
+    {
+      throw PostgreSQLException("The asynchronous query is not done yet");
+    }
+
+    if (timeout_)
+    {
+      throw PostgreSQLTimeoutException(error_);
+    }
+
+    if (!error_.empty())
+    {
+      throw PostgreSQLException(error_);
+    }
+
+    if (result_.get() == NULL)
+    {
+      throw PostgreSQLException("PostgreSQL: Step() applied to non-SELECT request");
+    }
+
+    return *result_;
+  }
+}
@@ -0,0 +1,122 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLResult.h"
+
+#include <memory>
+
+namespace OrthancPlugins
+{
+  /**
+   * Execution of a prepared statement whose result is received
+   * asynchronously, through a PostgreSQLEventLoop. The statement
+   * must be bound before the query is submitted to the loop. This
+   * object plays the role of a future, and must outlive its
+   * execution by the loop.
+   **/
+  class PostgreSQLAsyncQuery : public boost::noncopyable
+  {
+  public:
+    class ICallback : public boost::noncopyable
+    {
+    public:
+      virtual ~ICallback()
+      {
+      }
+
+      // Called by the event loop once the query is done (successfully or not)
+      virtual void Apply(PostgreSQLAsyncQuery& query) = 0;
+    };
+
+  private:
+    friend class PostgreSQLEventLoop;
+
+    enum State
+    {
+      State_Created,
+      State_Pending,
+      State_Done
+    };
+
+    PostgreSQLStatement&  statement_;
+    ICallback*  callback_;
+    State  state_;
+    std::auto_ptr<PostgreSQLResult>  result_;
+    std::string  error_;
+    bool  timeout_;
+
+    void Send();
+
+    void Complete(void* /* PGresult* */ result);   // Takes the ownership
+
+    void Fail(const std::string& error,
+              bool timeout);
+
+  public:
+    explicit PostgreSQLAsyncQuery(PostgreSQLStatement& statement);
+
+    PostgreSQLStatement& GetStatement() const
+    {
+      return statement_;
+    }
+
+    PostgreSQLConnection& GetConnection() const
+    {
+      return statement_.GetConnection();
+    }
+
+    // The callback is not owned by the query
+    void SetCallback(ICallback* callback);
+
+    bool IsDone() const
+    {
+      return state_ == State_Done;
+    }
+
+    bool IsSuccess() const
+    {
+      return state_ == State_Done && error_.empty();
+    }
+
+    const std::string& GetError() const
+    {
+      return error_;
+    }
+
+    // Whether the query was canceled by the event loop, as it has
+    // exceeded the timeout of the class of its statement
+    bool IsTimeout() const
+    {
+      return timeout_;
+    }
+
+    // Whether the statement has produced rows (i.e. is a SELECT)
+    bool HasResult() const
+    {
+      return result_.get() != NULL;
+    }
+
+    // Throws a PostgreSQLException if the query has failed (more
+    // precisely a PostgreSQLTimeoutException on timeout)
+    PostgreSQLResult& GetResult();
+  };
+}
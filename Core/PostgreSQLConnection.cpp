@@ -25,7 +25,15 @@
 #include "PostgreSQLStatement.h"
 #include "PostgreSQLTransaction.h"
 
+#include <cassert>
+#include <errno.h>
+#include <memory>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+
+#if !defined(_WIN32)
+#  include <poll.h>
+#endif
 
 // PostgreSQL includes
 #include <libpq-fe.h>
@@ -35,8 +43,101 @@
 
 namespace OrthancPlugins
 {
-  void PostgreSQLConnection::Close()
+  // Time that is left to the server to acknowledge a cancellation
+  static const unsigned int CANCEL_GRACE_PERIOD = 2000;  // In milliseconds
+
+
+  PostgreSQLConnection::Deadline::Deadline(unsigned int timeout) :
+    infinite_(timeout == 0),
+    canceled_(false)
+  {
+    if (!infinite_)
+    {
+      expiration_ = boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+    }
+  }
+
+
+  void PostgreSQLConnection::Deadline::SetCanceled()
+  {
+    canceled_ = true;
+    infinite_ = false;
+    expiration_ = (boost::get_system_time() + 
+                   boost::posix_time::milliseconds(CANCEL_GRACE_PERIOD));
+  }
+
+
+  int PostgreSQLConnection::Deadline::GetRemaining() const
+  {
+    if (infinite_)
+    {
+      return -1;
+    }
+
+    boost::system_time now = boost::get_system_time();
+    if (now >= expiration_)
+    {
+      return 0;
+    }
+    else
+    {
+      // Round up, so as not to spin during the last millisecond
+      return static_cast<int>(((expiration_ - now).total_microseconds() + 999) / 1000);
+    }
+  }
+
+
+  static void WaitReadable(int socket,
+                           int timeout /* in milliseconds, -1 for infinite */)
+  {
+#if defined(_WIN32)
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(socket, &readable);
+
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    int count = select(socket + 1, &readable, NULL, NULL, (timeout < 0 ? NULL : &tv));
+#else
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = POLLIN;
+    fd.revents = 0;
+
+    int count = poll(&fd, 1, timeout);
+#endif
+
+    if (count < 0 &&
+        errno != EINTR)
+    {
+      throw PostgreSQLException("Cannot wait for the socket of the connection to PostgreSQL");
+    }
+  }
+
+
+  void PostgreSQLConnection::ClearCachedStatements()
   {
+    for (CachedStatements::iterator it = cachedStatements_.begin();
+         it != cachedStatements_.end(); ++it)
+    {
+      delete it->second;
+    }
+
+    cachedStatements_.clear();
+  }
+
+
+  void PostgreSQLConnection::Reset()
+  {
+    // The prepared statements are lost together with the session
+    plans_.clear();
+    unusedPlans_.clear();
+
+    pipeline_.clear();
+    inPipeline_ = false;
+
     if (pg_ != NULL)
     {
       PQfinish(reinterpret_cast<PGconn*>(pg_));
@@ -44,10 +145,327 @@ namespace OrthancPlugins
     }
   }
 
-  
+
+  void PostgreSQLConnection::Close()
+  {
+    // The cached statements must be released before the connection
+    // is closed, as they are bound to the PostgreSQL session
+    ClearCachedStatements();
+
+    Reset();
+
+    // The advisory locks are released together with the session
+    advisoryLocks_.clear();
+    inTransaction_ = false;
+  }
+
+
+  bool PostgreSQLConnection::IsBroken() const
+  {
+    return (pg_ == NULL ||
+            PQstatus(reinterpret_cast<PGconn*>(pg_)) == CONNECTION_BAD);
+  }
+
+
+  void PostgreSQLConnection::Reconnect()
+  {
+    Reset();
+
+    unsigned int delay = reconnectDelay_;
+
+    for (unsigned int attempt = 0; ; attempt++)
+    {
+      try
+      {
+        Open();
+        break;
+      }
+      catch (PostgreSQLException&)
+      {
+        if (attempt >= reconnectAttempts_)
+        {
+          throw;
+        }
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(delay));
+
+      static const unsigned int MAX_DELAY = 5000;
+      delay = (2 * delay > MAX_DELAY ? MAX_DELAY : 2 * delay);
+    }
+
+    for (std::set<int32_t>::const_iterator 
+           it = advisoryLocks_.begin(); it != advisoryLocks_.end(); ++it)
+    {
+      PostgreSQLStatement s(*this, "SELECT pg_try_advisory_lock($1)");
+      s.DeclareInputInteger(0);
+      s.BindInteger(0, *it);
+
+      PostgreSQLResult result(s);
+      if (result.IsDone() ||
+          !result.GetBoolean(0))
+      {
+        Reset();
+        throw PostgreSQLException("The database was locked by another instance of Orthanc "
+                                  "while reconnecting to PostgreSQL");
+      }
+    }
+  }
+
+
+  void PostgreSQLConnection::EnsureAlive()
+  {
+    if (!IsBroken())
+    {
+      return;
+    }
+
+    if (inTransaction_)
+    {
+      // The transaction has been rolled back by the server
+      throw PostgreSQLException("The connection to PostgreSQL was lost during a transaction");
+    }
+
+    Reconnect();
+  }
+
+
+  void PostgreSQLConnection::SetReconnectPolicy(unsigned int attempts,
+                                                unsigned int delay)
+  {
+    reconnectAttempts_ = attempts;
+    reconnectDelay_ = delay;
+  }
+
+
+  void PostgreSQLConnection::RegisterAdvisoryLock(int32_t key)
+  {
+    advisoryLocks_.insert(key);
+  }
+
+
+  void PostgreSQLConnection::SetStatementTimeout(PostgreSQLStatementClass type,
+                                                 unsigned int timeout)
+  {
+    if (static_cast<size_t>(type) >= timeouts_.size())
+    {
+      throw PostgreSQLException("Unknown class of statements");
+    }
+
+    timeouts_[type] = timeout;
+  }
+
+
+  unsigned int PostgreSQLConnection::GetStatementTimeout(PostgreSQLStatementClass type) const
+  {
+    if (static_cast<size_t>(type) >= timeouts_.size())
+    {
+      throw PostgreSQLException("Unknown class of statements");
+    }
+
+    return timeouts_[type];
+  }
+
+
+  bool PostgreSQLConnection::Cancel()
+  {
+    if (pg_ == NULL)
+    {
+      return false;
+    }
+
+    PGcancel* cancel = PQgetCancel(reinterpret_cast<PGconn*>(pg_));
+    if (cancel == NULL)
+    {
+      return false;
+    }
+
+    char error[256];
+    bool ok = (PQcancel(cancel, error, sizeof(error)) == 1);
+    PQfreeCancel(cancel);
+
+    return ok;
+  }
+
+
+  void PostgreSQLConnection::WaitReady(Deadline& deadline)
+  {
+    PGconn* pg = reinterpret_cast<PGconn*>(pg_);
+
+    while (PQisBusy(pg))
+    {
+      int remaining = deadline.GetRemaining();
+
+      if (remaining == 0)
+      {
+        if (deadline.IsCanceled())
+        {
+          // Dropping the session makes the server abort the command
+          Reset();
+          throw PostgreSQLTimeoutException("The server has not acknowledged the cancellation "
+                                           "of a statement that exceeded its timeout");
+        }
+
+        Cancel();
+        deadline.SetCanceled();
+        continue;
+      }
+
+      if (PQsocket(pg) < 0)
+      {
+        // The session is lost: PQgetResult() will report the error
+        return;
+      }
+
+      WaitReadable(PQsocket(pg), remaining);
+
+      if (PQconsumeInput(pg) != 1)
+      {
+        return;
+      }
+    }
+  }
+
+
+  void* /* PGresult* */ PostgreSQLConnection::WaitResult(unsigned int timeout)
+  {
+    PGconn* pg = reinterpret_cast<PGconn*>(pg_);
+    Deadline deadline(timeout);
+
+    // Keep the first result, and read up to the end of the command
+    PGresult* first = NULL;
+
+    for (;;)
+    {
+      try
+      {
+        WaitReady(deadline);
+      }
+      catch (PostgreSQLException&)
+      {
+        if (first != NULL)
+        {
+          PQclear(first);
+        }
+
+        throw;
+      }
+
+      PGresult* result = PQgetResult(pg);
+      if (result == NULL)
+      {
+        break;
+      }
+      else if (first == NULL)
+      {
+        first = result;
+      }
+      else
+      {
+        PQclear(result);
+      }
+    }
+
+    if (deadline.IsCanceled() &&
+        first != NULL &&
+        PQresultStatus(first) == PGRES_FATAL_ERROR)
+    {
+      PQclear(first);
+      throw PostgreSQLTimeoutException("A statement has exceeded its timeout of " +
+                                       boost::lexical_cast<std::string>(timeout) + "ms");
+    }
+
+    return first;
+  }
+
+
+  void* /* PGresult* */ PostgreSQLConnection::WaitNextResult(unsigned int timeout)
+  {
+    Deadline deadline(timeout);
+    WaitReady(deadline);
+
+    PGresult* result = PQgetResult(reinterpret_cast<PGconn*>(pg_));
+
+    if (deadline.IsCanceled() &&
+        result != NULL &&
+        PQresultStatus(result) == PGRES_FATAL_ERROR)
+    {
+      PQclear(result);
+
+      // Read up to the end of the command
+      PGresult* rest = reinterpret_cast<PGresult*>(WaitResult(0));
+      if (rest != NULL)
+      {
+        PQclear(rest);
+      }
+
+      throw PostgreSQLTimeoutException("A statement has exceeded its timeout of " +
+                                       boost::lexical_cast<std::string>(timeout) + "ms");
+    }
+
+    return result;
+  }
+
+
+  void PostgreSQLConnection::ThrowResultError(void* /* PGresult* */ result)
+  {
+    if (result == NULL)
+    {
+      throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(pg_)));
+    }
+
+    PGresult* r = reinterpret_cast<PGresult*>(result);
+
+    std::string message = PQresultErrorMessage(r);
+
+    // SQLSTATE "57014" is "query_canceled", which notably results
+    // from the server-side "statement_timeout"
+    const char* state = PQresultErrorField(r, PG_DIAG_SQLSTATE);
+    bool timeout = (state != NULL && std::string(state) == "57014");
+
+    PQclear(r);
+
+    if (timeout)
+    {
+      throw PostgreSQLTimeoutException(message);
+    }
+    else
+    {
+      throw PostgreSQLException(message);
+    }
+  }
+
+
+  void PostgreSQLConnection::SetLocalStatementTimeout(unsigned int timeout)
+  {
+    if (inTransaction_ &&
+        timeout != localTimeout_)
+    {
+      ExecuteInternal("SET LOCAL statement_timeout = " + 
+                      boost::lexical_cast<std::string>(timeout), false);
+      localTimeout_ = timeout;
+    }
+  }
+
+
   PostgreSQLConnection::PostgreSQLConnection()
   {
     pg_ = NULL;
+    pipelining_ = false;
+    generation_ = 0;
+    inTransaction_ = false;
+    reconnectAttempts_ = 0;
+    reconnectDelay_ = 100;
+    timeouts_.resize(4, 0);
+    localTimeout_ = 0;
+    largeObjectStreaming_ = false;
+    cursorCounter_ = 0;
+    inPipeline_ = false;
+    maxPlans_ = 128;
+    planCounter_ = 0;
+    planHits_ = 0;
+    planMisses_ = 0;
+    planEvictions_ = 0;
     host_ = "localhost";
     port_ = 5432;
     username_ = "postgres";
@@ -63,8 +481,27 @@ namespace OrthancPlugins
     username_(other.username_),
     password_(other.password_),
     database_(other.database_),
-    pg_(NULL)
+    uri_(other.uri_),
+    pg_(NULL),
+    pipelining_(other.pipelining_),
+    generation_(0),
+    inTransaction_(false),
+    reconnectAttempts_(other.reconnectAttempts_),
+    reconnectDelay_(other.reconnectDelay_),
+    timeouts_(other.timeouts_),
+    localTimeout_(0),
+    largeObjectChunks_(other.largeObjectChunks_),
+    largeObjectStreaming_(other.largeObjectStreaming_),
+    cursorCounter_(0),
+    inPipeline_(false),
+    maxPlans_(other.maxPlans_),
+    planCounter_(0),
+    planHits_(0),
+    planMisses_(0),
+    planEvictions_(0)
   {
+    // Only the configuration of the chunks is inherited
+    largeObjectChunks_.Reset();
   }
 
 
@@ -124,6 +561,13 @@ namespace OrthancPlugins
     database_ = database;
   }
 
+  int PostgreSQLConnection::GetServerVersion()
+  {
+    Open();
+    return PQserverVersion(reinterpret_cast<PGconn*>(pg_));
+  }
+
+
   void PostgreSQLConnection::Open()
   {
     if (pg_ != NULL)
@@ -168,31 +612,227 @@ namespace OrthancPlugins
 
       throw PostgreSQLException(message);
     }
+
+    generation_++;
   }
 
 
-  void PostgreSQLConnection::Execute(const std::string& sql)
+  void PostgreSQLConnection::SetPipelining(bool enabled)
   {
-    Open();
+    FlushPipeline();
 
-    PGresult* result = PQexec(reinterpret_cast<PGconn*>(pg_), sql.c_str());
-    if (result == NULL)
+#if defined(LIBPQ_HAS_PIPELINING)
+    pipelining_ = enabled;
+#else
+    // Statements are always executed synchronously
+    pipelining_ = false;
+#endif
+  }
+
+
+  void PostgreSQLConnection::EnterPipeline()
+  {
+#if defined(LIBPQ_HAS_PIPELINING)
+    if (!inPipeline_)
     {
-      throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(pg_)));
+      if (PQenterPipelineMode(reinterpret_cast<PGconn*>(pg_)) != 1)
+      {
+        throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(pg_)));
+      }
+
+      inPipeline_ = true;
     }
+#else
+    throw PostgreSQLException("This version of libpq does not support the pipeline mode");
+#endif
+  }
 
-    bool ok = (PQresultStatus(result) == PGRES_COMMAND_OK ||
-               PQresultStatus(result) == PGRES_TUPLES_OK);
 
-    if (ok)
+  void PostgreSQLConnection::RegisterPipelined(const std::string& sql)
+  {
+    static const size_t MAX_PIPELINE_DEPTH = 1000;
+
+    pipeline_.push_back(sql);
+
+    if (pipeline_.size() >= MAX_PIPELINE_DEPTH)
     {
-      PQclear(result);
+      // Bound the memory that is used by the pending results
+      FlushPipeline();
+    }
+  }
+
+
+  bool PostgreSQLConnection::SyncPipeline(std::string& error,
+                                          bool& canceled)
+  {
+    error.clear();
+    canceled = false;
+
+#if defined(LIBPQ_HAS_PIPELINING)
+    if (!inPipeline_)
+    {
+      return true;
+    }
+
+    PGconn* pg = reinterpret_cast<PGconn*>(pg_);
+
+    // The whole pipeline is bounded by the timeout of the writes
+    Deadline deadline(timeouts_[PostgreSQLStatementClass_Write]);
+
+    if (PQpipelineSync(pg) != 1)
+    {
+      error = PQerrorMessage(pg);
     }
     else
     {
-      std::string message = PQresultErrorMessage(result);
-      PQclear(result);
-      throw PostgreSQLException(message);
+      // Each statement produces its results followed by NULL. Once a
+      // statement has failed, the server skips the next ones until
+      // the synchronization point (status "PIPELINE_ABORTED").
+      for (size_t i = 0; i < pipeline_.size(); i++)
+      {
+        for (;;)
+        {
+          WaitReady(deadline);
+
+          PGresult* result = PQgetResult(pg);
+          if (result == NULL)
+          {
+            break;
+          }
+
+          ExecStatusType status = PQresultStatus(result);
+          if (status == PGRES_FATAL_ERROR &&
+              error.empty())
+          {
+            error = ("Error in pipelined statement \"" + pipeline_[i] + "\": " +
+                     std::string(PQresultErrorMessage(result)));
+          }
+
+          PQclear(result);
+        }
+      }
+
+      WaitReady(deadline);
+
+      PGresult* result = PQgetResult(pg);
+      if (result == NULL ||
+          PQresultStatus(result) != PGRES_PIPELINE_SYNC)
+      {
+        if (error.empty())
+        {
+          error = "Cannot synchronize the pipeline: " + std::string(PQerrorMessage(pg));
+        }
+      }
+
+      if (result != NULL)
+      {
+        PQclear(result);
+      }
+    }
+
+    pipeline_.clear();
+    inPipeline_ = false;
+
+    if (PQexitPipelineMode(pg) != 1 &&
+        error.empty())
+    {
+      error = PQerrorMessage(pg);
+    }
+
+    canceled = deadline.IsCanceled();
+#endif
+
+    return error.empty();
+  }
+
+
+  void PostgreSQLConnection::FlushPipeline()
+  {
+    std::string error;
+    bool canceled;
+    if (!SyncPipeline(error, canceled))
+    {
+      if (canceled)
+      {
+        throw PostgreSQLTimeoutException(error);
+      }
+      else
+      {
+        throw PostgreSQLException(error);
+      }
+    }
+  }
+
+
+  void PostgreSQLConnection::DiscardPipeline()
+  {
+    std::string error;
+    bool canceled;
+    SyncPipeline(error, canceled);
+  }
+
+
+  void PostgreSQLConnection::ExecuteInternal(const std::string& sql,
+                                             bool canRetry)
+  {
+    for (unsigned int attempt = 0; ; attempt++)
+    {
+      EnsureAlive();
+      FlushPipeline();
+
+      PGresult* result = PQexec(reinterpret_cast<PGconn*>(pg_), sql.c_str());
+
+      bool ok = (result != NULL &&
+                 (PQresultStatus(result) == PGRES_COMMAND_OK ||
+                  PQresultStatus(result) == PGRES_TUPLES_OK));
+
+      if (ok)
+      {
+        PQclear(result);
+        return;
+      }
+
+      if (!canRetry ||
+          attempt > 0 ||
+          inTransaction_ ||
+          !IsBroken())
+      {
+        ThrowResultError(result);
+      }
+
+      if (result != NULL)
+      {
+        PQclear(result);
+      }
+
+      // The session was lost: EnsureAlive() will reconnect
+    }
+  }
+
+
+  void PostgreSQLConnection::Execute(const std::string& sql)
+  {
+    // The SQL command might not be idempotent: Never retry it
+    ExecuteInternal(sql, false);
+  }
+
+
+  void PostgreSQLConnection::AbortTransaction()
+  {
+    inTransaction_ = false;
+
+    if (IsBroken())
+    {
+      // The server has rolled back the transaction when the session
+      // was lost. A new session will be opened by the next command.
+      Reset();
+    }
+    else
+    {
+      // The errors in the pending statements are irrelevant, as the
+      // transaction is rolled back
+      DiscardPipeline();
+      Execute("ABORT");
     }
   }
 
@@ -211,6 +851,7 @@ namespace OrthancPlugins
                                   "AND c.relname=$1");
 
     statement.DeclareInputString(0);
+    statement.SetReadOnly(true);
     statement.BindString(0, lower);
 
     PostgreSQLResult result(statement);
@@ -236,4 +877,279 @@ namespace OrthancPlugins
     transaction.Commit();
   }
 
+
+  std::string PostgreSQLConnection::GetPlanKey(const std::string& sql,
+                                              const std::vector<unsigned int /*Oid*/>& oids)
+  {
+    std::string key;
+    key.reserve(sql.size() + 8 * oids.size() + 1);
+
+    for (size_t i = 0; i < oids.size(); i++)
+    {
+      key += boost::lexical_cast<std::string>(oids[i]) + ",";
+    }
+
+    key += ";" + sql;
+    return key;
+  }
+
+
+  void PostgreSQLConnection::EvictPlans(size_t target)
+  {
+    while (plans_.size() > target &&
+           !unusedPlans_.empty())
+    {
+      Plans::iterator plan = plans_.find(unusedPlans_.back());
+      unusedPlans_.pop_back();
+
+      if (plan != plans_.end())
+      {
+        assert(plan->second.references_ == 0);
+
+        try
+        {
+          Execute("DEALLOCATE \"" + plan->second.name_ + "\"");
+        }
+        catch (PostgreSQLException&)
+        {
+          // Not fatal, the plan will be released at the end of the session
+        }
+
+        plans_.erase(plan);
+        planEvictions_++;
+      }
+    }
+  }
+
+
+  const std::string& PostgreSQLConnection::AcquirePlan(const std::string& sql,
+                                                       const std::vector<unsigned int /*Oid*/>& oids)
+  {
+    std::string key = GetPlanKey(sql, oids);
+
+    Plans::iterator found = plans_.find(key);
+    if (found != plans_.end())
+    {
+      if (found->second.references_ == 0)
+      {
+        unusedPlans_.erase(found->second.unused_);
+      }
+
+      found->second.references_++;
+      planHits_++;
+      return found->second.name_;
+    }
+
+    planMisses_++;
+
+    // PQprepare() is a synchronous call
+    Open();
+    FlushPipeline();
+
+    // Make room for the new plan
+    if (maxPlans_ > 0)
+    {
+      EvictPlans(maxPlans_ - 1);
+    }
+
+    std::string name = "orthanc_" + boost::lexical_cast<std::string>(planCounter_++);
+
+    const unsigned int* tmp = oids.size() ? &oids[0] : NULL;
+
+    PGresult* result = PQprepare(reinterpret_cast<PGconn*>(pg_),
+                                 name.c_str(), sql.c_str(), oids.size(), tmp);
+
+    if (result == NULL)
+    {
+      throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(pg_)));
+    }
+
+    bool ok = (PQresultStatus(result) == PGRES_COMMAND_OK);
+    if (ok)
+    {
+      PQclear(result);
+    }
+    else
+    {
+      std::string message = PQresultErrorMessage(result);
+      PQclear(result);
+      throw PostgreSQLException(message);
+    }
+
+    Plan& plan = plans_[key];
+    plan.name_ = name;
+    plan.references_ = 1;
+    return plan.name_;
+  }
+
+
+  void PostgreSQLConnection::ReleasePlan(const std::string& sql,
+                                         const std::vector<unsigned int /*Oid*/>& oids)
+  {
+    Plans::iterator found = plans_.find(GetPlanKey(sql, oids));
+
+    // The plan is not found if the connection was closed in between
+    if (found != plans_.end() &&
+        found->second.references_ > 0)
+    {
+      found->second.references_--;
+
+      if (found->second.references_ == 0)
+      {
+        // Deallocation is postponed until room is needed, as this
+        // function is called from destructors
+        unusedPlans_.push_front(found->first);
+        found->second.unused_ = unusedPlans_.begin();
+      }
+    }
+  }
+
+
+  void PostgreSQLConnection::PrepareStatements(const std::vector<PostgreSQLStatement*>& statements)
+  {
+    for (size_t i = 0; i < statements.size(); i++)
+    {
+      if (&statements[i]->connection_ != this)
+      {
+        throw PostgreSQLException("Cannot prepare a statement of another connection");
+      }
+    }
+
+    EnsureAlive();
+    FlushPipeline();
+
+#if defined(LIBPQ_HAS_PIPELINING)
+    if (pipelining_)
+    {
+      // Collect the statements whose plan is not in the registry
+      std::vector<PostgreSQLStatement*> missing;
+      std::vector<std::string> keys;
+      std::set<std::string> pending;
+
+      for (size_t i = 0; i < statements.size(); i++)
+      {
+        PostgreSQLStatement& statement = *statements[i];
+
+        bool valid = true;
+        for (size_t j = 0; j < statement.oids_.size(); j++)
+        {
+          if (statement.oids_[j] == 0)
+          {
+            // Reported by PostgreSQLStatement::Prepare() below
+            valid = false;
+          }
+        }
+
+        if (valid &&
+            !statement.IsPrepared())
+        {
+          std::string key = GetPlanKey(statement.sql_, statement.oids_);
+          if (plans_.find(key) == plans_.end() &&
+              pending.find(key) == pending.end())
+          {
+            missing.push_back(&statement);
+            keys.push_back(key);
+            pending.insert(key);
+          }
+        }
+      }
+
+      if (!missing.empty())
+      {
+        // Make room for the new plans
+        if (maxPlans_ > 0)
+        {
+          EvictPlans(maxPlans_ > missing.size() ? maxPlans_ - missing.size() : 0);
+        }
+
+        std::vector<std::string> names(missing.size());
+
+        EnterPipeline();
+
+        for (size_t i = 0; i < missing.size(); i++)
+        {
+          PostgreSQLStatement& statement = *missing[i];
+          names[i] = "orthanc_" + boost::lexical_cast<std::string>(planCounter_++);
+
+          const unsigned int* tmp = statement.oids_.size() ? &statement.oids_[0] : NULL;
+
+          if (PQsendPrepare(reinterpret_cast<PGconn*>(pg_), names[i].c_str(), statement.sql_.c_str(),
+                            statement.oids_.size(), tmp) != 1)
+          {
+            std::string message = PQerrorMessage(reinterpret_cast<PGconn*>(pg_));
+            DiscardPipeline();
+            throw PostgreSQLException(message);
+          }
+
+          RegisterPipelined("PREPARE " + statement.sql_);
+        }
+
+        // If one of the plans cannot be created, none of them is
+        // registered: The other ones are dropped with the session
+        FlushPipeline();
+
+        for (size_t i = 0; i < missing.size(); i++)
+        {
+          Plan& plan = plans_[keys[i]];
+          plan.name_ = names[i];
+          plan.references_ = 1;
+
+          missing[i]->id_ = names[i];
+          missing[i]->generation_ = generation_;
+        }
+
+        planMisses_ += missing.size();
+      }
+    }
+#endif
+
+    // Acquire the plans that already exist, or create them one by one
+    // if the pipeline mode is not available
+    for (size_t i = 0; i < statements.size(); i++)
+    {
+      statements[i]->Prepare();
+    }
+  }
+
+
+  void PostgreSQLConnection::SetMaximumPreparedStatements(unsigned int count)
+  {
+    maxPlans_ = count;
+  }
+
+
+  PostgreSQLStatement* PostgreSQLConnection::LookupCachedStatement(const std::string& key) const
+  {
+    CachedStatements::const_iterator found = cachedStatements_.find(key);
+
+    if (found == cachedStatements_.end())
+    {
+      return NULL;
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+
+  PostgreSQLStatement& PostgreSQLConnection::CacheStatement(const std::string& key,
+                                                            PostgreSQLStatement* statement)
+  {
+    std::auto_ptr<PostgreSQLStatement> protection(statement);
+
+    if (statement == NULL ||
+        &statement->GetConnection() != this)
+    {
+      throw PostgreSQLException("Cannot cache a statement that belongs to another connection");
+    }
+
+    if (cachedStatements_.find(key) != cachedStatements_.end())
+    {
+      throw PostgreSQLException("This statement is already cached: " + key);
+    }
+
+    cachedStatements_[key] = protection.release();
+    return *statement;
+  }
 }
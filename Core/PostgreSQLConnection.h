@@ -32,17 +32,66 @@
 #  endif
 #endif
 
+#include "ChunkSizeTuner.h"
+
 #include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
 #include <boost/noncopyable.hpp>
+#include <boost/thread/thread_time.hpp>
 #include <stdint.h>
 
 namespace OrthancPlugins
 {
+  class PostgreSQLStatement;
+
+  // The classes of statements that are given distinct timeouts
+  enum PostgreSQLStatementClass
+  {
+    PostgreSQLStatementClass_Read,         // Point lookups
+    PostgreSQLStatementClass_Scan,         // Listings that can span whole tables
+    PostgreSQLStatementClass_Write,        // Modifications, and the pipelined statements
+    PostgreSQLStatementClass_LargeObject   // Enforced by the server, inside transactions
+  };
+
   class PostgreSQLConnection : public boost::noncopyable
   {
   private:
     friend class PostgreSQLStatement;
     friend class PostgreSQLLargeObject;
+    friend class PostgreSQLEventLoop;
+    friend class PostgreSQLResult;
+    friend class PostgreSQLTransaction;
+    friend class PostgreSQLCopyWriter;
+    friend class PostgreSQLCursor;
+    friend class PostgreSQLLargeObjectWriter;
+    friend class PostgreSQLConnectionPool;
+
+    // Deadline of a running command. Once canceled, the deadline is
+    // postponed by a grace period, during which the server must
+    // acknowledge the cancellation.
+    class Deadline : public boost::noncopyable
+    {
+    private:
+      bool  infinite_;
+      bool  canceled_;
+      boost::system_time  expiration_;
+
+    public:
+      explicit Deadline(unsigned int timeout);   // In milliseconds, 0 for no limit
+
+      bool IsCanceled() const
+      {
+        return canceled_;
+      }
+
+      void SetCanceled();
+
+      // Remaining time in milliseconds, or -1 if there is no limit
+      int GetRemaining() const;
+    };
 
     std::string host_;
     uint16_t port_;
@@ -51,9 +100,118 @@ namespace OrthancPlugins
     std::string database_;
     std::string uri_;
     void* pg_;   /* Object of type "PGconn*" */
+    bool pipelining_;
+
+    // Incremented each time a new session is opened: The statements
+    // that were prepared in a previous session are prepared again
+    unsigned int  generation_;
+    bool  inTransaction_;
+    unsigned int  reconnectAttempts_;
+    unsigned int  reconnectDelay_;  // In milliseconds
+    std::set<int32_t>  advisoryLocks_;
+    std::vector<unsigned int>  timeouts_;  // In milliseconds, indexed by PostgreSQLStatementClass
+    unsigned int  localTimeout_;  // Value of "statement_timeout" in the current transaction
+
+    // Size of the chunks of the large objects, learned on this session
+    ChunkSizeTuner  largeObjectChunks_;
+    bool  largeObjectStreaming_;
+
+    // Suffix of the name of the next server-side cursor (cf.
+    // PostgreSQLCursor), which is unique within the session
+    unsigned int  cursorCounter_;
+
+    // SQL of the statements that were sent in pipeline mode, and
+    // whose results are not collected yet (in the order of sending)
+    std::vector<std::string>  pipeline_;
+    bool  inPipeline_;
+
+    typedef std::map<std::string, PostgreSQLStatement*>  CachedStatements;
+
+    CachedStatements  cachedStatements_;
+
+    // Registry of the server-side prepared statements, indexed by
+    // their SQL and the types of their parameters. Identical
+    // statements share the same plan. The plans that are not used by
+    // any PostgreSQLStatement are kept in a LRU list, and are
+    // deallocated once the registry grows beyond "maxPlans_".
+    struct Plan
+    {
+      std::string  name_;
+      unsigned int  references_;
+      std::list<std::string>::iterator  unused_;
+    };
+
+    typedef std::map<std::string, Plan>  Plans;
+
+    Plans  plans_;
+    std::list<std::string>  unusedPlans_;  // Most recently released first
+    unsigned int  maxPlans_;
+    unsigned int  planCounter_;
+    uint64_t  planHits_;
+    uint64_t  planMisses_;
+    uint64_t  planEvictions_;
+
+    static std::string GetPlanKey(const std::string& sql,
+                                  const std::vector<unsigned int /*Oid*/>& oids);
+
+    void EvictPlans(size_t target);
+
+    const std::string& AcquirePlan(const std::string& sql,
+                                   const std::vector<unsigned int /*Oid*/>& oids);
+
+    void ReleasePlan(const std::string& sql,
+                     const std::vector<unsigned int /*Oid*/>& oids);
+
+    void ClearCachedStatements();
+
+    // Drop the PostgreSQL session, but keep the cached statements
+    void Reset();
 
     void Close();
 
+    bool IsBroken() const;
+
+    void Reconnect();
+
+    // Re-open the session if it was lost. This is only possible
+    // outside of a transaction: Otherwise, an exception is thrown.
+    void EnsureAlive();
+
+    void ExecuteInternal(const std::string& sql,
+                         bool canRetry);
+
+    void AbortTransaction();
+
+    void EnterPipeline();
+
+    void RegisterPipelined(const std::string& sql);
+
+    bool SyncPipeline(std::string& error,
+                      bool& canceled);
+
+    // Wait until libpq can return the next result of the running
+    // command without blocking. Once the deadline is exceeded, the
+    // command is canceled. If the server does not acknowledge the
+    // cancellation in time, the session is dropped.
+    void WaitReady(Deadline& deadline);
+
+    // Collect the result of the command that was sent by
+    // PQsendQuery*(), with a timeout in milliseconds (0 for no limit)
+    void* /* PGresult* */ WaitResult(unsigned int timeout);
+
+    // Collect the next result of the running command, without reading
+    // up to its end (for the single-row mode). Returns NULL once the
+    // command is over.
+    void* /* PGresult* */ WaitNextResult(unsigned int timeout);
+
+    // Throw the error that is reported by a failed result (or by the
+    // session if "result" is NULL), and clear this result
+    void ThrowResultError(void* /* PGresult* */ result);
+
+    // Server-side timeout of the statements up to the end of the
+    // current transaction (no effect outside of a transaction)
+    void SetLocalStatementTimeout(unsigned int timeout);
+
   public:
     PostgreSQLConnection();
 
@@ -110,10 +268,139 @@ namespace OrthancPlugins
 
     void Open();
 
+    unsigned int GetGeneration() const
+    {
+      return generation_;
+    }
+
+    bool IsInTransaction() const
+    {
+      return inTransaction_;
+    }
+
+    // If the session is lost, at most "attempts" reconnections are
+    // made, with an exponential backoff starting at "delay"
+    // milliseconds. Reconnections never happen inside a transaction.
+    void SetReconnectPolicy(unsigned int attempts,
+                            unsigned int delay);
+
+    unsigned int GetReconnectAttempts() const
+    {
+      return reconnectAttempts_;
+    }
+
+    unsigned int GetReconnectDelay() const
+    {
+      return reconnectDelay_;
+    }
+
+    // Session-level advisory locks that must be taken again after a
+    // reconnection. If another session has grabbed one of them in
+    // the meantime, the reconnection fails.
+    void RegisterAdvisoryLock(int32_t key);
+
+    // Timeout of the statements of one class, in milliseconds (0 for
+    // no limit). A statement that exceeds its timeout is canceled, and
+    // a PostgreSQLTimeoutException is thrown.
+    void SetStatementTimeout(PostgreSQLStatementClass type,
+                             unsigned int timeout);
+
+    unsigned int GetStatementTimeout(PostgreSQLStatementClass type) const;
+
+    // Ask the server to cancel the command that is running on this
+    // session, through a separate channel. Returns "false" if the
+    // request could not be sent.
+    bool Cancel();
+
+    // Allow PostgreSQLStatement::Enqueue() to use the pipeline mode of
+    // libpq (only available if compiled against PostgreSQL >= 14)
+    void SetPipelining(bool enabled);
+
+    bool IsPipelining() const
+    {
+      return pipelining_;
+    }
+
+    // Wait for the statements that were enqueued in the pipeline. If
+    // one of them has failed, an exception is thrown that reports the
+    // SQL of the first faulty statement.
+    void FlushPipeline();
+
+    // Same as FlushPipeline(), but ignores the errors. This is used
+    // before rolling back a transaction.
+    void DiscardPipeline();
+
     void Execute(const std::string& sql);
 
     bool DoesTableExist(const char* name);
 
+    // Version of the server, formatted as by "PQserverVersion()"
+    // (e.g. 90400 for PostgreSQL 9.4.0)
+    int GetServerVersion();
+
     void ClearAll();
+
+    // Maximum number of server-side prepared statements that are kept
+    // alive (the statements that are in use are never deallocated).
+    // The value "0" means no limit.
+    void SetMaximumPreparedStatements(unsigned int count);
+
+    unsigned int GetMaximumPreparedStatements() const
+    {
+      return maxPlans_;
+    }
+
+    size_t GetPreparedStatementsCount() const
+    {
+      return plans_.size();
+    }
+
+    uint64_t GetPreparedStatementsHits() const
+    {
+      return planHits_;
+    }
+
+    uint64_t GetPreparedStatementsMisses() const
+    {
+      return planMisses_;
+    }
+
+    uint64_t GetPreparedStatementsEvictions() const
+    {
+      return planEvictions_;
+    }
+
+    ChunkSizeTuner& GetLargeObjectChunks()
+    {
+      return largeObjectChunks_;
+    }
+
+    const ChunkSizeTuner& GetLargeObjectChunks() const
+    {
+      return largeObjectChunks_;
+    }
+
+    // Read the large objects by chunks of "lo_get()", the next chunk
+    // being requested while the previous one is copied, instead of
+    // the synchronous calls to "lo_read()"
+    void SetLargeObjectStreaming(bool enabled)
+    {
+      largeObjectStreaming_ = enabled;
+    }
+
+    bool IsLargeObjectStreaming() const
+    {
+      return largeObjectStreaming_;
+    }
+
+    // Prepare several statements of this connection at once. If the
+    // pipeline mode is enabled, all the missing server-side plans
+    // are created in a single round trip.
+    void PrepareStatements(const std::vector<PostgreSQLStatement*>& statements);
+
+    PostgreSQLStatement* LookupCachedStatement(const std::string& key) const;
+
+    PostgreSQLStatement& CacheStatement(const std::string& key,
+                                        PostgreSQLStatement* statement);  // Takes ownership
   };
 }
@@ -0,0 +1,265 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLConnectionPool.h"
+
+#include "PostgreSQLException.h"
+
+#include <boost/thread/thread_time.hpp>
+#include <libpq-fe.h>
+
+namespace OrthancPlugins
+{
+  PostgreSQLConnection* PostgreSQLConnectionPool::Acquire(unsigned int timeout)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const boost::system_time deadline = 
+      boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+
+    for (;;)
+    {
+      if (!idle_.empty())
+      {
+        PostgreSQLConnection* connection = idle_.front();
+        idle_.pop_front();
+        return connection;
+      }
+
+      if (all_.size() + opening_ < maxSize_)
+      {
+        // Grow the pool. The connection is opened outside of the
+        // mutex, as this involves a round trip to the server.
+        opening_++;
+        lock.unlock();
+
+        std::auto_ptr<PostgreSQLConnection> connection;
+
+        try
+        {
+          connection.reset(new PostgreSQLConnection(*prototype_));
+          connection->Open();
+        }
+        catch (...)
+        {
+          lock.lock();
+          opening_--;
+          available_.notify_one();
+          throw;
+        }
+
+        lock.lock();
+        opening_--;
+        all_.push_back(connection.get());
+        return connection.release();
+      }
+
+      if (!available_.timed_wait(lock, deadline) &&
+          idle_.empty())
+      {
+        throw PostgreSQLException("Timeout while waiting for an available connection in the pool");
+      }
+    }
+  }
+
+
+  void PostgreSQLConnectionPool::Release(PostgreSQLConnection* connection)
+  {
+    // Declared before the lock, so that a discarded connection is
+    // closed outside of the mutex
+    std::auto_ptr<PostgreSQLConnection> discarded;
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    connection->GetLargeObjectChunks().GetStatistics(largeObjects_[connection]);
+
+    if (connection->IsBroken() ||
+        PQtransactionStatus(reinterpret_cast<PGconn*>(connection->pg_)) != PQTRANS_IDLE)
+    {
+      // The session was lost, or was left in the middle of a
+      // transaction: The connection is closed, and a new one will
+      // be opened by Acquire() if needed
+      all_.remove(connection);
+      discarded.reset(connection);
+
+      LargeObjectStatistics::iterator found = largeObjects_.find(connection);
+      closedLargeObjects_.push_front(found->second);
+      largeObjects_.erase(found);
+
+      if (closedLargeObjects_.size() > maxSize_)
+      {
+        closedLargeObjects_.pop_back();
+      }
+    }
+    else
+    {
+      // Most recently used connections are reused first
+      idle_.push_front(connection);
+    }
+
+    available_.notify_one();
+  }
+
+
+  void PostgreSQLConnectionPool::Clear()
+  {
+    for (Connections::iterator it = all_.begin(); it != all_.end(); ++it)
+    {
+      delete *it;
+    }
+
+    all_.clear();
+    idle_.clear();
+    largeObjects_.clear();
+    closedLargeObjects_.clear();
+  }
+
+
+  PostgreSQLConnectionPool::PostgreSQLConnectionPool(PostgreSQLConnection* connection,
+                                                     unsigned int minSize,
+                                                     unsigned int maxSize) :
+    minSize_(minSize),
+    maxSize_(maxSize),
+    timeout_(10000),
+    opening_(0)
+  {
+    std::auto_ptr<PostgreSQLConnection> first(connection);
+
+    if (connection == NULL ||
+        maxSize == 0 ||
+        minSize > maxSize)
+    {
+      throw PostgreSQLException("Bad parameters for the pool of connections");
+    }
+
+    // The settings of the first connection are used to open the
+    // subsequent connections of the pool
+    prototype_.reset(new PostgreSQLConnection(*connection));
+
+    try
+    {
+      first->Open();
+      all_.push_back(first.get());
+      idle_.push_back(first.release());
+
+      while (all_.size() < minSize_)
+      {
+        std::auto_ptr<PostgreSQLConnection> other(new PostgreSQLConnection(*prototype_));
+        other->Open();
+        all_.push_back(other.get());
+        idle_.push_back(other.release());
+      }
+    }
+    catch (...)
+    {
+      Clear();
+      throw;
+    }
+  }
+
+
+  PostgreSQLConnectionPool::~PostgreSQLConnectionPool()
+  {
+    // All the accessors must have been released at this point
+    Clear();
+  }
+
+
+  void PostgreSQLConnectionPool::SetTimeout(unsigned int milliseconds)
+  {
+    timeout_ = milliseconds;
+  }
+
+
+  PostgreSQLConnection* PostgreSQLConnectionPool::OpenDedicatedConnection()
+  {
+    std::auto_ptr<PostgreSQLConnection> connection(new PostgreSQLConnection(*prototype_));
+    connection->Open();
+    return connection.release();
+  }
+
+
+  unsigned int PostgreSQLConnectionPool::GetSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return static_cast<unsigned int>(all_.size());
+  }
+
+
+  unsigned int PostgreSQLConnectionPool::GetIdleCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return static_cast<unsigned int>(idle_.size());
+  }
+
+
+  void PostgreSQLConnectionPool::GetLargeObjectStatistics(std::vector<ChunkSizeTuner::Statistics>& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target.clear();
+    target.reserve(largeObjects_.size() + closedLargeObjects_.size());
+
+    for (LargeObjectStatistics::const_iterator it = largeObjects_.begin();
+         it != largeObjects_.end(); ++it)
+    {
+      target.push_back(it->second);
+    }
+
+    target.insert(target.end(), closedLargeObjects_.begin(), closedLargeObjects_.end());
+  }
+
+
+  PostgreSQLConnectionPool::Accessor* PostgreSQLConnectionPool::TryAcquireIdle()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (idle_.empty())
+    {
+      return NULL;
+    }
+
+    PostgreSQLConnection* connection = idle_.front();
+    idle_.pop_front();
+
+    return new Accessor(*this, *connection);
+  }
+
+
+  PostgreSQLConnectionPool::Accessor::Accessor(PostgreSQLConnectionPool& pool) :
+    pool_(pool),
+    connection_(pool.Acquire(pool.GetTimeout()))
+  {
+  }
+
+
+  PostgreSQLConnectionPool::Accessor::Accessor(PostgreSQLConnectionPool& pool,
+                                               unsigned int timeout) :
+    pool_(pool),
+    connection_(pool.Acquire(timeout))
+  {
+  }
+
+
+  PostgreSQLConnectionPool::Accessor::~Accessor()
+  {
+    pool_.Release(connection_);
+  }
+}
@@ -0,0 +1,136 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLConnection.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace OrthancPlugins
+{
+  class PostgreSQLConnectionPool : public boost::noncopyable
+  {
+  private:
+    typedef std::list<PostgreSQLConnection*>  Connections;
+
+    std::auto_ptr<PostgreSQLConnection>  prototype_;
+    unsigned int  minSize_;
+    unsigned int  maxSize_;
+    unsigned int  timeout_;   // In milliseconds
+
+    boost::mutex               mutex_;
+    boost::condition_variable  available_;
+    Connections                all_;
+    Connections                idle_;
+    unsigned int               opening_;
+
+    // Statistics of the large objects of each connection, as of its
+    // last release to the pool
+    typedef std::map<const PostgreSQLConnection*, ChunkSizeTuner::Statistics>  LargeObjectStatistics;
+
+    LargeObjectStatistics      largeObjects_;
+
+    // Statistics of the connections that were closed by Release(),
+    // most recent first (at most "maxSize_" entries are kept)
+    std::list<ChunkSizeTuner::Statistics>  closedLargeObjects_;
+
+    PostgreSQLConnection* Acquire(unsigned int timeout);
+
+    void Release(PostgreSQLConnection* connection);
+
+    void Clear();
+
+  public:
+    class Accessor : public boost::noncopyable
+    {
+    private:
+      friend class PostgreSQLConnectionPool;
+
+      PostgreSQLConnectionPool&  pool_;
+      PostgreSQLConnection*      connection_;
+
+      Accessor(PostgreSQLConnectionPool& pool,
+               PostgreSQLConnection& connection) :
+        pool_(pool),
+        connection_(&connection)
+      {
+      }
+
+    public:
+      explicit Accessor(PostgreSQLConnectionPool& pool);
+
+      Accessor(PostgreSQLConnectionPool& pool,
+               unsigned int timeout);
+
+      ~Accessor();
+
+      PostgreSQLConnection& GetConnection() const
+      {
+        return *connection_;
+      }
+    };
+
+    PostgreSQLConnectionPool(PostgreSQLConnection* connection,  // Takes the ownership of the connection
+                             unsigned int minSize,
+                             unsigned int maxSize);
+
+    ~PostgreSQLConnectionPool();
+
+    unsigned int GetMinSize() const
+    {
+      return minSize_;
+    }
+
+    unsigned int GetMaxSize() const
+    {
+      return maxSize_;
+    }
+
+    void SetTimeout(unsigned int milliseconds);
+
+    unsigned int GetTimeout() const
+    {
+      return timeout_;
+    }
+
+    unsigned int GetSize();
+
+    unsigned int GetIdleCount();
+
+    // Take an idle connection, without waiting and without opening a
+    // new connection. Returns NULL if no connection is idle. The
+    // caller takes ownership of the accessor.
+    Accessor* TryAcquireIdle();
+
+    // Open a new connection with the settings of the pool, but that
+    // does not belong to the pool (e.g. to hold a session-level lock
+    // during the lifetime of a plugin). The caller takes ownership.
+    PostgreSQLConnection* OpenDedicatedConnection();
+
+    // One entry per connection that has been used at least once,
+    // including the last connections that were closed because broken
+    void GetLargeObjectStatistics(std::vector<ChunkSizeTuner::Statistics>& target);
+  };
+}
@@ -0,0 +1,286 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLCopyWriter.h"
+
+#include "PostgreSQLException.h"
+
+#include <limits>
+#include <string.h>
+
+// PostgreSQL includes
+#include <libpq-fe.h>
+
+
+namespace OrthancPlugins
+{
+  // Header of the binary format: Signature, flags and length of the
+  // header extension (cf. the documentation of COPY)
+  static const char COPY_SIGNATURE[] = "PGCOPY\n\377\r\n";   // Followed by a NUL character
+  static const size_t COPY_SIGNATURE_SIZE = 11;
+
+  static const size_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+
+
+  static void AppendInteger16(std::string& target,
+                              int16_t value)
+  {
+    target.push_back(static_cast<char>((value >> 8) & 0xff));
+    target.push_back(static_cast<char>(value & 0xff));
+  }
+
+
+  static void AppendInteger32(std::string& target,
+                              int32_t value)
+  {
+    int32_t v = htobe32(value);
+    target.append(reinterpret_cast<const char*>(&v), sizeof(int32_t));
+  }
+
+
+  PostgreSQLCopyWriter::PostgreSQLCopyWriter(PostgreSQLConnection& connection,
+                                             const std::string& target,
+                                             unsigned int columnsCount) :
+    connection_(connection),
+    columnsCount_(columnsCount),
+    chunkSize_(DEFAULT_CHUNK_SIZE),
+    isOpen_(false),
+    currentColumn_(0),
+    rowsCount_(0)
+  {
+    if (columnsCount == 0 ||
+        columnsCount > static_cast<unsigned int>(std::numeric_limits<int16_t>::max()))
+    {
+      throw PostgreSQLException("Bad number of columns for COPY");
+    }
+
+    // COPY cannot be run in pipeline mode
+    connection_.EnsureAlive();
+    connection_.FlushPipeline();
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+    std::string sql = "COPY " + target + " FROM STDIN (FORMAT binary)";
+
+    PGresult* result = PQexec(pg, sql.c_str());
+    if (result == NULL ||
+        PQresultStatus(result) != PGRES_COPY_IN)
+    {
+      connection_.ThrowResultError(result);
+    }
+
+    PQclear(result);
+    isOpen_ = true;
+
+    buffer_.reserve(chunkSize_);
+    buffer_.append(COPY_SIGNATURE, COPY_SIGNATURE_SIZE);
+    AppendInteger32(buffer_, 0);  // Flags
+    AppendInteger32(buffer_, 0);  // No header extension
+  }
+
+
+  PostgreSQLCopyWriter::~PostgreSQLCopyWriter()
+  {
+    if (isOpen_)
+    {
+      try
+      {
+        Abort();
+      }
+      catch (PostgreSQLException&)
+      {
+        // Never throw in a destructor
+      }
+    }
+  }
+
+
+  void PostgreSQLCopyWriter::Abort()
+  {
+    isOpen_ = false;
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+    if (PQputCopyEnd(pg, "Aborted by the client") == 1)
+    {
+      // Drain the error that reports the cancellation
+      PGresult* result = reinterpret_cast<PGresult*>(connection_.WaitResult(0));
+      if (result != NULL)
+      {
+        PQclear(result);
+      }
+    }
+  }
+
+
+  void PostgreSQLCopyWriter::SetChunkSize(size_t size)
+  {
+    if (size == 0)
+    {
+      throw PostgreSQLException("The chunk size must be positive");
+    }
+
+    chunkSize_ = size;
+    buffer_.reserve(chunkSize_);
+  }
+
+
+  void PostgreSQLCopyWriter::Flush()
+  {
+    if (!buffer_.empty())
+    {
+      PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+      if (PQputCopyData(pg, buffer_.c_str(), static_cast<int>(buffer_.size())) != 1)
+      {
+        throw PostgreSQLException(PQerrorMessage(pg));
+      }
+
+      // The capacity of the buffer is kept for the next chunk
+      buffer_.clear();
+    }
+  }
+
+
+  void PostgreSQLCopyWriter::BeginRow()
+  {
+    if (!isOpen_)
+    {
+      throw PostgreSQLException("The COPY is not running");
+    }
+
+    if (rowsCount_ > 0 &&
+        currentColumn_ != columnsCount_)
+    {
+      throw PostgreSQLException("Bad number of values in a row of COPY");
+    }
+
+    if (buffer_.size() >= chunkSize_)
+    {
+      Flush();
+    }
+
+    AppendInteger16(buffer_, static_cast<int16_t>(columnsCount_));
+    currentColumn_ = 0;
+    rowsCount_++;
+  }
+
+
+  void PostgreSQLCopyWriter::AddField(const void* data,
+                                      size_t size)
+  {
+    if (!isOpen_ ||
+        rowsCount_ == 0 ||
+        currentColumn_ >= columnsCount_)
+    {
+      throw PostgreSQLException("Bad number of values in a row of COPY");
+    }
+
+    if (size > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+    {
+      throw PostgreSQLException("Value too large for COPY");
+    }
+
+    AppendInteger32(buffer_, static_cast<int32_t>(size));
+
+    if (size > 0)
+    {
+      buffer_.append(reinterpret_cast<const char*>(data), size);
+    }
+
+    currentColumn_++;
+  }
+
+
+  void PostgreSQLCopyWriter::AddNull()
+  {
+    if (!isOpen_ ||
+        rowsCount_ == 0 ||
+        currentColumn_ >= columnsCount_)
+    {
+      throw PostgreSQLException("Bad number of values in a row of COPY");
+    }
+
+    AppendInteger32(buffer_, -1);
+    currentColumn_++;
+  }
+
+
+  void PostgreSQLCopyWriter::AddInteger(int32_t value)
+  {
+    int32_t v = htobe32(value);
+    AddField(&v, sizeof(int32_t));
+  }
+
+
+  void PostgreSQLCopyWriter::AddInteger64(int64_t value)
+  {
+    int64_t v = htobe64(value);
+    AddField(&v, sizeof(int64_t));
+  }
+
+
+  void PostgreSQLCopyWriter::AddString(const std::string& value)
+  {
+    AddField(value.c_str(), value.size());
+  }
+
+
+  void PostgreSQLCopyWriter::AddBinary(const void* data,
+                                       size_t size)
+  {
+    AddField(data, size);
+  }
+
+
+  uint64_t PostgreSQLCopyWriter::Finish()
+  {
+    if (!isOpen_)
+    {
+      throw PostgreSQLException("The COPY is not running");
+    }
+
+    if (rowsCount_ > 0 &&
+        currentColumn_ != columnsCount_)
+    {
+      throw PostgreSQLException("Bad number of values in a row of COPY");
+    }
+
+    AppendInteger16(buffer_, -1);  // Trailer
+    Flush();
+
+    isOpen_ = false;
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+    if (PQputCopyEnd(pg, NULL) != 1)
+    {
+      throw PostgreSQLException(PQerrorMessage(pg));
+    }
+
+    PGresult* result = reinterpret_cast<PGresult*>
+      (connection_.WaitResult(connection_.GetStatementTimeout(PostgreSQLStatementClass_Write)));
+
+    if (result == NULL ||
+        PQresultStatus(result) != PGRES_COMMAND_OK)
+    {
+      connection_.ThrowResultError(result);
+    }
+
+    PQclear(result);
+    return rowsCount_;
+  }
+}
@@ -0,0 +1,88 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLConnection.h"
+
+namespace OrthancPlugins
+{
+  /**
+   * Streams rows into a table with "COPY ... FROM STDIN" in the
+   * binary format of PostgreSQL. The rows are encoded into a buffer
+   * that is reused, and that is sent in chunks. The types of the
+   * values must exactly match the types of the columns (e.g. INT4 is
+   * written by AddInteger(), INT8 by AddInteger64()).
+   **/
+  class PostgreSQLCopyWriter : public boost::noncopyable
+  {
+  private:
+    PostgreSQLConnection&  connection_;
+    unsigned int           columnsCount_;
+    std::string            buffer_;
+    size_t                 chunkSize_;
+    bool                   isOpen_;
+    unsigned int           currentColumn_;
+    uint64_t               rowsCount_;
+
+    void Flush();
+
+    void AddField(const void* data,
+                  size_t size);
+
+    void Abort();
+
+  public:
+    // "target" is a table, possibly followed by the list of its
+    // columns, e.g. "MainDicomTags(id, tagGroup, tagElement, value)"
+    PostgreSQLCopyWriter(PostgreSQLConnection& connection,
+                         const std::string& target,
+                         unsigned int columnsCount);
+
+    // If Finish() was not called, the COPY is aborted
+    ~PostgreSQLCopyWriter();
+
+    // Size of the chunks that are sent to the server (in bytes)
+    void SetChunkSize(size_t size);
+
+    size_t GetChunkSize() const
+    {
+      return chunkSize_;
+    }
+
+    void BeginRow();
+
+    void AddNull();
+
+    void AddInteger(int32_t value);
+
+    void AddInteger64(int64_t value);
+
+    // For the TEXT and BYTEA columns
+    void AddString(const std::string& value);
+
+    void AddBinary(const void* data,
+                   size_t size);
+
+    // Send the remaining rows, and wait for the server to acknowledge
+    // the COPY. Returns the number of rows.
+    uint64_t Finish();
+  };
+}
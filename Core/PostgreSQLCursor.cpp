@@ -0,0 +1,192 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLCursor.h"
+
+#include "PostgreSQLException.h"
+
+#include <stdio.h>
+
+// PostgreSQL includes
+#include <libpq-fe.h>
+
+
+namespace OrthancPlugins
+{
+  PostgreSQLCursor::PostgreSQLCursor(PostgreSQLStatement& query,
+                                     unsigned int fetchSize) :
+    connection_(query.GetConnection()),
+    fetchSize_(fetchSize),
+    timeout_(connection_.GetStatementTimeout(PostgreSQLStatementClass_Scan)),
+    exhausted_(false)
+  {
+    if (fetchSize == 0)
+    {
+      throw PostgreSQLException("The fetch size of a cursor must be positive");
+    }
+
+    if (!connection_.IsInTransaction())
+    {
+      // Without "WITH HOLD", a cursor only lives until the end of
+      // its transaction
+      throw PostgreSQLException("A cursor can only be used within a transaction");
+    }
+
+    // The name is unique within the session, even if a previous
+    // cursor was allocated at the same address
+    char name[64];
+    sprintf(name, "OrthancCursor%u", connection_.cursorCounter_++);
+    name_ = "\"" + std::string(name) + "\"";
+
+    char fetch[128];
+    sprintf(fetch, "FETCH FORWARD %u FROM %s", fetchSize, name_.c_str());
+    fetch_ = fetch;
+
+    connection_.EnsureAlive();
+    connection_.FlushPipeline();
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+    PGresult* result = NULL;
+
+    std::string declare = "DECLARE " + name_ + " BINARY NO SCROLL CURSOR FOR " + query.GetSql();
+    if (query.SendUnprepared(declare))
+    {
+      result = reinterpret_cast<PGresult*>(connection_.WaitResult(timeout_));
+    }
+
+    if (result == NULL)
+    {
+      throw PostgreSQLException(PQerrorMessage(pg));
+    }
+
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+    {
+      connection_.ThrowResultError(result);  // Clears the result
+    }
+
+    PQclear(result);
+
+    try
+    {
+      FetchBatch();
+    }
+    catch (PostgreSQLException&)
+    {
+      // The destructor is not called if the constructor throws
+      try
+      {
+        connection_.Execute("CLOSE " + name_);
+      }
+      catch (PostgreSQLException&)
+      {
+      }
+
+      throw;
+    }
+  }
+
+
+  PostgreSQLCursor::~PostgreSQLCursor()
+  {
+    batch_.reset(NULL);
+
+    try
+    {
+      // Fails if the transaction was aborted, in which case the
+      // cursor is already gone
+      connection_.Execute("CLOSE " + name_);
+    }
+    catch (PostgreSQLException&)
+    {
+      // Never throw in a destructor
+    }
+  }
+
+
+  void PostgreSQLCursor::FetchBatch()
+  {
+    batch_.reset(NULL);
+
+    if (exhausted_)
+    {
+      return;
+    }
+
+    connection_.EnsureAlive();
+    connection_.FlushPipeline();
+
+    // The rows of FETCH are in binary format, as requested by the
+    // last argument (this overrides the format of the cursor)
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+    PGresult* result = NULL;
+
+    if (PQsendQueryParams(pg, fetch_.c_str(), 0, NULL, NULL, NULL, NULL, 1) == 1)
+    {
+      result = reinterpret_cast<PGresult*>(connection_.WaitResult(timeout_));
+    }
+
+    if (result == NULL)
+    {
+      throw PostgreSQLException(PQerrorMessage(pg));
+    }
+
+    if (PQresultStatus(result) == PGRES_TUPLES_OK &&
+        PQntuples(result) < static_cast<int>(fetchSize_))
+    {
+      // A partial batch is the last one
+      exhausted_ = true;
+    }
+
+    batch_.reset(new PostgreSQLResult(connection_, result));
+
+    if (batch_->IsDone())
+    {
+      exhausted_ = true;
+      batch_.reset(NULL);
+    }
+  }
+
+
+  const PostgreSQLResult& PostgreSQLCursor::GetBatch() const
+  {
+    if (IsDone())
+    {
+      throw PostgreSQLException("Bad sequence of calls");
+    }
+
+    return *batch_;
+  }
+
+
+  void PostgreSQLCursor::Step()
+  {
+    if (IsDone())
+    {
+      throw PostgreSQLException("Bad sequence of calls");
+    }
+
+    batch_->Step();
+
+    if (batch_->IsDone())
+    {
+      FetchBatch();
+    }
+  }
+}
@@ -0,0 +1,107 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLResult.h"
+
+namespace OrthancPlugins
+{
+  /**
+   * Iterates over the rows of a query through a server-side cursor,
+   * that is declared from a statement whose parameters are bound,
+   * then fetched by batches of rows in binary format. Contrarily to
+   * the streaming mode of PostgreSQLResult, the connection can run
+   * other statements between two batches, and the rows that are not
+   * fetched are never computed by the server. The cursor must be
+   * used within a transaction, and is closed by its destructor.
+   **/
+  class PostgreSQLCursor : public boost::noncopyable
+  {
+  private:
+    PostgreSQLConnection&  connection_;
+    std::string            name_;
+    std::string            fetch_;
+    unsigned int           fetchSize_;
+    unsigned int           timeout_;
+    bool                   exhausted_;   // Whether the server has sent all the rows
+    std::auto_ptr<PostgreSQLResult>  batch_;
+
+    void FetchBatch();
+
+    const PostgreSQLResult& GetBatch() const;
+
+  public:
+    PostgreSQLCursor(PostgreSQLStatement& query,
+                     unsigned int fetchSize = 1000);
+
+    ~PostgreSQLCursor();
+
+    unsigned int GetFetchSize() const
+    {
+      return fetchSize_;
+    }
+
+    void Step();
+
+    bool IsDone() const
+    {
+      return batch_.get() == NULL;
+    }
+
+    bool IsNull(unsigned int column) const
+    {
+      return GetBatch().IsNull(column);
+    }
+
+    bool GetBoolean(unsigned int column) const
+    {
+      return GetBatch().GetBoolean(column);
+    }
+
+    int GetInteger(unsigned int column) const
+    {
+      return GetBatch().GetInteger(column);
+    }
+
+    int64_t GetInteger64(unsigned int column) const
+    {
+      return GetBatch().GetInteger64(column);
+    }
+
+    std::string GetString(unsigned int column) const
+    {
+      return GetBatch().GetString(column);
+    }
+
+    void GetString(std::string& target,
+                   unsigned int column) const
+    {
+      GetBatch().GetString(target, column);
+    }
+
+    // Only valid until the next call to Step()
+    const char* GetStringView(size_t& size,
+                              unsigned int column) const
+    {
+      return GetBatch().GetStringView(size, column);
+    }
+  };
+}
@@ -0,0 +1,416 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLEventLoop.h"
+
+#include "PostgreSQLException.h"
+
+#include <boost/lexical_cast.hpp>
+#include <string.h>
+#include <vector>
+
+#if defined(__linux__)
+#  include <sys/epoll.h>
+#  include <unistd.h>
+#  include <errno.h>
+#elif !defined(_WIN32)
+#  include <sys/select.h>
+#  include <errno.h>
+#endif
+
+// PostgreSQL includes
+#include <libpq-fe.h>
+
+
+namespace OrthancPlugins
+{
+  void PostgreSQLEventLoop::Watch(PostgreSQLConnection& connection)
+  {
+#if defined(__linux__)
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &connection;
+
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, 
+                  PQsocket(reinterpret_cast<PGconn*>(connection.pg_)), &event) != 0)
+    {
+      throw PostgreSQLException("Cannot watch the socket of a PostgreSQL connection");
+    }
+#else
+    // The set of sockets is built at each call to select()
+#endif
+  }
+
+
+  void PostgreSQLEventLoop::Unwatch(PostgreSQLConnection& connection)
+  {
+#if defined(__linux__)
+    struct epoll_event event;   // Ignored, but must be non-NULL before Linux 2.6.9
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, 
+              PQsocket(reinterpret_cast<PGconn*>(connection.pg_)), &event);
+#endif
+  }
+
+
+  void PostgreSQLEventLoop::Process(PostgreSQLConnection& connection)
+  {
+    Queries::iterator found = queries_.find(&connection);
+    if (found == queries_.end())
+    {
+      return;
+    }
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection.pg_);
+    PostgreSQLAsyncQuery& query = *found->second.query_;
+
+    if (PQconsumeInput(pg) != 1)
+    {
+      std::string error = PQerrorMessage(pg);
+
+      if (found->second.result_ != NULL)
+      {
+        PQclear(reinterpret_cast<PGresult*>(found->second.result_));
+      }
+
+      Unwatch(connection);
+      queries_.erase(found);
+      query.Fail(error, false);
+      return;
+    }
+
+    // The results of a query are followed by NULL, which tells that
+    // the connection is ready for the next query
+    while (!PQisBusy(pg))
+    {
+      PGresult* result = PQgetResult(pg);
+
+      if (result == NULL)
+      {
+        PGresult* first = reinterpret_cast<PGresult*>(found->second.result_);
+        bool canceled = found->second.deadline_->IsCanceled();
+        unsigned int timeout = found->second.timeout_;
+
+        Unwatch(connection);
+        queries_.erase(found);
+
+        if (canceled &&
+            first != NULL &&
+            PQresultStatus(first) == PGRES_FATAL_ERROR)
+        {
+          PQclear(first);
+          query.Fail("A statement has exceeded its timeout of " +
+                     boost::lexical_cast<std::string>(timeout) + "ms", true);
+        }
+        else
+        {
+          query.Complete(first);
+        }
+
+        return;
+      }
+      else if (found->second.result_ == NULL)
+      {
+        found->second.result_ = result;
+      }
+      else
+      {
+        // Only keep the first result
+        PQclear(result);
+      }
+    }
+  }
+
+
+  void PostgreSQLEventLoop::Drain(PostgreSQLConnection& connection,
+                                  unsigned int timeout)
+  {
+    // Wait for the end of the query, so that the connection can be
+    // used again. Past the timeout, the query is canceled, then the
+    // session is dropped if the server does not acknowledge it.
+    try
+    {
+      PGresult* result = reinterpret_cast<PGresult*>(connection.WaitResult(timeout));
+      if (result != NULL)
+      {
+        PQclear(result);
+      }
+    }
+    catch (PostgreSQLException&)
+    {
+      // The result of the query is discarded anyway
+    }
+  }
+
+
+  int PostgreSQLEventLoop::GetNextDeadline() const
+  {
+    int next = -1;
+
+    for (Queries::const_iterator it = queries_.begin(); it != queries_.end(); ++it)
+    {
+      int remaining = it->second.deadline_->GetRemaining();
+      if (remaining >= 0 &&
+          (next < 0 || remaining < next))
+      {
+        next = remaining;
+      }
+    }
+
+    return next;
+  }
+
+
+  bool PostgreSQLEventLoop::ProcessDeadlines()
+  {
+    std::vector<PostgreSQLConnection*> expired;
+
+    for (Queries::const_iterator it = queries_.begin(); it != queries_.end(); ++it)
+    {
+      if (it->second.deadline_->GetRemaining() == 0)
+      {
+        expired.push_back(it->first);
+      }
+    }
+
+    // The callbacks might submit new queries, so the connections are
+    // looked up again
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+      Queries::iterator found = queries_.find(expired[i]);
+      if (found == queries_.end())
+      {
+        continue;
+      }
+
+      PostgreSQLConnection& connection = *found->first;
+
+      if (!found->second.deadline_->IsCanceled())
+      {
+        // The server answers the cancellation with an error, that
+        // is received by Process()
+        connection.Cancel();
+        found->second.deadline_->SetCanceled();
+      }
+      else
+      {
+        // Dropping the session makes the server abort the command
+        PostgreSQLAsyncQuery& query = *found->second.query_;
+
+        if (found->second.result_ != NULL)
+        {
+          PQclear(reinterpret_cast<PGresult*>(found->second.result_));
+        }
+
+        Unwatch(connection);
+        queries_.erase(found);
+        connection.Reset();
+
+        query.Fail("The server has not acknowledged the cancellation "
+                   "of a statement that exceeded its timeout", true);
+      }
+    }
+
+    return !expired.empty();
+  }
+
+
+  PostgreSQLEventLoop::PostgreSQLEventLoop() :
+    epoll_(-1)
+  {
+#if defined(__linux__)
+    epoll_ = epoll_create(16 /* Ignored since Linux 2.6.8 */);
+    if (epoll_ < 0)
+    {
+      throw PostgreSQLException("Cannot create an epoll instance");
+    }
+#endif
+  }
+
+
+  PostgreSQLEventLoop::~PostgreSQLEventLoop()
+  {
+    for (Queries::iterator it = queries_.begin(); it != queries_.end(); ++it)
+    {
+      if (it->second.result_ != NULL)
+      {
+        PQclear(reinterpret_cast<PGresult*>(it->second.result_));
+      }
+
+      // Nobody waits for the result anymore
+      it->first->Cancel();
+      Drain(*it->first, it->second.timeout_);
+
+      // The callbacks are not invoked, as they might throw
+      it->second.query_->result_.reset(NULL);
+      it->second.query_->error_ = "The event loop was destroyed before the query was done";
+      it->second.query_->state_ = PostgreSQLAsyncQuery::State_Done;
+    }
+
+#if defined(__linux__)
+    close(epoll_);
+#endif
+  }
+
+
+  void PostgreSQLEventLoop::Submit(PostgreSQLAsyncQuery& query)
+  {
+    PostgreSQLConnection& connection = query.GetConnection();
+
+    if (queries_.find(&connection) != queries_.end())
+    {
+      throw PostgreSQLException("Another asynchronous query is running on this connection");
+    }
+
+    unsigned int timeout = connection.GetStatementTimeout(query.GetStatement().GetTimeoutClass());
+
+    query.Send();
+
+    InFlight item;
+    item.query_ = &query;
+    item.result_ = NULL;
+    item.timeout_ = timeout;
+    item.deadline_.reset(new PostgreSQLConnection::Deadline(timeout));
+    queries_[&connection] = item;
+
+    try
+    {
+      Watch(connection);
+    }
+    catch (PostgreSQLException&)
+    {
+      queries_.erase(&connection);
+      Drain(connection, timeout);
+      throw;
+    }
+  }
+
+
+  bool PostgreSQLEventLoop::RunOnce(int timeout)
+  {
+    if (queries_.empty())
+    {
+      return false;
+    }
+
+    // Wake up at the earliest deadline of the queries in flight
+    int next = GetNextDeadline();
+    if (next >= 0 &&
+        (timeout < 0 || next < timeout))
+    {
+      timeout = next;
+    }
+
+    std::vector<PostgreSQLConnection*> ready;
+
+#if defined(__linux__)
+    std::vector<struct epoll_event> events(queries_.size());
+
+    int count = epoll_wait(epoll_, &events[0], static_cast<int>(events.size()), timeout);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+      {
+        return true;
+      }
+
+      throw PostgreSQLException("Error while waiting for PostgreSQL");
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      ready.push_back(reinterpret_cast<PostgreSQLConnection*>(events[i].data.ptr));
+    }
+#else
+    fd_set readable;
+    FD_ZERO(&readable);
+
+    int maxSocket = -1;
+    for (Queries::const_iterator it = queries_.begin(); it != queries_.end(); ++it)
+    {
+      int socket = PQsocket(reinterpret_cast<PGconn*>(it->first->pg_));
+      FD_SET(socket, &readable);
+      if (socket > maxSocket)
+      {
+        maxSocket = socket;
+      }
+    }
+
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    int count = select(maxSocket + 1, &readable, NULL, NULL, (timeout < 0 ? NULL : &tv));
+    if (count < 0)
+    {
+#if !defined(_WIN32)
+      if (errno == EINTR)
+      {
+        return true;
+      }
+#endif
+
+      throw PostgreSQLException("Error while waiting for PostgreSQL");
+    }
+
+    for (Queries::const_iterator it = queries_.begin(); it != queries_.end(); ++it)
+    {
+      if (FD_ISSET(PQsocket(reinterpret_cast<PGconn*>(it->first->pg_)), &readable))
+      {
+        ready.push_back(it->first);
+      }
+    }
+#endif
+
+    // The callbacks might submit new queries, so the connections are
+    // looked up again by Process()
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+      Process(*ready[i]);
+    }
+
+    bool expired = ProcessDeadlines();
+
+    return (count > 0 || expired);
+  }
+
+
+  void PostgreSQLEventLoop::Wait(PostgreSQLAsyncQuery& query)
+  {
+    while (!query.IsDone())
+    {
+      if (queries_.empty())
+      {
+        throw PostgreSQLException("This query was not submitted to the event loop");
+      }
+
+      RunOnce(-1);
+    }
+  }
+
+
+  void PostgreSQLEventLoop::WaitAll()
+  {
+    while (!queries_.empty())
+    {
+      RunOnce(-1);
+    }
+  }
+}
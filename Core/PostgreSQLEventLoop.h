@@ -0,0 +1,106 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLAsyncQuery.h"
+
+#include <map>
+#include <boost/shared_ptr.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Multiplexes the asynchronous queries that are running on
+   * different connections (typically taken from a
+   * PostgreSQLConnectionPool), using epoll() on Linux and select()
+   * on the other platforms. At most one query can be in flight on
+   * each connection, and the connection must not be used otherwise
+   * until this query is done. The loop is not thread-safe.
+   *
+   * Each query is given the timeout of the class of its statement.
+   * Once exceeded, the query is canceled, and fails with a
+   * PostgreSQLTimeoutException. If the server does not acknowledge
+   * the cancellation in time, the session is dropped.
+   **/
+  class PostgreSQLEventLoop : public boost::noncopyable
+  {
+  private:
+    struct InFlight
+    {
+      PostgreSQLAsyncQuery*  query_;
+      void*  result_;   /* Object of type "PGresult*" */
+      unsigned int  timeout_;   // In milliseconds, 0 for no limit
+      boost::shared_ptr<PostgreSQLConnection::Deadline>  deadline_;
+    };
+
+    typedef std::map<PostgreSQLConnection*, InFlight>  Queries;
+
+    Queries  queries_;
+    int      epoll_;
+
+    void Watch(PostgreSQLConnection& connection);
+
+    void Unwatch(PostgreSQLConnection& connection);
+
+    void Process(PostgreSQLConnection& connection);
+
+    void Drain(PostgreSQLConnection& connection,
+               unsigned int timeout);
+
+    // Earliest deadline of the queries in flight, or -1 if none
+    int GetNextDeadline() const;
+
+    // Cancels the queries that have exceeded their deadline, and
+    // drops the sessions whose cancellation was not acknowledged
+    bool ProcessDeadlines();
+
+  public:
+    PostgreSQLEventLoop();
+
+    ~PostgreSQLEventLoop();
+
+    // Sends the query to the server, without waiting for its result
+    void Submit(PostgreSQLAsyncQuery& query);
+
+    size_t GetPendingCount() const
+    {
+      return queries_.size();
+    }
+
+    bool HasPending() const
+    {
+      return !queries_.empty();
+    }
+
+    // Waits for the socket of at least one connection to become
+    // readable (at most until the earliest deadline of the queries),
+    // then completes the queries whose result is available, and
+    // cancels those that have exceeded their deadline. Returns
+    // "false" if nothing has happened before the timeout.
+    bool RunOnce(int timeout /* in milliseconds, -1 for infinite */);
+
+    // Runs the loop until the given query is done
+    void Wait(PostgreSQLAsyncQuery& query);
+
+    // Runs the loop until all the submitted queries are done
+    void WaitAll();
+  };
+}
@@ -38,4 +38,15 @@ namespace OrthancPlugins
     {
     }
   };
+
+
+  // A statement was canceled because it has exceeded its timeout
+  class PostgreSQLTimeoutException : public PostgreSQLException
+  {
+  public:
+    PostgreSQLTimeoutException(const std::string& message) : 
+      PostgreSQLException(message)
+    {
+    }
+  };
 }
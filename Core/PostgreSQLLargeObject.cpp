@@ -26,12 +26,23 @@
 
 #include <boost/lexical_cast.hpp>
 #include <libpq/libpq-fs.h>
+#include <string.h>
 
 
 namespace OrthancPlugins
 {  
+  void PostgreSQLLargeObject::BeginAccess(PostgreSQLConnection& connection)
+  {
+    connection.FlushPipeline();
+    connection.SetLocalStatementTimeout
+      (connection.GetStatementTimeout(PostgreSQLStatementClass_LargeObject));
+  }
+
+
   void PostgreSQLLargeObject::Create()
   {
+    BeginAccess(connection_);
+
     PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
 
     oid_ = lo_creat(pg, INV_WRITE);
@@ -45,7 +56,7 @@ namespace OrthancPlugins
   void PostgreSQLLargeObject::Write(const void* data, 
                                     size_t size)
   {
-    static int MAX_CHUNK_SIZE = 16 * 1024 * 1024;
+    BeginAccess(connection_);
 
     PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
 
@@ -55,17 +66,20 @@ namespace OrthancPlugins
       throw PostgreSQLException();
     }
 
+    ChunkSizeTuner& tuner = connection_.GetLargeObjectChunks();
+    ChunkSizeTuner::Operation operation(tuner);
+
     const char* position = reinterpret_cast<const char*>(data);
     while (size > 0)
     {
-      int chunk = (size > static_cast<size_t>(MAX_CHUNK_SIZE) ? MAX_CHUNK_SIZE : static_cast<int>(size));
-      int nbytes = lo_write(pg, fd, position, chunk);
+      int nbytes = lo_write(pg, fd, position, tuner.GetChunkSize(size));
       if (nbytes <= 0)
       {
         lo_close(pg, fd);
         throw PostgreSQLException();
       }
 
+      operation.Done(nbytes);
       size -= nbytes;
       position += nbytes;
     }
@@ -104,22 +118,44 @@ namespace OrthancPlugins
   class PostgreSQLLargeObject::Reader
   {
   private: 
+    PostgreSQLConnection& connection_;
+    std::string oid_;
     PGconn* pg_;
-    int fd_;
+    int fd_;   // Only opened if needed, as "lo_get()" needs no descriptor
     size_t size_;
 
+    void OpenDescriptor()
+    {
+      if (fd_ >= 0)
+      {
+        return;
+      }
+
+      Oid id = boost::lexical_cast<Oid>(oid_);
+
+      fd_ = lo_open(pg_, id, INV_READ);
+      if (fd_ < 0)
+      {
+        throw PostgreSQLException("No such large object in the connection; Make sure you use a transaction");
+      }
+    }
+
   public:
     Reader(PostgreSQLConnection& connection,
-           const std::string& oid)
+           const std::string& oid) :
+      connection_(connection),
+      oid_(oid),
+      fd_(-1)
     {
-      pg_ = reinterpret_cast<PGconn*>(connection.pg_);
-      Oid id = boost::lexical_cast<Oid>(oid);
+      BeginAccess(connection_);
+      pg_ = reinterpret_cast<PGconn*>(connection_.pg_);
 
-      fd_ = lo_open(pg_, id, INV_READ);
+      // The size is unknown: It is asked through a descriptor
+      OpenDescriptor();
 
-      if (fd_ < 0 ||
-          lo_lseek(pg_, fd_, 0, SEEK_END) < 0)
+      if (lo_lseek(pg_, fd_, 0, SEEK_END) < 0)
       {
+        lo_close(pg_, fd_);
         throw PostgreSQLException("No such large object in the connection; Make sure you use a transaction");
       }
 
@@ -127,6 +163,7 @@ namespace OrthancPlugins
       int size = lo_tell(pg_, fd_);
       if (size < 0)
       {
+        lo_close(pg_, fd_);
         throw PostgreSQLException("Internal error");
       }
       size_ = static_cast<size_t>(size);
@@ -135,9 +172,24 @@ namespace OrthancPlugins
       lo_lseek(pg_, fd_, 0, SEEK_SET);
     }
 
+    Reader(PostgreSQLConnection& connection,
+           const std::string& oid,
+           size_t size) :
+      connection_(connection),
+      oid_(oid),
+      fd_(-1),
+      size_(size)
+    {
+      BeginAccess(connection_);
+      pg_ = reinterpret_cast<PGconn*>(connection_.pg_);
+    }
+
     ~Reader()
     {
-      lo_close(pg_, fd_);
+      if (fd_ >= 0)
+      {
+        lo_close(pg_, fd_);
+      }
     }
 
     size_t GetSize() const
@@ -145,55 +197,255 @@ namespace OrthancPlugins
       return size_;
     }
 
-    void Read(char* target)
+    void ReadSequential(char* target)
     {
+      OpenDescriptor();
+
+      ChunkSizeTuner& tuner = connection_.GetLargeObjectChunks();
+      ChunkSizeTuner::Operation operation(tuner);
+
       for (size_t position = 0; position < size_; )
       {
-        size_t remaining = size_ - position;
-        size_t nbytes = lo_read(pg_, fd_, target + position, remaining);
+        int nbytes = lo_read(pg_, fd_, target + position, tuner.GetChunkSize(size_ - position));
 
-        if (nbytes < 0)
+        if (nbytes <= 0)
         {
-          throw PostgreSQLException("Unable to read the large object in the database");
+          throw PostgreSQLException("Unable to read the large object in the database: " +
+                                    std::string(PQerrorMessage(pg_)));
         }
 
+        operation.Done(nbytes);
         position += nbytes;
       }
     }
+
+    void SendChunk(size_t offset,
+                   size_t size)
+    {
+      std::string o = boost::lexical_cast<std::string>(offset);
+      std::string s = boost::lexical_cast<std::string>(size);
+      const char* values[3] = { oid_.c_str(), o.c_str(), s.c_str() };
+
+      // The chunk is returned in binary format, i.e. as raw bytes
+      if (PQsendQueryParams(pg_, "SELECT lo_get($1::oid, $2::int8, $3::int4)",
+                            3, NULL, values, NULL, NULL, 1) != 1)
+      {
+        throw PostgreSQLException(PQerrorMessage(pg_));
+      }
+    }
+
+    // Double buffering: The server prepares the next chunk while the
+    // current one is copied into the target
+    void ReadStreaming(char* target)
+    {
+      ChunkSizeTuner& tuner = connection_.GetLargeObjectChunks();
+      unsigned int timeout = connection_.GetStatementTimeout(PostgreSQLStatementClass_LargeObject);
+
+      size_t requested = tuner.GetChunkSize(size_);
+      SendChunk(0, requested);
+
+      ChunkSizeTuner::Operation operation(tuner);
+
+      for (size_t position = 0; position < size_; )
+      {
+        PGresult* result = reinterpret_cast<PGresult*>(connection_.WaitResult(timeout));
+
+        if (result == NULL ||
+            PQresultStatus(result) != PGRES_TUPLES_OK)
+        {
+          connection_.ThrowResultError(result);  // Clears the result
+        }
+
+        size_t length = (PQntuples(result) == 1 && !PQgetisnull(result, 0, 0) ?
+                         static_cast<size_t>(PQgetlength(result, 0, 0)) : 0);
+        if (length == 0 ||
+            length > requested)
+        {
+          PQclear(result);
+          throw PostgreSQLException("Unable to read the large object in the database");
+        }
+
+        operation.Done(length);
+
+        size_t next = position + length;
+        if (next < size_)
+        {
+          requested = tuner.GetChunkSize(size_ - next);
+
+          try
+          {
+            SendChunk(next, requested);
+          }
+          catch (PostgreSQLException&)
+          {
+            PQclear(result);
+            throw;
+          }
+        }
+
+        memcpy(target + position, PQgetvalue(result, 0, 0), length);
+        PQclear(result);
+        position = next;
+      }
+    }
+
+    void Read(char* target)
+    {
+      if (connection_.IsLargeObjectStreaming())
+      {
+        ReadStreaming(target);
+      }
+      else
+      {
+        ReadSequential(target);
+      }
+    }
   };
   
 
-  void PostgreSQLLargeObject::Read(std::string& target,
+  void* PostgreSQLLargeObject::StringBuffer::Allocate(size_t size)
+  {
+    target_.resize(size);
+    return (size == 0 ? NULL : &target_[0]);
+  }
+
+
+  void* PostgreSQLLargeObject::MallocBuffer::Allocate(size_t size)
+  {
+    size_ = size;
+
+    if (size == 0)
+    {
+      target_ = NULL;
+    }
+    else
+    {
+      target_ = malloc(size);
+      if (target_ == NULL)
+      {
+        throw std::bad_alloc();
+      }
+    }
+
+    return target_;
+  }
+
+
+  void PostgreSQLLargeObject::Read(IBuffer& target,
                                    PostgreSQLConnection& connection,
                                    const std::string& oid)
   {
     Reader reader(connection, oid);
-    target.resize(reader.GetSize());    
+    void* buffer = target.Allocate(reader.GetSize());
+
+    if (reader.GetSize() > 0)
+    {
+      reader.Read(reinterpret_cast<char*>(buffer));
+    }
+  }
+
 
-    if (target.size() > 0)
+  void PostgreSQLLargeObject::Read(IBuffer& target,
+                                   PostgreSQLConnection& connection,
+                                   const std::string& oid,
+                                   size_t size)
+  {
+    Reader reader(connection, oid, size);
+    void* buffer = target.Allocate(size);
+
+    if (size > 0)
     {
-      reader.Read(&target[0]);
+      reader.Read(reinterpret_cast<char*>(buffer));
     }
   }
 
 
+  void PostgreSQLLargeObject::Read(std::string& target,
+                                   PostgreSQLConnection& connection,
+                                   const std::string& oid)
+  {
+    StringBuffer buffer(target);
+    Read(buffer, connection, oid);
+  }
+
+
   void PostgreSQLLargeObject::Read(void*& target,
                                    size_t& size,
                                    PostgreSQLConnection& connection,
                                    const std::string& oid)
   {
-    Reader reader(connection, oid);
-    size = reader.GetSize();
+    MallocBuffer buffer(target, size);
 
-    if (size == 0)
+    try
+    {
+      Read(buffer, connection, oid);
+    }
+    catch (...)
     {
+      free(target);
       target = NULL;
+      throw;
     }
-    else
+  }
+
+
+  void PostgreSQLLargeObject::ReadRange(std::string& target,
+                                        PostgreSQLConnection& connection,
+                                        const std::string& oid,
+                                        uint64_t offset,
+                                        size_t length)
+  {
+    BeginAccess(connection);
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection.pg_);
+    Oid id = boost::lexical_cast<Oid>(oid);
+
+    int fd = lo_open(pg, id, INV_READ);
+    if (fd < 0)
+    {
+      throw PostgreSQLException("No such large object in the connection; Make sure you use a transaction");
+    }
+
+    try
+    {
+      if (lo_lseek64(pg, fd, static_cast<pg_int64>(offset), SEEK_SET) < 0)
+      {
+        throw PostgreSQLException("Cannot seek in the large object");
+      }
+
+      target.resize(length);
+
+      ChunkSizeTuner& tuner = connection.GetLargeObjectChunks();
+      ChunkSizeTuner::Operation operation(tuner);
+
+      size_t position = 0;
+      while (position < length)
+      {
+        int nbytes = lo_read(pg, fd, &target[position], tuner.GetChunkSize(length - position));
+
+        if (nbytes < 0)
+        {
+          throw PostgreSQLException("Unable to read the large object in the database: " +
+                                    std::string(PQerrorMessage(pg)));
+        }
+        else if (nbytes == 0)
+        {
+          break;   // End of the object
+        }
+
+        operation.Done(nbytes);
+        position += nbytes;
+      }
+
+      target.resize(position);
+    }
+    catch (...)
     {
-      target = malloc(size);
-      reader.Read(reinterpret_cast<char*>(target));
+      lo_close(pg, fd);
+      throw;
     }
+
+    lo_close(pg, fd);
   }
 
 
@@ -206,6 +458,8 @@ namespace OrthancPlugins
   void PostgreSQLLargeObject::Delete(PostgreSQLConnection& connection,
                                      const std::string& oid)
   {
+    BeginAccess(connection);
+
     PGconn* pg = reinterpret_cast<PGconn*>(connection.pg_);
     Oid id = boost::lexical_cast<Oid>(oid);
 
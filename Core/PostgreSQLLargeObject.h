@@ -34,12 +34,66 @@ namespace OrthancPlugins
     PostgreSQLConnection& connection_;
     Oid oid_;
 
+    // The operations on large objects are not bounded by a deadline
+    // on the client side: Their timeout is enforced by the server
+    static void BeginAccess(PostgreSQLConnection& connection);
+
     void Create();
 
     void Write(const void* data, 
                size_t size);
 
   public:
+    // Destination of the content of a large object, which is
+    // allocated once the size of the object is known, so that the
+    // content is read in place (e.g. a caller-provided buffer, or a
+    // slab taken from a pool)
+    class IBuffer : public boost::noncopyable
+    {
+    public:
+      virtual ~IBuffer()
+      {
+      }
+
+      // Can return NULL if "size" is zero
+      virtual void* Allocate(size_t size) = 0;
+    };
+
+    class StringBuffer : public IBuffer
+    {
+    private:
+      std::string& target_;
+
+    public:
+      explicit StringBuffer(std::string& target) :
+        target_(target)
+      {
+      }
+
+      virtual void* Allocate(size_t size);
+    };
+
+    // The memory is allocated with "malloc()", and must be released
+    // with "free()" by the caller
+    class MallocBuffer : public IBuffer
+    {
+    private:
+      void*&   target_;
+      size_t&  size_;
+
+    public:
+      MallocBuffer(void*& target,
+                   size_t& size) :
+        target_(target),
+        size_(size)
+      {
+        target_ = NULL;
+        size_ = 0;
+      }
+
+      virtual void* Allocate(size_t size);
+    };
+
     PostgreSQLLargeObject(PostgreSQLConnection& connection,
                           const void* data,
                           size_t size);
@@ -58,6 +112,26 @@ namespace OrthancPlugins
                      PostgreSQLConnection& connection,
                      const std::string& oid);
 
+    // The size of the object is first asked to the server
+    static void Read(IBuffer& target,
+                     PostgreSQLConnection& connection,
+                     const std::string& oid);
+
+    // The size of the object is already known (e.g. it was stored
+    // next to its OID), which saves two round trips
+    static void Read(IBuffer& target,
+                     PostgreSQLConnection& connection,
+                     const std::string& oid,
+                     size_t size);
+
+    // Read at most "length" bytes, starting at "offset": The range is
+    // clipped to the end of the object
+    static void ReadRange(std::string& target,
+                          PostgreSQLConnection& connection,
+                          const std::string& oid,
+                          uint64_t offset,
+                          size_t length);
+
     static void Delete(PostgreSQLConnection& connection,
                        const std::string& oid);
   };
@@ -0,0 +1,187 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLLargeObjectWriter.h"
+
+#include "PostgreSQLException.h"
+
+#include <boost/lexical_cast.hpp>
+
+// PostgreSQL includes
+#include <libpq-fe.h>
+#include <libpq/libpq-fs.h>
+
+
+namespace OrthancPlugins
+{
+  PostgreSQLLargeObjectWriter::PostgreSQLLargeObjectWriter(PostgreSQLConnection& connection,
+                                                           size_t bufferSize) :
+    connection_(connection),
+    oid_(0),
+    fd_(-1),
+    bufferSize_(bufferSize),
+    size_(0),
+    isOpen_(false)
+  {
+    if (!connection_.IsInTransaction())
+    {
+      // The descriptors of the large objects are closed at the end
+      // of each transaction
+      throw PostgreSQLException("A large object can only be written within a transaction");
+    }
+
+    // The timeout of the large objects is enforced by the server
+    connection_.FlushPipeline();
+    connection_.SetLocalStatementTimeout
+      (connection_.GetStatementTimeout(PostgreSQLStatementClass_LargeObject));
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+
+    oid_ = lo_creat(pg, INV_WRITE);
+    if (oid_ == 0)
+    {
+      throw PostgreSQLException("Cannot create a large object");
+    }
+
+    fd_ = lo_open(pg, oid_, INV_WRITE);
+    if (fd_ < 0)
+    {
+      lo_unlink(pg, oid_);
+      throw PostgreSQLException("Cannot open a large object");
+    }
+
+    isOpen_ = true;
+    buffer_.reserve(bufferSize_);
+  }
+
+
+  PostgreSQLLargeObjectWriter::~PostgreSQLLargeObjectWriter()
+  {
+    if (isOpen_)
+    {
+      try
+      {
+        Abort();
+      }
+      catch (PostgreSQLException&)
+      {
+        // Never throw in a destructor
+      }
+    }
+  }
+
+
+  void PostgreSQLLargeObjectWriter::Abort()
+  {
+    isOpen_ = false;
+
+    // These calls fail if the transaction is aborted, in which case
+    // the large object is removed by the rollback
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+    lo_close(pg, fd_);
+    lo_unlink(pg, oid_);
+  }
+
+
+  void PostgreSQLLargeObjectWriter::WriteChunks(const char* data,
+                                                size_t size)
+  {
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+
+    ChunkSizeTuner& tuner = connection_.GetLargeObjectChunks();
+    ChunkSizeTuner::Operation operation(tuner);
+
+    while (size > 0)
+    {
+      int nbytes = lo_write(pg, fd_, data, tuner.GetChunkSize(size));
+      if (nbytes <= 0)
+      {
+        throw PostgreSQLException("Unable to write the large object in the database: " +
+                                  std::string(PQerrorMessage(pg)));
+      }
+
+      operation.Done(nbytes);
+      size -= nbytes;
+      data += nbytes;
+    }
+  }
+
+
+  void PostgreSQLLargeObjectWriter::Flush()
+  {
+    if (!buffer_.empty())
+    {
+      WriteChunks(buffer_.c_str(), buffer_.size());
+      buffer_.clear();
+    }
+  }
+
+
+  void PostgreSQLLargeObjectWriter::Append(const void* data,
+                                           size_t size)
+  {
+    if (!isOpen_)
+    {
+      throw PostgreSQLException("Bad sequence of calls");
+    }
+
+    if (buffer_.size() + size > bufferSize_)
+    {
+      Flush();
+    }
+
+    if (size >= bufferSize_)
+    {
+      // Large chunks are not copied into the buffer
+      WriteChunks(reinterpret_cast<const char*>(data), size);
+    }
+    else if (size > 0)
+    {
+      buffer_.append(reinterpret_cast<const char*>(data), size);
+    }
+
+    size_ += size;
+  }
+
+
+  void PostgreSQLLargeObjectWriter::Finish()
+  {
+    if (!isOpen_)
+    {
+      throw PostgreSQLException("Bad sequence of calls");
+    }
+
+    Flush();
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+    if (lo_close(pg, fd_) < 0)
+    {
+      throw PostgreSQLException("Cannot close a large object");
+    }
+
+    isOpen_ = false;
+  }
+
+
+  std::string PostgreSQLLargeObjectWriter::GetOid() const
+  {
+    return boost::lexical_cast<std::string>(oid_);
+  }
+}
@@ -0,0 +1,73 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLConnection.h"
+
+namespace OrthancPlugins
+{
+  /**
+   * Creates a large object from a content that is received by
+   * successive chunks, so that the whole content never has to be
+   * held in memory. The small chunks are coalesced into a buffer
+   * before being sent to the server. The writer must be used within
+   * a transaction. If Finish() is not called, the destructor removes
+   * the large object.
+   **/
+  class PostgreSQLLargeObjectWriter : public boost::noncopyable
+  {
+  private:
+    PostgreSQLConnection&  connection_;
+    unsigned int           oid_;   // Object of type "Oid"
+    int                    fd_;
+    std::string            buffer_;
+    size_t                 bufferSize_;
+    uint64_t               size_;
+    bool                   isOpen_;
+
+    void WriteChunks(const char* data,
+                     size_t size);
+
+    void Flush();
+
+    void Abort();
+
+  public:
+    explicit PostgreSQLLargeObjectWriter(PostgreSQLConnection& connection,
+                                         size_t bufferSize = 1024 * 1024);
+
+    ~PostgreSQLLargeObjectWriter();
+
+    void Append(const void* data,
+                size_t size);
+
+    // Send the buffered data, and close the large object
+    void Finish();
+
+    std::string GetOid() const;
+
+    // Number of bytes that were appended
+    uint64_t GetSize() const
+    {
+      return size_;
+    }
+  };
+}
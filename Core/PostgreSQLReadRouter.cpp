@@ -0,0 +1,294 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLReadRouter.h"
+
+#include "PostgreSQLException.h"
+#include "PostgreSQLResult.h"
+
+namespace OrthancPlugins
+{
+  void PostgreSQLReadRouter::Statistics::Add(uint64_t microseconds)
+  {
+    count_++;
+    totalMicroseconds_ += microseconds;
+
+    if (microseconds > maxMicroseconds_)
+    {
+      maxMicroseconds_ = microseconds;
+    }
+  }
+
+
+  PostgreSQLReadRouter::Accessor::Accessor(PostgreSQLReadRouter& router,
+                                           PostgreSQLConnection& primary,
+                                           bool useReplica) :
+    router_(router),
+    route_(0),
+    connection_(&primary)
+  {
+    if (useReplica &&
+        !router_.replicas_.empty())
+    {
+      for (size_t i = 0; i < router_.replicas_.size() && route_ == 0; i++)
+      {
+        size_t index;
+        bool needsCheck;
+
+        if (!router_.SelectReplica(index, needsCheck))
+        {
+          break;
+        }
+
+        try
+        {
+          // Do not wait for a busy replica, use the primary instead
+          replica_.reset(new PostgreSQLConnectionPool::Accessor(*router_.replicas_[index]->pool_, 0));
+
+          bool available = true;
+
+          if (needsCheck)
+          {
+            int64_t lag = MeasureLag(replica_->GetConnection());
+            available = (lag <= static_cast<int64_t>(router_.maxLag_));
+            router_.UpdateReplica(index, available, lag);
+          }
+
+          if (available)
+          {
+            route_ = index + 1;
+            connection_ = &replica_->GetConnection();
+          }
+          else
+          {
+            replica_.reset(NULL);
+          }
+        }
+        catch (PostgreSQLException&)
+        {
+          replica_.reset(NULL);
+
+          if (needsCheck)
+          {
+            router_.UpdateReplica(index, false, -1);
+          }
+        }
+      }
+
+      if (route_ == 0)
+      {
+        boost::mutex::scoped_lock lock(router_.mutex_);
+        router_.fallbacks_++;
+      }
+    }
+
+    start_ = boost::posix_time::microsec_clock::universal_time();
+  }
+
+
+  PostgreSQLReadRouter::Accessor::~Accessor()
+  {
+    boost::posix_time::time_duration elapsed = 
+      boost::posix_time::microsec_clock::universal_time() - start_;
+
+    router_.Record(route_, elapsed.total_microseconds() < 0 ? 0 :
+                   static_cast<uint64_t>(elapsed.total_microseconds()));
+  }
+
+
+  PostgreSQLConnectionPool* PostgreSQLReadRouter::Accessor::GetReplicaPool() const
+  {
+    if (route_ == 0)
+    {
+      return NULL;
+    }
+    else
+    {
+      return router_.replicas_[route_ - 1]->pool_;
+    }
+  }
+
+
+  bool PostgreSQLReadRouter::SelectReplica(size_t& index,
+                                           bool& needsCheck)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const boost::system_time now = boost::get_system_time();
+
+    // Round-robin over the replicas that are either known to be
+    // available, or whose lag must be measured again
+    for (size_t i = 0; i < replicas_.size(); i++)
+    {
+      size_t candidate = (next_ + i) % replicas_.size();
+      const Replica& replica = *replicas_[candidate];
+
+      needsCheck = (now >= replica.nextCheck_);
+
+      if (replica.available_ || needsCheck)
+      {
+        if (needsCheck)
+        {
+          // Prevent concurrent threads from measuring the lag of the
+          // same replica
+          replicas_[candidate]->nextCheck_ = now + boost::posix_time::milliseconds(checkInterval_);
+        }
+
+        index = candidate;
+        next_ = (candidate + 1) % replicas_.size();
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  void PostgreSQLReadRouter::UpdateReplica(size_t index,
+                                           bool available,
+                                           int64_t lag)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Replica& replica = *replicas_[index];
+    replica.available_ = available;
+    replica.lag_ = lag;
+    replica.nextCheck_ = boost::get_system_time() + boost::posix_time::milliseconds(checkInterval_);
+  }
+
+
+  void PostgreSQLReadRouter::Record(size_t route,
+                                    uint64_t microseconds)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (route == 0)
+    {
+      primary_.Add(microseconds);
+    }
+    else
+    {
+      replicas_[route - 1]->statistics_.Add(microseconds);
+    }
+  }
+
+
+  PostgreSQLReadRouter::PostgreSQLReadRouter() :
+    next_(0),
+    maxLag_(1000),
+    checkInterval_(1000),
+    fallbacks_(0)
+  {
+  }
+
+
+  PostgreSQLReadRouter::~PostgreSQLReadRouter()
+  {
+    for (size_t i = 0; i < replicas_.size(); i++)
+    {
+      delete replicas_[i]->pool_;
+      delete replicas_[i];
+    }
+  }
+
+
+  void PostgreSQLReadRouter::AddReplica(PostgreSQLConnectionPool* pool)
+  {
+    std::auto_ptr<PostgreSQLConnectionPool> protection(pool);
+
+    if (pool == NULL)
+    {
+      throw PostgreSQLException("NULL pool of connections");
+    }
+
+    std::auto_ptr<Replica> replica(new Replica);
+    replica->pool_ = pool;
+    replica->available_ = false;
+    replica->lag_ = -1;
+    replica->nextCheck_ = boost::get_system_time();   // Measure the lag at the first use
+
+    boost::mutex::scoped_lock lock(mutex_);
+    replicas_.push_back(replica.release());
+    protection.release();
+  }
+
+
+  void PostgreSQLReadRouter::SetMaximumLag(unsigned int milliseconds)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxLag_ = milliseconds;
+  }
+
+
+  void PostgreSQLReadRouter::SetLagCheckInterval(unsigned int milliseconds)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    checkInterval_ = milliseconds;
+  }
+
+
+  PostgreSQLReadRouter::Statistics PostgreSQLReadRouter::GetPrimaryStatistics()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return primary_;
+  }
+
+
+  PostgreSQLReadRouter::Statistics PostgreSQLReadRouter::GetReplicaStatistics(size_t index)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (index >= replicas_.size())
+    {
+      throw PostgreSQLException("Parameter out of range");
+    }
+
+    return replicas_[index]->statistics_;
+  }
+
+
+  uint64_t PostgreSQLReadRouter::GetFallbacksCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return fallbacks_;
+  }
+
+
+  int64_t PostgreSQLReadRouter::MeasureLag(PostgreSQLConnection& connection)
+  {
+    // On an idle primary, "pg_last_xact_replay_timestamp()" grows
+    // forever: The lag is zero if all the received WAL is replayed
+    PostgreSQLStatement s(connection, 
+                          "SELECT CAST(CASE "
+                          "WHEN NOT pg_is_in_recovery() THEN 0 "
+                          "WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+                          "ELSE COALESCE(1000 * EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()), 0) "
+                          "END AS BIGINT)");
+    s.SetReadOnly(true);
+
+    PostgreSQLResult result(s);
+    if (result.IsDone())
+    {
+      throw PostgreSQLException("Cannot measure the replication lag");
+    }
+
+    return result.GetInteger64(0);
+  }
+}
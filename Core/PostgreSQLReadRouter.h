@@ -0,0 +1,177 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLConnectionPool.h"
+
+#include <vector>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/thread_time.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Routes the read-only requests either to the primary connection,
+   * or to one of the hot-standby replicas whose replication lag is
+   * below a threshold. The lag of each replica is measured at most
+   * once per check interval. If no replica is available, the
+   * requests fall back to the primary. The latency of the requests
+   * is recorded for each route.
+   **/
+  class PostgreSQLReadRouter : public boost::noncopyable
+  {
+  public:
+    class Statistics
+    {
+    private:
+      uint64_t  count_;
+      uint64_t  totalMicroseconds_;
+      uint64_t  maxMicroseconds_;
+
+    public:
+      Statistics() : 
+        count_(0),
+        totalMicroseconds_(0),
+        maxMicroseconds_(0)
+      {
+      }
+
+      void Add(uint64_t microseconds);
+
+      uint64_t GetCount() const
+      {
+        return count_;
+      }
+
+      uint64_t GetTotalMicroseconds() const
+      {
+        return totalMicroseconds_;
+      }
+
+      uint64_t GetMaxMicroseconds() const
+      {
+        return maxMicroseconds_;
+      }
+
+      uint64_t GetAverageMicroseconds() const
+      {
+        return (count_ == 0 ? 0 : totalMicroseconds_ / count_);
+      }
+    };
+
+    class Accessor : public boost::noncopyable
+    {
+    private:
+      PostgreSQLReadRouter&  router_;
+      size_t  route_;  // 0 for the primary, "i + 1" for the replica "i"
+      std::auto_ptr<PostgreSQLConnectionPool::Accessor>  replica_;
+      PostgreSQLConnection*  connection_;
+      boost::posix_time::ptime  start_;
+
+    public:
+      // If "useReplica" is false, the primary connection is always used
+      Accessor(PostgreSQLReadRouter& router,
+               PostgreSQLConnection& primary,
+               bool useReplica);
+
+      ~Accessor();
+
+      bool IsReplica() const
+      {
+        return route_ != 0;
+      }
+
+      PostgreSQLConnection& GetConnection() const
+      {
+        return *connection_;
+      }
+
+      // The pool of the replica, or NULL if routed to the primary
+      PostgreSQLConnectionPool* GetReplicaPool() const;
+    };
+
+  private:
+    struct Replica
+    {
+      PostgreSQLConnectionPool*  pool_;
+      bool  available_;
+      int64_t  lag_;   // In milliseconds
+      boost::system_time  nextCheck_;
+      Statistics  statistics_;
+    };
+
+    boost::mutex  mutex_;
+    std::vector<Replica*>  replicas_;
+    size_t  next_;
+    unsigned int  maxLag_;          // In milliseconds
+    unsigned int  checkInterval_;   // In milliseconds
+    Statistics  primary_;
+    uint64_t  fallbacks_;
+
+    bool SelectReplica(size_t& index,
+                       bool& needsCheck);
+
+    void UpdateReplica(size_t index,
+                       bool available,
+                       int64_t lag);
+
+    void Record(size_t route,
+                uint64_t microseconds);
+
+  public:
+    PostgreSQLReadRouter();
+
+    ~PostgreSQLReadRouter();
+
+    void AddReplica(PostgreSQLConnectionPool* pool);  // Takes the ownership
+
+    size_t GetReplicasCount() const
+    {
+      return replicas_.size();
+    }
+
+    void SetMaximumLag(unsigned int milliseconds);
+
+    unsigned int GetMaximumLag() const
+    {
+      return maxLag_;
+    }
+
+    void SetLagCheckInterval(unsigned int milliseconds);
+
+    unsigned int GetLagCheckInterval() const
+    {
+      return checkInterval_;
+    }
+
+    Statistics GetPrimaryStatistics();
+
+    Statistics GetReplicaStatistics(size_t index);
+
+    // Number of requests that could have been served by a replica,
+    // but that were sent to the primary
+    uint64_t GetFallbacksCount();
+
+    // Replication lag of a hot standby, in milliseconds (always 0 on
+    // a primary server). Requires PostgreSQL >= 10.
+    static int64_t MeasureLag(PostgreSQLConnection& connection);
+  };
+}
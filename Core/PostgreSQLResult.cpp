@@ -20,9 +20,11 @@
 
 #include "PostgreSQLResult.h"
 
+#include "BigEndianDecoder.h"
 #include "PostgreSQLException.h"
 
 #include <cassert>
+#include <string.h>
 #include <boost/lexical_cast.hpp>
 
 // PostgreSQL includes
@@ -74,26 +76,185 @@ namespace OrthancPlugins
     }
   }
 
-  PostgreSQLResult::PostgreSQLResult(PostgreSQLStatement& statement) : 
-    position_(0), 
-    connection_(statement.GetConnection())
+  void PostgreSQLResult::Adopt(void* result)
   {
-    result_ = statement.Execute();
-    assert(result_ != NULL);   // An exception would have been thrown otherwise
+    assert(result != NULL);
+    result_ = result;
 
     // This is the first call to "Step()"
-    if (PQresultStatus(reinterpret_cast<PGresult*>(result_)) != PGRES_TUPLES_OK)
+    ExecStatusType status = PQresultStatus(reinterpret_cast<PGresult*>(result_));
+    if (status != PGRES_TUPLES_OK)
     {
+      // The destructor is not called if the constructor throws
+      if (status == PGRES_FATAL_ERROR)
+      {
+        result_ = NULL;
+        connection_.ThrowResultError(result);  // Clears the result
+      }
+
+      Clear();
       throw PostgreSQLException("PostgreSQL: Step() applied to non-SELECT request");
     }
 
     CheckDone();
   }
 
+  void PostgreSQLResult::Drain()
+  {
+    if (running_)
+    {
+      running_ = false;
+
+      PGresult* rest = reinterpret_cast<PGresult*>(connection_.WaitResult(timeout_));
+      if (rest != NULL)
+      {
+        PQclear(rest);
+      }
+    }
+  }
+
+  void PostgreSQLResult::FetchRow()
+  {
+    assert(streaming_ && result_ == NULL);
+
+    if (!running_)
+    {
+      return;
+    }
+
+    PGresult* result;
+
+    try
+    {
+      result = reinterpret_cast<PGresult*>(connection_.WaitNextResult(timeout_));
+    }
+    catch (PostgreSQLException&)
+    {
+      // The connection has read up to the end of the command
+      running_ = false;
+      throw;
+    }
+
+    if (result == NULL)
+    {
+      running_ = false;
+      return;
+    }
+
+    switch (PQresultStatus(result))
+    {
+      case PGRES_SINGLE_TUPLE:
+        result_ = result;
+        position_ = 0;
+        break;
+
+      case PGRES_TUPLES_OK:
+        // This empty result marks the end of the rows
+        PQclear(result);
+        Drain();
+        break;
+
+      case PGRES_FATAL_ERROR:
+        // The end of the command must be read before reporting the
+        // error, which is only known by the result
+        try
+        {
+          Drain();
+        }
+        catch (PostgreSQLException&)
+        {
+          PQclear(result);
+          throw;
+        }
+
+        connection_.ThrowResultError(result);  // Clears the result
+        throw PostgreSQLException();  // Not reached, ThrowResultError() always throws
+
+      default:
+        PQclear(result);
+        Drain();
+        throw PostgreSQLException("PostgreSQL: Step() applied to non-SELECT request");
+    }
+  }
+
+  PostgreSQLResult::PostgreSQLResult(PostgreSQLStatement& statement,
+                                     PostgreSQLResultMode mode) : 
+    result_(NULL),
+    position_(0), 
+    connection_(statement.GetConnection()),
+    streaming_(mode == PostgreSQLResultMode_Streaming),
+    running_(false),
+    timeout_(connection_.GetStatementTimeout(statement.GetTimeoutClass()))
+  {
+    if (streaming_)
+    {
+      // No transparent retry after a reconnection, as some rows might
+      // have been consumed by the caller
+      connection_.EnsureAlive();
+      connection_.FlushPipeline();
+
+      PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+      if (!statement.SendInternal())
+      {
+        throw PostgreSQLException(PQerrorMessage(pg));
+      }
+
+      running_ = true;
+
+      if (PQsetSingleRowMode(pg) != 1)
+      {
+        Drain();
+        throw PostgreSQLException("Cannot enable the single-row mode of PostgreSQL");
+      }
+
+      FetchRow();
+    }
+    else
+    {
+      Adopt(statement.Execute());   // An exception is thrown on NULL results
+    }
+  }
+
+  PostgreSQLResult::PostgreSQLResult(PostgreSQLConnection& connection,
+                                     void* result) : 
+    result_(NULL),
+    position_(0), 
+    connection_(connection),
+    streaming_(false),
+    running_(false),
+    timeout_(0)
+  {
+    Adopt(result);
+  }
+
+  PostgreSQLResult::~PostgreSQLResult()
+  {
+    Clear();
+
+    try
+    {
+      // Skip the rows that were not consumed: They are received one
+      // by one, so the memory stays bounded
+      Drain();
+    }
+    catch (PostgreSQLException&)
+    {
+      // Never throw in a destructor
+    }
+  }
+
   void PostgreSQLResult::Step()
   {
-    position_++;
-    CheckDone();
+    if (streaming_)
+    {
+      Clear();
+      FetchRow();
+    }
+    else
+    {
+      position_++;
+      CheckDone();
+    }
   }
 
   bool PostgreSQLResult::IsNull(unsigned int column) const
@@ -126,7 +287,7 @@ namespace OrthancPlugins
     return htobe64(*reinterpret_cast<int64_t*>(v));
   }
 
-  std::string PostgreSQLResult::GetString(unsigned int column) const
+  void PostgreSQLResult::CheckStringColumn(unsigned int column) const
   {
     CheckColumn(column, 0);
 
@@ -135,13 +296,102 @@ namespace OrthancPlugins
     {
       throw PostgreSQLException("Bad type of parameter");
     }
+  }
+
+  const char* PostgreSQLResult::GetStringView(size_t& size,
+                                              unsigned int column) const
+  {
+    CheckStringColumn(column);
 
-    return std::string(PQgetvalue(reinterpret_cast<PGresult*>(result_), position_, column));
+    // The results are in binary format: The byte arrays may contain
+    // NUL characters, hence the explicit length
+    size = static_cast<size_t>(PQgetlength(reinterpret_cast<PGresult*>(result_), position_, column));
+    return PQgetvalue(reinterpret_cast<PGresult*>(result_), position_, column);
   }
 
+  std::string PostgreSQLResult::GetString(unsigned int column) const
+  {
+    size_t size;
+    const char* value = GetStringView(size, column);
+    return std::string(value, size);
+  }
 
-  void PostgreSQLResult::GetLargeObject(std::string& result,
-                                        unsigned int column) const
+  void PostgreSQLResult::GetString(std::string& target,
+                                   unsigned int column) const
+  {
+    size_t size;
+    const char* value = GetStringView(size, column);
+    target.assign(value, size);
+  }
+
+
+  size_t PostgreSQLResult::CopyColumn(void* target,
+                                      unsigned int column,
+                                      size_t size) const
+  {
+    PGresult* result = reinterpret_cast<PGresult*>(result_);
+    int count = PQntuples(result);
+
+    uint8_t* p = reinterpret_cast<uint8_t*>(target);
+    for (int i = position_; i < count; i++, p += size)
+    {
+      if (PQgetisnull(result, i, column))
+      {
+        throw PostgreSQLException("NULL value in an integer column");
+      }
+
+      // The cells of a PGresult are not contiguous
+      memcpy(p, PQgetvalue(result, i, column), size);
+    }
+
+    return static_cast<size_t>(count - position_);
+  }
+
+
+  void PostgreSQLResult::ReadIntegerColumn(std::vector<int32_t>& target,
+                                           unsigned int column)
+  {
+    target.clear();
+
+    // In the streaming mode, each PGresult contains a single row
+    while (!IsDone())
+    {
+      CheckColumn(column, INT4OID);
+
+      size_t start = target.size();
+      target.resize(start + PQntuples(reinterpret_cast<PGresult*>(result_)) - position_);
+
+      size_t count = CopyColumn(&target[start], column, sizeof(int32_t));
+      DecodeBigEndian32(&target[start], count);
+
+      position_ = PQntuples(reinterpret_cast<PGresult*>(result_)) - 1;
+      Step();
+    }
+  }
+
+
+  void PostgreSQLResult::ReadInteger64Column(std::vector<int64_t>& target,
+                                             unsigned int column)
+  {
+    target.clear();
+
+    while (!IsDone())
+    {
+      CheckColumn(column, INT8OID);
+
+      size_t start = target.size();
+      target.resize(start + PQntuples(reinterpret_cast<PGresult*>(result_)) - position_);
+
+      size_t count = CopyColumn(&target[start], column, sizeof(int64_t));
+      DecodeBigEndian64(&target[start], count);
+
+      position_ = PQntuples(reinterpret_cast<PGresult*>(result_)) - 1;
+      Step();
+    }
+  }
+
+
+  std::string PostgreSQLResult::GetLargeObjectOid(unsigned int column) const
   {
     CheckColumn(column, OIDOID);
 
@@ -151,7 +401,14 @@ namespace OrthancPlugins
     oid = *(const Oid*) PQgetvalue(reinterpret_cast<PGresult*>(result_), position_, column);
     oid = ntohl(oid);
 
-    PostgreSQLLargeObject::Read(result, connection_, boost::lexical_cast<std::string>(oid));
+    return boost::lexical_cast<std::string>(oid);
+  }
+
+
+  void PostgreSQLResult::GetLargeObject(std::string& result,
+                                        unsigned int column) const
+  {
+    PostgreSQLLargeObject::Read(result, connection_, GetLargeObjectOid(column));
   }
 
 
@@ -159,14 +416,80 @@ namespace OrthancPlugins
                                         size_t& size,
                                         unsigned int column) const
   {
-    CheckColumn(column, OIDOID);
+    PostgreSQLLargeObject::Read(result, size, connection_, GetLargeObjectOid(column));
+  }
 
-    Oid oid;
-    assert(PQfsize(reinterpret_cast<PGresult*>(result_), column) == sizeof(oid));
 
-    oid = *(const Oid*) PQgetvalue(reinterpret_cast<PGresult*>(result_), position_, column);
-    oid = ntohl(oid);
+  void PostgreSQLResult::GetLargeObjectRange(std::string& result,
+                                             unsigned int column,
+                                             uint64_t offset,
+                                             size_t length) const
+  {
+    PostgreSQLLargeObject::ReadRange(result, connection_, GetLargeObjectOid(column), offset, length);
+  }
+
+
+  unsigned int PostgreSQLResult::GetColumnsCount() const
+  {
+    return static_cast<unsigned int>(PQnfields(reinterpret_cast<PGresult*>(result_)));
+  }
+
+
+  void PostgreSQLResult::CheckColumnFor(unsigned int column,
+                                        PostgreSQLTypeTag<int32_t>) const
+  {
+    CheckColumn(column, INT4OID);
+  }
+
 
-    PostgreSQLLargeObject::Read(result, size, connection_, boost::lexical_cast<std::string>(oid));
+  void PostgreSQLResult::CheckColumnFor(unsigned int column,
+                                        PostgreSQLTypeTag<int64_t>) const
+  {
+    CheckColumn(column, INT8OID);
+  }
+
+
+  void PostgreSQLResult::CheckColumnFor(unsigned int column,
+                                        PostgreSQLTypeTag<std::string>) const
+  {
+    CheckStringColumn(column);
+  }
+
+
+  void PostgreSQLResult::GetValue(unsigned int column,
+                                  int32_t& target) const
+  {
+    PGresult* result = reinterpret_cast<PGresult*>(result_);
+    if (PQgetisnull(result, position_, column))
+    {
+      throw PostgreSQLException("NULL value in an integer column");
+    }
+
+    int32_t v;
+    memcpy(&v, PQgetvalue(result, position_, column), sizeof(int32_t));
+    target = htobe32(v);
+  }
+
+
+  void PostgreSQLResult::GetValue(unsigned int column,
+                                  int64_t& target) const
+  {
+    PGresult* result = reinterpret_cast<PGresult*>(result_);
+    if (PQgetisnull(result, position_, column))
+    {
+      throw PostgreSQLException("NULL value in an integer column");
+    }
+
+    int64_t v;
+    memcpy(&v, PQgetvalue(result, position_, column), sizeof(int64_t));
+    target = htobe64(v);
+  }
+
+
+  void PostgreSQLResult::GetValue(unsigned int column,
+                                  std::string& target) const
+  {
+    target.assign(PQgetvalue(reinterpret_cast<PGresult*>(result_), position_, column),
+                  PQgetlength(reinterpret_cast<PGresult*>(result_), position_, column));
   }
 }
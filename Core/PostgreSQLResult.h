@@ -24,26 +24,87 @@
 
 namespace OrthancPlugins
 {
+  enum PostgreSQLResultMode
+  {
+    // All the rows are received by the constructor
+    PostgreSQLResultMode_Buffered,
+
+    // The rows are received one by one by Step(), so that the memory
+    // does not depend on the size of the result (single-row mode of
+    // libpq). No other command can be run on the connection until
+    // the result is destroyed, and the destructor reads the rows
+    // that were not consumed.
+    PostgreSQLResultMode_Streaming
+  };
+
+
   class PostgreSQLResult : public boost::noncopyable
   {
   private:
+    friend class PostgreSQLAsyncQuery;
+    friend class PostgreSQLCursor;
+
     void *result_;  /* Object of type "PGresult*" */
     int position_;
     PostgreSQLConnection& connection_;
+    bool streaming_;
+    bool running_;          // Whether the streamed command still sends rows
+    unsigned int timeout_;  // Timeout to receive one streamed row
+
+    // Takes the ownership of a result that was received asynchronously
+    PostgreSQLResult(PostgreSQLConnection& connection,
+                     void* /* PGresult* */ result);
+
+    void Adopt(void* /* PGresult* */ result);
 
     void Clear();
 
     void CheckDone();
 
+    void FetchRow();
+
+    void Drain();
+
     void CheckColumn(unsigned int column, /*Oid*/ unsigned int expectedType) const;
 
+    void CheckStringColumn(unsigned int column) const;
+
+    // Copies the big-endian values of a column for the rows that
+    // remain in the current PGresult, and returns their number
+    size_t CopyColumn(void* target,
+                      unsigned int column,
+                      size_t size) const;
+
+  protected:
+    // Accessors for the columns whose types are known at compile
+    // time: The types are checked once by CheckColumnFor(), then the
+    // values are read by GetValue(), which only rejects the NULL
+    // values of the integer columns (the NULL strings are empty)
+    unsigned int GetColumnsCount() const;
+
+    void CheckColumnFor(unsigned int column,
+                        PostgreSQLTypeTag<int32_t> tag) const;
+
+    void CheckColumnFor(unsigned int column,
+                        PostgreSQLTypeTag<int64_t> tag) const;
+
+    void CheckColumnFor(unsigned int column,
+                        PostgreSQLTypeTag<std::string> tag) const;
+
+    void GetValue(unsigned int column,
+                  int32_t& target) const;
+
+    void GetValue(unsigned int column,
+                  int64_t& target) const;
+
+    void GetValue(unsigned int column,
+                  std::string& target) const;
+
   public:
-    PostgreSQLResult(PostgreSQLStatement& statement);
+    explicit PostgreSQLResult(PostgreSQLStatement& statement,
+                              PostgreSQLResultMode mode = PostgreSQLResultMode_Buffered);
 
-    ~PostgreSQLResult()
-    {
-      Clear();
-    }
+    ~PostgreSQLResult();
 
     void Step();
 
@@ -62,11 +123,41 @@ namespace OrthancPlugins
 
     std::string GetString(unsigned int column) const;
 
+    // Same as GetString(), but the memory of "target" is reused, so
+    // that nothing is allocated in steady state if the same string
+    // receives the values of successive rows
+    void GetString(std::string& target,
+                   unsigned int column) const;
+
+    // Borrowed access to a string or a byte array, without any copy:
+    // The buffer belongs to the result and is followed by a NUL
+    // character. It is only valid until the next call to Step().
+    const char* GetStringView(size_t& size,
+                              unsigned int column) const;
+
+    // Decode one integer column of all the remaining rows, from the
+    // current one, into a contiguous buffer. The result is done
+    // afterwards. The column must not contain NULL values.
+    void ReadIntegerColumn(std::vector<int32_t>& target,
+                           unsigned int column);
+
+    void ReadInteger64Column(std::vector<int64_t>& target,
+                             unsigned int column);
+
+    // OID of a large object, as a decimal string
+    std::string GetLargeObjectOid(unsigned int column) const;
+
     void GetLargeObject(std::string& result,
                         unsigned int column) const;
 
     void GetLargeObject(void*& result,
                         size_t& size,
                         unsigned int column) const;
+
+    // Only reads the bytes in the range [offset, offset + length)
+    void GetLargeObjectRange(std::string& result,
+                             unsigned int column,
+                             uint64_t offset,
+                             size_t length) const;
   };
 }
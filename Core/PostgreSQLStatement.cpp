@@ -21,101 +21,178 @@
 #include "PostgreSQLStatement.h"
 
 #include "PostgreSQLException.h"
-#include "Configuration.h"
 
+#include <algorithm>
 #include <cassert>
+#include <limits>
+#include <string.h>
+#include <boost/algorithm/string/predicate.hpp>
 
 // PostgreSQL includes
 #include <libpq-fe.h>
 #include <c.h>
 #include <catalog/pg_type.h>
 
+// Not defined by the older versions of "pg_type.h"
+#if !defined(INT4ARRAYOID)
+#  define INT4ARRAYOID 1007
+#endif
+
+#if !defined(INT8ARRAYOID)
+#  define INT8ARRAYOID 1016
+#endif
+
+#if !defined(TEXTARRAYOID)
+#  define TEXTARRAYOID 1009
+#endif
+
+#if !defined(BYTEAARRAYOID)
+#  define BYTEAARRAYOID 1001
+#endif
+
 
 namespace OrthancPlugins
 {
   class PostgreSQLStatement::Inputs : public boost::noncopyable
   {
   private:
-    std::vector<char*> values_;
-    std::vector<int> sizes_;
+    // Most of the parameters (integers, UUIDs, DICOM tags...) fit
+    // inside their slot. The larger ones go to a heap buffer that is
+    // kept from one execution to the next, and that only grows: In
+    // steady state, binding a parameter allocates nothing. A
+    // parameter can also reference a buffer of the caller, which
+    // avoids any copy.
+    enum
+    {
+      INLINE_SIZE = 64
+    };
 
-    static char* Allocate(const void* source, int size)
+    struct Slot
     {
-      if (size == 0)
+      char    inline_[INLINE_SIZE];
+      char*   heap_;
+      size_t  capacity_;
+    };
+
+    std::vector<Slot>   slots_;
+    std::vector<char*>  values_;   // NULL for the SQL NULL values
+    std::vector<int>    sizes_;
+    unsigned int        allocations_;
+
+    char* GetBuffer(size_t pos, size_t size)
+    {
+      Slot& slot = slots_[pos];
+
+      if (size <= INLINE_SIZE)
       {
-        return NULL;
+        return slot.inline_;
       }
-      else
-      {
-        char* ptr = reinterpret_cast<char*>(malloc(size));
 
-        if (source != NULL)
+      if (size > slot.capacity_)
+      {
+        size_t capacity = std::max(size, 2 * slot.capacity_);
+        char* buffer = reinterpret_cast<char*>(malloc(capacity));
+        if (buffer == NULL)
         {
-          memcpy(ptr, source, size);
+          throw PostgreSQLException("Not enough memory");
         }
 
-        return ptr;
+        free(slot.heap_);
+        slot.heap_ = buffer;
+        slot.capacity_ = capacity;
+        allocations_++;
       }
+
+      return slot.heap_;
     }
 
-    void Resize(size_t size)
+    void EnlargeForIndex(size_t index)
     {
-      // Shrinking of the vector
-      for (size_t i = size; i < values_.size(); i++)
+      if (index >= slots_.size())
       {
-        if (values_[i] != NULL)
-          free(values_[i]);
+        std::vector<bool> isInline(slots_.size());
+        for (size_t i = 0; i < slots_.size(); i++)
+        {
+          isInline[i] = (values_[i] == slots_[i].inline_);
+        }
+
+        Slot empty;
+        empty.heap_ = NULL;
+        empty.capacity_ = 0;
+
+        slots_.resize(index + 1, empty);
+        values_.resize(index + 1, NULL);
+        sizes_.resize(index + 1, 0);
+
+        // The inline buffers have moved
+        for (size_t i = 0; i < isInline.size(); i++)
+        {
+          if (isInline[i])
+          {
+            values_[i] = slots_[i].inline_;
+          }
+        }
       }
+    }
 
-      values_.resize(size, NULL);
-      sizes_.resize(size, 0);
+  public:
+    Inputs() :
+      allocations_(0)
+    {
     }
 
-    void EnlargeForIndex(size_t index)
+    ~Inputs()
     {
-      if (index >= values_.size())
+      for (size_t i = 0; i < slots_.size(); i++)
       {
-        // The vector is too small
-        Resize(index + 1);
+        free(slots_[i].heap_);
       }
     }
 
-  public:
-    Inputs()
+    // Returns the buffer of "size" bytes that will be sent as the
+    // parameter, for the caller to fill it
+    char* SetBuffer(size_t pos, int size)
     {
+      EnlargeForIndex(pos);
+
+      values_[pos] = GetBuffer(pos, size);
+      sizes_[pos] = size;
+
+      return values_[pos];
     }
 
-    ~Inputs()
+    void SetItem(size_t pos, const void* source, int size)
     {
-      Resize(0);
+      char* buffer = SetBuffer(pos, size);
+      if (size != 0)
+      {
+        memcpy(buffer, source, size);
+      }
     }
 
-    void SetItem(size_t pos, const void* source, int size)
+    // The buffer is not copied, and must outlive the execution
+    void SetReference(size_t pos, const void* source, int size)
     {
       EnlargeForIndex(pos);
 
-      if (sizes_[pos] == size)
+      if (size == 0)
       {
-        if (source && size != 0)
-        {
-          memcpy(values_[pos], source, size);
-        }
+        // Not NULL, which would be the SQL NULL value
+        values_[pos] = slots_[pos].inline_;
       }
       else
       {
-        if (values_[pos] != NULL)
-        {
-          free(values_[pos]);
-        }
-
-        values_[pos] = Allocate(source, size);
-        sizes_[pos] = size;
+        values_[pos] = const_cast<char*>(reinterpret_cast<const char*>(source));
       }
+
+      sizes_[pos] = size;
     }
 
-    void SetItem(size_t pos, int size)
+    void SetNull(size_t pos)
     {
-      SetItem(pos, NULL, size);
+      EnlargeForIndex(pos);
+      values_[pos] = NULL;
+      sizes_[pos] = 0;
     }
 
     void* GetItem(size_t pos) const
@@ -137,15 +214,36 @@ namespace OrthancPlugins
     {
       return sizes_;
     }
+
+    unsigned int GetAllocationsCount() const
+    {
+      return allocations_;
+    }
   };
 
 
+  bool PostgreSQLStatement::IsPrepared() const
+  {
+    return (id_.size() > 0 &&
+            generation_ == connection_.GetGeneration());
+  }
+
+
   void PostgreSQLStatement::Prepare()
   {
     if (id_.size() > 0)
     {
-      // Already prepared
-      return;
+      if (generation_ == connection_.GetGeneration())
+      {
+        // Already prepared
+        return;
+      }
+      else
+      {
+        // The connection was re-opened since the last preparation,
+        // which has dropped the server-side plan
+        id_.clear();
+      }
     }
 
     for (size_t i = 0; i < oids_.size(); i++)
@@ -157,42 +255,20 @@ namespace OrthancPlugins
       }
     }
 
-    id_ = GenerateUuid();
-
-    const unsigned int* tmp = oids_.size() ? &oids_[0] : NULL;
-
-    PGresult* result = PQprepare(reinterpret_cast<PGconn*>(connection_.pg_),
-                                 id_.c_str(), sql_.c_str(), oids_.size(), tmp);
-
-    if (result == NULL)
-    {
-      id_.clear();
-      throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(connection_.pg_)));
-    }
-
-    bool ok = (PQresultStatus(result) == PGRES_COMMAND_OK);
-    if (ok)
-    {
-      PQclear(result);
-    }
-    else
-    {
-      std::string message = PQresultErrorMessage(result);
-      PQclear(result);
-      id_.clear();
-      throw PostgreSQLException(message);
-    }
+    // Reuse the server-side plan of an identical statement, if any
+    id_ = connection_.AcquirePlan(sql_, oids_);
+    generation_ = connection_.GetGeneration();
   }
 
 
   void PostgreSQLStatement::Unprepare()
   {
-    if (id_.size() > 0)
+    if (id_.size() > 0 &&
+        generation_ == connection_.GetGeneration())
     {
-      // "Although there is no libpq function for deleting a
-      // prepared statement, the SQL DEALLOCATE statement can be
-      // used for that purpose."
-      //connection_.Execute("DEALLOCATE " + id_);
+      // The plan is deallocated by the connection once it is evicted
+      // from its registry of prepared statements
+      connection_.ReleasePlan(sql_, oids_);
     }
 
     id_.clear();
@@ -211,7 +287,10 @@ namespace OrthancPlugins
     }
 
     oids_[param] = type;
-    binary_[param] = (type == TEXTOID || type == BYTEAOID || type == OIDOID) ? 0 : 1;
+    // The binary format of the strings and of the byte arrays is made
+    // of their raw bytes, with an explicit length: They need neither a
+    // trailing NUL, nor escape sequences
+    binary_[param] = (type == OIDOID) ? 0 : 1;
   }
 
 
@@ -245,36 +324,71 @@ namespace OrthancPlugins
   }
 
 
-  void* /* PGresult* */ PostgreSQLStatement::Execute()
+  void PostgreSQLStatement::DeclareInputIntegerArray(unsigned int param)
   {
-    Prepare();
+    DeclareInputInternal(param, INT4ARRAYOID);
+  }
 
-    PGresult* result;
 
-    if (oids_.size() == 0)
-    {
-      // No parameter
-      result = PQexecPrepared(reinterpret_cast<PGconn*>(connection_.pg_),
-                              id_.c_str(), 0, NULL, NULL, NULL, 1);
-    }
-    else
-    {
-      // At least 1 parameter
-      result = PQexecPrepared(reinterpret_cast<PGconn*>(connection_.pg_),
-                              id_.c_str(),
-                              oids_.size(),
-                              &inputs_->GetValues()[0],
-                              &inputs_->GetSizes()[0],
-                              &binary_[0],
-                              1);
-    }
+  void PostgreSQLStatement::DeclareInputInteger64Array(unsigned int param)
+  {
+    DeclareInputInternal(param, INT8ARRAYOID);
+  }
+
 
-    if (result == NULL)
+  void PostgreSQLStatement::DeclareInputStringArray(unsigned int param)
+  {
+    DeclareInputInternal(param, TEXTARRAYOID);
+  }
+
+
+  void PostgreSQLStatement::DeclareInputBinaryArray(unsigned int param)
+  {
+    DeclareInputInternal(param, BYTEAARRAYOID);
+  }
+
+
+  void* /* PGresult* */ PostgreSQLStatement::Execute()
+  {
+    for (unsigned int attempt = 0; ; attempt++)
     {
-      throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(connection_.pg_)));
-    }
+      // Nothing is sent if the session was lost, so reconnecting is
+      // safe (outside of a transaction)
+      connection_.EnsureAlive();
+      connection_.FlushPipeline();
+
+      // The deadline of the statement is enforced on the client
+      // side, so that a hanging server cannot block the caller
+      PGresult* result = NULL;
+
+      if (SendInternal())
+      {
+        result = reinterpret_cast<PGresult*>
+          (connection_.WaitResult(connection_.GetStatementTimeout(timeoutClass_)));
+      }
 
-    return result;
+      if (connection_.IsBroken() &&
+          readOnly_ &&
+          attempt == 0 &&
+          !connection_.IsInTransaction())
+      {
+        // The session was lost while running a read-only statement:
+        // It can be executed again on a new session
+        if (result != NULL)
+        {
+          PQclear(result);
+        }
+
+        continue;
+      }
+
+      if (result == NULL)
+      {
+        throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(connection_.pg_)));
+      }
+
+      return result;
+    }
   }
 
 
@@ -282,6 +396,33 @@ namespace OrthancPlugins
                                            const std::string& sql) :
     connection_(connection),
     sql_(sql),
+    generation_(0),
+    inputs_(new Inputs)
+  {
+    // A SELECT can have side effects (e.g. "lo_unlink()" or
+    // "pg_try_advisory_lock()"): The statements are never executed
+    // again after a reconnection, unless the caller explicitly
+    // marks them as read-only
+    readOnly_ = false;
+
+    size_t start = sql.find_first_not_of(" \t\r\n(");
+    bool select = (start != std::string::npos &&
+                   boost::algorithm::istarts_with(sql.substr(start), "SELECT"));
+    timeoutClass_ = (select ? PostgreSQLStatementClass_Read : PostgreSQLStatementClass_Write);
+
+    connection_.Open();
+  }
+
+
+  PostgreSQLStatement::PostgreSQLStatement(PostgreSQLConnection& connection,
+                                           const PostgreSQLStatement& model) :
+    connection_(connection),
+    sql_(model.sql_),
+    generation_(0),
+    readOnly_(model.readOnly_),
+    timeoutClass_(model.timeoutClass_),
+    oids_(model.oids_),
+    binary_(model.binary_),
     inputs_(new Inputs)
   {
     connection_.Open();
@@ -301,10 +442,107 @@ namespace OrthancPlugins
     }
     else
     {
-      std::string error = PQresultErrorMessage(result);
-      PQclear(result);
-      throw PostgreSQLException(error);
+      connection_.ThrowResultError(result);
+    }
+  }
+
+
+  bool PostgreSQLStatement::SendInternal()
+  {
+    Prepare();
+
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+
+    // The parameters are copied by libpq into its output buffer,
+    // so the inputs can be re-bound as soon as this call returns
+    int ok;
+    if (oids_.size() == 0)
+    {
+      ok = PQsendQueryPrepared(pg, id_.c_str(), 0, NULL, NULL, NULL, 1);
     }
+    else
+    {
+      ok = PQsendQueryPrepared(pg, id_.c_str(),
+                               oids_.size(),
+                               &inputs_->GetValues()[0],
+                               &inputs_->GetSizes()[0],
+                               &binary_[0],
+                               1);
+    }
+
+    return (ok == 1);
+  }
+
+
+  bool PostgreSQLStatement::SendUnprepared(const std::string& sql)
+  {
+    PGconn* pg = reinterpret_cast<PGconn*>(connection_.pg_);
+
+    int ok;
+    if (oids_.size() == 0)
+    {
+      ok = PQsendQueryParams(pg, sql.c_str(), 0, NULL, NULL, NULL, NULL, 1);
+    }
+    else
+    {
+      for (size_t i = 0; i < oids_.size(); i++)
+      {
+        if (oids_[i] == 0)
+        {
+          // The type of an input parameter was not set
+          throw PostgreSQLException();
+        }
+      }
+
+      ok = PQsendQueryParams(pg, sql.c_str(),
+                             oids_.size(),
+                             reinterpret_cast<const Oid*>(&oids_[0]),
+                             &inputs_->GetValues()[0],
+                             &inputs_->GetSizes()[0],
+                             &binary_[0],
+                             1);
+    }
+
+    return (ok == 1);
+  }
+
+
+  void PostgreSQLStatement::Send()
+  {
+    connection_.EnsureAlive();
+
+    if (!SendInternal())
+    {
+      throw PostgreSQLException(PQerrorMessage(reinterpret_cast<PGconn*>(connection_.pg_)));
+    }
+  }
+
+
+  void PostgreSQLStatement::Enqueue()
+  {
+#if defined(LIBPQ_HAS_PIPELINING)
+    if (connection_.IsPipelining())
+    {
+      connection_.EnsureAlive();
+      Prepare();
+      connection_.EnterPipeline();
+
+      try
+      {
+        Send();
+      }
+      catch (PostgreSQLException&)
+      {
+        connection_.DiscardPipeline();
+        throw;
+      }
+
+      connection_.RegisterPipelined(sql_);
+      return;
+    }
+#endif
+
+    Run();
   }
 
 
@@ -315,7 +553,7 @@ namespace OrthancPlugins
       throw PostgreSQLException("Parameter out of range");
     }
 
-    inputs_->SetItem(param, 0);
+    inputs_->SetNull(param);
   }
 
 
@@ -355,7 +593,8 @@ namespace OrthancPlugins
   }
 
 
-  void PostgreSQLStatement::BindString(unsigned int param, const std::string& value)
+  void PostgreSQLStatement::CheckStringParameter(unsigned int param,
+                                                 size_t size) const
   {
     if (param >= oids_.size())
     {
@@ -367,19 +606,43 @@ namespace OrthancPlugins
       throw PostgreSQLException("Bad type of parameter");
     }
 
-    if (value.size() == 0)
+    if (size > static_cast<size_t>(std::numeric_limits<int>::max()))
     {
-      inputs_->SetItem(param, "", 1 /* end-of-string character */);
-    }
-    else
-    {
-      inputs_->SetItem(param, value.c_str(), 
-                       value.size() + 1);  // "+1" for end-of-string character
+      throw PostgreSQLException("Parameter too large");
     }
   }
 
 
+  void PostgreSQLStatement::BindString(unsigned int param, const std::string& value)
+  {
+    CheckStringParameter(param, value.size());
+    inputs_->SetItem(param, value.c_str(), static_cast<int>(value.size()));
+  }
+
+
+  void PostgreSQLStatement::BindStringReference(unsigned int param,
+                                                const void* value,
+                                                size_t size)
+  {
+    CheckStringParameter(param, size);
+    inputs_->SetReference(param, value, static_cast<int>(size));
+  }
+
+
+  void PostgreSQLStatement::BindStringReference(unsigned int param,
+                                                const char* value)
+  {
+    BindStringReference(param, value, strlen(value));
+  }
+
+
   void PostgreSQLStatement::BindLargeObject(unsigned int param, const PostgreSQLLargeObject& value)
+  {
+    BindLargeObject(param, value.GetOid());
+  }
+
+
+  void PostgreSQLStatement::BindLargeObject(unsigned int param, const std::string& oid)
   {
     if (param >= oids_.size())
     {
@@ -391,7 +654,204 @@ namespace OrthancPlugins
       throw PostgreSQLException("Bad type of parameter");
     }
 
-    inputs_->SetItem(param, value.GetOid().c_str(), 
-                     value.GetOid().size() + 1);  // "+1" for end-of-string character
+    inputs_->SetItem(param, oid.c_str(), 
+                     oid.size() + 1);  // "+1" for end-of-string character
+  }
+
+
+  unsigned int PostgreSQLStatement::GetInputsAllocationsCount() const
+  {
+    return inputs_->GetAllocationsCount();
+  }
+
+
+  static char* WriteInteger32(char* target,
+                              int32_t value)
+  {
+    int32_t v = htobe32(value);
+    memcpy(target, &v, sizeof(int32_t));
+    return target + sizeof(int32_t);
+  }
+
+
+  char* PostgreSQLStatement::BindArrayInternal(unsigned int param,
+                                               unsigned int /*Oid*/ arrayType,
+                                               unsigned int /*Oid*/ elementType,
+                                               size_t count,
+                                               size_t elementsSize)
+  {
+    if (param >= oids_.size())
+    {
+      throw PostgreSQLException("Parameter out of range");
+    }
+
+    if (oids_[param] != arrayType)
+    {
+      throw PostgreSQLException("Bad type of parameter");
+    }
+
+    // Binary format of a one-dimensional array without NULL values
+    // (cf. "array_recv()" in the source code of PostgreSQL): Number
+    // of dimensions, flag for the NULL values, type of the elements,
+    // then the size and the lower bound of the dimension, then each
+    // element preceded by its length
+    size_t size = 3 * sizeof(int32_t);
+    if (count > 0)
+    {
+      size += 2 * sizeof(int32_t) + count * sizeof(int32_t) + elementsSize;
+    }
+
+    if (count > static_cast<size_t>(std::numeric_limits<int32_t>::max()) ||
+        size > static_cast<size_t>(std::numeric_limits<int>::max()))
+    {
+      throw PostgreSQLException("Parameter too large");
+    }
+
+    char* target = inputs_->SetBuffer(param, static_cast<int>(size));
+    target = WriteInteger32(target, count > 0 ? 1 : 0);
+    target = WriteInteger32(target, 0);
+    target = WriteInteger32(target, static_cast<int32_t>(elementType));
+
+    if (count > 0)
+    {
+      target = WriteInteger32(target, static_cast<int32_t>(count));
+      target = WriteInteger32(target, 1);
+    }
+
+    return target;
+  }
+
+
+  void PostgreSQLStatement::BindIntegerArray(unsigned int param,
+                                             const int32_t* values,
+                                             size_t count)
+  {
+    char* target = BindArrayInternal(param, INT4ARRAYOID, INT4OID, count, count * sizeof(int32_t));
+
+    for (size_t i = 0; i < count; i++)
+    {
+      target = WriteInteger32(target, sizeof(int32_t));
+      target = WriteInteger32(target, values[i]);
+    }
+  }
+
+
+  void PostgreSQLStatement::BindInteger64Array(unsigned int param,
+                                               const int64_t* values,
+                                               size_t count)
+  {
+    char* target = BindArrayInternal(param, INT8ARRAYOID, INT8OID, count, count * sizeof(int64_t));
+
+    for (size_t i = 0; i < count; i++)
+    {
+      target = WriteInteger32(target, sizeof(int64_t));
+
+      int64_t v = htobe64(values[i]);
+      memcpy(target, &v, sizeof(int64_t));
+      target += sizeof(int64_t);
+    }
+  }
+
+
+  void PostgreSQLStatement::BindStringArray(unsigned int param,
+                                            const std::string* values,
+                                            size_t count)
+  {
+    if (param >= oids_.size())
+    {
+      throw PostgreSQLException("Parameter out of range");
+    }
+
+    // The same binding serves the arrays of strings and of byte arrays
+    unsigned int arrayType = TEXTARRAYOID;
+    unsigned int elementType = TEXTOID;
+
+    if (oids_[param] == BYTEAARRAYOID)
+    {
+      arrayType = BYTEAARRAYOID;
+      elementType = BYTEAOID;
+    }
+
+    size_t elementsSize = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+      if (values[i].size() > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+      {
+        throw PostgreSQLException("Parameter too large");
+      }
+
+      elementsSize += values[i].size();
+    }
+
+    char* target = BindArrayInternal(param, arrayType, elementType, count, elementsSize);
+
+    for (size_t i = 0; i < count; i++)
+    {
+      target = WriteInteger32(target, static_cast<int32_t>(values[i].size()));
+
+      if (!values[i].empty())
+      {
+        memcpy(target, values[i].c_str(), values[i].size());
+        target += values[i].size();
+      }
+    }
+  }
+
+
+  void PostgreSQLStatement::DeclareInputFor(unsigned int param,
+                                            PostgreSQLTypeTag<int32_t>)
+  {
+    DeclareInputInteger(param);
+  }
+
+
+  void PostgreSQLStatement::DeclareInputFor(unsigned int param,
+                                            PostgreSQLTypeTag<int64_t>)
+  {
+    DeclareInputInteger64(param);
+  }
+
+
+  void PostgreSQLStatement::DeclareInputFor(unsigned int param,
+                                            PostgreSQLTypeTag<std::string>)
+  {
+    DeclareInputString(param);
+  }
+
+
+  void PostgreSQLStatement::DeclareInputFor(unsigned int param,
+                                            PostgreSQLTypeTag<const char*>)
+  {
+    DeclareInputString(param);
+  }
+
+
+  void PostgreSQLStatement::BindValue(unsigned int param,
+                                      int32_t value)
+  {
+    int32_t v = htobe32(value);
+    inputs_->SetItem(param, &v, sizeof(int32_t));
+  }
+
+
+  void PostgreSQLStatement::BindValue(unsigned int param,
+                                      int64_t value)
+  {
+    int64_t v = htobe64(value);
+    inputs_->SetItem(param, &v, sizeof(int64_t));
+  }
+
+
+  void PostgreSQLStatement::BindValue(unsigned int param,
+                                      const std::string& value)
+  {
+    inputs_->SetItem(param, value.c_str(), static_cast<int>(value.size()));
+  }
+
+
+  void PostgreSQLStatement::BindValue(unsigned int param,
+                                      const char* value)
+  {
+    inputs_->SetReference(param, value, static_cast<int>(strlen(value)));
   }
 }
@@ -29,19 +29,35 @@
 
 namespace OrthancPlugins
 {
+  // Selects the overloads that correspond to a C++ type, at compile
+  // time (cf. PostgreSQLTypedStatement)
+  template <typename T>
+  struct PostgreSQLTypeTag
+  {
+  };
+
+
   class PostgreSQLStatement : public boost::noncopyable
   {
   private:
     class Inputs;
+    friend class PostgreSQLConnection;
     friend class PostgreSQLResult;
+    friend class PostgreSQLAsyncQuery;
+    friend class PostgreSQLCursor;
 
     PostgreSQLConnection& connection_;
     std::string id_;
     std::string sql_;
+    unsigned int generation_;   // Generation of the connection when "id_" was prepared
+    bool readOnly_;
+    PostgreSQLStatementClass timeoutClass_;
     std::vector<unsigned int /*Oid*/>  oids_;
     std::vector<int>  binary_;
     boost::shared_ptr<Inputs> inputs_;
 
+    bool IsPrepared() const;
+
     void Prepare();
 
     void Unprepare();
@@ -49,12 +65,67 @@ namespace OrthancPlugins
     void DeclareInputInternal(unsigned int param,
                               unsigned int /*Oid*/ type);
 
+    void CheckStringParameter(unsigned int param,
+                              size_t size) const;
+
+    // Writes the header of an array parameter, and returns the
+    // location of its first element
+    char* BindArrayInternal(unsigned int param,
+                            unsigned int /*Oid*/ arrayType,
+                            unsigned int /*Oid*/ elementType,
+                            size_t count,
+                            size_t elementsSize);
+
+    // Returns "false" if the statement could not be sent
+    bool SendInternal();
+
+    // Send another command (e.g. the declaration of a cursor over
+    // this statement) with the parameters of this statement, without
+    // preparing it. Returns "false" if it could not be sent.
+    bool SendUnprepared(const std::string& sql);
+
     void* /* PGresult* */ Execute();
 
+    // Send the statement to the server without waiting for its result
+    void Send();
+
+  protected:
+    // Declaration and binding of the parameters whose types are known
+    // at compile time: The types of the parameters are not checked
+    void DeclareInputFor(unsigned int param,
+                         PostgreSQLTypeTag<int32_t> tag);
+
+    void DeclareInputFor(unsigned int param,
+                         PostgreSQLTypeTag<int64_t> tag);
+
+    void DeclareInputFor(unsigned int param,
+                         PostgreSQLTypeTag<std::string> tag);
+
+    void DeclareInputFor(unsigned int param,
+                         PostgreSQLTypeTag<const char*> tag);
+
+    void BindValue(unsigned int param,
+                   int32_t value);
+
+    void BindValue(unsigned int param,
+                   int64_t value);
+
+    void BindValue(unsigned int param,
+                   const std::string& value);
+
+    // The string is not copied (cf. BindStringReference())
+    void BindValue(unsigned int param,
+                   const char* value);
+
   public:
     PostgreSQLStatement(PostgreSQLConnection& connection,
                         const std::string& sql);
 
+    // Create a statement with the same SQL and the same types of
+    // parameters as "model", but on another connection
+    PostgreSQLStatement(PostgreSQLConnection& connection,
+                        const PostgreSQLStatement& model);
+
     ~PostgreSQLStatement()
     {
       Unprepare();
@@ -70,8 +141,52 @@ namespace OrthancPlugins
 
     void DeclareInputLargeObject(unsigned int param);
 
+    // Arrays of values, typically combined with "unnest()" to execute
+    // a statement once for a whole set of rows
+    void DeclareInputIntegerArray(unsigned int param);
+
+    void DeclareInputInteger64Array(unsigned int param);
+
+    void DeclareInputStringArray(unsigned int param);
+
+    void DeclareInputBinaryArray(unsigned int param);
+
+    // Read-only statements are transparently executed again if the
+    // session is lost while they run outside of a transaction. This
+    // is disabled by default, as it is only safe for the statements
+    // without side effects.
+    void SetReadOnly(bool readOnly)
+    {
+      readOnly_ = readOnly;
+    }
+
+    bool IsReadOnly() const
+    {
+      return readOnly_;
+    }
+
+    // Select the timeout of the connection that applies to this
+    // statement. By default, the SELECT statements are in class
+    // "Read", and the other ones in class "Write".
+    void SetTimeoutClass(PostgreSQLStatementClass type)
+    {
+      timeoutClass_ = type;
+    }
+
+    PostgreSQLStatementClass GetTimeoutClass() const
+    {
+      return timeoutClass_;
+    }
+
     void Run();
 
+    // Send the statement without waiting for its completion, if the
+    // pipeline mode is enabled on the connection. The errors are
+    // reported by the next synchronous operation on the connection
+    // (at the latest, at the commit of the transaction). Falls back
+    // to Run() if pipelining is not available.
+    void Enqueue();
+
     void BindNull(unsigned int param);
 
     void BindInteger(unsigned int param, int value);
@@ -80,11 +195,48 @@ namespace OrthancPlugins
 
     void BindString(unsigned int param, const std::string& value);
 
+    // Bind a string or a byte array without copying it: The buffer
+    // must remain valid until the statement has been executed (by
+    // Run(), Enqueue() or PostgreSQLResult), and the parameter must be
+    // bound again before any further execution
+    void BindStringReference(unsigned int param,
+                             const void* value,
+                             size_t size);
+
+    // NUL-terminated version of BindStringReference()
+    void BindStringReference(unsigned int param,
+                             const char* value);
+
     void BindLargeObject(unsigned int param, const PostgreSQLLargeObject& value);
 
+    // The OID of a large object, as a decimal string
+    void BindLargeObject(unsigned int param, const std::string& oid);
+
+    void BindIntegerArray(unsigned int param,
+                          const int32_t* values,
+                          size_t count);
+
+    void BindInteger64Array(unsigned int param,
+                            const int64_t* values,
+                            size_t count);
+
+    // For the arrays of strings and of byte arrays
+    void BindStringArray(unsigned int param,
+                         const std::string* values,
+                         size_t count);
+
     PostgreSQLConnection& GetConnection() const
     {
       return connection_;
     }
+
+    const std::string& GetSql() const
+    {
+      return sql_;
+    }
+
+    // For unit tests only! Number of heap allocations made to store
+    // the bound parameters since the creation of the statement.
+    unsigned int GetInputsAllocationsCount() const;
   };
 }
@@ -0,0 +1,131 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PostgreSQLStatementCatalog.h"
+
+#include "PostgreSQLException.h"
+
+namespace OrthancPlugins
+{
+  PostgreSQLStatementCatalog::PostgreSQLStatementCatalog(PostgreSQLConnection& connection,
+                                                         const PostgreSQLStatementDeclaration* declarations,
+                                                         size_t count) :
+    connection_(connection),
+    generation_(0)
+  {
+    try
+    {
+      statements_.reserve(count);
+
+      for (size_t i = 0; i < count; i++)
+      {
+        if (declarations[i].id_ != i ||
+            declarations[i].sql_ == NULL ||
+            declarations[i].parameters_ == NULL)
+        {
+          throw PostgreSQLException("Badly ordered table of statements");
+        }
+
+        std::auto_ptr<PostgreSQLStatement> statement
+          (new PostgreSQLStatement(connection_, declarations[i].sql_));
+
+        for (unsigned int param = 0; declarations[i].parameters_[param] != '\0'; param++)
+        {
+          switch (declarations[i].parameters_[param])
+          {
+            case 'i':
+              statement->DeclareInputInteger(param);
+              break;
+
+            case 'l':
+              statement->DeclareInputInteger64(param);
+              break;
+
+            case 's':
+              statement->DeclareInputString(param);
+              break;
+
+            case 'b':
+              statement->DeclareInputBinary(param);
+              break;
+
+            case 'o':
+              statement->DeclareInputLargeObject(param);
+              break;
+
+            case 'I':
+              statement->DeclareInputIntegerArray(param);
+              break;
+
+            case 'L':
+              statement->DeclareInputInteger64Array(param);
+              break;
+
+            case 'S':
+              statement->DeclareInputStringArray(param);
+              break;
+
+            case 'B':
+              statement->DeclareInputBinaryArray(param);
+              break;
+
+            default:
+              throw PostgreSQLException("Unknown type of parameter in the table of statements");
+          }
+        }
+
+        if (declarations[i].scan_)
+        {
+          statement->SetTimeoutClass(PostgreSQLStatementClass_Scan);
+        }
+
+        statement->SetReadOnly(declarations[i].readOnly_);
+
+        statements_.push_back(statement.release());
+      }
+    }
+    catch (...)
+    {
+      // The destructor is not called if the constructor throws
+      for (size_t i = 0; i < statements_.size(); i++)
+      {
+        delete statements_[i];
+      }
+
+      throw;
+    }
+  }
+
+
+  PostgreSQLStatementCatalog::~PostgreSQLStatementCatalog()
+  {
+    for (size_t i = 0; i < statements_.size(); i++)
+    {
+      delete statements_[i];
+    }
+  }
+
+
+  void PostgreSQLStatementCatalog::Prepare()
+  {
+    connection_.PrepareStatements(statements_);
+    generation_ = connection_.GetGeneration();
+  }
+}
@@ -0,0 +1,89 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLException.h"
+#include "PostgreSQLStatement.h"
+
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * Declaration of a statement in a static table. The types of the
+   * parameters are given as a string with one character per
+   * parameter: 'i' (INT4), 'l' (INT8), 's' (TEXT), 'b' (BYTEA) or
+   * 'o' (OID of a large object). The upper-case letters 'I', 'L', 'S'
+   * and 'B' stand for the arrays of the corresponding types.
+   **/
+  struct PostgreSQLStatementDeclaration
+  {
+    size_t       id_;          // Must match the index in the table
+    const char*  sql_;
+    const char*  parameters_;
+    bool         scan_;        // Use the timeout of the statements of class "Scan"
+    bool         readOnly_;    // No side effect: Can be executed again after a reconnection
+  };
+
+
+  /**
+   * Set of statements that are created from a static table, and that
+   * are all prepared at once, in a single round trip if the pipeline
+   * mode is available. They are prepared again in one batch if the
+   * session is re-opened.
+   **/
+  class PostgreSQLStatementCatalog : public boost::noncopyable
+  {
+  private:
+    PostgreSQLConnection&  connection_;
+    std::vector<PostgreSQLStatement*>  statements_;
+    unsigned int  generation_;   // Generation of the connection at the last call to Prepare()
+
+  public:
+    PostgreSQLStatementCatalog(PostgreSQLConnection& connection,
+                               const PostgreSQLStatementDeclaration* declarations,
+                               size_t count);
+
+    ~PostgreSQLStatementCatalog();
+
+    void Prepare();
+
+    size_t GetSize() const
+    {
+      return statements_.size();
+    }
+
+    PostgreSQLStatement& operator[] (size_t id)
+    {
+      if (generation_ != connection_.GetGeneration())
+      {
+        Prepare();
+      }
+
+      if (id >= statements_.size())
+      {
+        throw PostgreSQLException("Unknown statement in the catalog");
+      }
+
+      return *statements_[id];
+    }
+  };
+}
@@ -39,7 +39,7 @@ namespace OrthancPlugins
   {
     if (isOpen_)
     {
-      connection_.Execute("ABORT");
+      connection_.AbortTransaction();
     }
   }
 
@@ -50,7 +50,11 @@ namespace OrthancPlugins
       throw PostgreSQLException("PostgreSQL: Beginning a transaction twice!");
     }
 
-    connection_.Execute("BEGIN");
+    // Nothing has happened yet in the transaction: The command can
+    // be sent again if the session was lost
+    connection_.ExecuteInternal("BEGIN", true);
+    connection_.inTransaction_ = true;
+    connection_.localTimeout_ = 0;
     isOpen_ = true;
   }
 
@@ -62,11 +66,11 @@ namespace OrthancPlugins
                                 "Did you remember to call Begin()?");
     }
 
-    connection_.Execute("ABORT");
     isOpen_ = false;
+    connection_.AbortTransaction();
   }
 
-  void PostgreSQLTransaction::Commit() 
+  void PostgreSQLTransaction::Commit(PostgreSQLDurability durability) 
   {
     if (!isOpen_) 
     {
@@ -74,7 +78,27 @@ namespace OrthancPlugins
                                 "Did you remember to call Begin()?");
     }
 
-    connection_.Execute("COMMIT");
+    // The weaker durability only applies to this transaction, and is
+    // sent together with the commit to save one round trip
+    switch (durability)
+    {
+      case PostgreSQLDurability_Full:
+        connection_.Execute("COMMIT");
+        break;
+
+      case PostgreSQLDurability_Local:
+        connection_.Execute("SET LOCAL synchronous_commit TO local; COMMIT");
+        break;
+
+      case PostgreSQLDurability_Relaxed:
+        connection_.Execute("SET LOCAL synchronous_commit TO off; COMMIT");
+        break;
+
+      default:
+        throw PostgreSQLException("Unknown durability");
+    }
+
+    connection_.inTransaction_ = false;
     isOpen_ = false;
   }
 }
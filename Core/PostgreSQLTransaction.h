@@ -24,6 +24,15 @@
 
 namespace OrthancPlugins
 {
+  // The durability of a commit, from the weakest to the strongest
+  // (cf. the "synchronous_commit" setting of PostgreSQL)
+  enum PostgreSQLDurability
+  {
+    PostgreSQLDurability_Relaxed,   // Do not wait for the flush of the WAL ("off")
+    PostgreSQLDurability_Local,     // Do not wait for the synchronous standbys ("local")
+    PostgreSQLDurability_Full       // Setting of the server
+  };
+
   class PostgreSQLTransaction
   {
   private:
@@ -40,6 +49,6 @@ namespace OrthancPlugins
 
     void Rollback();
 
-    void Commit();
+    void Commit(PostgreSQLDurability durability = PostgreSQLDurability_Full);
   };
 }
@@ -0,0 +1,176 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PostgreSQLException.h"
+#include "PostgreSQLResult.h"
+
+#include <boost/tuple/tuple.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Statement whose types of parameters and of columns are given as
+   * Boost tuples, e.g.:
+   *
+   *   PostgreSQLTypedStatement< boost::tuple<int64_t, std::string>,
+   *                             boost::tuple<int32_t, std::string> >
+   *
+   * The supported types are "int32_t" (INT4), "int64_t" (INT8),
+   * "std::string" (TEXT, VARCHAR or BYTEA), and "const char*" for
+   * the parameters that are bound without a copy. The parameters
+   * are declared at compile time, and a type mismatch in the
+   * bindings does not compile. The types of the columns of the rows
+   * are checked at run time, once per result: A mismatch throws a
+   * PostgreSQLException, as does a NULL value in an integer column.
+   **/
+  template <typename Parameters,
+            typename Columns = boost::tuple<> >
+  class PostgreSQLTypedStatement : public PostgreSQLStatement
+  {
+  private:
+    void DeclareInputs(unsigned int,
+                       const boost::tuples::null_type*)
+    {
+    }
+
+    template <typename Head, typename Tail>
+    void DeclareInputs(unsigned int param,
+                       const boost::tuples::cons<Head, Tail>*)
+    {
+      DeclareInputFor(param, PostgreSQLTypeTag<Head>());
+      DeclareInputs(param + 1, static_cast<const Tail*>(NULL));
+    }
+
+    void BindValues(unsigned int,
+                    const boost::tuples::null_type&)
+    {
+    }
+
+    template <typename Head, typename Tail>
+    void BindValues(unsigned int param,
+                    const boost::tuples::cons<Head, Tail>& values)
+    {
+      BindValue(param, values.get_head());
+      BindValues(param + 1, values.get_tail());
+    }
+
+  public:
+    typedef Parameters  ParametersType;
+    typedef Columns     ColumnsType;
+
+    PostgreSQLTypedStatement(PostgreSQLConnection& connection,
+                             const std::string& sql) :
+      PostgreSQLStatement(connection, sql)
+    {
+      DeclareInputs(0, static_cast<const typename Parameters::inherited*>(NULL));
+    }
+
+    // Use "boost::make_tuple()" to bind several values at once
+    void Bind(const Parameters& values)
+    {
+      BindValues(0, values);
+    }
+  };
+
+
+  /**
+   * Result whose types of columns are given as a Boost tuple. The
+   * types are checked once, when the result is received, and the
+   * getters access the values without any further check.
+   **/
+  template <typename Columns>
+  class PostgreSQLTypedResult : public PostgreSQLResult
+  {
+  private:
+    void CheckColumns(unsigned int,
+                      const boost::tuples::null_type*) const
+    {
+    }
+
+    template <typename Head, typename Tail>
+    void CheckColumns(unsigned int column,
+                      const boost::tuples::cons<Head, Tail>*) const
+    {
+      CheckColumnFor(column, PostgreSQLTypeTag<Head>());
+      CheckColumns(column + 1, static_cast<const Tail*>(NULL));
+    }
+
+    void GetValues(unsigned int,
+                   const boost::tuples::null_type&) const
+    {
+    }
+
+    template <typename Head, typename Tail>
+    void GetValues(unsigned int column,
+                   boost::tuples::cons<Head, Tail>& row) const
+    {
+      GetValue(column, row.get_head());
+      GetValues(column + 1, row.get_tail());
+    }
+
+    void Check()
+    {
+      if (!IsDone())
+      {
+        if (GetColumnsCount() != static_cast<unsigned int>(boost::tuples::length<Columns>::value))
+        {
+          throw PostgreSQLException("Bad number of columns in a typed result");
+        }
+
+        CheckColumns(0, static_cast<const typename Columns::inherited*>(NULL));
+      }
+    }
+
+  public:
+    // The statement can be untyped, e.g. taken from a catalog
+    explicit PostgreSQLTypedResult(PostgreSQLStatement& statement,
+                                   PostgreSQLResultMode mode = PostgreSQLResultMode_Buffered) :
+      PostgreSQLResult(statement, mode)
+    {
+      Check();
+    }
+
+    // In the streaming mode, the columns are checked on the first row,
+    // as all the rows of a command share the same description
+    template <typename Parameters>
+    explicit PostgreSQLTypedResult(PostgreSQLTypedStatement<Parameters, Columns>& statement,
+                                   PostgreSQLResultMode mode = PostgreSQLResultMode_Buffered) :
+      PostgreSQLResult(statement, mode)
+    {
+      Check();
+    }
+
+    // The column must not be NULL
+    template <int Column>
+    typename boost::tuples::element<Column, Columns>::type Get() const
+    {
+      typename boost::tuples::element<Column, Columns>::type value;
+      GetValue(Column, value);
+      return value;
+    }
+
+    void GetRow(Columns& row) const
+    {
+      GetValues(0, row);
+    }
+  };
+}
@@ -24,11 +24,50 @@
 #include "../Core/PostgreSQLException.h"
 #include "../Core/Configuration.h"
 
+#include <boost/lexical_cast.hpp>
+
 
 static OrthancPluginContext* context_ = NULL;
 static OrthancPlugins::PostgreSQLWrapper* backend_ = NULL;
 
 
+static void LogRouteStatistics(const char* route,
+                               const OrthancPlugins::PostgreSQLReadRouter::Statistics& statistics)
+{
+  char info[1024];
+  sprintf(info, "Read-only requests of the PostgreSQL index sent to %s: %llu, "
+          "average latency of %.2f ms, maximum latency of %.2f ms", route,
+          static_cast<unsigned long long>(statistics.GetCount()),
+          static_cast<double>(statistics.GetAverageMicroseconds()) / 1000.0,
+          static_cast<double>(statistics.GetMaxMicroseconds()) / 1000.0);
+  OrthancPluginLogInfo(context_, info);
+}
+
+
+static void LogRouterStatistics(OrthancPlugins::PostgreSQLReadRouter& router)
+{
+  if (router.GetReplicasCount() == 0)
+  {
+    return;
+  }
+
+  // Report the latency of each route, so that the routing to the
+  // hot-standby replicas can be checked
+  LogRouteStatistics("the primary", router.GetPrimaryStatistics());
+
+  for (size_t i = 0; i < router.GetReplicasCount(); i++)
+  {
+    std::string route = "the replica " + boost::lexical_cast<std::string>(i);
+    LogRouteStatistics(route.c_str(), router.GetReplicaStatistics(i));
+  }
+
+  char info[1024];
+  sprintf(info, "Read-only requests of the PostgreSQL index that fell back to the primary: %llu",
+          static_cast<unsigned long long>(router.GetFallbacksCount()));
+  OrthancPluginLogInfo(context_, info);
+}
+
+
 extern "C"
 {
   ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext* context)
@@ -74,16 +113,19 @@ extern "C"
 
     try
     {
-      /* Create the connection to PostgreSQL */
+      /* Create the pool of connections to PostgreSQL */
       bool useLock;
-      std::auto_ptr<OrthancPlugins::PostgreSQLConnection> 
-        pg(OrthancPlugins::CreateConnection(useLock, context_, configuration));
+      std::auto_ptr<OrthancPlugins::PostgreSQLConnectionPool> 
+        pool(OrthancPlugins::CreateConnectionPool(useLock, context_, configuration));
 
-      pg->Open();
-      //pg->ClearAll();   // Reset the database
- 
       /* Create the database back-end */
-      backend_ = new OrthancPlugins::PostgreSQLWrapper(pg.release(), useLock, allowUnlock);
+      backend_ = new OrthancPlugins::PostgreSQLWrapper(pool.release(), useLock, allowUnlock);
+
+      /* Connect to the hot-standby replicas, if any */
+      OrthancPlugins::ConfigureReadReplicas(backend_->GetReadRouter(), context_, configuration);
+
+      /* Relax the durability of the commits, if requested */
+      OrthancPlugins::ConfigureDurability(backend_->GetDurabilityPolicy(), configuration);
 
       /* Register the PostgreSQL index into Orthanc */
       OrthancPlugins::DatabaseBackendAdapter::Register(context_, *backend_);
@@ -104,6 +146,8 @@ extern "C"
 
     if (backend_ != NULL)
     {
+      LogRouterStatistics(backend_->GetReadRouter());
+
       delete backend_;
       backend_ = NULL;
     }
@@ -23,82 +23,474 @@
 #include "EmbeddedResources.h"
 
 #include "../Core/Configuration.h"
+#include "../Core/PostgreSQLEventLoop.h"
 #include "../Core/PostgreSQLException.h"
 #include "../Core/PostgreSQLTransaction.h"
+#include "../Core/PostgreSQLTypedStatement.h"
 
 #include <boost/lexical_cast.hpp>
+#include <cassert>
 
 namespace OrthancPlugins
 {
-  PostgreSQLWrapper::PostgreSQLWrapper(PostgreSQLConnection* connection,
+  // The statements of the index, which are all prepared at once
+  // when the connection is opened (cf. PostgreSQLStatementCatalog)
+  enum Statement
+  {
+    Statement_AttachFile,
+    Statement_AttachChild,
+    Statement_CreateResource,
+    Statement_DeleteAttachment,
+    Statement_DeleteMetadata,
+    Statement_DeleteResource,
+    Statement_GetAllPublicIds,
+    Statement_GetChanges,
+    Statement_GetLastChange,
+    Statement_GetChildrenInternalId,
+    Statement_GetChildrenPublicId,
+    Statement_GetExports,
+    Statement_GetLastExport,
+    Statement_GetMainDicomTags1,
+    Statement_GetMainDicomTags2,
+    Statement_GetPublicId,
+    Statement_GetResourceCount,
+    Statement_GetResourceType,
+    Statement_GetTotalCompressedSize,
+    Statement_GetTotalUncompressedSize,
+    Statement_IsProtectedPatient,
+    Statement_ListMetadata,
+    Statement_ListAttachments,
+    Statement_LogChange,
+    Statement_LogExport,
+    Statement_LookupAttachment,
+    Statement_LookupIdentifier1,
+    Statement_LookupIdentifier2,
+    Statement_LookupMetadata,
+    Statement_LookupParent,
+    Statement_LookupResource,
+    Statement_SelectPatientToRecycle,
+    Statement_SelectPatientToRecycleAvoid,
+    Statement_SetMainDicomTags,
+    Statement_SetIdentifierTag,
+    Statement_SetMetadata1,
+    Statement_SetMetadata2,
+    Statement_ProtectPatient1,
+    Statement_ProtectPatient2,
+    Statement_ClearDeletedFiles,
+    Statement_ClearDeletedResources,
+    Statement_ClearRemainingAncestor,
+    Statement_GetDeletedFiles,
+    Statement_GetDeletedResources,
+    Statement_GetRemainingAncestor,
+
+    // The statements below need PostgreSQL >= 9.4 (multi-argument
+    // "unnest()"): They must stay at the end of the table, as they
+    // are left out of the catalog on older servers
+    Statement_SetMainDicomTagsBulk,
+    Statement_SetIdentifierTagsBulk
+  };
+
+
+  static const PostgreSQLStatementDeclaration STATEMENTS[] =
+  {
+    { Statement_AttachFile,
+      "INSERT INTO AttachedFiles VALUES($1, $2, $3, $4, $5, $6, $7, $8)",
+      "lislliss", false, false },
+    { Statement_AttachChild,
+      "UPDATE Resources SET parentId = $1 WHERE internalId = $2",
+      "ll", false, false },
+    { Statement_CreateResource,
+      "INSERT INTO Resources VALUES(DEFAULT, $1, $2, NULL) RETURNING internalId",
+      "is", false, false },
+    { Statement_DeleteAttachment,
+      "DELETE FROM AttachedFiles WHERE id=$1 AND fileType=$2",
+      "li", false, false },
+    { Statement_DeleteMetadata,
+      "DELETE FROM Metadata WHERE id=$1 and type=$2",
+      "li", false, false },
+    { Statement_DeleteResource,
+      "DELETE FROM Resources WHERE internalId=$1",
+      "l", false, false },
+    { Statement_GetAllPublicIds,
+      "SELECT publicId FROM Resources WHERE resourceType=$1",
+      "i", true, true },
+    { Statement_GetChanges,
+      "SELECT c.seq, c.changeType, c.resourceType, c.date, r.publicId "
+      "FROM Changes AS c, Resources AS r "
+      "WHERE c.internalId = r.internalId AND c.seq>$1 ORDER BY c.seq LIMIT $2",
+      "li", false, true },
+    { Statement_GetLastChange,
+      "SELECT c.seq, c.changeType, c.resourceType, c.date, r.publicId "
+      "FROM Changes AS c, Resources AS r "
+      "WHERE c.internalId = r.internalId ORDER BY c.seq DESC LIMIT 1",
+      "", false, true },
+    { Statement_GetChildrenInternalId,
+      "SELECT a.internalId FROM Resources AS a, Resources AS b "
+      "WHERE a.parentId = b.internalId AND b.internalId = $1",
+      "l", false, true },
+    { Statement_GetChildrenPublicId,
+      "SELECT a.publicId FROM Resources AS a, Resources AS b "
+      "WHERE a.parentId = b.internalId AND b.internalId = $1",
+      "l", false, true },
+    { Statement_GetExports,
+      "SELECT * FROM ExportedResources WHERE seq>$1 ORDER BY seq LIMIT $2",
+      "li", false, true },
+    { Statement_GetLastExport,
+      "SELECT * FROM ExportedResources ORDER BY seq DESC LIMIT 1",
+      "", false, true },
+    { Statement_GetMainDicomTags1,
+      "SELECT * FROM MainDicomTags WHERE id=$1",
+      "l", false, true },
+    { Statement_GetMainDicomTags2,
+      "SELECT * FROM DicomIdentifiers WHERE id=$1",
+      "l", false, true },
+    { Statement_GetPublicId,
+      "SELECT publicId FROM Resources WHERE internalId=$1",
+      "l", false, true },
+    { Statement_GetResourceCount,
+      "SELECT CAST(COUNT(*) AS BIGINT) FROM Resources WHERE resourceType=$1",
+      "i", true, true },
+    { Statement_GetResourceType,
+      "SELECT resourceType FROM Resources WHERE internalId=$1",
+      "l", false, true },
+    { Statement_GetTotalCompressedSize,
+      "SELECT CAST(SUM(compressedSize) AS BIGINT) FROM AttachedFiles",
+      "", true, true },
+    { Statement_GetTotalUncompressedSize,
+      "SELECT CAST(SUM(uncompressedSize) AS BIGINT) FROM AttachedFiles",
+      "", true, true },
+    { Statement_IsProtectedPatient,
+      "SELECT * FROM PatientRecyclingOrder WHERE patientId = $1",
+      "l", false, true },
+    { Statement_ListMetadata,
+      "SELECT type FROM Metadata WHERE id=$1",
+      "l", false, true },
+    { Statement_ListAttachments,
+      "SELECT fileType FROM AttachedFiles WHERE id=$1",
+      "l", false, true },
+    { Statement_LogChange,
+      "INSERT INTO Changes VALUES(DEFAULT, $1, $2, $3, $4)",
+      "ilis", false, false },
+    { Statement_LogExport,
+      "INSERT INTO ExportedResources VALUES(DEFAULT, $1, $2, $3, $4, $5, $6, $7, $8)",
+      "isssssss", false, false },
+    { Statement_LookupAttachment,
+      "SELECT uuid, uncompressedSize, compressionType, compressedSize, "
+      "uncompressedHash, compressedHash FROM AttachedFiles WHERE id=$1 AND fileType=$2",
+      "li", false, true },
+    { Statement_LookupIdentifier1,
+      "SELECT id FROM DicomIdentifiers WHERE tagGroup=$1 AND tagElement=$2 and value=$3",
+      "iib", false, true },
+    { Statement_LookupIdentifier2,
+      "SELECT id FROM DicomIdentifiers WHERE value=$1",
+      "b", false, true },
+    { Statement_LookupMetadata,
+      "SELECT value FROM Metadata WHERE id=$1 and type=$2",
+      "li", false, true },
+    { Statement_LookupParent,
+      "SELECT parentId FROM Resources WHERE internalId=$1",
+      "l", false, true },
+    { Statement_LookupResource,
+      "SELECT internalId, resourceType FROM Resources WHERE publicId=$1",
+      "s", false, true },
+    { Statement_SelectPatientToRecycle,
+      "SELECT patientId FROM PatientRecyclingOrder ORDER BY seq ASC LIMIT 1",
+      "", false, true },
+    { Statement_SelectPatientToRecycleAvoid,
+      "SELECT patientId FROM PatientRecyclingOrder WHERE patientId != $1 ORDER BY seq ASC LIMIT 1",
+      "l", false, true },
+    { Statement_SetMainDicomTags,
+      "INSERT INTO MainDicomTags VALUES($1, $2, $3, $4)",
+      "liib", false, false },
+    { Statement_SetIdentifierTag,
+      "INSERT INTO DicomIdentifiers VALUES($1, $2, $3, $4)",
+      "liib", false, false },
+    { Statement_SetMetadata1,
+      "DELETE FROM Metadata WHERE id=$1 AND type=$2",
+      "li", false, false },
+    { Statement_SetMetadata2,
+      "INSERT INTO Metadata VALUES ($1, $2, $3)",
+      "lis", false, false },
+    { Statement_ProtectPatient1,
+      "DELETE FROM PatientRecyclingOrder WHERE patientId=$1",
+      "l", false, false },
+    { Statement_ProtectPatient2,
+      "INSERT INTO PatientRecyclingOrder VALUES(DEFAULT, $1)",
+      "l", false, false },
+    { Statement_ClearDeletedFiles,
+      "DELETE FROM DeletedFiles",
+      "", false, false },
+    { Statement_ClearDeletedResources,
+      "DELETE FROM DeletedResources",
+      "", false, false },
+    { Statement_ClearRemainingAncestor,
+      "DELETE FROM RemainingAncestor",
+      "", false, false },
+    { Statement_GetDeletedFiles,
+      "SELECT * FROM DeletedFiles",
+      "", false, true },
+    { Statement_GetDeletedResources,
+      "SELECT * FROM DeletedResources",
+      "", false, true },
+    { Statement_GetRemainingAncestor,
+      "SELECT * FROM RemainingAncestor",
+      "", false, true },
+    { Statement_SetMainDicomTagsBulk,
+      "INSERT INTO MainDicomTags SELECT * FROM unnest($1, $2, $3, $4)",
+      "LIIB", false, false },
+    { Statement_SetIdentifierTagsBulk,
+      "INSERT INTO DicomIdentifiers SELECT * FROM unnest($1, $2, $3, $4)",
+      "LIIB", false, false }
+  };
+
+  // Returns the version of "statement" that must be used on the given
+  // route: On a replica, the statement is cached in the connection
+  static PostgreSQLStatement& GetRoutedStatement(PostgreSQLConnection& db,
+                                                 PostgreSQLStatement& statement)
+  {
+    if (&db == &statement.GetConnection())
+    {
+      return statement;
+    }
+
+    PostgreSQLStatement* cached = db.LookupCachedStatement(statement.GetSql());
+    if (cached == NULL)
+    {
+      cached = &db.CacheStatement(statement.GetSql(), new PostgreSQLStatement(db, statement));
+    }
+
+    return *cached;
+  }
+
+
+  static PostgreSQLStatement& GetRoutedStatement(PostgreSQLReadRouter::Accessor& route,
+                                                 PostgreSQLStatement& statement)
+  {
+    return GetRoutedStatement(route.GetConnection(), statement);
+  }
+
+
+  PostgreSQLWrapper::PostgreSQLWrapper(PostgreSQLConnectionPool* pool,
                                        bool useLock,
                                        bool allowUnlock) :
-    connection_(connection),
-    globalProperties_(*connection, useLock, GlobalProperty_IndexLock)
+    pool_(pool),
+    primary_(*pool),
+    connection_(primary_.GetConnection()),
+    globalProperties_(connection_, useLock, GlobalProperty_IndexLock),
+    bulkTags_(connection_.GetServerVersion() >= 90400),
+    statements_(connection_, STATEMENTS, bulkTags_ ?
+                sizeof(STATEMENTS) / sizeof(STATEMENTS[0]) :
+                static_cast<size_t>(Statement_SetMainDicomTagsBulk)),
+    commitDurability_(PostgreSQLDurability_Full)
   {
     globalProperties_.Lock(allowUnlock);
 
     Prepare();
 
+    // The schema exists at this point: Prepare all the statements in
+    // one batch, which avoids latency spikes on the first requests
+    statements_.Prepare();
 
-    /**
-     * Below are the PostgreSQL precompiled statements that are used
-     * in more than 1 method of this class.
-     **/
+    if (pool_->GetMaxSize() > 1)
+    {
+      // GetMainDicomTags() runs its second lookup on an idle
+      // connection of the pool: Open this connection and prepare the
+      // statement up front, for the same reason
+      PostgreSQLConnectionPool::Accessor secondary(*pool_);
+      std::vector<PostgreSQLStatement*> statements(1, &GetRoutedStatement
+                                                   (secondary.GetConnection(), statements_[Statement_GetMainDicomTags2]));
+      secondary.GetConnection().PrepareStatements(statements);
+    }
+  }
 
-    getPublicId_.reset
-      (new PostgreSQLStatement
-       (*connection_, "SELECT publicId FROM Resources WHERE internalId=$1"));
-    getPublicId_->DeclareInputInteger64(0);
 
-    clearDeletedFiles_.reset
-      (new PostgreSQLStatement
-       (*connection_, "DELETE FROM DeletedFiles"));
+  void PostgreSQLWrapper::PendingTags::Add(int64_t id,
+                                           uint16_t group,
+                                           uint16_t element,
+                                           const char* value)
+  {
+    ids_.push_back(id);
+    groups_.push_back(group);
+    elements_.push_back(element);
+
+    // The strings are not destroyed by Clear(), so that their memory
+    // is reused by the next transactions
+    if (count_ < values_.size())
+    {
+      values_[count_].assign(value);
+    }
+    else
+    {
+      values_.push_back(value);
+    }
 
-    clearDeletedResources_.reset
-      (new PostgreSQLStatement
-       (*connection_, "DELETE FROM DeletedResources"));
+    count_++;
   }
 
 
-  void PostgreSQLWrapper::SignalDeletedFilesAndResources()
+  void PostgreSQLWrapper::PendingTags::Clear()
+  {
+    ids_.clear();
+    groups_.clear();
+    elements_.clear();
+    count_ = 0;
+  }
+
+
+  void PostgreSQLWrapper::PendingTags::Bind(PostgreSQLStatement& statement,
+                                            size_t index) const
+  {
+    assert(index < count_);
+    statement.BindInteger64(0, ids_[index]);
+    statement.BindInteger(1, groups_[index]);
+    statement.BindInteger(2, elements_[index]);
+    statement.BindStringReference(3, values_[index].c_str());
+  }
+
+
+  void PostgreSQLWrapper::PendingTags::Bind(PostgreSQLStatement& statement) const
+  {
+    assert(count_ > 0);
+    statement.BindInteger64Array(0, &ids_[0], count_);
+    statement.BindIntegerArray(1, &groups_[0], count_);
+    statement.BindIntegerArray(2, &elements_[0], count_);
+    statement.BindStringArray(3, &values_[0], count_);
+  }
+
+
+  PostgreSQLStatement& PostgreSQLWrapper::GetStatement(size_t statement)
   {
-    if (getDeletedFiles_.get() == NULL ||
-        getDeletedResources_.get() == NULL)
+    // The buffered tags are written before any other statement,
+    // which might depend on them
+    FlushPendingTags();
+    return statements_[statement];
+  }
+
+
+  void PostgreSQLWrapper::FlushPendingTags(PendingTags& tags,
+                                           size_t bulkStatement,
+                                           size_t statement)
+  {
+    if (tags.IsEmpty())
     {
-      getDeletedFiles_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM DeletedFiles"));
+      return;
+    }
+
+    if (bulkTags_)
+    {
+      PostgreSQLStatement& s = statements_[bulkStatement];
+      tags.Bind(s);
+      tags.Clear();
+      Enqueue(s);
+    }
+    else
+    {
+      // Before PostgreSQL 9.4, the tags are inserted one by one. The
+      // values are sent by Enqueue(), before Clear() is called.
+      PostgreSQLStatement& s = statements_[statement];
+
+      for (size_t i = 0; i < tags.GetCount(); i++)
+      {
+        tags.Bind(s, i);
+        Enqueue(s);
+      }
+
+      tags.Clear();
+    }
+  }
+
+
+  void PostgreSQLWrapper::FlushPendingTags()
+  {
+    FlushPendingTags(pendingMainDicomTags_, Statement_SetMainDicomTagsBulk, Statement_SetMainDicomTags);
+    FlushPendingTags(pendingIdentifierTags_, Statement_SetIdentifierTagsBulk, Statement_SetIdentifierTag);
+  }
+
+
+  void PostgreSQLWrapper::StartTransaction()
+  {
+    pendingMainDicomTags_.Clear();
+    pendingIdentifierTags_.Clear();
+
+    transaction_.reset(new PostgreSQLTransaction(connection_));
+    commitDurability_ = PostgreSQLDurability_Relaxed;
+  }
+
+
+  void PostgreSQLWrapper::RollbackTransaction()
+  {
+    pendingMainDicomTags_.Clear();
+    pendingIdentifierTags_.Clear();
+
+    transaction_.reset(NULL);
+  }
+
+
+  void PostgreSQLWrapper::CommitTransaction()
+  {
+    FlushPendingTags();
 
-      getDeletedResources_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM DeletedResources"));
+    transaction_->Commit(commitDurability_);
+    transaction_.reset(NULL);
+  }
+
+
+  void PostgreSQLWrapper::Enqueue(PostgreSQLStatement& statement,
+                                  PostgreSQLDurability durability)
+  {
+    RequireDurability(durability);
+
+    if (transaction_.get() != NULL)
+    {
+      // The pending statements are flushed at the latest by the
+      // commit of the transaction
+      statement.Enqueue();
     }
+    else
+    {
+      // Outside of a transaction, the changes must be visible as
+      // soon as the method returns
+      statement.Run();
+    }
+  }
+
+
+  void PostgreSQLWrapper::SignalDeletedFilesAndResources()
+  {
+    // The strings are reused from one row to the next, so that
+    // nothing is allocated per value in steady state
+    std::string uuid, uncompressedHash, compressedHash;
 
     {
-      PostgreSQLResult result(*getDeletedFiles_);
+      PostgreSQLResult result(GetStatement(Statement_GetDeletedFiles), PostgreSQLResultMode_Streaming);
 
       while (!result.IsDone())
       {
-        GetOutput().SignalDeletedAttachment(result.GetString(0).c_str(),
+        result.GetString(uuid, 0);
+        result.GetString(uncompressedHash, 5);
+        result.GetString(compressedHash, 6);
+
+        GetOutput().SignalDeletedAttachment(uuid,
                                             result.GetInteger(1),
                                             result.GetInteger64(3),
-                                            result.GetString(5).c_str(),
+                                            uncompressedHash,
                                             result.GetInteger(4),
                                             result.GetInteger64(2),
-                                            result.GetString(6).c_str());
+                                            compressedHash);
 
         result.Step();
       }
     }
 
     {
-      PostgreSQLResult result(*getDeletedResources_);
+      PostgreSQLResult result(GetStatement(Statement_GetDeletedResources), PostgreSQLResultMode_Streaming);
+      std::string& publicId = uuid;
 
       while (!result.IsDone())
       {
         OrthancPluginResourceType type = static_cast<OrthancPluginResourceType>(result.GetInteger(0));
-        GetOutput().SignalDeletedResource(result.GetString(1), type);
+        result.GetString(publicId, 1);
+        GetOutput().SignalDeletedResource(publicId, type);
 
         result.Step();
       }
@@ -108,17 +500,23 @@ namespace OrthancPlugins
 
   void PostgreSQLWrapper::Prepare()
   {
-    PostgreSQLTransaction t(*connection_);
-
-    if (!connection_->DoesTableExist("Resources"))
+    // The DDL is only run on a fresh database, as reported by the
+    // catalog probe of GlobalProperties::Lock()
+    if (!globalProperties_.HasSchemaElement(SchemaElement_Index))
     {
-      std::string query;
-      EmbeddedResources::GetFileResource(query, EmbeddedResources::POSTGRESQL_PREPARE);
+      PostgreSQLTransaction t(connection_);
 
-      connection_->Execute(query);
+      if (!connection_.DoesTableExist("Resources"))
+      {
+        std::string query;
+        EmbeddedResources::GetFileResource(query, EmbeddedResources::POSTGRESQL_PREPARE);
+
+        connection_.Execute(query);
+      }
+
+      t.Commit();
     }
 
-    
     // Check the version of the database
     std::string version = "unknown";
     if (!LookupGlobalProperty(version, GlobalProperty_DatabaseSchemaVersion))
@@ -142,8 +540,6 @@ namespace OrthancPlugins
       std::string message = "Incompatible version of the Orthanc PostgreSQL database: " + version;
       throw PostgreSQLException(message);
     }
-          
-    t.Commit();
   }
 
 
@@ -156,73 +552,50 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::AddAttachment(int64_t id,
                                         const OrthancPluginAttachment& attachment)
   {
-    if (attachFile_.get() == NULL)
-    {
-      attachFile_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO AttachedFiles VALUES($1, $2, $3, $4, $5, $6, $7, $8)"));
-      attachFile_->DeclareInputInteger64(0);
-      attachFile_->DeclareInputInteger(1);
-      attachFile_->DeclareInputString(2);
-      attachFile_->DeclareInputInteger64(3);
-      attachFile_->DeclareInputInteger64(4);
-      attachFile_->DeclareInputInteger(5);
-      attachFile_->DeclareInputString(6);
-      attachFile_->DeclareInputString(7);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_AttachFile);
 
-    attachFile_->BindInteger64(0, id);
-    attachFile_->BindInteger(1, attachment.contentType);
-    attachFile_->BindString(2, attachment.uuid);
-    attachFile_->BindInteger64(3, attachment.compressedSize);
-    attachFile_->BindInteger64(4, attachment.uncompressedSize);
-    attachFile_->BindInteger(5, attachment.compressionType);
-    attachFile_->BindString(6, attachment.uncompressedHash);
-    attachFile_->BindString(7, attachment.compressedHash);
-    attachFile_->Run();
+    s.BindInteger64(0, id);
+    s.BindInteger(1, attachment.contentType);
+    s.BindStringReference(2, attachment.uuid);
+    s.BindInteger64(3, attachment.compressedSize);
+    s.BindInteger64(4, attachment.uncompressedSize);
+    s.BindInteger(5, attachment.compressionType);
+    s.BindStringReference(6, attachment.uncompressedHash);
+    s.BindStringReference(7, attachment.compressedHash);
+    Enqueue(s, durability_.GetAttachment(attachment.contentType));
   }
 
 
   void PostgreSQLWrapper::AttachChild(int64_t parent,
                                       int64_t child)
   {
-    if (attachChild_.get() == NULL)
-    {
-      attachChild_.reset
-        (new PostgreSQLStatement
-         (*connection_, "UPDATE Resources SET parentId = $1 WHERE internalId = $2"));
-      attachChild_->DeclareInputInteger64(0);
-      attachChild_->DeclareInputInteger64(1);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_AttachChild);
 
-    attachChild_->BindInteger64(0, parent);
-    attachChild_->BindInteger64(1, child);
-    attachChild_->Run();
+    s.BindInteger64(0, parent);
+    s.BindInteger64(1, child);
+    Enqueue(s);
   }
 
 
-  void PostgreSQLWrapper::ClearTable(const std::string& tableName)
+  void PostgreSQLWrapper::ClearTable(const std::string& tableName,
+                                     PostgreSQLDurability durability)
   {
-    connection_->Execute("DELETE FROM " + tableName);    
+    FlushPendingTags();
+    RequireDurability(durability);
+    connection_.Execute("DELETE FROM " + tableName);    
   }
 
 
   int64_t PostgreSQLWrapper::CreateResource(const char* publicId,
                                             OrthancPluginResourceType type)
   {
-    if (createResource_.get() == NULL)
-    {
-      createResource_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO Resources VALUES(DEFAULT, $1, $2, NULL) RETURNING internalId"));
-      createResource_->DeclareInputInteger(0);
-      createResource_->DeclareInputString(1);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_CreateResource);
 
-    createResource_->BindInteger(0, static_cast<int>(type));
-    createResource_->BindString(1, publicId);
-   
-    PostgreSQLResult result(*createResource_);
+    s.BindInteger(0, static_cast<int>(type));
+    s.BindString(1, publicId);
+
+    RequireDurability(PostgreSQLDurability_Full);
+    PostgreSQLResult result(s);
     if (result.IsDone())
     {
       throw PostgreSQLException();
@@ -235,21 +608,14 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::DeleteAttachment(int64_t id,
                                            int32_t attachment)
   {
-    clearDeletedFiles_->Run();
-    clearDeletedResources_->Run();
+    Enqueue(GetStatement(Statement_ClearDeletedFiles), durability_.GetBookkeeping());
+    Enqueue(GetStatement(Statement_ClearDeletedResources), durability_.GetBookkeeping());
 
-    if (deleteAttachment_.get() == NULL)
-    {
-      deleteAttachment_.reset
-        (new PostgreSQLStatement
-         (*connection_, "DELETE FROM AttachedFiles WHERE id=$1 AND fileType=$2"));
-      deleteAttachment_->DeclareInputInteger64(0);
-      deleteAttachment_->DeclareInputInteger(1);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_DeleteAttachment);
 
-    deleteAttachment_->BindInteger64(0, id);
-    deleteAttachment_->BindInteger(1, static_cast<int>(attachment));
-    deleteAttachment_->Run();
+    s.BindInteger64(0, id);
+    s.BindInteger(1, static_cast<int>(attachment));
+    Enqueue(s, durability_.GetAttachment(attachment));
 
     SignalDeletedFilesAndResources();
   }
@@ -258,51 +624,26 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::DeleteMetadata(int64_t id,
                                          int32_t type)
   {
-    if (deleteMetadata_.get() == NULL)
-    {
-      deleteMetadata_.reset
-        (new PostgreSQLStatement
-         (*connection_, "DELETE FROM Metadata WHERE id=$1 and type=$2"));
-      deleteMetadata_->DeclareInputInteger64(0);
-      deleteMetadata_->DeclareInputInteger(1);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_DeleteMetadata);
 
-    deleteMetadata_->BindInteger64(0, id);
-    deleteMetadata_->BindInteger(1, static_cast<int>(type));
-    deleteMetadata_->Run();
+    s.BindInteger64(0, id);
+    s.BindInteger(1, static_cast<int>(type));
+    Enqueue(s);
   }
 
 
   void PostgreSQLWrapper::DeleteResource(int64_t id)
   {
-    if (clearRemainingAncestor_.get() == NULL ||
-        getRemainingAncestor_.get() == NULL)
-    {
-      clearRemainingAncestor_.reset
-        (new PostgreSQLStatement
-         (*connection_, "DELETE FROM RemainingAncestor"));
-
-      getRemainingAncestor_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM RemainingAncestor"));
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_DeleteResource);
 
-    clearDeletedFiles_->Run();
-    clearDeletedResources_->Run();
-    clearRemainingAncestor_->Run();
+    Enqueue(GetStatement(Statement_ClearDeletedFiles), durability_.GetBookkeeping());
+    Enqueue(GetStatement(Statement_ClearDeletedResources), durability_.GetBookkeeping());
+    Enqueue(GetStatement(Statement_ClearRemainingAncestor), durability_.GetBookkeeping());
 
-    if (deleteResource_.get() == NULL)
-    {
-      deleteResource_.reset
-        (new PostgreSQLStatement
-         (*connection_, "DELETE FROM Resources WHERE internalId=$1"));
-      deleteResource_->DeclareInputInteger64(0);
-    }
-
-    deleteResource_->BindInteger64(0, id);
-    deleteResource_->Run();
+    s.BindInteger64(0, id);
+    Enqueue(s);
 
-    PostgreSQLResult result(*getRemainingAncestor_);
+    PostgreSQLResult result(GetStatement(Statement_GetRemainingAncestor));
     if (!result.IsDone())
     {
       GetOutput().SignalRemainingAncestor(result.GetString(1),
@@ -319,19 +660,16 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::GetAllPublicIds(std::list<std::string>& target,
                                           OrthancPluginResourceType resourceType)
   {
-    if (getAllPublicIds_.get() == NULL)
-    {
-      getAllPublicIds_.reset
-        (new PostgreSQLStatement(*connection_, 
-                                 "SELECT publicId FROM Resources WHERE resourceType=$1"));
-      getAllPublicIds_->DeclareInputInteger(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_GetAllPublicIds);
 
-    getAllPublicIds_->BindInteger(0, static_cast<int>(resourceType));
-    PostgreSQLResult result(*getAllPublicIds_);
+    s.BindInteger(0, static_cast<int>(resourceType));
 
     target.clear();
 
+    // The rows are received one at a time, so that only the list of
+    // public IDs grows with the size of the database
+    PostgreSQLResult result(s, PostgreSQLResultMode_Streaming);
+
     while (!result.IsDone())
     {
       target.push_back(result.GetString(0));
@@ -347,13 +685,20 @@ namespace OrthancPlugins
     PostgreSQLResult result(s);
     uint32_t count = 0;
 
+    // The public IDs are joined by the statement, instead of being
+    // looked up row by row
+    std::string publicId, date;
+
     while (count < maxResults && !result.IsDone())
     {
+      result.GetString(date, 3);
+      result.GetString(publicId, 4);
+
       GetOutput().AnswerChange(result.GetInteger64(0),
                                result.GetInteger(1),
-                               static_cast<OrthancPluginResourceType>(result.GetInteger(3)),
-                               GetPublicId(result.GetInteger64(2)),
-                               result.GetString(4));
+                               static_cast<OrthancPluginResourceType>(result.GetInteger(2)),
+                               publicId,
+                               date);
       result.Step();
       count++;
     }
@@ -366,56 +711,41 @@ namespace OrthancPlugins
                                      int64_t since,
                                      uint32_t maxResults)
   {
-    if (getChanges_.get() == NULL)
-    {
-      getChanges_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM Changes WHERE seq>$1 ORDER BY seq LIMIT $2"));
-      getChanges_->DeclareInputInteger64(0);
-      getChanges_->DeclareInputInteger(1);
-    }
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
+    PostgreSQLStatement& s = GetRoutedStatement(route, GetStatement(Statement_GetChanges));
 
-    getChanges_->BindInteger64(0, since);
-    getChanges_->BindInteger(1, maxResults + 1);
-    GetChangesInternal(done, *getChanges_, maxResults);
+    s.BindInteger64(0, since);
+    s.BindInteger(1, maxResults + 1);
+    GetChangesInternal(done, s, maxResults);
   }
 
   void PostgreSQLWrapper::GetLastChange()
   {
-    if (getLastChange_.get() == NULL)
-    {
-      getLastChange_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM Changes ORDER BY seq DESC LIMIT 1"));
-    }
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
 
     bool done;  // Ignored
-    GetChangesInternal(done, *getLastChange_, 1);
+    GetChangesInternal(done, GetRoutedStatement(route, GetStatement(Statement_GetLastChange)), 1);
   }
 
 
-  void PostgreSQLWrapper::GetChildrenInternalId(std::list<int64_t>& target,
-                                                int64_t id)
+  // Decode the internal IDs of a result as one batch
+  static void ReadIdentifiers(std::list<int64_t>& target,
+                              PostgreSQLResult& result)
   {
-    if (getChildrenInternalId_.get() == NULL)
-    {
-      getChildrenInternalId_.reset
-        (new PostgreSQLStatement(*connection_, 
-                                 "SELECT a.internalId FROM Resources AS a, Resources AS b  "
-                                 "WHERE a.parentId = b.internalId AND b.internalId = $1"));
-      getChildrenInternalId_->DeclareInputInteger64(0);
-    }
+    std::vector<int64_t> ids;
+    result.ReadInteger64Column(ids, 0);
+    target.assign(ids.begin(), ids.end());
+  }
 
-    getChildrenInternalId_->BindInteger64(0, id);
-    PostgreSQLResult result(*getChildrenInternalId_);
 
-    target.clear();
+  void PostgreSQLWrapper::GetChildrenInternalId(std::list<int64_t>& target,
+                                                int64_t id)
+  {
+    PostgreSQLStatement& s = GetStatement(Statement_GetChildrenInternalId);
 
-    while (!result.IsDone())
-    {
-      target.push_back(result.GetInteger64(0));
-      result.Step();
-    }
+    s.BindInteger64(0, id);
+    PostgreSQLTypedResult< boost::tuple<int64_t> > result(s);
+    ReadIdentifiers(target, result);
   }
 
 
@@ -423,23 +753,17 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::GetChildrenPublicId(std::list<std::string>& target,
                                               int64_t id)
   {
-    if (getChildrenPublicId_.get() == NULL)
-    {
-      getChildrenPublicId_.reset
-        (new PostgreSQLStatement(*connection_, 
-                                 "SELECT a.publicId FROM Resources AS a, Resources AS b  "
-                                 "WHERE a.parentId = b.internalId AND b.internalId = $1"));
-      getChildrenPublicId_->DeclareInputInteger64(0);
-    }
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
+    PostgreSQLStatement& s = GetRoutedStatement(route, GetStatement(Statement_GetChildrenPublicId));
 
-    getChildrenPublicId_->BindInteger64(0, id);
-    PostgreSQLResult result(*getChildrenPublicId_);
+    s.BindInteger64(0, id);
+    PostgreSQLTypedResult< boost::tuple<std::string> > result(s);
 
     target.clear();
 
     while (!result.IsDone())
     {
-      target.push_back(result.GetString(0));
+      target.push_back(result.Get<0>());
       result.Step();
     }
   }
@@ -452,21 +776,28 @@ namespace OrthancPlugins
     PostgreSQLResult result(s);
     uint32_t count = 0;
 
+    // Columns 2 to 8, reused from one row to the next
+    std::string values[7];
+
     while (count < maxResults && !result.IsDone())
     {
       int64_t seq = result.GetInteger64(0);
       OrthancPluginResourceType resourceType = static_cast<OrthancPluginResourceType>(result.GetInteger(1));
-      std::string publicId = result.GetString(2);
+
+      for (unsigned int i = 0; i < 7; i++)
+      {
+        result.GetString(values[i], i + 2);
+      }
 
       GetOutput().AnswerExportedResource(seq, 
                                          resourceType,
-                                         publicId,
-                                         result.GetString(3),  // modality
-                                         result.GetString(8),  // date
-                                         result.GetString(4),  // patient ID
-                                         result.GetString(5),  // study instance UID
-                                         result.GetString(6),  // series instance UID
-                                         result.GetString(7)); // sop instance UID
+                                         values[0],   // public ID
+                                         values[1],   // modality
+                                         values[6],   // date
+                                         values[2],   // patient ID
+                                         values[3],   // study instance UID
+                                         values[4],   // series instance UID
+                                         values[5]);  // sop instance UID
 
       result.Step();
       count++;
@@ -479,106 +810,121 @@ namespace OrthancPlugins
                                                int64_t since,
                                                uint32_t maxResults)
   {
-    if (getExports_.get() == NULL)
-    {
-      getExports_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM ExportedResources WHERE seq>$1 ORDER BY seq LIMIT $2"));
-      getExports_->DeclareInputInteger64(0);
-      getExports_->DeclareInputInteger(1);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_GetExports);
 
-    getExports_->BindInteger64(0, since);
-    getExports_->BindInteger(1, maxResults + 1);
-    GetExportedResourcesInternal(done, *getExports_, maxResults);
+    s.BindInteger64(0, since);
+    s.BindInteger(1, maxResults + 1);
+    GetExportedResourcesInternal(done, s, maxResults);
   }
 
   void PostgreSQLWrapper::GetLastExportedResource()
   {
-    if (getLastExport_.get() == NULL)
+    bool done;  // Ignored
+    GetExportedResourcesInternal(done, GetStatement(Statement_GetLastExport), 1);
+  }
+
+
+  static void AnswerDicomTags(DatabaseBackendOutput& output,
+                              PostgreSQLResult& result)
+  {
+    std::string value;  // Reused from one tag to the next
+
+    while (!result.IsDone())
     {
-      getLastExport_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM ExportedResources ORDER BY seq DESC LIMIT 1"));
+      result.GetString(value, 3);
+      output.AnswerDicomTag(static_cast<uint16_t>(result.GetInteger(1)),
+                            static_cast<uint16_t>(result.GetInteger(2)),
+                            value);
+      result.Step();
     }
-
-    bool done;  // Ignored
-    GetExportedResourcesInternal(done, *getLastExport_, 1);
   }
 
 
   void PostgreSQLWrapper::GetMainDicomTags(int64_t id)
   {
-    if (getMainDicomTags1_.get() == NULL ||
-        getMainDicomTags2_.get() == NULL)
-    {
-      getMainDicomTags1_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM MainDicomTags WHERE id=$1"));
-      getMainDicomTags1_->DeclareInputInteger64(0);
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
+    PostgreSQLStatement& tags = GetRoutedStatement(route, GetStatement(Statement_GetMainDicomTags1));
+    PostgreSQLStatement& identifiers = GetRoutedStatement(route, GetStatement(Statement_GetMainDicomTags2));
+
+    tags.BindInteger64(0, id);
+
+    std::auto_ptr<PostgreSQLConnectionPool::Accessor> secondary;
 
-      getMainDicomTags2_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM DicomIdentifiers WHERE id=$1"));
-      getMainDicomTags2_->DeclareInputInteger64(0);
+    if (transaction_.get() == NULL)
+    {
+      // Outside of a transaction, the two lookups are independent:
+      // Overlap their latencies by running the second one on another
+      // connection of the same server. Neither wait for a busy pool,
+      // nor open a new connection: This would cost more than it saves.
+      PostgreSQLConnectionPool& pool = (route.IsReplica() ? *route.GetReplicaPool() : *pool_);
+      secondary.reset(pool.TryAcquireIdle());
     }
 
+    if (secondary.get() != NULL)
     {
-      getMainDicomTags1_->BindInteger64(0, id);
-      PostgreSQLResult result(*getMainDicomTags1_);
+      PostgreSQLStatement& other = GetRoutedStatement(secondary->GetConnection(), identifiers);
+      other.BindInteger64(0, id);
+
+      PostgreSQLAsyncQuery query1(tags);
+      PostgreSQLAsyncQuery query2(other);
 
-      while (!result.IsDone())
       {
-        GetOutput().AnswerDicomTag(static_cast<uint16_t>(result.GetInteger(1)),
-                                   static_cast<uint16_t>(result.GetInteger(2)),
-                                   result.GetString(3));
-        result.Step();
+        // The loop is destroyed before the queries, which waits for
+        // the queries that are still running if an exception occurs
+        PostgreSQLEventLoop loop;
+        loop.Submit(query1);
+        loop.Submit(query2);
+        loop.WaitAll();
       }
-    }
 
+      AnswerDicomTags(GetOutput(), query1.GetResult());
+      AnswerDicomTags(GetOutput(), query2.GetResult());
+    }
+    else
     {
-      getMainDicomTags2_->BindInteger64(0, id);
-      PostgreSQLResult result(*getMainDicomTags2_);
+      {
+        PostgreSQLResult result(tags);
+        AnswerDicomTags(GetOutput(), result);
+      }
 
-      while (!result.IsDone())
       {
-        GetOutput().AnswerDicomTag(static_cast<uint16_t>(result.GetInteger(1)),
-                                   static_cast<uint16_t>(result.GetInteger(2)),
-                                   result.GetString(3));
-        result.Step();
+        identifiers.BindInteger64(0, id);
+        PostgreSQLResult result(identifiers);
+        AnswerDicomTags(GetOutput(), result);
       }
     }
   }
 
 
-  std::string PostgreSQLWrapper::GetPublicId(int64_t resourceId)
+  std::string PostgreSQLWrapper::GetPublicIdInternal(PostgreSQLStatement& s,
+                                                    int64_t resourceId)
   {
-    getPublicId_->BindInteger64(0, resourceId);
+    s.BindInteger64(0, resourceId);
     
-    PostgreSQLResult result(*getPublicId_);
+    PostgreSQLTypedResult< boost::tuple<std::string> > result(s);
     if (result.IsDone())
     { 
       throw PostgreSQLException("Unknown resource");
     }
 
-    return result.GetString(0);
+    return result.Get<0>();
+  }
+
+
+  std::string PostgreSQLWrapper::GetPublicId(int64_t resourceId)
+  {
+    return GetPublicIdInternal(GetStatement(Statement_GetPublicId), resourceId);
   }
 
 
 
   uint64_t PostgreSQLWrapper::GetResourceCount(OrthancPluginResourceType resourceType)
   {
-    if (getResourceCount_.get() == NULL)
-    {
-      getResourceCount_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT CAST(COUNT(*) AS BIGINT) FROM Resources WHERE resourceType=$1"));
-      getResourceCount_->DeclareInputInteger(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_GetResourceCount);
 
-    getResourceCount_->BindInteger(0, static_cast<int>(resourceType));
+    s.BindInteger(0, static_cast<int>(resourceType));
 
-    PostgreSQLResult result(*getResourceCount_);
+    PostgreSQLResult result(s);
     if (result.IsDone())
     {
       throw PostgreSQLException();
@@ -598,36 +944,23 @@ namespace OrthancPlugins
 
   OrthancPluginResourceType PostgreSQLWrapper::GetResourceType(int64_t resourceId)
   {
-    if (getResourceType_.get() == NULL)
-    {
-      getResourceType_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT resourceType FROM Resources WHERE internalId=$1"));
-      getResourceType_->DeclareInputInteger64(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_GetResourceType);
 
-    getResourceType_->BindInteger64(0, resourceId);
+    s.BindInteger64(0, resourceId);
     
-    PostgreSQLResult result(*getResourceType_);
+    PostgreSQLTypedResult< boost::tuple<int32_t> > result(s);
     if (result.IsDone())
     { 
       throw PostgreSQLException("Unknown resource");
     }
 
-    return static_cast<OrthancPluginResourceType>(result.GetInteger(0));
+    return static_cast<OrthancPluginResourceType>(result.Get<0>());
   }
 
 
   uint64_t PostgreSQLWrapper::GetTotalCompressedSize()
   {
-    if (getTotalCompressedSize_.get() == NULL)
-    {
-      getTotalCompressedSize_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT CAST(SUM(compressedSize) AS BIGINT) FROM AttachedFiles"));
-    }
-
-    PostgreSQLResult result(*getTotalCompressedSize_);
+    PostgreSQLResult result(GetStatement(Statement_GetTotalCompressedSize));
     if (result.IsDone())
     {
       throw PostgreSQLException();
@@ -646,14 +979,7 @@ namespace OrthancPlugins
 
   uint64_t PostgreSQLWrapper::GetTotalUncompressedSize()
   {
-    if (getTotalUncompressedSize_.get() == NULL)
-    {
-      getTotalUncompressedSize_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT CAST(SUM(uncompressedSize) AS BIGINT) FROM AttachedFiles"));
-    }
-
-    PostgreSQLResult result(*getTotalUncompressedSize_);
+    PostgreSQLResult result(GetStatement(Statement_GetTotalUncompressedSize));
     if (result.IsDone())
     {
       throw PostgreSQLException();
@@ -672,24 +998,20 @@ namespace OrthancPlugins
 
   bool PostgreSQLWrapper::IsExistingResource(int64_t internalId)
   {
-    getPublicId_->BindInteger64(0, internalId);
-    PostgreSQLResult result(*getPublicId_);
+    PostgreSQLStatement& s = GetStatement(Statement_GetPublicId);
+
+    s.BindInteger64(0, internalId);
+    PostgreSQLResult result(s);
     return !result.IsDone();
   }
 
 
   bool PostgreSQLWrapper::IsProtectedPatient(int64_t internalId)
   {
-    if (isProtectedPatient_.get() == NULL)
-    {
-      isProtectedPatient_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT * FROM PatientRecyclingOrder WHERE patientId = $1"));
-      isProtectedPatient_->DeclareInputInteger64(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_IsProtectedPatient);
 
-    isProtectedPatient_->BindInteger64(0, internalId);
-    PostgreSQLResult result(*isProtectedPatient_);
+    s.BindInteger64(0, internalId);
+    PostgreSQLResult result(s);
     return result.IsDone();
   }
 
@@ -697,16 +1019,10 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::ListAvailableMetadata(std::list<int32_t>& target,
                                                 int64_t id)
   {
-    if (listMetadata_.get() == NULL)
-    {
-      listMetadata_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT type FROM Metadata WHERE id=$1"));
-      listMetadata_->DeclareInputInteger64(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_ListMetadata);
 
-    listMetadata_->BindInteger64(0, id);
-    PostgreSQLResult result(*listMetadata_);
+    s.BindInteger64(0, id);
+    PostgreSQLResult result(s);
 
     target.clear();
 
@@ -721,16 +1037,10 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::ListAvailableAttachments(std::list<int32_t>& target,
                                                    int64_t id)
   {
-    if (listAttachments_.get() == NULL)
-    {
-      listAttachments_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT fileType FROM AttachedFiles WHERE id=$1"));
-      listAttachments_->DeclareInputInteger64(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_ListAttachments);
 
-    listAttachments_->BindInteger64(0, id);
-    PostgreSQLResult result(*listAttachments_);
+    s.BindInteger64(0, id);
+    PostgreSQLResult result(s);
 
     target.clear();
 
@@ -744,16 +1054,7 @@ namespace OrthancPlugins
 
   void PostgreSQLWrapper::LogChange(const OrthancPluginChange& change)
   {
-    if (logChange_.get() == NULL)
-    {
-      logChange_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO Changes VALUES(DEFAULT, $1, $2, $3, $4)"));
-      logChange_->DeclareInputInteger(0);
-      logChange_->DeclareInputInteger64(1);
-      logChange_->DeclareInputInteger(2);
-      logChange_->DeclareInputString(3);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_LogChange);
 
     int64_t id;
     OrthancPluginResourceType type;
@@ -763,11 +1064,11 @@ namespace OrthancPlugins
       throw PostgreSQLException();
     }
 
-    logChange_->BindInteger(0, change.changeType);
-    logChange_->BindInteger64(1, id);
-    logChange_->BindInteger(2, change.resourceType);
-    logChange_->BindString(3, change.date);
-    logChange_->Run();      
+    s.BindInteger(0, change.changeType);
+    s.BindInteger64(1, id);
+    s.BindInteger(2, change.resourceType);
+    s.BindString(3, change.date);
+    Enqueue(s, durability_.GetHistory());
   }
 
 
@@ -775,30 +1076,17 @@ namespace OrthancPlugins
 
   void PostgreSQLWrapper::LogExportedResource(const OrthancPluginExportedResource& resource)
   {
-    if (logExport_.get() == NULL)
-    {
-      logExport_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO ExportedResources VALUES(DEFAULT, $1, $2, $3, $4, $5, $6, $7, $8)"));
-      logExport_->DeclareInputInteger(0);
-      logExport_->DeclareInputString(1);
-      logExport_->DeclareInputString(2);
-      logExport_->DeclareInputString(3);
-      logExport_->DeclareInputString(4);
-      logExport_->DeclareInputString(5);
-      logExport_->DeclareInputString(6);
-      logExport_->DeclareInputString(7);
-    }
-
-    logExport_->BindInteger(0, resource.resourceType);
-    logExport_->BindString(1, resource.publicId);
-    logExport_->BindString(2, resource.modality);
-    logExport_->BindString(3, resource.patientId);
-    logExport_->BindString(4, resource.studyInstanceUid);
-    logExport_->BindString(5, resource.seriesInstanceUid);
-    logExport_->BindString(6, resource.sopInstanceUid);
-    logExport_->BindString(7, resource.date);
-    logExport_->Run();      
+    PostgreSQLStatement& s = GetStatement(Statement_LogExport);
+
+    s.BindInteger(0, resource.resourceType);
+    s.BindString(1, resource.publicId);
+    s.BindString(2, resource.modality);
+    s.BindString(3, resource.patientId);
+    s.BindString(4, resource.studyInstanceUid);
+    s.BindString(5, resource.seriesInstanceUid);
+    s.BindString(6, resource.sopInstanceUid);
+    s.BindString(7, resource.date);
+    Enqueue(s, durability_.GetHistory());
   }
 
 
@@ -807,29 +1095,26 @@ namespace OrthancPlugins
   bool PostgreSQLWrapper::LookupAttachment(int64_t id,
                                            int32_t contentType)
   {
-    if (lookupAttachment_.get() == NULL)
-    {
-      lookupAttachment_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT uuid, uncompressedSize, compressionType, compressedSize, "
-          "uncompressedHash, compressedHash FROM AttachedFiles WHERE id=$1 AND fileType=$2"));
-      lookupAttachment_->DeclareInputInteger64(0);
-      lookupAttachment_->DeclareInputInteger(1);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_LookupAttachment);
+
+    s.BindInteger64(0, id);
+    s.BindInteger(1, static_cast<int>(contentType));
 
-    lookupAttachment_->BindInteger64(0, id);
-    lookupAttachment_->BindInteger(1, static_cast<int>(contentType));
+    typedef boost::tuple<std::string, int64_t, int32_t, int64_t, std::string, std::string>  Attachment;
 
-    PostgreSQLResult result(*lookupAttachment_);
+    PostgreSQLTypedResult<Attachment> result(s);
     if (!result.IsDone())
     {
-      GetOutput().AnswerAttachment(result.GetString(0),
+      Attachment a;
+      result.GetRow(a);
+
+      GetOutput().AnswerAttachment(a.get<0>(),        // uuid
                                    contentType,
-                                   result.GetInteger64(1),
-                                   result.GetString(4),
-                                   result.GetInteger(2),
-                                   result.GetInteger64(3),
-                                   result.GetString(5));
+                                   a.get<1>(),        // uncompressed size
+                                   a.get<4>(),        // uncompressed hash
+                                   a.get<2>(),        // compression type
+                                   a.get<3>(),        // compressed size
+                                   a.get<5>());       // compressed hash
       return true;
     }
     else
@@ -844,52 +1129,27 @@ namespace OrthancPlugins
                                            uint16_t element,
                                            const char* value)
   {
-    if (lookupIdentifier1_.get() == NULL)
-    {
-      lookupIdentifier1_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT id FROM DicomIdentifiers WHERE tagGroup=$1 AND tagElement=$2 and value=$3"));
-      lookupIdentifier1_->DeclareInputInteger(0);
-      lookupIdentifier1_->DeclareInputInteger(1);
-      lookupIdentifier1_->DeclareInputBinary(2);
-    }
-
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
+    PostgreSQLStatement& s = GetRoutedStatement(route, GetStatement(Statement_LookupIdentifier1));
 
-    lookupIdentifier1_->BindInteger(0, group);
-    lookupIdentifier1_->BindInteger(1, element);
-    lookupIdentifier1_->BindString(2, value);
+    s.BindInteger(0, group);
+    s.BindInteger(1, element);
+    s.BindString(2, value);
 
-    PostgreSQLResult result(*lookupIdentifier1_);
-    target.clear();
-
-    while (!result.IsDone())
-    {
-      target.push_back(result.GetInteger64(0));
-      result.Step();
-    }
+    PostgreSQLTypedResult< boost::tuple<int64_t> > result(s);
+    ReadIdentifiers(target, result);
   }
 
   void PostgreSQLWrapper::LookupIdentifier(std::list<int64_t>& target,
                                            const char* value)
   {
-    if (lookupIdentifier2_.get() == NULL)
-    {
-      lookupIdentifier2_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT id FROM DicomIdentifiers WHERE value=$1"));
-      lookupIdentifier2_->DeclareInputBinary(0);
-    }
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
+    PostgreSQLStatement& s = GetRoutedStatement(route, GetStatement(Statement_LookupIdentifier2));
 
-    lookupIdentifier2_->BindString(0, value);
+    s.BindString(0, value);
 
-    PostgreSQLResult result(*lookupIdentifier2_);
-    target.clear();
-
-    while (!result.IsDone())
-    {
-      target.push_back(result.GetInteger64(0));
-      result.Step();
-    }
+    PostgreSQLTypedResult< boost::tuple<int64_t> > result(s);
+    ReadIdentifiers(target, result);
   }
 
 
@@ -897,26 +1157,20 @@ namespace OrthancPlugins
                                          int64_t id,
                                          int32_t type)
   {
-    if (lookupMetadata_.get() == NULL)
-    {
-      lookupMetadata_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT value FROM Metadata WHERE id=$1 and type=$2"));
-      lookupMetadata_->DeclareInputInteger64(0);
-      lookupMetadata_->DeclareInputInteger(1);
-    }
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
+    PostgreSQLStatement& s = GetRoutedStatement(route, GetStatement(Statement_LookupMetadata));
 
-    lookupMetadata_->BindInteger64(0, id);
-    lookupMetadata_->BindInteger(1, static_cast<int>(type));
+    s.BindInteger64(0, id);
+    s.BindInteger(1, static_cast<int>(type));
 
-    PostgreSQLResult result(*lookupMetadata_);
+    PostgreSQLTypedResult< boost::tuple<std::string> > result(s);
     if (result.IsDone())
     {
       return false;
     }
     else
     {
-      target = result.GetString(0);
+      target = result.Get<0>();
       return true;
     }
   }
@@ -925,17 +1179,11 @@ namespace OrthancPlugins
   bool PostgreSQLWrapper::LookupParent(int64_t& parentId,
                                        int64_t resourceId)
   {
-    if (lookupParent_.get() == NULL)
-    {
-      lookupParent_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT parentId FROM Resources WHERE internalId=$1"));
-      lookupParent_->DeclareInputInteger64(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_LookupParent);
 
-    lookupParent_->BindInteger64(0, resourceId);
+    s.BindInteger64(0, resourceId);
 
-    PostgreSQLResult result(*lookupParent_);
+    PostgreSQLResult result(s);
     if (result.IsDone())
     {
       throw PostgreSQLException("Unknown resource");
@@ -957,25 +1205,20 @@ namespace OrthancPlugins
                                          OrthancPluginResourceType& type,
                                          const char* publicId)
   {
-    if (lookupResource_.get() == NULL)
-    {
-      lookupResource_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT internalId, resourceType FROM Resources WHERE publicId=$1"));
-      lookupResource_->DeclareInputString(0);
-    }
+    PostgreSQLReadRouter::Accessor route(router_, connection_, transaction_.get() == NULL);
+    PostgreSQLStatement& s = GetRoutedStatement(route, GetStatement(Statement_LookupResource));
 
-    lookupResource_->BindString(0, publicId);
+    s.BindString(0, publicId);
 
-    PostgreSQLResult result(*lookupResource_);
+    PostgreSQLTypedResult< boost::tuple<int64_t, int32_t> > result(s);
     if (result.IsDone())
     {
       return false;
     }
     else
     {
-      id = result.GetInteger64(0);
-      type = static_cast<OrthancPluginResourceType>(result.GetInteger(1));
+      id = result.Get<0>();
+      type = static_cast<OrthancPluginResourceType>(result.Get<1>());
       return true;
     }
   }
@@ -983,14 +1226,7 @@ namespace OrthancPlugins
 
   bool PostgreSQLWrapper::SelectPatientToRecycle(int64_t& internalId)
   {
-    if (selectPatientToRecycle_.get() == NULL)
-    {
-      selectPatientToRecycle_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT patientId FROM PatientRecyclingOrder ORDER BY seq ASC LIMIT 1"));
-    }
-
-    PostgreSQLResult result(*selectPatientToRecycle_);
+    PostgreSQLResult result(GetStatement(Statement_SelectPatientToRecycle));
 
     if (result.IsDone())
     {
@@ -1008,16 +1244,10 @@ namespace OrthancPlugins
   bool PostgreSQLWrapper::SelectPatientToRecycle(int64_t& internalId,
                                                  int64_t patientIdToAvoid)
   {
-    if (selectPatientToRecycleAvoid_.get() == NULL)
-    {
-      selectPatientToRecycleAvoid_.reset
-        (new PostgreSQLStatement
-         (*connection_, "SELECT patientId FROM PatientRecyclingOrder WHERE patientId != $1 ORDER BY seq ASC LIMIT 1"));
-      selectPatientToRecycleAvoid_->DeclareInputInteger64(0);
-    }
+    PostgreSQLStatement& s = GetStatement(Statement_SelectPatientToRecycleAvoid);
 
-    selectPatientToRecycleAvoid_->BindInteger64(0, patientIdToAvoid);
-    PostgreSQLResult result(*selectPatientToRecycleAvoid_);
+    s.BindInteger64(0, patientIdToAvoid);
+    PostgreSQLResult result(s);
 
     if (result.IsDone())
     {
@@ -1041,8 +1271,9 @@ namespace OrthancPlugins
     s.BindInteger64(0, id);
     s.BindInteger(1, group);
     s.BindInteger(2, element);
-    s.BindString(3, value);
-    s.Run();
+
+    // No copy: The value is sent by Enqueue(), before it goes out of scope
+    s.BindStringReference(3, value);
   }
 
 
@@ -1051,18 +1282,18 @@ namespace OrthancPlugins
                                           uint16_t element,
                                           const char* value)
   {
-    if (setMainDicomTags_.get() == NULL)
+    if (transaction_.get() != NULL)
     {
-      setMainDicomTags_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO MainDicomTags VALUES($1, $2, $3, $4)"));
-      setMainDicomTags_->DeclareInputInteger64(0);
-      setMainDicomTags_->DeclareInputInteger(1);
-      setMainDicomTags_->DeclareInputInteger(2);
-      setMainDicomTags_->DeclareInputBinary(3);
+      // Inserted in bulk by the next statement, at the latest by the commit
+      pendingMainDicomTags_.Add(id, group, element, value);
+      RequireDurability(PostgreSQLDurability_Full);
+    }
+    else
+    {
+      PostgreSQLStatement& s = GetStatement(Statement_SetMainDicomTags);
+      SetTagInternal(s, id, group, element, value);
+      Enqueue(s);
     }
-
-    SetTagInternal(*setMainDicomTags_, id, group, element, value);
   }
 
   void PostgreSQLWrapper::SetIdentifierTag(int64_t id,
@@ -1070,18 +1301,17 @@ namespace OrthancPlugins
                                            uint16_t element,
                                            const char* value)
   {
-    if (setIdentifierTag_.get() == NULL)
+    if (transaction_.get() != NULL)
     {
-      setIdentifierTag_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO DicomIdentifiers VALUES($1, $2, $3, $4)"));
-      setIdentifierTag_->DeclareInputInteger64(0);
-      setIdentifierTag_->DeclareInputInteger(1);
-      setIdentifierTag_->DeclareInputInteger(2);
-      setIdentifierTag_->DeclareInputBinary(3);
+      pendingIdentifierTags_.Add(id, group, element, value);
+      RequireDurability(PostgreSQLDurability_Full);
+    }
+    else
+    {
+      PostgreSQLStatement& s = GetStatement(Statement_SetIdentifierTag);
+      SetTagInternal(s, id, group, element, value);
+      Enqueue(s);
     }
-
-    SetTagInternal(*setIdentifierTag_, id, group, element, value);
   }
 
 
@@ -1089,31 +1319,17 @@ namespace OrthancPlugins
                                       int32_t type,
                                       const char* value)
   {
-    if (setMetadata1_.get() == NULL ||
-        setMetadata2_.get() == NULL)
-    {
-      setMetadata1_.reset
-        (new PostgreSQLStatement
-         (*connection_, "DELETE FROM Metadata WHERE id=$1 AND type=$2"));
-      setMetadata1_->DeclareInputInteger64(0);
-      setMetadata1_->DeclareInputInteger(1);
-
-      setMetadata2_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO Metadata VALUES ($1, $2, $3)"));
-      setMetadata2_->DeclareInputInteger64(0);
-      setMetadata2_->DeclareInputInteger(1);
-      setMetadata2_->DeclareInputString(2);
-    }
+    PostgreSQLStatement& setMetadata1 = GetStatement(Statement_SetMetadata1);
+    PostgreSQLStatement& setMetadata2 = GetStatement(Statement_SetMetadata2);
 
-    setMetadata1_->BindInteger64(0, id);
-    setMetadata1_->BindInteger(1, static_cast<int>(type));
-    setMetadata1_->Run();
+    setMetadata1.BindInteger64(0, id);
+    setMetadata1.BindInteger(1, static_cast<int>(type));
+    Enqueue(setMetadata1);
 
-    setMetadata2_->BindInteger64(0, id);
-    setMetadata2_->BindInteger(1, static_cast<int>(type));
-    setMetadata2_->BindString(2, value);
-    setMetadata2_->Run();
+    setMetadata2.BindInteger64(0, id);
+    setMetadata2.BindInteger(1, static_cast<int>(type));
+    setMetadata2.BindStringReference(2, value);
+    Enqueue(setMetadata2);
   }
 
 
@@ -1121,29 +1337,18 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::SetProtectedPatient(int64_t internalId, 
                                               bool isProtected)
   {
-    if (protectPatient1_.get() == NULL ||
-        protectPatient2_.get() == NULL)
-    {
-      protectPatient1_.reset
-        (new PostgreSQLStatement
-         (*connection_, "DELETE FROM PatientRecyclingOrder WHERE patientId=$1"));
-      protectPatient1_->DeclareInputInteger64(0);
-    
-      protectPatient2_.reset
-        (new PostgreSQLStatement
-         (*connection_, "INSERT INTO PatientRecyclingOrder VALUES(DEFAULT, $1)"));
-      protectPatient2_->DeclareInputInteger64(0);
-    }
+    PostgreSQLStatement& protectPatient1 = GetStatement(Statement_ProtectPatient1);
+    PostgreSQLStatement& protectPatient2 = GetStatement(Statement_ProtectPatient2);
 
     if (isProtected)
     {
-      protectPatient1_->BindInteger64(0, internalId);
-      protectPatient1_->Run();
+      protectPatient1.BindInteger64(0, internalId);
+      Enqueue(protectPatient1);
     }
     else if (IsProtectedPatient(internalId))
     {
-      protectPatient2_->BindInteger64(0, internalId);
-      protectPatient2_->Run();
+      protectPatient2.BindInteger64(0, internalId);
+      Enqueue(protectPatient2);
     }
     else
     {
@@ -1157,7 +1362,7 @@ namespace OrthancPlugins
   void PostgreSQLWrapper::GetChildren(std::list<std::string>& childrenPublicIds,
                                       int64_t id)
   {
-    PostgreSQLStatement s(*connection_, "SELECT publicId FROM Resources WHERE parentId=$1");
+    PostgreSQLStatement s(connection_, "SELECT publicId FROM Resources WHERE parentId=$1");
     s.DeclareInputInteger64(0);
     s.BindInteger64(0, id);
 
@@ -1180,7 +1385,9 @@ namespace OrthancPlugins
   {
     char buf[128];
     sprintf(buf, "SELECT CAST(COUNT(*) AS BIGINT) FROM %s", table.c_str());
-    PostgreSQLStatement s(*connection_, buf);
+    FlushPendingTags();
+
+    PostgreSQLStatement s(connection_, buf);
 
     PostgreSQLResult result(s);
     if (result.IsDone())
@@ -1204,7 +1411,7 @@ namespace OrthancPlugins
   bool PostgreSQLWrapper::GetParentPublicId(std::string& target,
                                             int64_t id)
   {
-    PostgreSQLStatement s(*connection_, 
+    PostgreSQLStatement s(connection_, 
                           "SELECT a.publicId FROM Resources AS a, Resources AS b "
                           "WHERE a.internalId = b.parentId AND b.internalId = $1");
     s.DeclareInputInteger64(0);
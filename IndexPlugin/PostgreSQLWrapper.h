@@ -22,9 +22,12 @@
 
 #include <orthanc/OrthancCppDatabasePlugin.h>
 
+#include "../Core/DurabilityPolicy.h"
 #include "../Core/GlobalProperties.h"
-#include "../Core/PostgreSQLConnection.h"
+#include "../Core/PostgreSQLConnectionPool.h"
+#include "../Core/PostgreSQLReadRouter.h"
 #include "../Core/PostgreSQLStatement.h"
+#include "../Core/PostgreSQLStatementCatalog.h"
 #include "../Core/PostgreSQLResult.h"
 #include "../Core/PostgreSQLTransaction.h"
 
@@ -35,74 +38,117 @@ namespace OrthancPlugins
   class PostgreSQLWrapper : public IDatabaseBackend
   {
   private:
-    std::auto_ptr<PostgreSQLConnection> connection_;
+    // Orthanc serializes the accesses to the index, so the wrapper
+    // keeps one connection of the pool checked out for its lifetime
+    std::auto_ptr<PostgreSQLConnectionPool>  pool_;
+    PostgreSQLConnectionPool::Accessor  primary_;
+    PostgreSQLConnection&  connection_;
     std::auto_ptr<PostgreSQLTransaction>  transaction_;
     GlobalProperties  globalProperties_;
 
-    std::auto_ptr<PostgreSQLStatement> attachFile_;
-    std::auto_ptr<PostgreSQLStatement> attachChild_;
-    std::auto_ptr<PostgreSQLStatement> createResource_;
-    std::auto_ptr<PostgreSQLStatement> deleteAttachment_;
-    std::auto_ptr<PostgreSQLStatement> deleteMetadata_;
-    std::auto_ptr<PostgreSQLStatement> deleteResource_;
-    std::auto_ptr<PostgreSQLStatement> getAllMetadata_;
-    std::auto_ptr<PostgreSQLStatement> getAllPublicIds_;
-    std::auto_ptr<PostgreSQLStatement> getChanges_;
-    std::auto_ptr<PostgreSQLStatement> getLastChange_;
-    std::auto_ptr<PostgreSQLStatement> getChildrenInternalId_;
-    std::auto_ptr<PostgreSQLStatement> getChildrenPublicId_;
-    std::auto_ptr<PostgreSQLStatement> getExports_;
-    std::auto_ptr<PostgreSQLStatement> getLastExport_;
-    std::auto_ptr<PostgreSQLStatement> getMainDicomTags1_;
-    std::auto_ptr<PostgreSQLStatement> getMainDicomTags2_;
-    std::auto_ptr<PostgreSQLStatement> getPublicId_;
-    std::auto_ptr<PostgreSQLStatement> getResourceCount_;
-    std::auto_ptr<PostgreSQLStatement> getResourceType_;
-    std::auto_ptr<PostgreSQLStatement> getTotalCompressedSize_;
-    std::auto_ptr<PostgreSQLStatement> getTotalUncompressedSize_;
-    std::auto_ptr<PostgreSQLStatement> isProtectedPatient_;
-    std::auto_ptr<PostgreSQLStatement> listMetadata_;
-    std::auto_ptr<PostgreSQLStatement> listAttachments_;
-    std::auto_ptr<PostgreSQLStatement> logChange_;
-    std::auto_ptr<PostgreSQLStatement> logExport_;
-    std::auto_ptr<PostgreSQLStatement> lookupAttachment_;
-    std::auto_ptr<PostgreSQLStatement> lookupIdentifier1_;
-    std::auto_ptr<PostgreSQLStatement> lookupIdentifier2_;
-    std::auto_ptr<PostgreSQLStatement> lookupMetadata_;
-    std::auto_ptr<PostgreSQLStatement> lookupParent_;
-    std::auto_ptr<PostgreSQLStatement> lookupResource_;
-    std::auto_ptr<PostgreSQLStatement> selectPatientToRecycle_;
-    std::auto_ptr<PostgreSQLStatement> selectPatientToRecycleAvoid_;
-    std::auto_ptr<PostgreSQLStatement> setMainDicomTags_;
-    std::auto_ptr<PostgreSQLStatement> setIdentifierTag_;
-    std::auto_ptr<PostgreSQLStatement> setMetadata1_;
-    std::auto_ptr<PostgreSQLStatement> setMetadata2_;
-    std::auto_ptr<PostgreSQLStatement> protectPatient1_;
-    std::auto_ptr<PostgreSQLStatement> protectPatient2_;
-
-    std::auto_ptr<PostgreSQLStatement> clearDeletedFiles_;
-    std::auto_ptr<PostgreSQLStatement> clearDeletedResources_;
-    std::auto_ptr<PostgreSQLStatement> clearRemainingAncestor_;
-    std::auto_ptr<PostgreSQLStatement> getDeletedFiles_;
-    std::auto_ptr<PostgreSQLStatement> getDeletedResources_;
-    std::auto_ptr<PostgreSQLStatement> getRemainingAncestor_;
- 
+    // Routing of the read-only calls that happen outside of a
+    // transaction to the hot-standby replicas, if any
+    PostgreSQLReadRouter  router_;
+
+    // Whether the server supports the bulk insertion of the tags
+    // (PostgreSQL >= 9.4). Must be declared before "statements_".
+    bool  bulkTags_;
+
+    // The statements are declared in a static table in the ".cpp" file
+    PostgreSQLStatementCatalog  statements_;
+
+    // The main DICOM tags and the identifiers that are set inside a
+    // transaction are buffered, then inserted in bulk as arrays
+    class PendingTags : public boost::noncopyable
+    {
+    private:
+      std::vector<int64_t>      ids_;
+      std::vector<int32_t>      groups_;
+      std::vector<int32_t>      elements_;
+      std::vector<std::string>  values_;
+      size_t                    count_;
+
+    public:
+      PendingTags() : 
+        count_(0)
+      {
+      }
+
+      bool IsEmpty() const
+      {
+        return count_ == 0;
+      }
+
+      size_t GetCount() const
+      {
+        return count_;
+      }
+
+      void Add(int64_t id,
+               uint16_t group,
+               uint16_t element,
+               const char* value);
+
+      void Clear();
+
+      // Bind all the tags as arrays, for the bulk insertion
+      void Bind(PostgreSQLStatement& statement) const;
+
+      // Bind one single tag
+      void Bind(PostgreSQLStatement& statement,
+                size_t index) const;
+    };
+
+    PendingTags  pendingMainDicomTags_;
+    PendingTags  pendingIdentifierTags_;
+
+    // The commit of a transaction uses the strongest durability that
+    // is required by its modifications
+    DurabilityPolicy  durability_;
+    PostgreSQLDurability  commitDurability_;
+
     void Prepare();
 
+    // Access to the statements of the catalog, after the buffered tags
+    // are flushed
+    PostgreSQLStatement& GetStatement(size_t statement);
+
+    void FlushPendingTags(PendingTags& tags,
+                          size_t bulkStatement,
+                          size_t statement);
+
+    void FlushPendingTags();
+
+    void RequireDurability(PostgreSQLDurability durability)
+    {
+      if (durability > commitDurability_)
+      {
+        commitDurability_ = durability;
+      }
+    }
+
+    // Run a statement whose result is not needed
+    void Enqueue(PostgreSQLStatement& statement,
+                 PostgreSQLDurability durability = PostgreSQLDurability_Full);
+
     void SignalDeletedFilesAndResources();
 
     void GetChangesInternal(bool& done,
                             PostgreSQLStatement& s,
                             uint32_t maxResults);
 
+    std::string GetPublicIdInternal(PostgreSQLStatement& s,
+                                    int64_t resourceId);
+
     void GetExportedResourcesInternal(bool& done,
                                       PostgreSQLStatement& s,
                                       uint32_t maxResults);
 
-    void ClearTable(const std::string& tableName);
+    void ClearTable(const std::string& tableName,
+                    PostgreSQLDurability durability);
 
   public:
-    PostgreSQLWrapper(PostgreSQLConnection* connection,  // Takes the ownership of the connection
+    PostgreSQLWrapper(PostgreSQLConnectionPool* pool,  // Takes the ownership of the pool
                       bool useLock,
                       bool allowUnlock);
 
@@ -110,12 +156,12 @@ namespace OrthancPlugins
 
     virtual void Open()
     {
-      connection_->Open();
+      connection_.Open();
     }
 
     virtual void Close()
     {
-      transaction_.reset(NULL);
+      RollbackTransaction();
     }
 
     virtual void AddAttachment(int64_t id,
@@ -126,12 +172,12 @@ namespace OrthancPlugins
 
     virtual void ClearChanges()
     {
-      ClearTable("Changes");
+      ClearTable("Changes", durability_.GetHistory());
     }
 
     virtual void ClearExportedResources()
     {
-      ClearTable("ExportedResources");
+      ClearTable("ExportedResources", durability_.GetHistory());
     }
 
     virtual int64_t CreateResource(const char* publicId,
@@ -228,6 +274,7 @@ namespace OrthancPlugins
     virtual void SetGlobalProperty(int32_t property,
                                    const char* value)
     {
+      RequireDurability(PostgreSQLDurability_Full);
       return globalProperties_.SetGlobalProperty(property, value);
     }
 
@@ -248,21 +295,11 @@ namespace OrthancPlugins
     virtual void SetProtectedPatient(int64_t internalId, 
                                      bool isProtected);
 
-    virtual void StartTransaction()
-    {
-      transaction_.reset(new PostgreSQLTransaction(*connection_));
-    }
+    virtual void StartTransaction();
 
-    virtual void RollbackTransaction()
-    {
-      transaction_.reset(NULL);
-    }
+    virtual void RollbackTransaction();
 
-    virtual void CommitTransaction()
-    {
-      transaction_->Commit();
-      transaction_.reset(NULL);
-    }
+    virtual void CommitTransaction();
 
     // For unit tests only!
     void GetChildren(std::list<std::string>& childrenPublicIds,
@@ -274,5 +311,21 @@ namespace OrthancPlugins
     // For unit tests only!
     bool GetParentPublicId(std::string& result,
                            int64_t id);
+
+    PostgreSQLReadRouter& GetReadRouter()
+    {
+      return router_;
+    }
+
+    DurabilityPolicy& GetDurabilityPolicy()
+    {
+      return durability_;
+    }
+
+    // For unit tests only!
+    PostgreSQLConnectionPool& GetConnectionPool()
+    {
+      return *pool_;
+    }
   };
 }
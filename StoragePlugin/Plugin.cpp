@@ -24,10 +24,55 @@
 #include "../Core/PostgreSQLException.h"
 #include "../Core/Configuration.h"
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/mutex.hpp>
+
 
 static OrthancPluginContext* context_ = NULL;
 static OrthancPlugins::PostgreSQLStorageArea* storage_ = NULL;
 
+// The sizes of the chunks of the large objects that were learned are
+// reported at most once per interval, so that their bounds can be
+// tuned while Orthanc is running
+static const long STATISTICS_INTERVAL = 300;  // In seconds
+static boost::mutex statisticsMutex_;
+static boost::posix_time::ptime statisticsTime_;
+
+
+static void LogLargeObjectStatistics(bool force)
+{
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if (!force &&
+        now - statisticsTime_ < boost::posix_time::seconds(STATISTICS_INTERVAL))
+    {
+      return;
+    }
+
+    statisticsTime_ = now;
+  }
+
+  std::vector<OrthancPlugins::ChunkSizeTuner::Statistics> statistics;
+  storage_->GetConnectionPool().GetLargeObjectStatistics(statistics);
+
+  for (size_t i = 0; i < statistics.size(); i++)
+  {
+    char info[1024];
+    sprintf(info, "Large objects of the PostgreSQL connection %d: %llu bytes in %llu operations (%llu ms), "
+            "chunks of %llu KB, throughput of %.1f MB/s, latency of %.2f ms",
+            static_cast<int>(i),
+            static_cast<unsigned long long>(statistics[i].bytes_),
+            static_cast<unsigned long long>(statistics[i].operations_),
+            static_cast<unsigned long long>(statistics[i].microseconds_ / 1000),
+            static_cast<unsigned long long>(statistics[i].chunkSize_ / 1024),
+            statistics[i].throughput_ / (1024.0 * 1024.0),
+            statistics[i].latency_ * 1000.0);
+    OrthancPluginLogInfo(context_, info);
+  }
+}
+
 
 static int32_t StorageCreate(const char* uuid,
                              const void* content,
@@ -37,6 +82,7 @@ static int32_t StorageCreate(const char* uuid,
   try
   {
     storage_->Create(uuid, content, static_cast<size_t>(size), type);
+    LogLargeObjectStatistics(false);
     return 0;
   }
   catch (std::runtime_error& e)
@@ -57,6 +103,7 @@ static int32_t StorageRead(void** content,
     size_t tmp;
     storage_->Read(*content, tmp, uuid, type);
     *size = static_cast<int64_t>(tmp);
+    LogLargeObjectStatistics(false);
     return 0;
   }
   catch (std::runtime_error& e)
@@ -131,16 +178,29 @@ extern "C"
 
     try
     {
-      /* Create the connection to PostgreSQL */
+      /* Create the pool of connections to PostgreSQL */
       bool useLock;
-      std::auto_ptr<OrthancPlugins::PostgreSQLConnection> 
-        pg(OrthancPlugins::CreateConnection(useLock, context_, configuration));
+      std::auto_ptr<OrthancPlugins::PostgreSQLConnectionPool> 
+        pool(OrthancPlugins::CreateConnectionPool(useLock, context_, configuration));
 
-      pg->Open();
-      //pg->ClearAll();   // Reset the database
+      /* Large objects (by default) or "bytea" column */
+      OrthancPlugins::PostgreSQLStorageBackend backend = OrthancPlugins::PostgreSQLStorageArea::ParseBackend
+        (OrthancPlugins::GetStringValue(configuration["PostgreSQL"], "StorageBackend", "LargeObject"));
 
       /* Create the storage area back-end */
-      storage_ = new OrthancPlugins::PostgreSQLStorageArea(pg.release(), useLock, allowUnlock);
+      storage_ = new OrthancPlugins::PostgreSQLStorageArea(pool.release(), useLock, allowUnlock, backend);
+
+      /* The attachments of the other backend would be unreachable */
+      storage_->CheckOtherBackendIsEmpty();
+
+      statisticsTime_ = boost::posix_time::microsec_clock::universal_time();
+
+      /* Relax the durability of the commits, if requested */
+      OrthancPlugins::ConfigureDurability(storage_->GetDurabilityPolicy(), configuration);
+
+      /* Threshold of the single-statement access to the large objects (in KB) */
+      int threshold = OrthancPlugins::GetIntegerValue(configuration["PostgreSQL"], "DirectAccessThreshold", 1024);
+      storage_->SetDirectThreshold(threshold <= 0 ? 0 : static_cast<size_t>(threshold) * 1024);
 
       /* Register the storage area into Orthanc */
       OrthancPluginRegisterStorageArea(context_, StorageCreate, StorageRead, StorageRemove);
@@ -161,6 +221,8 @@ extern "C"
 
     if (storage_ != NULL)
     {
+      LogLargeObjectStatistics(true);
+
       delete storage_;
       storage_ = NULL;
     }
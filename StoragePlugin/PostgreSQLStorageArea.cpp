@@ -25,44 +25,349 @@
 #include "../Core/PostgreSQLException.h"
 #include "../Core/Configuration.h"
 
+#include <limits>
+
 namespace OrthancPlugins
 {  
-  PostgreSQLStorageArea::PostgreSQLStorageArea(PostgreSQLConnection* db,
+  static const size_t DEFAULT_DIRECT_THRESHOLD = 1024 * 1024;
+
+  // Maximum size of the values of PostgreSQL
+  static const size_t MAX_BYTEA_SIZE = 1024 * 1024 * 1024 - 1;
+
+
+  static PostgreSQLStatement& GetCreateStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::Create";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "INSERT INTO StorageArea(uuid, content, type, size) VALUES ($1, $2, $3, $4)"));
+      s->DeclareInputString(0);
+      s->DeclareInputLargeObject(1);
+      s->DeclareInputInteger(2);
+      s->DeclareInputInteger64(3);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetCreateDirectStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::CreateDirect";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "INSERT INTO StorageArea(uuid, content, type, size) "
+                                 "VALUES ($1, lo_from_bytea(0, $2), $3, $4)"));
+      s->DeclareInputString(0);
+      s->DeclareInputBinary(1);
+      s->DeclareInputInteger(2);
+      s->DeclareInputInteger64(3);
+      s->SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetReadDirectStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::ReadDirect";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      // The content is only read if its size does not exceed the
+      // threshold "$3". The size is NULL for the attachments written
+      // by the previous versions of the plugin, that are read through
+      // the client-side interface instead of sending a useless prefix.
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "SELECT CASE WHEN size <= $3 "
+                                 "THEN lo_get(content, 0, $3 + 1) END "
+                                 "FROM StorageArea WHERE uuid=$1 AND type=$2"));
+      s->DeclareInputString(0);
+      s->DeclareInputInteger(1);
+      s->DeclareInputInteger(2);
+      s->SetReadOnly(true);
+      s->SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetReadRangeStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::ReadRange";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      // At most "$4" bytes are read from the offset "$3" of the large
+      // object (less if its end is reached)
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "SELECT lo_get(content, $3, $4) FROM StorageArea WHERE uuid=$1 AND type=$2"));
+      s->DeclareInputString(0);
+      s->DeclareInputInteger(1);
+      s->DeclareInputInteger64(2);
+      s->DeclareInputInteger(3);
+      s->SetReadOnly(true);
+      s->SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetReadStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::Read";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "SELECT content, size FROM StorageArea WHERE uuid=$1 AND type=$2"));
+      s->DeclareInputString(0);
+      s->DeclareInputInteger(1);
+      s->SetReadOnly(true);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetCreateByteaStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::CreateBytea";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "INSERT INTO StorageAreaBytea(uuid, content, type) VALUES ($1, $2, $3)"));
+      s->DeclareInputString(0);
+      s->DeclareInputBinary(1);
+      s->DeclareInputInteger(2);
+      s->SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetReadByteaStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::ReadBytea";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "SELECT content FROM StorageAreaBytea WHERE uuid=$1 AND type=$2"));
+      s->DeclareInputString(0);
+      s->DeclareInputInteger(1);
+      s->SetReadOnly(true);
+      s->SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetReadRangeByteaStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::ReadRangeBytea";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      // The positions of "substring()" start at 1. As the values are
+      // stored without compression, only the TOAST chunks that
+      // overlap the range are fetched by the server.
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "SELECT substring(content FROM $3 FOR $4) FROM StorageAreaBytea "
+                                 "WHERE uuid=$1 AND type=$2"));
+      s->DeclareInputString(0);
+      s->DeclareInputInteger(1);
+      s->DeclareInputInteger(2);
+      s->DeclareInputInteger(3);
+      s->SetReadOnly(true);
+      s->SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static PostgreSQLStatement& GetRemoveByteaStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::RemoveBytea";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "DELETE FROM StorageAreaBytea WHERE uuid=$1 AND type=$2"));
+      s->DeclareInputString(0);
+      s->DeclareInputInteger(1);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  static void CopyToBuffer(PostgreSQLLargeObject::IBuffer& target,
+                           const char* value,
+                           size_t size)
+  {
+    void* buffer = target.Allocate(size);
+    if (size > 0)
+    {
+      memcpy(buffer, value, size);
+    }
+  }
+
+
+  static PostgreSQLStatement& GetRemoveStatement(PostgreSQLConnection& db)
+  {
+    static const char* KEY = "StorageArea::Remove";
+
+    PostgreSQLStatement* statement = db.LookupCachedStatement(KEY);
+    if (statement == NULL)
+    {
+      std::auto_ptr<PostgreSQLStatement> s
+        (new PostgreSQLStatement(db, "DELETE FROM StorageArea WHERE uuid=$1 AND type=$2"));
+      s->DeclareInputString(0);
+      s->DeclareInputInteger(1);
+      statement = &db.CacheStatement(KEY, s.release());
+    }
+
+    return *statement;
+  }
+
+
+  PostgreSQLStorageArea::PostgreSQLStorageArea(PostgreSQLConnectionPool* pool,
                                                bool useLock,
-                                               bool allowUnlock) : 
-    db_(db),
-    globalProperties_(*db, useLock, GlobalProperty_StorageLock)
+                                               bool allowUnlock,
+                                               PostgreSQLStorageBackend backend) : 
+    pool_(pool),
+    useLock_(useLock),
+    backend_(backend),
+    directThreshold_(DEFAULT_DIRECT_THRESHOLD),
+    directAccess_(false),
+    hasOtherBackend_(false)
   {
-    globalProperties_.Lock(allowUnlock);
+    // The advisory lock is attached to the PostgreSQL session, so
+    // it must be released on the very connection that took it
+    lock_.reset(pool_->OpenDedicatedConnection());
+
+    // "lo_from_bytea()" and "lo_get()" appeared in PostgreSQL 9.4
+    directAccess_ = (lock_->GetServerVersion() >= 90400);
+    if (!directAccess_)
+    {
+      directThreshold_ = 0;
+    }
+
+    GlobalProperties globalProperties(*lock_, useLock_, GlobalProperty_StorageLock);
+    globalProperties.Lock(allowUnlock);
+
+    Prepare(*lock_, globalProperties, backend_);
 
-    Prepare();
+    // Remember the result of the schema probe, as the table of the
+    // other backend is never created by this storage area
+    hasOtherBackend_ = globalProperties.HasSchemaElement
+      (backend_ == PostgreSQLStorageBackend_Bytea ?
+       SchemaElement_StorageArea : SchemaElement_StorageAreaBytea);
   }
 
 
-  void PostgreSQLStorageArea::Prepare()
+  void PostgreSQLStorageArea::Prepare(PostgreSQLConnection& db,
+                                      const GlobalProperties& globalProperties,
+                                      PostgreSQLStorageBackend backend)
   {
-    PostgreSQLTransaction transaction(*db_);
+    if (backend == PostgreSQLStorageBackend_Bytea)
+    {
+      if (!globalProperties.HasSchemaElement(SchemaElement_StorageAreaBytea))
+      {
+        PostgreSQLTransaction transaction(db);
 
-    db_->Execute("CREATE TABLE IF NOT EXISTS StorageArea("
-                 "uuid VARCHAR NOT NULL PRIMARY KEY,"
-                 "content OID NOT NULL,"
-                 "type INTEGER NOT NULL)");
+        db.Execute("CREATE TABLE IF NOT EXISTS StorageAreaBytea("
+                   "uuid VARCHAR NOT NULL PRIMARY KEY,"
+                   "content BYTEA NOT NULL,"
+                   "type INTEGER NOT NULL)");
 
-    // Automatically remove the large objects associated with the table
-    db_->Execute("CREATE OR REPLACE RULE StorageAreaDelete AS ON DELETE TO StorageArea DO SELECT lo_unlink(old.content);");
+        // Out-of-line storage without compression: The attachments
+        // are mostly compressed already, and the ranges are read
+        // without decompressing the whole value
+        db.Execute("ALTER TABLE StorageAreaBytea ALTER COLUMN content SET STORAGE EXTERNAL");
 
-    create_.reset(new PostgreSQLStatement(*db_, "INSERT INTO StorageArea VALUES ($1,$2,$3)"));
-    create_->DeclareInputString(0);
-    create_->DeclareInputLargeObject(1);
-    create_->DeclareInputInteger(2);
+        transaction.Commit();
+      }
 
-    read_.reset(new PostgreSQLStatement(*db_, "SELECT content FROM StorageArea WHERE uuid=$1 AND type=$2"));
-    read_->DeclareInputString(0);
-    read_->DeclareInputInteger(1);
+      return;
+    }
 
-    remove_.reset(new PostgreSQLStatement(*db_, "DELETE FROM StorageArea WHERE uuid=$1 AND type=$2"));
-    remove_->DeclareInputString(0);
-    remove_->DeclareInputInteger(1);
+    // Running the DDL at each startup would take locks that collide
+    // with the other instances of Orthanc during rolling restarts
+    if (globalProperties.HasSchemaElement(SchemaElement_StorageArea) &&
+        globalProperties.HasSchemaElement(SchemaElement_StorageAreaRule) &&
+        globalProperties.HasSchemaElement(SchemaElement_StorageAreaSize))
+    {
+      return;
+    }
+
+    PostgreSQLTransaction transaction(db);
+
+    // The size of the attachments is NULL for the rows that were
+    // written by the previous versions of the plugin
+    db.Execute("CREATE TABLE IF NOT EXISTS StorageArea("
+               "uuid VARCHAR NOT NULL PRIMARY KEY,"
+               "content OID NOT NULL,"
+               "type INTEGER NOT NULL,"
+               "size BIGINT)");
+
+    if (globalProperties.HasSchemaElement(SchemaElement_StorageArea) &&
+        !globalProperties.HasSchemaElement(SchemaElement_StorageAreaSize))
+    {
+      // Another instance might have added the column since the
+      // schema was probed. The table lock serializes the upgrades,
+      // then the column is looked up again ("ADD COLUMN IF NOT
+      // EXISTS" is only available since PostgreSQL 9.6).
+      db.Execute("LOCK TABLE StorageArea IN ACCESS EXCLUSIVE MODE");
+
+      bool hasSize;
+
+      {
+        PostgreSQLStatement s(db, "SELECT 1 FROM pg_catalog.pg_attribute "
+                              "WHERE attrelid = 'public.storagearea'::regclass "
+                              "AND attname = 'size' AND NOT attisdropped");
+        PostgreSQLResult r(s);
+        hasSize = !r.IsDone();
+      }
+
+      if (!hasSize)
+      {
+        db.Execute("ALTER TABLE StorageArea ADD COLUMN size BIGINT");
+      }
+    }
+
+    // Automatically remove the large objects associated with the table
+    db.Execute("CREATE OR REPLACE RULE StorageAreaDelete AS ON DELETE TO StorageArea DO SELECT lo_unlink(old.content);");
 
     transaction.Commit();
   }
@@ -70,7 +375,78 @@ namespace OrthancPlugins
 
   PostgreSQLStorageArea::~PostgreSQLStorageArea()
   {
-    globalProperties_.Unlock();
+    try
+    {
+      GlobalProperties globalProperties(*lock_, useLock_, GlobalProperty_StorageLock);
+      globalProperties.Unlock();
+    }
+    catch (std::runtime_error&)
+    {
+      // Never throw from a destructor
+    }
+  }
+
+
+  void PostgreSQLStorageArea::SetDirectThreshold(size_t threshold)
+  {
+    // The size of the bytea values is limited to 1GB by PostgreSQL
+    if (threshold >= static_cast<size_t>(1024 * 1024 * 1024))
+    {
+      throw PostgreSQLException("Too large threshold for the direct access to the large objects");
+    }
+
+    // Silently disabled on the servers that cannot support it
+    directThreshold_ = (directAccess_ ? threshold : 0);
+  }
+
+
+  void PostgreSQLStorageArea::CreateDirect(PostgreSQLConnection& db,
+                                           const std::string& uuid,
+                                           const void* content,
+                                           size_t size,
+                                           OrthancPluginContentType type)
+  {
+    // A NULL pointer would be bound as a NULL value
+    if (content == NULL)
+    {
+      content = "";
+    }
+
+    PostgreSQLStatement* statement;
+
+    if (backend_ == PostgreSQLStorageBackend_Bytea)
+    {
+      if (size > MAX_BYTEA_SIZE)
+      {
+        throw PostgreSQLException("The attachments of the bytea storage backend are limited to 1GB");
+      }
+
+      statement = &GetCreateByteaStatement(db);
+      statement->BindString(0, uuid);
+      statement->BindStringReference(1, content, size);
+      statement->BindInteger(2, static_cast<int>(type));
+    }
+    else
+    {
+      statement = &GetCreateDirectStatement(db);
+      statement->BindString(0, uuid);
+      statement->BindStringReference(1, content, size);
+      statement->BindInteger(2, static_cast<int>(type));
+      statement->BindInteger64(3, static_cast<int64_t>(size));
+    }
+
+    PostgreSQLDurability durability = durability_.GetAttachment(type);
+    if (durability == PostgreSQLDurability_Full)
+    {
+      // The statement is a transaction on its own
+      statement->Run();
+    }
+    else
+    {
+      PostgreSQLTransaction transaction(db);
+      statement->Run();
+      transaction.Commit(durability);
+    }
   }
 
 
@@ -79,92 +455,421 @@ namespace OrthancPlugins
                                       size_t size,
                                       OrthancPluginContentType type)
   {
-    boost::mutex::scoped_lock lock(mutex_);
-    PostgreSQLTransaction transaction(*db_);
+    if (backend_ == PostgreSQLStorageBackend_Bytea ||
+        (size <= directThreshold_ &&
+         directThreshold_ > 0))
+    {
+      PostgreSQLConnectionPool::Accessor accessor(*pool_);
+      CreateDirect(accessor.GetConnection(), uuid, content, size, type);
+      return;
+    }
 
-    PostgreSQLLargeObject obj(*db_, content, size);
-    create_->BindString(0, uuid);
-    create_->BindLargeObject(1, obj);    
-    create_->BindInteger(2, static_cast<int>(type));    
-    create_->Run();
+    Writer writer(*this, uuid, type);
+    writer.Append(content, size);
+    writer.Commit();
+  }
 
-    transaction.Commit();
+
+  PostgreSQLStorageArea::Writer::Writer(PostgreSQLStorageArea& area,
+                                        const std::string& uuid,
+                                        OrthancPluginContentType type) :
+    area_(area),
+    accessor_(*area.pool_),
+    uuid_(uuid),
+    type_(type)
+  {
+    if (area_.backend_ == PostgreSQLStorageBackend_LargeObject)
+    {
+      transaction_.reset(new PostgreSQLTransaction(accessor_.GetConnection()));
+      object_.reset(new PostgreSQLLargeObjectWriter(accessor_.GetConnection()));
+    }
   }
 
 
-  void  PostgreSQLStorageArea::Read(void*& content,
-                                    size_t& size,
+  void PostgreSQLStorageArea::Writer::Append(const void* data,
+                                             size_t size)
+  {
+    if (object_.get() != NULL)
+    {
+      object_->Append(data, size);
+    }
+    else if (size > 0)
+    {
+      buffer_.append(reinterpret_cast<const char*>(data), size);
+    }
+  }
+
+
+  void PostgreSQLStorageArea::Writer::Commit()
+  {
+    if (object_.get() == NULL)
+    {
+      area_.CreateDirect(accessor_.GetConnection(), uuid_, buffer_.c_str(), buffer_.size(), type_);
+      return;
+    }
+
+    object_->Finish();
+
+    PostgreSQLStatement& statement = GetCreateStatement(accessor_.GetConnection());
+    statement.BindString(0, uuid_);
+    statement.BindLargeObject(1, object_->GetOid());
+    statement.BindInteger(2, static_cast<int>(type_));
+    statement.BindInteger64(3, static_cast<int64_t>(object_->GetSize()));
+    statement.Run();
+
+    transaction_->Commit(area_.durability_.GetAttachment(type_));
+  }
+
+
+  void  PostgreSQLStorageArea::Read(PostgreSQLLargeObject::IBuffer& target,
                                     const std::string& uuid,
-                                    OrthancPluginContentType type) 
+                                    OrthancPluginContentType type)
   {
-    boost::mutex::scoped_lock lock(mutex_);
-    PostgreSQLTransaction transaction(*db_);
+    PostgreSQLConnectionPool::Accessor accessor(*pool_);
+    PostgreSQLConnection& db = accessor.GetConnection();
 
-    read_->BindString(0, uuid);
-    read_->BindInteger(1, static_cast<int>(type));
-    PostgreSQLResult result(*read_);
+    if (backend_ == PostgreSQLStorageBackend_Bytea)
+    {
+      PostgreSQLStatement& statement = GetReadByteaStatement(db);
+      statement.BindString(0, uuid);
+      statement.BindInteger(1, static_cast<int>(type));
+      PostgreSQLResult result(statement);
+
+      if (result.IsDone())
+      {
+        throw PostgreSQLException();
+      }
+
+      size_t size;
+      const char* value = result.GetStringView(size, 0);
+      CopyToBuffer(target, value, size);
+      return;
+    }
+
+    if (directThreshold_ > 0)
+    {
+      PostgreSQLStatement& statement = GetReadDirectStatement(db);
+      statement.BindString(0, uuid);
+      statement.BindInteger(1, static_cast<int>(type));
+      statement.BindInteger(2, static_cast<int>(directThreshold_));
+      PostgreSQLResult result(statement);
+
+      if (result.IsDone())
+      {
+        throw PostgreSQLException();
+      }
+
+      if (!result.IsNull(0))
+      {
+        size_t size;
+        const char* value = result.GetStringView(size, 0);
+
+        // Safety net, if the stored size does not match the content
+        if (size <= directThreshold_)
+        {
+          CopyToBuffer(target, value, size);
+          return;
+        }
+      }
+    }
+
+    PostgreSQLTransaction transaction(db);
+
+    PostgreSQLStatement& statement = GetReadStatement(db);
+    statement.BindString(0, uuid);
+    statement.BindInteger(1, static_cast<int>(type));
+    PostgreSQLResult result(statement);
 
     if (result.IsDone())
     {
       throw PostgreSQLException();
     }
 
-    result.GetLargeObject(content, size, 0);
+    if (result.IsNull(1))
+    {
+      // Attachment written by a previous version of the plugin: The
+      // size is asked to the server
+      PostgreSQLLargeObject::Read(target, db, result.GetLargeObjectOid(0));
+    }
+    else
+    {
+      int64_t size = result.GetInteger64(1);
+      if (size < 0 ||
+          static_cast<uint64_t>(size) > static_cast<uint64_t>(std::numeric_limits<size_t>::max()))
+      {
+        throw PostgreSQLException("Bad size of attachment");
+      }
+
+      PostgreSQLLargeObject::Read(target, db, result.GetLargeObjectOid(0), static_cast<size_t>(size));
+    }
 
     transaction.Commit();
   }
 
 
-  void  PostgreSQLStorageArea::Read(std::string& content,
+  void  PostgreSQLStorageArea::Read(void*& content,
+                                    size_t& size,
                                     const std::string& uuid,
                                     OrthancPluginContentType type) 
   {
-    void* tmp = NULL; 
-    size_t size;
-    Read(tmp, size, uuid, type);
+    PostgreSQLLargeObject::MallocBuffer buffer(content, size);
 
     try
     {
-      content.resize(size);
+      Read(buffer, uuid, type);
     }
-    catch (std::bad_alloc&)
+    catch (...)
     {
-      free(tmp);
+      free(content);
+      content = NULL;
       throw;
     }
+  }
 
-    if (size != 0)
+
+  void  PostgreSQLStorageArea::Read(std::string& content,
+                                    const std::string& uuid,
+                                    OrthancPluginContentType type) 
+  {
+    // The content is read in place, without intermediate buffer
+    PostgreSQLLargeObject::StringBuffer buffer(content);
+    Read(buffer, uuid, type);
+  }
+
+
+  void  PostgreSQLStorageArea::ReadRange(std::string& content,
+                                         const std::string& uuid,
+                                         OrthancPluginContentType type,
+                                         uint64_t offset,
+                                         size_t length)
+  {
+    if (offset > static_cast<uint64_t>(std::numeric_limits<int64_t>::max()))
+    {
+      throw PostgreSQLException("Offset out of range");
+    }
+
+    PostgreSQLConnectionPool::Accessor accessor(*pool_);
+    PostgreSQLConnection& db = accessor.GetConnection();
+
+    if (backend_ == PostgreSQLStorageBackend_Bytea)
+    {
+      // The values never exceed 1GB: Larger offsets and lengths are
+      // clipped, which gives the same range
+      PostgreSQLStatement& statement = GetReadRangeByteaStatement(db);
+      statement.BindString(0, uuid);
+      statement.BindInteger(1, static_cast<int>(type));
+      statement.BindInteger(2, static_cast<int>(offset >= MAX_BYTEA_SIZE ? MAX_BYTEA_SIZE + 1 : offset + 1));
+      statement.BindInteger(3, static_cast<int>(length >= MAX_BYTEA_SIZE ? MAX_BYTEA_SIZE : length));
+      PostgreSQLResult result(statement);
+
+      if (result.IsDone())
+      {
+        throw PostgreSQLException();
+      }
+
+      result.GetString(content, 0);
+      return;
+    }
+
+    if (length <= directThreshold_ &&
+        directThreshold_ > 0)
     {
-      assert(tmp != NULL);
-      memcpy(&content[0], tmp, size);
+      // Single statement, outside of a transaction
+      PostgreSQLStatement& statement = GetReadRangeStatement(db);
+      statement.BindString(0, uuid);
+      statement.BindInteger(1, static_cast<int>(type));
+      statement.BindInteger64(2, static_cast<int64_t>(offset));
+      statement.BindInteger(3, static_cast<int>(length));
+      PostgreSQLResult result(statement);
+
+      if (result.IsDone())
+      {
+        throw PostgreSQLException();
+      }
+
+      result.GetString(content, 0);
+      return;
     }
 
-    free(tmp);
+    PostgreSQLTransaction transaction(db);
+
+    PostgreSQLStatement& statement = GetReadStatement(db);
+    statement.BindString(0, uuid);
+    statement.BindInteger(1, static_cast<int>(type));
+    PostgreSQLResult result(statement);
+
+    if (result.IsDone())
+    {
+      throw PostgreSQLException();
+    }
+
+    result.GetLargeObjectRange(content, 0, offset, length);
+
+    transaction.Commit();
   }
 
 
   void  PostgreSQLStorageArea::Remove(const std::string& uuid,
                                       OrthancPluginContentType type)
   {
-    boost::mutex::scoped_lock lock(mutex_);
-    PostgreSQLTransaction transaction(*db_);
+    PostgreSQLConnectionPool::Accessor accessor(*pool_);
+    PostgreSQLConnection& db = accessor.GetConnection();
 
-    remove_->BindString(0, uuid);
-    remove_->BindInteger(1, static_cast<int>(type));
-    remove_->Run();
+    PostgreSQLTransaction transaction(db);
 
-    transaction.Commit();
+    PostgreSQLStatement& statement = (backend_ == PostgreSQLStorageBackend_Bytea ?
+                                      GetRemoveByteaStatement(db) : GetRemoveStatement(db));
+    statement.BindString(0, uuid);
+    statement.BindInteger(1, static_cast<int>(type));
+    statement.Run();
+
+    transaction.Commit(durability_.GetAttachment(type));
   }
 
 
   void PostgreSQLStorageArea::Clear()
   {
-    boost::mutex::scoped_lock lock(mutex_);
-    PostgreSQLTransaction transaction(*db_);
+    PostgreSQLConnectionPool::Accessor accessor(*pool_);
+    PostgreSQLConnection& db = accessor.GetConnection();
 
-    db_->Execute("DELETE FROM StorageArea");
+    PostgreSQLTransaction transaction(db);
+
+    db.Execute(backend_ == PostgreSQLStorageBackend_Bytea ?
+               "DELETE FROM StorageAreaBytea" : "DELETE FROM StorageArea");
 
     transaction.Commit();
   }
 
+
+  static const char* GetOtherBackendTable(PostgreSQLStorageBackend backend)
+  {
+    return (backend == PostgreSQLStorageBackend_Bytea ? "StorageArea" : "StorageAreaBytea");
+  }
+
+
+  void PostgreSQLStorageArea::CheckOtherBackendIsEmpty()
+  {
+    if (!hasOtherBackend_)
+    {
+      return;
+    }
+
+    PostgreSQLConnectionPool::Accessor accessor(*pool_);
+    PostgreSQLConnection& db = accessor.GetConnection();
+
+    std::string table = GetOtherBackendTable(backend_);
+    PostgreSQLStatement statement(db, "SELECT EXISTS (SELECT 1 FROM " + table + ")");
+    statement.SetReadOnly(true);
+    PostgreSQLResult result(statement);
+
+    if (!result.IsDone() &&
+        result.GetBoolean(0))
+    {
+      throw PostgreSQLException("The table \"" + table + "\" of the other storage backend is not empty: "
+                                "Stop Orthanc, and move its attachments with the tool "
+                                "\"OrthancPostgreSQLStorageMigration\" before changing the option "
+                                "\"StorageBackend\"");
+    }
+  }
+
+
+  uint64_t PostgreSQLStorageArea::Migrate(unsigned int batchSize)
+  {
+    if (batchSize == 0)
+    {
+      throw PostgreSQLException("The batches of the migration cannot be empty");
+    }
+
+    PostgreSQLConnectionPool::Accessor accessor(*pool_);
+    PostgreSQLConnection& db = accessor.GetConnection();
+
+    // The content is converted by the server, without round trip
+    // through the client. The large objects of the moved rows are
+    // removed by the rule "StorageAreaDelete".
+    std::string source = GetOtherBackendTable(backend_);
+    std::string copy;
+
+    if (backend_ == PostgreSQLStorageBackend_Bytea)
+    {
+      copy = ("INSERT INTO StorageAreaBytea(uuid, content, type) "
+              "SELECT uuid, lo_get(content), type FROM StorageArea WHERE uuid = ANY($1)");
+    }
+    else
+    {
+      copy = ("INSERT INTO StorageArea(uuid, content, type, size) "
+              "SELECT uuid, lo_from_bytea(0, content), type, length(content) "
+              "FROM StorageAreaBytea WHERE uuid = ANY($1)");
+    }
+
+    if (!db.DoesTableExist(source.c_str()))
+    {
+      return 0;
+    }
+
+    PostgreSQLStatement select(db, "SELECT uuid FROM " + source + " LIMIT $1");
+    select.DeclareInputInteger(0);
+
+    PostgreSQLStatement insert(db, copy);
+    insert.DeclareInputStringArray(0);
+    insert.SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+
+    PostgreSQLStatement remove(db, "DELETE FROM " + source + " WHERE uuid = ANY($1)");
+    remove.DeclareInputStringArray(0);
+    remove.SetTimeoutClass(PostgreSQLStatementClass_LargeObject);
+
+    uint64_t count = 0;
+    std::vector<std::string> uuids;
+    uuids.reserve(batchSize);
+
+    for (;;)
+    {
+      PostgreSQLTransaction transaction(db);
+
+      uuids.clear();
+
+      {
+        select.BindInteger(0, static_cast<int>(batchSize));
+        PostgreSQLResult result(select);
+
+        while (!result.IsDone())
+        {
+          uuids.push_back(result.GetString(0));
+          result.Step();
+        }
+      }
+
+      if (uuids.empty())
+      {
+        transaction.Commit();
+        return count;
+      }
+
+      insert.BindStringArray(0, &uuids[0], uuids.size());
+      insert.Run();
+
+      remove.BindStringArray(0, &uuids[0], uuids.size());
+      remove.Run();
+
+      transaction.Commit();
+      count += uuids.size();
+    }
+  }
+
+
+  PostgreSQLStorageBackend PostgreSQLStorageArea::ParseBackend(const std::string& value)
+  {
+    if (value == "LargeObject")
+    {
+      return PostgreSQLStorageBackend_LargeObject;
+    }
+    else if (value == "Bytea")
+    {
+      return PostgreSQLStorageBackend_Bytea;
+    }
+    else
+    {
+      throw PostgreSQLException("Unknown storage backend: \"" + value + "\"");
+    }
+  }
+
 }
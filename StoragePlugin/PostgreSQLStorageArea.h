@@ -20,33 +20,92 @@
 
 #pragma once
 
+#include "../Core/DurabilityPolicy.h"
 #include "../Core/GlobalProperties.h"
-#include "../Core/PostgreSQLConnection.h"
+#include "../Core/PostgreSQLConnectionPool.h"
+#include "../Core/PostgreSQLLargeObjectWriter.h"
 #include "../Core/PostgreSQLStatement.h"
+#include "../Core/PostgreSQLTransaction.h"
 
 #include <orthanc/OrthancCPlugin.h>
 #include <memory>
-#include <boost/thread/mutex.hpp>
 
 namespace OrthancPlugins
 {  
+  enum PostgreSQLStorageBackend
+  {
+    // Table "StorageArea", whose rows reference large objects
+    PostgreSQLStorageBackend_LargeObject,
+
+    // Table "StorageAreaBytea", whose content is stored out of line
+    // by TOAST. The attachments are limited to 1GB.
+    PostgreSQLStorageBackend_Bytea
+  };
+
   class PostgreSQLStorageArea
   {
   private:
-    std::auto_ptr<PostgreSQLConnection>  db_;
-    GlobalProperties globalProperties_;
+    // Each request is served by its own connection from the pool,
+    // which allows concurrent accesses to the storage area. The
+    // prepared statements are cached inside each connection.
+    std::auto_ptr<PostgreSQLConnectionPool>  pool_;
 
-    boost::mutex mutex_;
-    std::auto_ptr<PostgreSQLStatement>  create_;
-    std::auto_ptr<PostgreSQLStatement>  read_;
-    std::auto_ptr<PostgreSQLStatement>  remove_;
+    // The advisory lock belongs to a PostgreSQL session: It is held
+    // by a dedicated connection that is never handed out by the pool
+    std::auto_ptr<PostgreSQLConnection>  lock_;
+    bool  useLock_;
+    PostgreSQLStorageBackend  backend_;
+    DurabilityPolicy  durability_;
+    size_t  directThreshold_;
+    bool  directAccess_;     // Whether the server is PostgreSQL >= 9.4
+    bool  hasOtherBackend_;  // Whether the table of the other backend exists
+
+    static void Prepare(PostgreSQLConnection& db,
+                        const GlobalProperties& globalProperties,
+                        PostgreSQLStorageBackend backend);
+
+    // Write the attachments of the "bytea" backend, whatever their
+    // size, and the small attachments of the large objects
+    void CreateDirect(PostgreSQLConnection& db,
+                      const std::string& uuid,
+                      const void* content,
+                      size_t size,
+                      OrthancPluginContentType type);
 
-    void Prepare();
 
   public:
-    PostgreSQLStorageArea(PostgreSQLConnection* db,   // Takes the ownership
+    // Creation of an attachment whose content is received by chunks
+    // (e.g. from a decompressor or from the network), without holding
+    // it in memory. The attachment only exists once Commit() is
+    // called, and is discarded if the writer is destroyed before.
+    // With the "bytea" backend, whose values cannot be written by
+    // parts, the content is accumulated in memory until Commit().
+    class Writer : public boost::noncopyable
+    {
+    private:
+      PostgreSQLStorageArea&                        area_;
+      PostgreSQLConnectionPool::Accessor            accessor_;
+      std::auto_ptr<PostgreSQLTransaction>          transaction_;
+      std::auto_ptr<PostgreSQLLargeObjectWriter>    object_;
+      std::string                                   buffer_;
+      std::string                                   uuid_;
+      OrthancPluginContentType                      type_;
+
+    public:
+      Writer(PostgreSQLStorageArea& area,
+             const std::string& uuid,
+             OrthancPluginContentType type);
+
+      void Append(const void* data,
+                  size_t size);
+
+      void Commit();
+    };
+
+    PostgreSQLStorageArea(PostgreSQLConnectionPool* pool,   // Takes the ownership
                           bool useLock,
-                          bool allowUnlock);
+                          bool allowUnlock,
+                          PostgreSQLStorageBackend backend = PostgreSQLStorageBackend_LargeObject);
 
     ~PostgreSQLStorageArea();
 
@@ -55,6 +114,12 @@ namespace OrthancPlugins
                 size_t size,
                 OrthancPluginContentType type);
 
+    // The content is written in place into the buffer, whose size is
+    // given by the size of the attachment stored in the table
+    void Read(PostgreSQLLargeObject::IBuffer& target,
+              const std::string& uuid,
+              OrthancPluginContentType type);
+
     void Read(std::string& content,
               const std::string& uuid,
               OrthancPluginContentType type);
@@ -64,15 +129,62 @@ namespace OrthancPlugins
               const std::string& uuid,
               OrthancPluginContentType type);
 
+    // Read the bytes [offset, offset + length) of an attachment,
+    // without transferring the rest of it. The range is clipped to
+    // the end of the attachment.
+    void ReadRange(std::string& content,
+                   const std::string& uuid,
+                   OrthancPluginContentType type,
+                   uint64_t offset,
+                   size_t length);
+
     void Remove(const std::string& uuid,
                 OrthancPluginContentType type);
 
     void Clear();
 
-    // For unit tests only (not thread-safe)!
-    PostgreSQLConnection& GetConnection()
+    PostgreSQLStorageBackend GetBackend() const
+    {
+      return backend_;
+    }
+
+    // Move the attachments that are stored by the other backend into
+    // the backend of this storage area, by transactions of at most
+    // "batchSize" attachments. The content is copied by the server.
+    // Returns the number of attachments that were moved.
+    uint64_t Migrate(unsigned int batchSize);
+
+    // Throw an exception if the other backend still holds some
+    // attachments, which would not be found by this storage area
+    // (i.e. the option "StorageBackend" was changed, but the
+    // attachments were not migrated)
+    void CheckOtherBackendIsEmpty();
+
+    // "LargeObject" or "Bytea"
+    static PostgreSQLStorageBackend ParseBackend(const std::string& value);
+
+    DurabilityPolicy& GetDurabilityPolicy()
+    {
+      return durability_;
+    }
+
+    // The attachments whose size is below this threshold (in bytes)
+    // are written and read in a single statement, with the functions
+    // "lo_from_bytea()" and "lo_get()" of PostgreSQL >= 9.4, instead
+    // of the client-side interface of the large objects that needs
+    // several round trips. Zero disables this direct access, which
+    // is always the case with older servers.
+    void SetDirectThreshold(size_t threshold);
+
+    size_t GetDirectThreshold() const
+    {
+      return directThreshold_;
+    }
+
+    // For unit tests only!
+    PostgreSQLConnectionPool& GetConnectionPool()
     {
-      return *db_;
+      return *pool_;
     }
   };
 }
@@ -0,0 +1,106 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "PostgreSQLStorageArea.h"
+#include "../Core/PostgreSQLException.h"
+
+#include <iostream>
+#include <memory>
+#include <boost/lexical_cast.hpp>
+
+
+// Quote a value of a libpq connection string
+static std::string QuoteConnectionValue(const std::string& value)
+{
+  std::string s = "'";
+
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    if (value[i] == '\'' ||
+        value[i] == '\\')
+    {
+      s += '\\';
+    }
+
+    s += value[i];
+  }
+
+  return s + "'";
+}
+
+
+// Command-line tool that moves the attachments of the storage area
+// from one backend to the other. The lock of the storage area is
+// taken, so Orthanc must be stopped during the migration. The
+// password is not given on the command line (where it would be
+// visible to the other users): libpq reads it from the environment
+// variable "PGPASSWORD" or from the file "~/.pgpass".
+int main(int argc, char **argv)
+{
+  if (argc < 6)
+  {
+    std::cerr << "Usage: " << argv[0] << " <host> <port> <username> <database> "
+              << "<LargeObject|Bytea> [batch size]"
+              << std::endl << std::endl
+              << "Moves all the attachments into the given storage backend. The password "
+              << "is read from the environment variable PGPASSWORD, or from ~/.pgpass."
+              << std::endl << std::endl
+              << "Example: PGPASSWORD=... " << argv[0] << " localhost 5432 postgres orthanc Bytea 100"
+              << std::endl << std::endl;
+    return -1;
+  }
+
+  try
+  {
+    OrthancPlugins::PostgreSQLStorageBackend backend = 
+      OrthancPlugins::PostgreSQLStorageArea::ParseBackend(argv[5]);
+
+    unsigned int batchSize = 100;
+    if (argc >= 7)
+    {
+      batchSize = boost::lexical_cast<unsigned int>(argv[6]);
+    }
+
+    std::auto_ptr<OrthancPlugins::PostgreSQLConnection> pg(new OrthancPlugins::PostgreSQLConnection);
+    pg->SetConnectionUri("host=" + QuoteConnectionValue(argv[1]) +
+                         " port=" + boost::lexical_cast<std::string>(boost::lexical_cast<uint16_t>(argv[2])) +
+                         " user=" + QuoteConnectionValue(argv[3]) +
+                         " dbname=" + QuoteConnectionValue(argv[4]));
+
+    OrthancPlugins::PostgreSQLStorageArea storage
+      (new OrthancPlugins::PostgreSQLConnectionPool(pg.release(), 1, 1), true, false, backend);
+
+    uint64_t count = storage.Migrate(batchSize);
+
+    std::cout << "Number of attachments that were moved: " << count << std::endl;
+    return 0;
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    std::cerr << "Bad port number or batch size" << std::endl;
+    return -1;
+  }
+  catch (std::runtime_error& e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return -1;
+  }
+}
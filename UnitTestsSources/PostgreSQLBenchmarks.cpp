@@ -0,0 +1,527 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2015 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include <gtest/gtest.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../Core/PostgreSQLCursor.h"
+#include "../Core/PostgreSQLLargeObject.h"
+#include "../Core/PostgreSQLTransaction.h"
+#include "../StoragePlugin/PostgreSQLStorageArea.h"
+
+using namespace OrthancPlugins;
+
+extern PostgreSQLConnection* CreateTestConnection(bool clearAll);
+extern PostgreSQLConnectionPool* CreateTestConnectionPool(bool clearAll);
+
+
+namespace
+{
+  // Values of various lengths, as found in the DICOM tags, the UUIDs
+  // and the public identifiers bound during an ingestion
+  class BindingValues
+  {
+  private:
+    std::vector<std::string>  values_;
+
+  public:
+    BindingValues()
+    {
+      for (size_t i = 0; i < 64; i++)
+      {
+        values_.push_back(std::string(4 + (i * 37) % 150, 'a' + i % 26));
+      }
+    }
+
+    size_t GetSize() const
+    {
+      return values_.size();
+    }
+
+    const std::string& operator[] (size_t i) const
+    {
+      return values_[i % values_.size()];
+    }
+  };
+
+
+  class Chronometer
+  {
+  private:
+    boost::posix_time::ptime  start_;
+
+  public:
+    Chronometer() : 
+      start_(boost::posix_time::microsec_clock::universal_time())
+    {
+    }
+
+    double GetMilliseconds() const
+    {
+      boost::posix_time::time_duration d = boost::posix_time::microsec_clock::universal_time() - start_;
+      return static_cast<double>(d.total_microseconds()) / 1000.0;
+    }
+
+    double GetNanosecondsPerItem(size_t count) const
+    {
+      boost::posix_time::time_duration d = boost::posix_time::microsec_clock::universal_time() - start_;
+      return 1000.0 * static_cast<double>(d.total_microseconds()) / static_cast<double>(count);
+    }
+  };
+}
+
+
+static const size_t BINDING_ITERATIONS = 1000000;
+static const int SCAN_ROWS = 1000000;
+
+
+// Peak of the resident memory of the process, in KB
+static long GetPeakMemory()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+
+template <typename Iterator>
+static void ScanRows(double& firstRow,
+                     double& total,
+                     Iterator& it,
+                     const Chronometer& chronometer)
+{
+  firstRow = chronometer.GetMilliseconds();
+
+  int count = 0;
+  size_t size = 0;
+  while (!it.IsDone())
+  {
+    size += it.GetString(1).size();
+    count++;
+    it.Step();
+  }
+
+  total = chronometer.GetMilliseconds();
+  ASSERT_EQ(SCAN_ROWS, count);
+  ASSERT_LT(0u, size);
+}
+
+
+TEST(PostgreSQLBenchmarks, BindString)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(false));
+
+  PostgreSQLStatement s(*pg, "SELECT $1::TEXT, $2::TEXT, $3");
+  s.DeclareInputString(0);
+  s.DeclareInputString(1);
+  s.DeclareInputInteger64(2);
+
+  BindingValues values;
+
+  // Warm-up: The buffers grow to the largest value
+  for (size_t i = 0; i < values.GetSize(); i++)
+  {
+    s.BindString(0, values[i]);
+    s.BindString(1, values[i + 1]);
+    s.BindInteger64(2, i);
+  }
+
+  unsigned int allocations = s.GetInputsAllocationsCount();
+
+  double statement;
+
+  {
+    Chronometer chronometer;
+
+    for (size_t i = 0; i < BINDING_ITERATIONS; i++)
+    {
+      s.BindString(0, values[i]);
+      s.BindString(1, values[i + 7]);
+      s.BindInteger64(2, i);
+    }
+
+    statement = chronometer.GetNanosecondsPerItem(3 * BINDING_ITERATIONS);
+  }
+
+  // No allocation in steady state
+  ASSERT_EQ(allocations, s.GetInputsAllocationsCount());
+
+  // Reference: One heap round trip per change of size, which was the
+  // behavior of the previous layout of the parameters
+  double reference;
+
+  {
+    char* slots[3] = { NULL, NULL, NULL };
+    size_t sizes[3] = { 0, 0, 0 };
+
+    Chronometer chronometer;
+
+    for (size_t i = 0; i < BINDING_ITERATIONS; i++)
+    {
+      int64_t integer = static_cast<int64_t>(i);
+      const void* v[3] = { values[i].c_str(), values[i + 7].c_str(), &integer };
+      size_t lengths[3] = { values[i].size() + 1, values[i + 7].size() + 1, sizeof(int64_t) };
+
+      for (size_t j = 0; j < 3; j++)
+      {
+        size_t size = lengths[j];
+
+        if (sizes[j] != size)
+        {
+          free(slots[j]);
+          slots[j] = reinterpret_cast<char*>(malloc(size));
+          sizes[j] = size;
+        }
+
+        memcpy(slots[j], v[j], size);
+      }
+    }
+
+    reference = chronometer.GetNanosecondsPerItem(3 * BINDING_ITERATIONS);
+
+    for (size_t j = 0; j < 3; j++)
+    {
+      free(slots[j]);
+    }
+  }
+
+  printf("Binding a parameter: %.1f ns (reference with one allocation per change of size: %.1f ns)\n",
+         statement, reference);
+}
+
+
+TEST(PostgreSQLBenchmarks, Scan)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(false));
+
+  PostgreSQLStatement s(*pg, "SELECT i, md5(i::text) FROM generate_series(1, $1) AS i");
+  s.DeclareInputInteger(0);
+  s.BindInteger(0, SCAN_ROWS);
+
+  PostgreSQLTransaction t(*pg);
+
+  // The peak of the memory never decreases, so the scans are run by
+  // increasing memory footprint
+  const char* names[3] = { "Cursor", "Streaming result", "Buffered result" };
+  double firstRow[3], total[3];
+  long memory[3];
+
+  for (int i = 0; i < 3; i++)
+  {
+    long before = GetPeakMemory();
+    Chronometer chronometer;
+
+    switch (i)
+    {
+      case 0:
+      {
+        PostgreSQLCursor cursor(s);
+        ScanRows(firstRow[i], total[i], cursor, chronometer);
+        break;
+      }
+
+      case 1:
+      {
+        PostgreSQLResult result(s, PostgreSQLResultMode_Streaming);
+        ScanRows(firstRow[i], total[i], result, chronometer);
+        break;
+      }
+
+      default:
+      {
+        PostgreSQLResult result(s);
+        ScanRows(firstRow[i], total[i], result, chronometer);
+        break;
+      }
+    }
+
+    memory[i] = GetPeakMemory() - before;
+  }
+
+  t.Commit();
+
+  for (int i = 0; i < 3; i++)
+  {
+    printf("Scan of %d rows with a %s: First row after %.1f ms, %.1f ms in total, +%ld KB of peak memory\n",
+           SCAN_ROWS, names[i], firstRow[i], total[i], memory[i]);
+  }
+}
+
+
+TEST(PostgreSQLBenchmarks, ReadIntegerColumn)
+{
+  static const int ROWS = 1000000;
+
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(false));
+
+  PostgreSQLStatement s(*pg, "SELECT i::INT8 FROM generate_series(1, $1) AS i");
+  s.DeclareInputInteger(0);
+  s.BindInteger(0, ROWS);
+
+  double cells, batch;
+
+  {
+    PostgreSQLResult r(s);
+    std::vector<int64_t> values;
+    values.reserve(ROWS);
+
+    Chronometer chronometer;
+
+    while (!r.IsDone())
+    {
+      values.push_back(r.GetInteger64(0));
+      r.Step();
+    }
+
+    cells = chronometer.GetNanosecondsPerItem(ROWS);
+    ASSERT_EQ(static_cast<size_t>(ROWS), values.size());
+  }
+
+  {
+    PostgreSQLResult r(s);
+    std::vector<int64_t> values;
+    values.reserve(ROWS);
+
+    Chronometer chronometer;
+    r.ReadInteger64Column(values, 0);
+    batch = chronometer.GetNanosecondsPerItem(ROWS);
+
+    ASSERT_EQ(static_cast<size_t>(ROWS), values.size());
+    ASSERT_EQ(ROWS, values.back());
+  }
+
+  printf("Decoding an INT8 column: %.1f million rows/s in batch, %.1f million rows/s cell by cell\n",
+         1000.0 / batch, 1000.0 / cells);
+}
+
+
+TEST(PostgreSQLBenchmarks, StorageArea)
+{
+  static const size_t ITERATIONS = 200;
+
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+  PostgreSQLStorageArea storage(pool.release(), true, true);
+
+  const size_t sizes[] = { 1024, 16 * 1024, 256 * 1024, 1024 * 1024 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++)
+  {
+    std::string value(sizes[i], 'x');
+
+    // Without, then with the single-statement access
+    double write[2], read[2];
+
+    for (size_t direct = 0; direct < 2; direct++)
+    {
+      storage.SetDirectThreshold(direct ? sizes[i] : 0);
+
+      {
+        Chronometer chronometer;
+
+        for (size_t j = 0; j < ITERATIONS; j++)
+        {
+          storage.Create(boost::lexical_cast<std::string>(j), value.c_str(), value.size(),
+                         OrthancPluginContentType_Dicom);
+        }
+
+        write[direct] = chronometer.GetNanosecondsPerItem(ITERATIONS) / 1000.0;
+      }
+
+      {
+        Chronometer chronometer;
+        std::string content;
+
+        for (size_t j = 0; j < ITERATIONS; j++)
+        {
+          storage.Read(content, boost::lexical_cast<std::string>(j), OrthancPluginContentType_Dicom);
+        }
+
+        read[direct] = chronometer.GetNanosecondsPerItem(ITERATIONS) / 1000.0;
+        ASSERT_EQ(value, content);
+      }
+
+      storage.Clear();
+    }
+
+    printf("Attachment of %d KB: Write in %.0f us (%.0f us with lo_from_bytea), "
+           "read in %.0f us (%.0f us with lo_get)\n", static_cast<int>(sizes[i] / 1024),
+           write[0], write[1], read[0], read[1]);
+  }
+}
+
+
+TEST(PostgreSQLBenchmarks, LargeObjectChunks)
+{
+  static const size_t ITERATIONS = 10;
+  static const size_t SIZE = 64 * 1024 * 1024;
+
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  std::string value(SIZE, 'x');
+  std::string oid;
+
+  {
+    PostgreSQLTransaction t(*pg);
+    PostgreSQLLargeObject obj(*pg, value);
+    oid = obj.GetOid();
+    t.Commit();
+  }
+
+  // Fixed chunks of 16MB (as before the tuning), then learned chunks,
+  // with the synchronous calls to "lo_read()", then with streaming
+  const struct
+  {
+    size_t       minChunkSize_;
+    size_t       maxChunkSize_;
+    bool         streaming_;
+    const char*  name_;
+  } modes[] = {
+    { SIZE / 4, SIZE / 4, false, "fixed chunks" },
+    { 64 * 1024, SIZE / 4, false, "learned chunks" },
+    { 64 * 1024, SIZE / 4, true, "learned chunks and streaming" }
+  };
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+  {
+    pg->GetLargeObjectChunks().SetBounds(modes[i].minChunkSize_, modes[i].maxChunkSize_);
+    pg->SetLargeObjectStreaming(modes[i].streaming_);
+
+    std::string content;
+    Chronometer chronometer;
+
+    for (size_t j = 0; j < ITERATIONS; j++)
+    {
+      PostgreSQLTransaction t(*pg);
+      PostgreSQLLargeObject::Read(content, *pg, oid);
+    }
+
+    double ms = chronometer.GetMilliseconds() / static_cast<double>(ITERATIONS);
+    ASSERT_EQ(value, content);
+
+    ChunkSizeTuner::Statistics statistics;
+    pg->GetLargeObjectChunks().GetStatistics(statistics);
+
+    printf("Read of %d MB with %s: %.1f ms (%.0f MB/s), chunks of %d KB, latency of %.2f ms\n",
+           static_cast<int>(SIZE / (1024 * 1024)), modes[i].name_, ms,
+           static_cast<double>(SIZE) / (1024.0 * 1024.0) / (ms / 1000.0),
+           static_cast<int>(statistics.chunkSize_ / 1024), statistics.latency_ * 1000.0);
+  }
+}
+
+
+static void BenchmarkStorageBackends(const size_t* sizes,
+                                     size_t count)
+{
+  const struct
+  {
+    PostgreSQLStorageBackend  backend_;
+    const char*               name_;
+  } backends[] = {
+    { PostgreSQLStorageBackend_LargeObject, "large objects" },
+    { PostgreSQLStorageBackend_Bytea, "bytea" }
+  };
+
+  for (size_t i = 0; i < count; i++)
+  {
+    // About 64MB per measure, between 1 and 100 attachments
+    size_t iterations = (64 * 1024 * 1024) / sizes[i];
+    if (iterations < 1)
+    {
+      iterations = 1;
+    }
+    else if (iterations > 100)
+    {
+      iterations = 100;
+    }
+
+    std::string value(sizes[i], 'x');
+    const double megabytes = static_cast<double>(sizes[i] * iterations) / (1024.0 * 1024.0);
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+      PostgreSQLStorageArea storage(CreateTestConnectionPool(true), true, true, backends[b].backend_);
+
+      double create, read, remove;
+
+      {
+        Chronometer chronometer;
+
+        for (size_t j = 0; j < iterations; j++)
+        {
+          storage.Create(boost::lexical_cast<std::string>(j), value.c_str(), value.size(),
+                         OrthancPluginContentType_Dicom);
+        }
+
+        create = chronometer.GetMilliseconds() / 1000.0;
+      }
+
+      {
+        Chronometer chronometer;
+        std::string content;
+
+        for (size_t j = 0; j < iterations; j++)
+        {
+          storage.Read(content, boost::lexical_cast<std::string>(j), OrthancPluginContentType_Dicom);
+        }
+
+        read = chronometer.GetMilliseconds() / 1000.0;
+        ASSERT_EQ(value.size(), content.size());
+      }
+
+      {
+        Chronometer chronometer;
+
+        for (size_t j = 0; j < iterations; j++)
+        {
+          storage.Remove(boost::lexical_cast<std::string>(j), OrthancPluginContentType_Dicom);
+        }
+
+        remove = chronometer.GetMilliseconds() / 1000.0;
+      }
+
+      printf("%d attachments of %d KB with %s: Ingest at %.1f MB/s, read at %.1f MB/s, "
+             "delete at %.0f attachments/s\n", static_cast<int>(iterations),
+             static_cast<int>(sizes[i] / 1024), backends[b].name_,
+             megabytes / create, megabytes / read, static_cast<double>(iterations) / remove);
+    }
+  }
+}
+
+
+TEST(PostgreSQLBenchmarks, StorageBackends)
+{
+  const size_t sizes[] = { 1024, 100 * 1024, 10 * 1024 * 1024 };
+  BenchmarkStorageBackends(sizes, sizeof(sizes) / sizeof(size_t));
+}
+
+
+// Needs several GB of memory on the client and on the server: Run
+// with "--gtest_also_run_disabled_tests"
+TEST(PostgreSQLBenchmarks, DISABLED_StorageBackendsHuge)
+{
+  const size_t sizes[] = { 500 * 1024 * 1024 };
+  BenchmarkStorageBackends(sizes, sizeof(sizes) / sizeof(size_t));
+}
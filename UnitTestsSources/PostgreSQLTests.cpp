@@ -21,16 +21,28 @@
 #include <gtest/gtest.h>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
+#include "../Core/Configuration.h"
+#include "../Core/DurabilityPolicy.h"
+#include "../Core/GlobalProperties.h"
+#include "../Core/PostgreSQLCopyWriter.h"
+#include "../Core/PostgreSQLCursor.h"
 #include "../Core/PostgreSQLTransaction.h"
+#include "../Core/PostgreSQLTypedStatement.h"
 #include "../Core/PostgreSQLResult.h"
 #include "../Core/PostgreSQLLargeObject.h"
+#include "../Core/PostgreSQLLargeObjectWriter.h"
 #include "../Core/PostgreSQLException.h"
+#include "../Core/PostgreSQLEventLoop.h"
+#include "../Core/PostgreSQLReadRouter.h"
+#include "../Core/PostgreSQLStatementCatalog.h"
 #include "../StoragePlugin/PostgreSQLStorageArea.h"
 
 using namespace OrthancPlugins;
 
 extern PostgreSQLConnection* CreateTestConnection(bool clearAll);
+extern PostgreSQLConnectionPool* CreateTestConnectionPool(bool clearAll);
 
 
 static int64_t CountLargeObjects(PostgreSQLConnection& db)
@@ -43,6 +55,25 @@ static int64_t CountLargeObjects(PostgreSQLConnection& db)
 }
 
 
+static int64_t CountLargeObjects(PostgreSQLConnectionPool& pool)
+{
+  PostgreSQLConnectionPool::Accessor accessor(pool);
+  return CountLargeObjects(accessor.GetConnection());
+}
+
+
+static int64_t CountLargeObjectsMetadata(PostgreSQLConnectionPool& pool)
+{
+  // Contrarily to "pg_largeobject" that contains one row per page of
+  // 2KB, "pg_largeobject_metadata" contains one row per large object
+  PostgreSQLConnectionPool::Accessor accessor(pool);
+  PostgreSQLTransaction t(accessor.GetConnection());
+  PostgreSQLStatement s(accessor.GetConnection(), "SELECT COUNT(*) FROM pg_catalog.pg_largeobject_metadata");
+  PostgreSQLResult r(s);
+  return r.GetInteger64(0);
+}
+
+
 TEST(PostgreSQL, Basic)
 {
   std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
@@ -162,6 +193,119 @@ TEST(PostgreSQL, String)
 }
 
 
+TEST(PostgreSQL, StringReference)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  pg->Execute("CREATE TABLE Test(name TEXT, value BYTEA)");
+
+  PostgreSQLStatement s(*pg, "INSERT INTO Test VALUES ($1,$2)");
+  s.DeclareInputString(0);
+  s.DeclareInputBinary(1);
+
+  // The byte arrays are sent in binary format, with their exact length
+  const char binary[] = { 'a', '\\', 'x', '\0', 'b', '\'' };
+  std::string name = "binary";
+  s.BindStringReference(0, name.c_str());
+  s.BindStringReference(1, binary, sizeof(binary));
+  s.Run();
+
+  s.BindStringReference(0, "empty");
+  s.BindStringReference(1, "", 0);
+  s.Run();
+
+  s.BindString(0, "copy");
+  s.BindString(1, std::string(binary, sizeof(binary)));
+  s.Run();
+
+  {
+    PostgreSQLStatement t(*pg, "SELECT name, value, length(value) FROM Test ORDER BY name");
+    PostgreSQLResult r(t);
+
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_EQ("binary", r.GetString(0));
+    ASSERT_EQ(std::string(binary, sizeof(binary)), r.GetString(1));
+    ASSERT_EQ(6, r.GetInteger(2));
+
+    r.Step();
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_EQ("copy", r.GetString(0));
+    ASSERT_EQ(std::string(binary, sizeof(binary)), r.GetString(1));
+
+    r.Step();
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_EQ("empty", r.GetString(0));
+    ASSERT_FALSE(r.IsNull(1));
+    ASSERT_EQ("", r.GetString(1));
+
+    r.Step();
+    ASSERT_TRUE(r.IsDone());
+  }
+}
+
+
+TEST(PostgreSQL, Arrays)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  pg->Execute("CREATE TABLE Test(id BIGINT, name INTEGER, label TEXT, value BYTEA)");
+
+  PostgreSQLStatement s(*pg, "INSERT INTO Test SELECT * FROM unnest($1, $2, $3, $4)");
+  s.DeclareInputInteger64Array(0);
+  s.DeclareInputIntegerArray(1);
+  s.DeclareInputStringArray(2);
+  s.DeclareInputBinaryArray(3);
+
+  const int64_t ids[] = { 1, -2, 0x100000000ll };
+  const int32_t names[] = { 10, 20, -30 };
+  const std::string labels[] = { "hello", "", "world" };
+  const std::string values[] = { std::string("a\0b", 3), "\\x", "" };
+
+  s.BindInteger64Array(0, ids, 3);
+  s.BindIntegerArray(1, names, 3);
+  s.BindStringArray(2, labels, 3);
+  s.BindStringArray(3, values, 3);
+  s.Run();
+
+  // Empty arrays
+  s.BindInteger64Array(0, NULL, 0);
+  s.BindIntegerArray(1, NULL, 0);
+  s.BindStringArray(2, NULL, 0);
+  s.BindStringArray(3, NULL, 0);
+  s.Run();
+
+  ASSERT_THROW(s.BindIntegerArray(0, names, 3), PostgreSQLException);
+
+  {
+    PostgreSQLStatement t(*pg, "SELECT id, name, label, value FROM Test ORDER BY id");
+    PostgreSQLResult r(t);
+
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_EQ(-2, r.GetInteger64(0));
+    ASSERT_EQ(20, r.GetInteger(1));
+    ASSERT_EQ("", r.GetString(2));
+    ASSERT_EQ("\\x", r.GetString(3));
+
+    r.Step();
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_EQ(1, r.GetInteger64(0));
+    ASSERT_EQ(10, r.GetInteger(1));
+    ASSERT_EQ("hello", r.GetString(2));
+    ASSERT_EQ(std::string("a\0b", 3), r.GetString(3));
+
+    r.Step();
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_EQ(0x100000000ll, r.GetInteger64(0));
+    ASSERT_EQ(-30, r.GetInteger(1));
+    ASSERT_EQ("world", r.GetString(2));
+    ASSERT_EQ("", r.GetString(3));
+
+    r.Step();
+    ASSERT_TRUE(r.IsDone());
+  }
+}
+
+
 TEST(PostgreSQL, Transaction)
 {
   std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
@@ -311,10 +455,10 @@ TEST(PostgreSQL, LargeObject)
 
 TEST(PostgreSQL, StorageArea)
 {
-  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
-  PostgreSQLStorageArea s(pg.release(), true, true);
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+  PostgreSQLStorageArea s(pool.release(), true, true);
 
-  ASSERT_EQ(0, CountLargeObjects(s.GetConnection()));
+  ASSERT_EQ(0, CountLargeObjects(s.GetConnectionPool()));
   
   for (int i = 0; i < 10; i++)
   {
@@ -326,9 +470,9 @@ TEST(PostgreSQL, StorageArea)
   std::string tmp;
   ASSERT_THROW(s.Read(tmp, "nope", OrthancPluginContentType_Unknown), PostgreSQLException);
   
-  ASSERT_EQ(10, CountLargeObjects(s.GetConnection()));
+  ASSERT_EQ(10, CountLargeObjects(s.GetConnectionPool()));
   s.Remove("5", OrthancPluginContentType_Unknown);
-  ASSERT_EQ(9, CountLargeObjects(s.GetConnection()));
+  ASSERT_EQ(9, CountLargeObjects(s.GetConnectionPool()));
 
   for (int i = 0; i < 10; i++)
   {
@@ -348,5 +492,1529 @@ TEST(PostgreSQL, StorageArea)
   }
 
   s.Clear();
-  ASSERT_EQ(0, CountLargeObjects(s.GetConnection()));
+  ASSERT_EQ(0, CountLargeObjects(s.GetConnectionPool()));
+}
+
+
+TEST(PostgreSQL, StorageAreaUpgrade)
+{
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+
+  {
+    // Schema written by the previous versions of the plugin, without
+    // the "size" column
+    PostgreSQLConnectionPool::Accessor accessor(*pool);
+    PostgreSQLConnection& db = accessor.GetConnection();
+    db.Execute("CREATE TABLE StorageArea("
+               "uuid VARCHAR NOT NULL PRIMARY KEY,"
+               "content OID NOT NULL,"
+               "type INTEGER NOT NULL)");
+    db.Execute("CREATE RULE StorageAreaDelete AS ON DELETE TO StorageArea DO SELECT lo_unlink(old.content);");
+    db.Execute("INSERT INTO StorageArea VALUES ('legacy', lo_from_bytea(0, 'Hello'), 1)");
+
+    GlobalProperties p(db, false, GlobalProperty_StorageLock);
+    p.Lock(false);
+    ASSERT_TRUE(p.HasSchemaElement(SchemaElement_StorageArea));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_StorageAreaSize));
+  }
+
+  PostgreSQLStorageArea s(pool.release(), false, false);
+
+  {
+    PostgreSQLConnectionPool::Accessor accessor(s.GetConnectionPool());
+    GlobalProperties p(accessor.GetConnection(), false, GlobalProperty_StorageLock);
+    p.Lock(false);
+    ASSERT_TRUE(p.HasSchemaElement(SchemaElement_StorageAreaSize));
+  }
+
+  std::string content;
+  s.Read(content, "legacy", OrthancPluginContentType_Dicom);
+  ASSERT_EQ("Hello", content);
+
+  s.Create("new", "World", 5, OrthancPluginContentType_Dicom);
+  s.Read(content, "new", OrthancPluginContentType_Dicom);
+  ASSERT_EQ("World", content);
+
+  s.Clear();
+  ASSERT_EQ(0, CountLargeObjectsMetadata(s.GetConnectionPool()));
+}
+
+
+TEST(PostgreSQL, StorageAreaDirectAccess)
+{
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+  PostgreSQLStorageArea s(pool.release(), true, true);
+
+  s.SetDirectThreshold(100);
+  s.GetDurabilityPolicy().SetAttachment(OrthancPluginContentType_Dicom, PostgreSQLDurability_Relaxed);
+
+  // Sizes around the threshold, either written directly or through
+  // the client-side interface of the large objects
+  const size_t sizes[] = { 0, 1, 99, 100, 101, 5000 };
+  const size_t count = sizeof(sizes) / sizeof(size_t);
+
+  for (size_t direct = 0; direct < 2; direct++)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      std::string value(sizes[i], '\0');
+      for (size_t j = 0; j < value.size(); j++)
+      {
+        value[j] = static_cast<char>(j * 7 + i);
+      }
+
+      std::string uuid = boost::lexical_cast<std::string>(direct) + "-" + boost::lexical_cast<std::string>(i);
+      s.SetDirectThreshold(direct ? 100 : 0);
+      s.Create(uuid, value.empty() ? NULL : value.c_str(), value.size(),
+               (i % 2) ? OrthancPluginContentType_Dicom : OrthancPluginContentType_Unknown);
+
+      // Read back with and without the direct access
+      for (size_t k = 0; k < 2; k++)
+      {
+        std::string content;
+        s.SetDirectThreshold(k ? 100 : 0);
+        s.Read(content, uuid, (i % 2) ? OrthancPluginContentType_Dicom : OrthancPluginContentType_Unknown);
+        ASSERT_EQ(value, content);
+      }
+    }
+  }
+
+  ASSERT_EQ(2 * static_cast<int64_t>(count), CountLargeObjectsMetadata(s.GetConnectionPool()));
+
+  std::string tmp;
+  ASSERT_THROW(s.Read(tmp, "nope", OrthancPluginContentType_Unknown), PostgreSQLException);
+  ASSERT_THROW(s.Read(tmp, "1-0", OrthancPluginContentType_Dicom), PostgreSQLException);
+  ASSERT_THROW(s.SetDirectThreshold(2u * 1024u * 1024u * 1024u), PostgreSQLException);
+
+  s.Remove("1-1", OrthancPluginContentType_Dicom);
+  ASSERT_EQ(2 * static_cast<int64_t>(count) - 1, CountLargeObjectsMetadata(s.GetConnectionPool()));
+
+  s.Clear();
+  ASSERT_EQ(0, CountLargeObjectsMetadata(s.GetConnectionPool()));
+}
+
+
+namespace
+{
+  // Buffer provided by the caller, whose capacity is fixed
+  class FixedBuffer : public PostgreSQLLargeObject::IBuffer
+  {
+  private:
+    std::vector<char>  buffer_;
+    size_t             size_;
+
+  public:
+    explicit FixedBuffer(size_t capacity) :
+      buffer_(capacity),
+      size_(0)
+    {
+    }
+
+    virtual void* Allocate(size_t size)
+    {
+      if (size > buffer_.size())
+      {
+        throw PostgreSQLException("Too small buffer");
+      }
+
+      size_ = size;
+      return &buffer_[0];
+    }
+
+    std::string GetContent() const
+    {
+      return std::string(&buffer_[0], size_);
+    }
+  };
+}
+
+
+TEST(PostgreSQL, StorageAreaReadInPlace)
+{
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+  PostgreSQLStorageArea s(pool.release(), true, true);
+
+  std::string small(50, 's');
+  std::string large(500, 'l');
+  s.SetDirectThreshold(100);
+  s.Create("small", small.c_str(), small.size(), OrthancPluginContentType_Dicom);
+  s.Create("large", large.c_str(), large.size(), OrthancPluginContentType_Dicom);
+  s.Create("empty", NULL, 0, OrthancPluginContentType_Dicom);
+
+  for (int legacy = 0; legacy < 2; legacy++)
+  {
+    if (legacy)
+    {
+      // Rows written by the previous versions of the plugin
+      PostgreSQLConnectionPool::Accessor accessor(s.GetConnectionPool());
+      accessor.GetConnection().Execute("UPDATE StorageArea SET size = NULL");
+    }
+
+    for (size_t threshold = 0; threshold <= 100; threshold += 100)
+    {
+      s.SetDirectThreshold(threshold);
+
+      FixedBuffer buffer(1000);
+      s.Read(buffer, "small", OrthancPluginContentType_Dicom);
+      ASSERT_EQ(small, buffer.GetContent());
+      s.Read(buffer, "large", OrthancPluginContentType_Dicom);
+      ASSERT_EQ(large, buffer.GetContent());
+      s.Read(buffer, "empty", OrthancPluginContentType_Dicom);
+      ASSERT_TRUE(buffer.GetContent().empty());
+
+      FixedBuffer tooSmall(100);
+      ASSERT_THROW(s.Read(tooSmall, "large", OrthancPluginContentType_Dicom), PostgreSQLException);
+
+      void* content = NULL;
+      size_t size = 42;
+      s.Read(content, size, "large", OrthancPluginContentType_Dicom);
+      ASSERT_EQ(large.size(), size);
+      ASSERT_EQ(0, memcmp(content, large.c_str(), size));
+      free(content);
+
+      std::string target;
+      s.Read(target, "small", OrthancPluginContentType_Dicom);
+      ASSERT_EQ(small, target);
+    }
+  }
+
+  s.Clear();
+}
+
+
+TEST(PostgreSQL, StorageAreaReadRange)
+{
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+  PostgreSQLStorageArea s(pool.release(), true, true);
+
+  std::string value(5000, '\0');
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    value[i] = static_cast<char>(i % 251);
+  }
+
+  s.SetDirectThreshold(0);
+  s.Create("hello", value.c_str(), value.size(), OrthancPluginContentType_Dicom);
+
+  // Ranges read through "lo_get()" or "lo_lseek64()"
+  for (size_t threshold = 0; threshold <= 100; threshold += 100)
+  {
+    s.SetDirectThreshold(threshold);
+
+    std::string content;
+    s.ReadRange(content, "hello", OrthancPluginContentType_Dicom, 0, 10);
+    ASSERT_EQ(value.substr(0, 10), content);
+
+    s.ReadRange(content, "hello", OrthancPluginContentType_Dicom, 1234, 100);
+    ASSERT_EQ(value.substr(1234, 100), content);
+
+    s.ReadRange(content, "hello", OrthancPluginContentType_Dicom, 4000, 2000);
+    ASSERT_EQ(value.substr(4000), content);
+
+    s.ReadRange(content, "hello", OrthancPluginContentType_Dicom, 4990, 50);
+    ASSERT_EQ(value.substr(4990), content);
+
+    s.ReadRange(content, "hello", OrthancPluginContentType_Dicom, 6000, 50);
+    ASSERT_TRUE(content.empty());
+
+    s.ReadRange(content, "hello", OrthancPluginContentType_Dicom, 10, 0);
+    ASSERT_TRUE(content.empty());
+
+    ASSERT_THROW(s.ReadRange(content, "nope", OrthancPluginContentType_Dicom, 0, 10), PostgreSQLException);
+  }
+
+  s.Clear();
+}
+
+
+TEST(PostgreSQL, LargeObjectWriter)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  ASSERT_THROW(PostgreSQLLargeObjectWriter w(*pg), PostgreSQLException);
+
+  std::string expected;
+  std::string oid;
+
+  {
+    PostgreSQLTransaction t(*pg);
+    PostgreSQLLargeObjectWriter writer(*pg, 100);
+
+    // Chunks that are smaller, equal and larger than the buffer
+    const size_t sizes[] = { 1, 0, 30, 99, 100, 250, 7, 1000, 3 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++)
+    {
+      std::string chunk(sizes[i], static_cast<char>('a' + i));
+      writer.Append(chunk.c_str(), chunk.size());
+      expected += chunk;
+    }
+
+    writer.Finish();
+    ASSERT_EQ(expected.size(), writer.GetSize());
+    ASSERT_THROW(writer.Append("a", 1), PostgreSQLException);
+
+    oid = writer.GetOid();
+    t.Commit();
+  }
+
+  ASSERT_EQ(1, CountLargeObjects(*pg));
+
+  {
+    PostgreSQLTransaction t(*pg);
+    std::string content;
+    PostgreSQLLargeObject::Read(content, *pg, oid);
+    ASSERT_EQ(expected, content);
+  }
+
+  // An unfinished writer removes its large object
+  {
+    PostgreSQLTransaction t(*pg);
+
+    {
+      PostgreSQLLargeObjectWriter writer(*pg);
+      writer.Append("Hello", 5);
+    }
+
+    t.Commit();
+  }
+
+  ASSERT_EQ(1, CountLargeObjects(*pg));
+}
+
+
+TEST(PostgreSQL, ChunkSizeTuner)
+{
+  ChunkSizeTuner tuner;
+  ASSERT_THROW(tuner.SetBounds(0, 1024), PostgreSQLException);
+  ASSERT_THROW(tuner.SetBounds(2048, 1024), PostgreSQLException);
+  ASSERT_THROW(tuner.SetTargetDuration(0), PostgreSQLException);
+
+  tuner.SetBounds(64 * 1024, 64 * 1024 * 1024);
+  tuner.SetTargetDuration(100);
+
+  // Simulated link with a latency of 10ms and a bandwidth of 100MB/s:
+  // The chunks converge to "B * (T - L)", i.e. 9MB
+  const double latency = 0.01;
+  const double bandwidth = 100.0 * 1024.0 * 1024.0;
+
+  for (int i = 0; i < 100; i++)
+  {
+    size_t chunk = tuner.GetChunkSize();
+    double duration = latency + static_cast<double>(chunk) / bandwidth;
+    tuner.Record(chunk, static_cast<uint64_t>(duration * 1000000.0));
+  }
+
+  ChunkSizeTuner::Statistics statistics;
+  tuner.GetStatistics(statistics);
+  ASSERT_EQ(100u, statistics.operations_);
+  ASSERT_NEAR(9.0 * 1024.0 * 1024.0, static_cast<double>(statistics.chunkSize_), 0.5 * 1024.0 * 1024.0);
+  ASSERT_NEAR(latency, statistics.latency_, 0.001);
+  ASSERT_NEAR(bandwidth, tuner.GetBandwidth(), 0.05 * bandwidth);
+
+  // The bounds are enforced
+  tuner.SetBounds(64 * 1024, 1024 * 1024);
+  ASSERT_EQ(0u, tuner.GetChunkSize(0));
+  ASSERT_EQ(10u, tuner.GetChunkSize(10));
+
+  for (int i = 0; i < 100; i++)
+  {
+    tuner.Record(tuner.GetChunkSize(), 1000);
+  }
+
+  ASSERT_EQ(1024u * 1024u, tuner.GetChunkSize());
+}
+
+
+TEST(PostgreSQL, LargeObjectStreaming)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  // Small chunks, so that each object is read in several chunks
+  pg->GetLargeObjectChunks().SetBounds(1000, 1000);
+
+  std::string content(100000, '\0');
+  for (size_t i = 0; i < content.size(); i++)
+  {
+    content[i] = static_cast<char>(i * 7);
+  }
+
+  std::string oid;
+
+  {
+    PostgreSQLTransaction t(*pg);
+    PostgreSQLLargeObject obj(*pg, content);
+    oid = obj.GetOid();
+    t.Commit();
+  }
+
+  for (int streaming = 0; streaming < 2; streaming++)
+  {
+    pg->SetLargeObjectStreaming(streaming == 1);
+    ASSERT_EQ(streaming == 1, pg->IsLargeObjectStreaming());
+
+    PostgreSQLTransaction t(*pg);
+
+    std::string s;
+    PostgreSQLLargeObject::Read(s, *pg, oid);
+    ASSERT_EQ(content, s);
+
+    // Size that is known in advance
+    PostgreSQLLargeObject::StringBuffer buffer(s);
+    PostgreSQLLargeObject::Read(buffer, *pg, oid, 12345);
+    ASSERT_EQ(content.substr(0, 12345), s);
+  }
+
+  ChunkSizeTuner::Statistics statistics;
+  pg->GetLargeObjectChunks().GetStatistics(statistics);
+  ASSERT_EQ(1000u, statistics.chunkSize_);
+  ASSERT_EQ(100000u + 2u * (100000u + 12345u), statistics.bytes_);
+  ASSERT_EQ(100u + 2u * (100u + 13u), statistics.operations_);
+
+  // The connections of a pool inherit the bounds, but not the statistics
+  PostgreSQLConnection copy(*pg);
+  copy.GetLargeObjectChunks().GetStatistics(statistics);
+  ASSERT_EQ(1000u, statistics.chunkSize_);
+  ASSERT_EQ(0u, statistics.bytes_);
+  ASSERT_TRUE(copy.IsLargeObjectStreaming());
+}
+
+
+TEST(PostgreSQL, StorageAreaWriter)
+{
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+  PostgreSQLStorageArea s(pool.release(), true, true);
+
+  {
+    PostgreSQLStorageArea::Writer writer(s, "hello", OrthancPluginContentType_Dicom);
+    writer.Append("Hello ", 6);
+    writer.Append("world", 5);
+    writer.Commit();
+  }
+
+  {
+    // Not committed
+    PostgreSQLStorageArea::Writer writer(s, "nope", OrthancPluginContentType_Dicom);
+    writer.Append("Nope", 4);
+  }
+
+  ASSERT_EQ(1, CountLargeObjects(s.GetConnectionPool()));
+
+  std::string content;
+  s.Read(content, "hello", OrthancPluginContentType_Dicom);
+  ASSERT_EQ("Hello world", content);
+  ASSERT_THROW(s.Read(content, "nope", OrthancPluginContentType_Dicom), PostgreSQLException);
+
+  s.Clear();
+  ASSERT_EQ(0, CountLargeObjects(s.GetConnectionPool()));
+}
+
+
+TEST(PostgreSQL, StorageAreaBytea)
+{
+  ASSERT_EQ(PostgreSQLStorageBackend_LargeObject, PostgreSQLStorageArea::ParseBackend("LargeObject"));
+  ASSERT_EQ(PostgreSQLStorageBackend_Bytea, PostgreSQLStorageArea::ParseBackend("Bytea"));
+  ASSERT_THROW(PostgreSQLStorageArea::ParseBackend("nope"), PostgreSQLException);
+
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+  PostgreSQLStorageArea s(pool.release(), true, true, PostgreSQLStorageBackend_Bytea);
+  ASSERT_EQ(PostgreSQLStorageBackend_Bytea, s.GetBackend());
+
+  {
+    PostgreSQLConnectionPool::Accessor accessor(s.GetConnectionPool());
+    ASSERT_TRUE(accessor.GetConnection().DoesTableExist("StorageAreaBytea"));
+    ASSERT_FALSE(accessor.GetConnection().DoesTableExist("StorageArea"));
+  }
+
+  // Binary content, larger than the threshold of the direct access
+  std::string value(2 * 1024 * 1024, '\0');
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    value[i] = static_cast<char>(i % 251);
+  }
+
+  s.Create("a", value.c_str(), value.size(), OrthancPluginContentType_Dicom);
+  s.Create("b", NULL, 0, OrthancPluginContentType_Dicom);
+
+  {
+    PostgreSQLStorageArea::Writer writer(s, "c", OrthancPluginContentType_Dicom);
+    writer.Append("Hello ", 6);
+    writer.Append("world", 5);
+    writer.Commit();
+  }
+
+  {
+    // Not committed
+    PostgreSQLStorageArea::Writer writer(s, "nope", OrthancPluginContentType_Dicom);
+    writer.Append("Nope", 4);
+  }
+
+  ASSERT_EQ(0, CountLargeObjects(s.GetConnectionPool()));
+
+  std::string content;
+  s.Read(content, "a", OrthancPluginContentType_Dicom);
+  ASSERT_EQ(value, content);
+  s.Read(content, "b", OrthancPluginContentType_Dicom);
+  ASSERT_TRUE(content.empty());
+  s.Read(content, "c", OrthancPluginContentType_Dicom);
+  ASSERT_EQ("Hello world", content);
+  ASSERT_THROW(s.Read(content, "nope", OrthancPluginContentType_Dicom), PostgreSQLException);
+  ASSERT_THROW(s.Read(content, "a", OrthancPluginContentType_Unknown), PostgreSQLException);
+
+  s.ReadRange(content, "a", OrthancPluginContentType_Dicom, 1000, 5000);
+  ASSERT_EQ(value.substr(1000, 5000), content);
+  s.ReadRange(content, "a", OrthancPluginContentType_Dicom, value.size() - 10, 100);
+  ASSERT_EQ(value.substr(value.size() - 10), content);
+  s.ReadRange(content, "a", OrthancPluginContentType_Dicom, 1ull << 40, 100);
+  ASSERT_TRUE(content.empty());
+
+  s.Remove("a", OrthancPluginContentType_Dicom);
+  ASSERT_THROW(s.Read(content, "a", OrthancPluginContentType_Dicom), PostgreSQLException);
+  s.Read(content, "c", OrthancPluginContentType_Dicom);
+  ASSERT_EQ("Hello world", content);
+
+  s.Clear();
+  ASSERT_THROW(s.Read(content, "c", OrthancPluginContentType_Dicom), PostgreSQLException);
+}
+
+
+TEST(PostgreSQL, StorageMigration)
+{
+  {
+    // Start from an empty database
+    std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  }
+
+  std::vector<std::string> values;
+  for (int i = 0; i < 25; i++)
+  {
+    values.push_back(std::string(i * 1000, static_cast<char>('a' + i)));
+  }
+
+  {
+    PostgreSQLStorageArea s(CreateTestConnectionPool(false), true, false);
+
+    // Nothing to migrate, as the table "StorageAreaBytea" is missing
+    ASSERT_EQ(0u, s.Migrate(10));
+    s.CheckOtherBackendIsEmpty();
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      s.Create(boost::lexical_cast<std::string>(i), values[i].c_str(), values[i].size(),
+               OrthancPluginContentType_Dicom);
+    }
+
+    ASSERT_EQ(25, CountLargeObjectsMetadata(s.GetConnectionPool()));
+  }
+
+  {
+    PostgreSQLStorageArea s(CreateTestConnectionPool(false), true, false, PostgreSQLStorageBackend_Bytea);
+    ASSERT_THROW(s.CheckOtherBackendIsEmpty(), PostgreSQLException);
+    ASSERT_THROW(s.Migrate(0), PostgreSQLException);
+    ASSERT_EQ(25u, s.Migrate(10));
+    ASSERT_EQ(0u, s.Migrate(10));
+    s.CheckOtherBackendIsEmpty();
+
+    // The large objects were removed by the rule of "StorageArea"
+    ASSERT_EQ(0, CountLargeObjectsMetadata(s.GetConnectionPool()));
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      std::string content;
+      s.Read(content, boost::lexical_cast<std::string>(i), OrthancPluginContentType_Dicom);
+      ASSERT_EQ(values[i], content);
+    }
+  }
+
+  {
+    PostgreSQLStorageArea s(CreateTestConnectionPool(false), true, false);
+    ASSERT_EQ(25u, s.Migrate(7));
+    ASSERT_EQ(25, CountLargeObjectsMetadata(s.GetConnectionPool()));
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      // The sizes are stored, so the attachments are read in place
+      std::string content;
+      s.Read(content, boost::lexical_cast<std::string>(i), OrthancPluginContentType_Dicom);
+      ASSERT_EQ(values[i], content);
+    }
+
+    PostgreSQLConnectionPool::Accessor accessor(s.GetConnectionPool());
+    PostgreSQLStatement statement(accessor.GetConnection(), "SELECT COUNT(*) FROM StorageAreaBytea");
+    PostgreSQLResult result(statement);
+    ASSERT_EQ(0, result.GetInteger64(0));
+  }
+}
+
+
+TEST(PostgreSQL, ConnectionPool)
+{
+  PostgreSQLConnectionPool pool(CreateTestConnection(true), 2, 3);
+  pool.SetTimeout(100);
+
+  ASSERT_EQ(2u, pool.GetSize());
+  ASSERT_EQ(2u, pool.GetIdleCount());
+
+  {
+    PostgreSQLConnectionPool::Accessor a(pool);
+    PostgreSQLConnectionPool::Accessor b(pool);
+    ASSERT_NE(&a.GetConnection(), &b.GetConnection());
+    ASSERT_EQ(0u, pool.GetIdleCount());
+
+    {
+      // Grow the pool up to its maximum size
+      PostgreSQLConnectionPool::Accessor c(pool);
+      ASSERT_EQ(3u, pool.GetSize());
+      ASSERT_NE(&a.GetConnection(), &c.GetConnection());
+      ASSERT_NE(&b.GetConnection(), &c.GetConnection());
+
+      ASSERT_THROW(PostgreSQLConnectionPool::Accessor d(pool), PostgreSQLException);
+    }
+
+    // The connection that was just released is reused
+    ASSERT_EQ(1u, pool.GetIdleCount());
+    PostgreSQLConnectionPool::Accessor d(pool);
+    ASSERT_EQ(3u, pool.GetSize());
+  }
+
+  ASSERT_EQ(3u, pool.GetIdleCount());
+
+  {
+    // Only the idle connections are handed out, without waiting
+    std::auto_ptr<PostgreSQLConnectionPool::Accessor> a(pool.TryAcquireIdle());
+    std::auto_ptr<PostgreSQLConnectionPool::Accessor> b(pool.TryAcquireIdle());
+    std::auto_ptr<PostgreSQLConnectionPool::Accessor> c(pool.TryAcquireIdle());
+    ASSERT_TRUE(a.get() != NULL && b.get() != NULL && c.get() != NULL);
+    ASSERT_EQ(0u, pool.GetIdleCount());
+
+    std::auto_ptr<PostgreSQLConnectionPool::Accessor> d(pool.TryAcquireIdle());
+    ASSERT_TRUE(d.get() == NULL);
+    ASSERT_EQ(3u, pool.GetSize());
+  }
+
+  ASSERT_EQ(3u, pool.GetIdleCount());
+
+  {
+    // The prepared statements are cached separately in each connection
+    PostgreSQLConnectionPool::Accessor a(pool);
+    PostgreSQLConnection& db = a.GetConnection();
+    ASSERT_TRUE(db.LookupCachedStatement("Test") == NULL);
+
+    PostgreSQLStatement& s = db.CacheStatement("Test", new PostgreSQLStatement(db, "SELECT 42"));
+    ASSERT_EQ(&s, db.LookupCachedStatement("Test"));
+    ASSERT_THROW(db.CacheStatement("Test", new PostgreSQLStatement(db, "SELECT 43")), PostgreSQLException);
+
+    PostgreSQLResult r(s);
+    ASSERT_EQ(42, r.GetInteger(0));
+  }
+}
+
+
+static int64_t CountRecords(PostgreSQLConnection& db)
+{
+  PostgreSQLStatement s(db, "SELECT CAST(COUNT(*) AS BIGINT) FROM Test");
+  PostgreSQLResult r(s);
+  return r.GetInteger64(0);
+}
+
+
+TEST(PostgreSQL, Pipeline)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->SetPipelining(true);
+
+  pg->Execute("CREATE TABLE Test(name INTEGER PRIMARY KEY)");
+
+  PostgreSQLStatement s(*pg, "INSERT INTO Test VALUES ($1)");
+  s.DeclareInputInteger(0);
+
+  {
+    PostgreSQLTransaction t(*pg);
+
+    for (int i = 0; i < 100; i++)
+    {
+      s.BindInteger(0, i);
+      s.Enqueue();
+    }
+
+    t.Commit();
+  }
+
+  ASSERT_EQ(100, CountRecords(*pg));
+
+  {
+    PostgreSQLTransaction t(*pg);
+    s.BindInteger(0, 100);
+    s.Enqueue();
+
+    // The reading of the table flushes the pipeline
+    ASSERT_EQ(101, CountRecords(*pg));
+
+    // Violation of the primary key, reported by the commit at the latest
+    ASSERT_THROW({ s.BindInteger(0, 42); s.Enqueue(); t.Commit(); }, PostgreSQLException);
+  }
+
+  // The connection is still usable after the error
+  ASSERT_EQ(100, CountRecords(*pg));
+}
+
+
+TEST(PostgreSQL, PreparedStatements)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->SetMaximumPreparedStatements(2);
+
+  const size_t count = pg->GetPreparedStatementsCount();
+  const uint64_t misses = pg->GetPreparedStatementsMisses();
+
+  {
+    PostgreSQLStatement s1(*pg, "SELECT $1");
+    s1.DeclareInputInteger(0);
+    s1.BindInteger(0, 42);
+    PostgreSQLResult r1(s1);
+    ASSERT_EQ(42, r1.GetInteger(0));
+
+    // Identical statements share the same server-side plan
+    PostgreSQLStatement s2(*pg, "SELECT $1");
+    s2.DeclareInputInteger(0);
+    s2.BindInteger(0, 43);
+    PostgreSQLResult r2(s2);
+    ASSERT_EQ(43, r2.GetInteger(0));
+
+    ASSERT_EQ(count + 1, pg->GetPreparedStatementsCount());
+    ASSERT_EQ(misses + 1, pg->GetPreparedStatementsMisses());
+    ASSERT_LE(1u, pg->GetPreparedStatementsHits());
+
+    // Different types of parameters lead to different plans
+    PostgreSQLStatement s3(*pg, "SELECT $1");
+    s3.DeclareInputInteger64(0);
+    s3.BindInteger64(0, 44);
+    PostgreSQLResult r3(s3);
+    ASSERT_EQ(44, r3.GetInteger64(0));
+    ASSERT_EQ(misses + 2, pg->GetPreparedStatementsMisses());
+  }
+
+  // The unused plans are evicted once the registry is full
+  for (int i = 0; i < 10; i++)
+  {
+    PostgreSQLStatement s(*pg, "SELECT " + boost::lexical_cast<std::string>(i));
+    PostgreSQLResult r(s);
+    ASSERT_EQ(i, r.GetInteger(0));
+  }
+
+  ASSERT_GE(2u, pg->GetPreparedStatementsCount());
+  ASSERT_LE(8u, pg->GetPreparedStatementsEvictions());
+
+  // An evicted plan is transparently prepared again
+  PostgreSQLStatement s(*pg, "SELECT $1");
+  s.DeclareInputInteger(0);
+  s.BindInteger(0, 45);
+  PostgreSQLResult r(s);
+  ASSERT_EQ(45, r.GetInteger(0));
+}
+
+
+namespace
+{
+  class CountCallback : public PostgreSQLAsyncQuery::ICallback
+  {
+  private:
+    unsigned int count_;
+
+  public:
+    CountCallback() : count_(0)
+    {
+    }
+
+    virtual void Apply(PostgreSQLAsyncQuery& query)
+    {
+      ASSERT_TRUE(query.IsDone());
+      count_++;
+    }
+
+    unsigned int GetCount() const
+    {
+      return count_;
+    }
+  };
+}
+
+
+TEST(PostgreSQL, EventLoop)
+{
+  PostgreSQLConnectionPool pool(CreateTestConnection(true), 3, 3);
+
+  PostgreSQLConnectionPool::Accessor a(pool);
+  PostgreSQLConnectionPool::Accessor b(pool);
+  PostgreSQLConnectionPool::Accessor c(pool);
+
+  PostgreSQLStatement s1(a.GetConnection(), "SELECT $1 + 1");
+  s1.DeclareInputInteger(0);
+  s1.BindInteger(0, 41);
+
+  PostgreSQLStatement s2(b.GetConnection(), "SELECT $1 + 1 FROM pg_sleep(0.1)");
+  s2.DeclareInputInteger(0);
+  s2.BindInteger(0, 42);
+
+  // Fails at execution time (a missing table would fail as soon as
+  // the statement is prepared, i.e. synchronously in Submit())
+  PostgreSQLStatement s3(c.GetConnection(), "SELECT 1 / $1");
+  s3.DeclareInputInteger(0);
+  s3.BindInteger(0, 0);
+
+  CountCallback callback;
+  PostgreSQLAsyncQuery q1(s1);
+  PostgreSQLAsyncQuery q2(s2);
+  PostgreSQLAsyncQuery q3(s3);
+  PostgreSQLAsyncQuery q4(s1);
+  q1.SetCallback(&callback);
+  q2.SetCallback(&callback);
+  q3.SetCallback(&callback);
+
+  PostgreSQLEventLoop loop;
+  loop.Submit(q1);
+  loop.Submit(q2);
+  loop.Submit(q3);
+  ASSERT_EQ(3u, loop.GetPendingCount());
+  ASSERT_FALSE(q1.IsDone());
+
+  // Only one query at once on each connection
+  ASSERT_THROW(loop.Submit(q4), PostgreSQLException);
+
+  loop.Wait(q1);
+  ASSERT_TRUE(q1.IsSuccess());
+  ASSERT_EQ(42, q1.GetResult().GetInteger(0));
+
+  loop.WaitAll();
+  ASSERT_FALSE(loop.HasPending());
+  ASSERT_EQ(3u, callback.GetCount());
+
+  ASSERT_TRUE(q2.IsSuccess());
+  ASSERT_EQ(43, q2.GetResult().GetInteger(0));
+
+  ASSERT_TRUE(q3.IsDone());
+  ASSERT_FALSE(q3.IsSuccess());
+  ASSERT_FALSE(q3.GetError().empty());
+  ASSERT_THROW(q3.GetResult(), PostgreSQLException);
+
+  // The connections can be used synchronously again
+  PostgreSQLResult r(s1);
+  ASSERT_EQ(42, r.GetInteger(0));
+}
+
+
+TEST(PostgreSQL, EventLoopTimeout)
+{
+  PostgreSQLConnectionPool pool(CreateTestConnection(true), 2, 2);
+
+  PostgreSQLConnectionPool::Accessor a(pool);
+  PostgreSQLConnectionPool::Accessor b(pool);
+  a.GetConnection().SetStatementTimeout(PostgreSQLStatementClass_Read, 100);
+
+  PostgreSQLStatement s1(a.GetConnection(), "SELECT 1 FROM pg_sleep(10)");
+  PostgreSQLStatement s2(b.GetConnection(), "SELECT 42 FROM pg_sleep(0.2)");
+  ASSERT_EQ(PostgreSQLStatementClass_Read, s1.GetTimeoutClass());
+
+  PostgreSQLAsyncQuery q1(s1);
+  PostgreSQLAsyncQuery q2(s2);
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  PostgreSQLEventLoop loop;
+  loop.Submit(q1);
+  loop.Submit(q2);
+
+  // The query that exceeds its timeout is canceled...
+  loop.Wait(q1);
+  ASSERT_TRUE(q1.IsDone());
+  ASSERT_FALSE(q1.IsSuccess());
+  ASSERT_TRUE(q1.IsTimeout());
+  ASSERT_THROW(q1.GetResult(), PostgreSQLTimeoutException);
+  ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 5000);
+
+  // ... without affecting the other queries
+  loop.WaitAll();
+  ASSERT_TRUE(q2.IsSuccess());
+  ASSERT_FALSE(q2.IsTimeout());
+  ASSERT_EQ(42, q2.GetResult().GetInteger(0));
+
+  // The connection can be used again
+  PostgreSQLStatement s3(a.GetConnection(), "SELECT 43");
+  PostgreSQLResult r(s3);
+  ASSERT_EQ(43, r.GetInteger(0));
+}
+
+
+static int GetBackendPid(PostgreSQLConnection& db)
+{
+  PostgreSQLStatement s(db, "SELECT pg_backend_pid()");
+  PostgreSQLResult r(s);
+  return r.GetInteger(0);
+}
+
+
+static void TerminateBackend(int pid)
+{
+  std::auto_ptr<PostgreSQLConnection> killer(CreateTestConnection(false));
+  PostgreSQLStatement s(*killer, "SELECT pg_terminate_backend($1)");
+  s.DeclareInputInteger(0);
+  s.BindInteger(0, pid);
+  PostgreSQLResult r(s);
+  ASSERT_TRUE(r.GetBoolean(0));
+}
+
+
+TEST(PostgreSQL, Reconnect)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->SetReconnectPolicy(3, 10);
+
+  // Statements are only executed again if explicitly marked as
+  // read-only, as a SELECT might have side effects
+  PostgreSQLStatement s(*pg, "SELECT pg_backend_pid()");
+  ASSERT_FALSE(s.IsReadOnly());
+  s.SetReadOnly(true);
+
+  int pid;
+  unsigned int generation = pg->GetGeneration();
+
+  {
+    PostgreSQLResult r(s);
+    pid = r.GetInteger(0);
+  }
+
+  // Read-only statements are transparently executed again
+  TerminateBackend(pid);
+
+  {
+    PostgreSQLResult r(s);
+    ASSERT_NE(pid, r.GetInteger(0));
+    pid = r.GetInteger(0);
+  }
+
+  ASSERT_EQ(generation + 1, pg->GetGeneration());
+
+  // No reconnection inside a transaction
+  {
+    PostgreSQLTransaction t(*pg);
+    TerminateBackend(pid);
+    ASSERT_THROW(PostgreSQLResult r(s), PostgreSQLException);
+    ASSERT_THROW(t.Commit(), PostgreSQLException);
+  }
+
+  // The session is opened again after the rollback
+  ASSERT_NE(pid, GetBackendPid(*pg));
+  ASSERT_EQ(generation + 2, pg->GetGeneration());
+
+  // The statements that are not marked as read-only are never
+  // executed again, even if they are SELECT
+  pid = GetBackendPid(*pg);
+  TerminateBackend(pid);
+  ASSERT_THROW(GetBackendPid(*pg), PostgreSQLException);
+  ASSERT_NE(pid, GetBackendPid(*pg));
+}
+
+
+TEST(PostgreSQL, ConnectionPoolBroken)
+{
+  PostgreSQLConnectionPool pool(CreateTestConnection(true), 1, 1);
+  pool.SetTimeout(100);
+
+  int pid;
+
+  {
+    PostgreSQLConnectionPool::Accessor a(pool);
+    pid = GetBackendPid(a.GetConnection());
+
+    TerminateBackend(pid);
+    ASSERT_THROW(GetBackendPid(a.GetConnection()), PostgreSQLException);
+  }
+
+  // The broken connection is closed instead of going back to the pool
+  ASSERT_EQ(0u, pool.GetSize());
+  ASSERT_EQ(0u, pool.GetIdleCount());
+
+  {
+    // ... and a new session replaces it
+    PostgreSQLConnectionPool::Accessor a(pool);
+    ASSERT_EQ(1u, pool.GetSize());
+    ASSERT_NE(pid, GetBackendPid(a.GetConnection()));
+  }
+
+  ASSERT_EQ(1u, pool.GetIdleCount());
+
+  {
+    // A connection that is released inside a transaction is not reused
+    PostgreSQLConnectionPool::Accessor a(pool);
+    a.GetConnection().Execute("BEGIN");
+  }
+
+  ASSERT_EQ(0u, pool.GetSize());
+}
+
+
+TEST(PostgreSQL, ReadRouter)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  PostgreSQLReadRouter router;
+  ASSERT_EQ(0u, router.GetReplicasCount());
+
+  // A primary server is never lagging
+  ASSERT_EQ(0, PostgreSQLReadRouter::MeasureLag(*pg));
+
+  // Without replica, the requests are sent to the primary
+  {
+    PostgreSQLReadRouter::Accessor route(router, *pg, true);
+    ASSERT_FALSE(route.IsReplica());
+    ASSERT_EQ(pg.get(), &route.GetConnection());
+    ASSERT_TRUE(route.GetReplicaPool() == NULL);
+  }
+
+  {
+    PostgreSQLReadRouter::Accessor route(router, *pg, false);
+    ASSERT_FALSE(route.IsReplica());
+  }
+
+  ASSERT_EQ(2u, router.GetPrimaryStatistics().GetCount());
+  ASSERT_EQ(0u, router.GetFallbacksCount());
+
+  // Use a second session on the same server as a "replica"
+  router.AddReplica(CreateTestConnectionPool(false));
+  ASSERT_EQ(1u, router.GetReplicasCount());
+
+  {
+    PostgreSQLReadRouter::Accessor route(router, *pg, true);
+    ASSERT_TRUE(route.IsReplica());
+    ASSERT_NE(pg.get(), &route.GetConnection());
+    ASSERT_TRUE(route.GetReplicaPool() != NULL);
+
+    PostgreSQLStatement s(route.GetConnection(), "SELECT 42");
+    PostgreSQLResult r(s);
+    ASSERT_EQ(42, r.GetInteger(0));
+  }
+
+  // Requests inside a transaction always go to the primary
+  {
+    PostgreSQLReadRouter::Accessor route(router, *pg, false);
+    ASSERT_FALSE(route.IsReplica());
+  }
+
+  ASSERT_EQ(1u, router.GetReplicaStatistics(0).GetCount());
+  ASSERT_EQ(3u, router.GetPrimaryStatistics().GetCount());
+  ASSERT_EQ(0u, router.GetFallbacksCount());
+}
+
+
+TEST(PostgreSQL, Timeout)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->SetStatementTimeout(PostgreSQLStatementClass_Read, 100);
+
+  PostgreSQLStatement s(*pg, "SELECT pg_sleep(5)");
+  ASSERT_EQ(PostgreSQLStatementClass_Read, s.GetTimeoutClass());
+
+  // The statement is canceled on the client side
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  ASSERT_THROW(PostgreSQLResult r(s), PostgreSQLTimeoutException);
+  ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 3000);
+
+  // The session can still be used
+  {
+    PostgreSQLStatement t(*pg, "SELECT 42");
+    PostgreSQLResult r(t);
+    ASSERT_EQ(42, r.GetInteger(0));
+  }
+
+  // No limit on the class of the statement
+  s.SetTimeoutClass(PostgreSQLStatementClass_Scan);
+  pg->SetStatementTimeout(PostgreSQLStatementClass_Read, 0);
+
+  // The server-side timeouts are reported with the same exception
+  {
+    PostgreSQLTransaction t(*pg);
+    pg->Execute("SET LOCAL statement_timeout = 100");
+    ASSERT_THROW(PostgreSQLResult r(s), PostgreSQLTimeoutException);
+  }
+
+  ASSERT_THROW(pg->SetStatementTimeout(static_cast<PostgreSQLStatementClass>(42), 10), PostgreSQLException);
+}
+
+
+TEST(PostgreSQL, SchemaProbe)
+{
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
+
+  {
+    PostgreSQLConnectionPool::Accessor accessor(*pool);
+    GlobalProperties p(accessor.GetConnection(), false, GlobalProperty_StorageLock);
+    p.Lock(false);
+
+    // The table "GlobalProperties" is created by the probe if missing
+    ASSERT_TRUE(p.HasSchemaElement(SchemaElement_GlobalProperties));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_Index));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_StorageArea));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_StorageAreaRule));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_StorageAreaSize));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_StorageAreaBytea));
+    ASSERT_TRUE(accessor.GetConnection().DoesTableExist("GlobalProperties"));
+  }
+
+  PostgreSQLStorageArea storageArea(pool.release(), true, false);
+
+  {
+    PostgreSQLConnectionPool::Accessor accessor(storageArea.GetConnectionPool());
+    GlobalProperties p(accessor.GetConnection(), false, GlobalProperty_StorageLock);
+    p.Lock(false);
+
+    ASSERT_TRUE(p.HasSchemaElement(SchemaElement_GlobalProperties));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_Index));
+    ASSERT_TRUE(p.HasSchemaElement(SchemaElement_StorageArea));
+    ASSERT_TRUE(p.HasSchemaElement(SchemaElement_StorageAreaRule));
+    ASSERT_TRUE(p.HasSchemaElement(SchemaElement_StorageAreaSize));
+    ASSERT_FALSE(p.HasSchemaElement(SchemaElement_StorageAreaBytea));
+  }
+
+  // The lock of the storage area is held by another session
+  {
+    std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(false));
+    GlobalProperties p(*pg, true, GlobalProperty_StorageLock);
+    ASSERT_THROW(p.Lock(false), PostgreSQLException);
+  }
+}
+
+
+TEST(PostgreSQL, StatementCatalog)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->SetPipelining(true);  // Prepare in one batch, if available
+  pg->Execute("CREATE TABLE Test(name INTEGER, value BIGINT)");
+
+  static const PostgreSQLStatementDeclaration DECLARATIONS[] = 
+  {
+    { 0, "INSERT INTO Test VALUES($1, $2)", "il", false, false },
+    { 1, "SELECT value FROM Test WHERE name=$1", "i", false, true },
+    { 2, "SELECT COUNT(*) FROM Test", "", true, true },
+    { 3, "SELECT value FROM Test WHERE name=$1", "i", false, false }  // Shares the plan of statement 1
+  };
+
+  PostgreSQLStatementCatalog catalog(*pg, DECLARATIONS, 4);
+  ASSERT_EQ(4u, catalog.GetSize());
+  ASSERT_EQ(PostgreSQLStatementClass_Write, catalog[0].GetTimeoutClass());
+  ASSERT_EQ(PostgreSQLStatementClass_Scan, catalog[2].GetTimeoutClass());
+  ASSERT_FALSE(catalog[0].IsReadOnly());
+  ASSERT_TRUE(catalog[1].IsReadOnly());
+  ASSERT_FALSE(catalog[3].IsReadOnly());
+  ASSERT_EQ(3u, pg->GetPreparedStatementsCount());
+  ASSERT_EQ(3u, pg->GetPreparedStatementsMisses());
+  ASSERT_EQ(1u, pg->GetPreparedStatementsHits());
+
+  // Using the statements requires no further preparation
+  catalog[0].BindInteger(0, 42);
+  catalog[0].BindInteger64(1, 4242);
+  catalog[0].Run();
+
+  {
+    catalog[3].BindInteger(0, 42);
+    PostgreSQLResult r(catalog[3]);
+    ASSERT_EQ(4242, r.GetInteger64(0));
+  }
+
+  ASSERT_EQ(3u, pg->GetPreparedStatementsMisses());
+  ASSERT_THROW(catalog[4], PostgreSQLException);
+
+  // The declarations must be ordered
+  static const PostgreSQLStatementDeclaration BAD[] = 
+  {
+    { 1, "SELECT 1", "", false, true }
+  };
+
+  ASSERT_THROW(PostgreSQLStatementCatalog(*pg, BAD, 1), PostgreSQLException);
+}
+
+
+TEST(PostgreSQL, Durability)
+{
+  Json::Value configuration;
+  configuration["PostgreSQL"]["Durability"]["History"] = "Relaxed";
+  configuration["PostgreSQL"]["Durability"]["Attachments"]["2"] = "Local";
+
+  DurabilityPolicy policy;
+  ConfigureDurability(policy, configuration);
+  ASSERT_EQ(PostgreSQLDurability_Relaxed, policy.GetHistory());
+  ASSERT_EQ(PostgreSQLDurability_Full, policy.GetBookkeeping());
+  ASSERT_EQ(PostgreSQLDurability_Full, policy.GetAttachment(1));
+  ASSERT_EQ(PostgreSQLDurability_Local, policy.GetAttachment(2));
+
+  configuration["PostgreSQL"]["Durability"]["History"] = "Nope";
+  ASSERT_THROW(ConfigureDurability(policy, configuration), PostgreSQLException);
+
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->Execute("CREATE TABLE Test(value INTEGER)");
+
+  PostgreSQLStatement getSetting(*pg, "SELECT current_setting('synchronous_commit')");
+  std::string original;
+
+  {
+    PostgreSQLResult r(getSetting);
+    original = r.GetString(0);
+  }
+
+  {
+    PostgreSQLTransaction t(*pg);
+    pg->Execute("INSERT INTO Test VALUES(42)");
+    t.Commit(PostgreSQLDurability_Relaxed);
+  }
+
+  {
+    PostgreSQLTransaction t(*pg);
+    pg->Execute("INSERT INTO Test VALUES(43)");
+    t.Commit(PostgreSQLDurability_Local);
+  }
+
+  // The relaxed durability does not outlive the transactions
+  {
+    PostgreSQLResult r(getSetting);
+    ASSERT_EQ(original, r.GetString(0));
+  }
+
+  PostgreSQLStatement count(*pg, "SELECT COUNT(*) FROM Test");
+  PostgreSQLResult r(count);
+  ASSERT_EQ(2, r.GetInteger64(0));
+}
+
+
+TEST(PostgreSQL, CopyWriter)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->Execute("CREATE TABLE Test(id BIGINT, name INTEGER, value BYTEA)");
+
+  {
+    PostgreSQLCopyWriter writer(*pg, "Test", 3);
+    writer.SetChunkSize(64);  // Force several chunks
+
+    for (int i = 0; i < 100; i++)
+    {
+      writer.BeginRow();
+      writer.AddInteger64(i);
+      writer.AddInteger(-i);
+
+      if (i % 10 == 0)
+      {
+        writer.AddNull();
+      }
+      else
+      {
+        writer.AddString(std::string("a\0b", 3) + boost::lexical_cast<std::string>(i));
+      }
+    }
+
+    ASSERT_EQ(100u, writer.Finish());
+  }
+
+  {
+    PostgreSQLStatement s(*pg, "SELECT COUNT(*), COUNT(value), SUM(name) FROM Test");
+    PostgreSQLResult r(s);
+    ASSERT_EQ(100, r.GetInteger64(0));
+    ASSERT_EQ(90, r.GetInteger64(1));
+    ASSERT_EQ(-4950, r.GetInteger64(2));
+  }
+
+  {
+    PostgreSQLStatement s(*pg, "SELECT value FROM Test WHERE id=42");
+    PostgreSQLResult r(s);
+    ASSERT_EQ(std::string("a\0b42", 5), r.GetString(0));
+  }
+
+  // A COPY that is not finished is aborted
+  {
+    PostgreSQLCopyWriter writer(*pg, "Test(id, name)", 2);
+    writer.BeginRow();
+    writer.AddInteger64(1000);
+    ASSERT_THROW(writer.BeginRow(), PostgreSQLException);
+    ASSERT_THROW(writer.Finish(), PostgreSQLException);
+  }
+
+  // The types of the values must match the columns
+  {
+    PostgreSQLCopyWriter writer(*pg, "Test(id)", 1);
+    writer.BeginRow();
+    writer.AddInteger(1000);
+    ASSERT_THROW(writer.Finish(), PostgreSQLException);
+  }
+
+  {
+    PostgreSQLStatement s(*pg, "SELECT COUNT(*) FROM Test");
+    PostgreSQLResult r(s);
+    ASSERT_EQ(100, r.GetInteger64(0));
+  }
+}
+
+
+TEST(PostgreSQL, TypedStatement)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  pg->Execute("CREATE TABLE Test(id BIGINT, name INTEGER, label TEXT)");
+
+  typedef boost::tuple<int64_t, int32_t, const char*>  InsertParameters;
+  PostgreSQLTypedStatement<InsertParameters> insert(*pg, "INSERT INTO Test VALUES($1, $2, $3)");
+
+  std::string label = "hello";
+  insert.Bind(InsertParameters(1, 10, label.c_str()));
+  insert.Run();
+
+  insert.Bind(InsertParameters(0x100000000ll, -20, "world"));
+  insert.Run();
+
+  typedef boost::tuple<int32_t, std::string>  Row;
+  PostgreSQLTypedStatement<boost::tuple<int64_t>, Row> select
+    (*pg, "SELECT name, label FROM Test WHERE id >= $1 ORDER BY id");
+
+  select.Bind(boost::make_tuple(static_cast<int64_t>(0)));
+
+  {
+    PostgreSQLTypedResult<Row> r(select);
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_EQ(10, r.Get<0>());
+    ASSERT_EQ("hello", r.Get<1>());
+
+    r.Step();
+    ASSERT_FALSE(r.IsDone());
+
+    Row row;
+    r.GetRow(row);
+    ASSERT_EQ(-20, row.get<0>());
+    ASSERT_EQ("world", row.get<1>());
+
+    r.Step();
+    ASSERT_TRUE(r.IsDone());
+  }
+
+  // The types of the columns are checked once, on untyped statements
+  PostgreSQLStatement untyped(*pg, "SELECT id, label FROM Test");
+  ASSERT_THROW(PostgreSQLTypedResult<Row> r(untyped), PostgreSQLException);
+
+  PostgreSQLStatement count(*pg, "SELECT name FROM Test");
+  ASSERT_THROW(PostgreSQLTypedResult<Row> r(count), PostgreSQLException);
+
+  // NULL values are rejected in the integer columns
+  PostgreSQLStatement null(*pg, "SELECT NULL::INTEGER, label FROM Test ORDER BY id");
+
+  {
+    PostgreSQLTypedResult<Row> r(null);
+    ASSERT_FALSE(r.IsDone());
+    ASSERT_THROW(r.Get<0>(), PostgreSQLException);
+    ASSERT_EQ("hello", r.Get<1>());
+  }
+}
+
+
+TEST(PostgreSQL, Streaming)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  PostgreSQLStatement s(*pg, "SELECT i, 'row' || i FROM generate_series(1, $1) AS i");
+  s.DeclareInputInteger(0);
+
+  s.BindInteger(0, 1000);
+
+  {
+    PostgreSQLResult r(s, PostgreSQLResultMode_Streaming);
+
+    int count = 0;
+    while (!r.IsDone())
+    {
+      count++;
+      ASSERT_EQ(count, r.GetInteger(0));
+      ASSERT_EQ("row" + boost::lexical_cast<std::string>(count), r.GetString(1));
+      r.Step();
+    }
+
+    ASSERT_EQ(1000, count);
+  }
+
+  // Abandoning a result skips its remaining rows
+  {
+    PostgreSQLResult r(s, PostgreSQLResultMode_Streaming);
+    ASSERT_EQ(1, r.GetInteger(0));
+    r.Step();
+    ASSERT_EQ(2, r.GetInteger(0));
+  }
+
+  s.BindInteger(0, 0);
+
+  {
+    PostgreSQLResult r(s, PostgreSQLResultMode_Streaming);
+    ASSERT_TRUE(r.IsDone());
+  }
+
+  // An error in the middle of the rows is reported by Step()
+  {
+    PostgreSQLStatement failing(*pg, "SELECT 1 / (3 - i) FROM generate_series(1, 5) AS i");
+    PostgreSQLResult r(failing, PostgreSQLResultMode_Streaming);
+    ASSERT_FALSE(r.IsDone());
+    r.Step();
+    ASSERT_THROW(r.Step(), PostgreSQLException);
+  }
+
+  // The connection is still usable
+  {
+    PostgreSQLStatement count(*pg, "SELECT COUNT(*) FROM generate_series(1, 10)");
+    PostgreSQLResult r(count);
+    ASSERT_EQ(10, r.GetInteger64(0));
+  }
+}
+
+
+TEST(PostgreSQL, Cursor)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  PostgreSQLStatement s(*pg, "SELECT i, 'row' || i FROM generate_series(1, $1) AS i");
+  s.DeclareInputInteger(0);
+  s.BindInteger(0, 25);
+
+  // Outside of a transaction
+  ASSERT_THROW(PostgreSQLCursor c(s), PostgreSQLException);
+
+  PostgreSQLTransaction t(*pg);
+
+  for (unsigned int fetchSize = 1; fetchSize <= 30; fetchSize += 4)
+  {
+    PostgreSQLCursor cursor(s, fetchSize);
+
+    int count = 0;
+    while (!cursor.IsDone())
+    {
+      count++;
+      ASSERT_EQ(count, cursor.GetInteger(0));
+      ASSERT_EQ("row" + boost::lexical_cast<std::string>(count), cursor.GetString(1));
+      cursor.Step();
+    }
+
+    ASSERT_EQ(25, count);
+    ASSERT_THROW(cursor.GetInteger(0), PostgreSQLException);
+  }
+
+  {
+    s.BindInteger(0, 0);
+    PostgreSQLCursor cursor(s);
+    ASSERT_TRUE(cursor.IsDone());
+  }
+
+  // Other statements can run between the batches, and several
+  // cursors can be open at once
+  {
+    s.BindInteger(0, 10);
+    PostgreSQLCursor a(s, 3);
+    PostgreSQLCursor b(s, 4);
+
+    for (int i = 1; i <= 5; i++)
+    {
+      ASSERT_EQ(i, a.GetInteger(0));
+      ASSERT_EQ(i, b.GetInteger(0));
+
+      PostgreSQLStatement count(*pg, "SELECT COUNT(*) FROM generate_series(1, 10)");
+      PostgreSQLResult r(count);
+      ASSERT_EQ(10, r.GetInteger64(0));
+
+      a.Step();
+      b.Step();
+    }
+  }
+
+  t.Commit();
+}
+
+
+TEST(PostgreSQL, StringView)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  PostgreSQLStatement s(*pg, "SELECT repeat('x', i), $1::BYTEA FROM generate_series(1, 10000) AS i");
+  s.DeclareInputBinary(0);
+  s.BindString(0, std::string("a\0b", 3));
+
+  PostgreSQLResult r(s);
+
+  size_t size;
+  const char* view = r.GetStringView(size, 1);
+  ASSERT_EQ(3u, size);
+  ASSERT_EQ(0, memcmp(view, "a\0b", 3));
+  ASSERT_EQ('\0', view[3]);
+
+  ASSERT_THROW(r.GetStringView(size, 2), PostgreSQLException);
+
+  // The memory of the target string is reused from one row to the
+  // next, as long as the values do not grow
+  std::string target;
+  target.reserve(10000);
+  const char* buffer = target.c_str();
+
+  int count = 0;
+  while (!r.IsDone())
+  {
+    count++;
+    r.GetString(target, 0);
+    ASSERT_EQ(static_cast<size_t>(count), target.size());
+    ASSERT_EQ(buffer, target.c_str());
+
+    view = r.GetStringView(size, 0);
+    ASSERT_EQ(target.size(), size);
+    ASSERT_EQ(0, memcmp(view, target.c_str(), size));
+
+    r.Step();
+  }
+
+  ASSERT_EQ(10000, count);
+}
+
+
+TEST(PostgreSQL, ReadIntegerColumn)
+{
+  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+
+  PostgreSQLStatement s(*pg, "SELECT i::INT4 - 500, (i - 500) * 10000000000::INT8 "
+                        "FROM generate_series(1, 1000) AS i ORDER BY i");
+
+  {
+    PostgreSQLResult r(s);
+    r.Step();  // Start from the second row
+
+    std::vector<int32_t> values;
+    r.ReadIntegerColumn(values, 0);
+    ASSERT_TRUE(r.IsDone());
+    ASSERT_EQ(999u, values.size());
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      ASSERT_EQ(static_cast<int32_t>(i) - 498, values[i]);
+    }
+  }
+
+  for (int mode = 0; mode < 2; mode++)
+  {
+    PostgreSQLResult r(s, mode == 0 ? PostgreSQLResultMode_Buffered : PostgreSQLResultMode_Streaming);
+
+    std::vector<int64_t> values;
+    r.ReadInteger64Column(values, 1);
+    ASSERT_TRUE(r.IsDone());
+    ASSERT_EQ(1000u, values.size());
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      ASSERT_EQ((static_cast<int64_t>(i) - 499) * 10000000000ll, values[i]);
+    }
+  }
+
+  {
+    PostgreSQLResult r(s);
+    std::vector<int64_t> values;
+    ASSERT_THROW(r.ReadInteger64Column(values, 0), PostgreSQLException);
+  }
+
+  {
+    PostgreSQLStatement nulls(*pg, "SELECT NULLIF(i, 3) FROM generate_series(1, 5) AS i");
+    PostgreSQLResult r(nulls);
+    std::vector<int32_t> values;
+    ASSERT_THROW(r.ReadIntegerColumn(values, 0), PostgreSQLException);
+  }
 }
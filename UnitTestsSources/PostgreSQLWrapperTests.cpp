@@ -28,7 +28,7 @@
 
 using namespace OrthancPlugins;
 
-extern PostgreSQLConnection* CreateTestConnection(bool clearAll);
+extern PostgreSQLConnectionPool* CreateTestConnectionPool(bool clearAll);
 
 
 // From Orthanc enumerations 
@@ -134,7 +134,7 @@ static int32_t InvokeService(struct _OrthancPluginContext_t* context,
 
 TEST(PostgreSQLWrapper, Basic)
 {
-  std::auto_ptr<PostgreSQLConnection> pg(CreateTestConnection(true));
+  std::auto_ptr<PostgreSQLConnectionPool> pool(CreateTestConnectionPool(true));
 
   OrthancPluginContext context;
   context.pluginsManager = NULL;
@@ -142,7 +142,7 @@ TEST(PostgreSQLWrapper, Basic)
   context.Free = ::free;
   context.InvokeService = InvokeService;
 
-  PostgreSQLWrapper db(pg.release(), true, true);
+  PostgreSQLWrapper db(pool.release(), true, true);
   db.RegisterOutput(new DatabaseBackendOutput(&context, NULL));
 
   std::string s;
@@ -419,7 +419,47 @@ TEST(PostgreSQLWrapper, Basic)
 
 TEST(PostgreSQLWrapper, Lock)
 {
-  PostgreSQLWrapper db1(CreateTestConnection(true), true, false);
-  PostgreSQLWrapper db2(CreateTestConnection(false), false, false);
-  ASSERT_THROW(OrthancPlugins::PostgreSQLWrapper db3(CreateTestConnection(false), true, false), std::runtime_error);
+  PostgreSQLWrapper db1(CreateTestConnectionPool(true), true, false);
+  PostgreSQLWrapper db2(CreateTestConnectionPool(false), false, false);
+  ASSERT_THROW(OrthancPlugins::PostgreSQLWrapper db3(CreateTestConnectionPool(false), true, false), std::runtime_error);
+}
+
+
+TEST(PostgreSQLWrapper, BulkTags)
+{
+  PostgreSQLWrapper db(CreateTestConnectionPool(true), false, false);
+
+  int64_t a = db.CreateResource("study", OrthancPluginResourceType_Study);
+
+  // Inside a transaction, the tags are buffered until the next statement
+  db.StartTransaction();
+  db.SetMainDicomTag(a, 0x0010, 0x0010, "name");
+  db.SetMainDicomTag(a, 0x0010, 0x0020, "patient");
+  db.SetIdentifierTag(a, 0x0010, 0x0020, "patient");
+  ASSERT_EQ(2, db.GetTableRecordCount("MainDicomTags"));
+  ASSERT_EQ(1, db.GetTableRecordCount("DicomIdentifiers"));
+
+  db.SetMainDicomTag(a, 0x0020, 0x000d, "study");
+  db.SetIdentifierTag(a, 0x0020, 0x000d, "study");
+  db.CommitTransaction();
+
+  ASSERT_EQ(3, db.GetTableRecordCount("MainDicomTags"));
+  ASSERT_EQ(2, db.GetTableRecordCount("DicomIdentifiers"));
+
+  // The buffered tags are dropped on rollbacks
+  db.StartTransaction();
+  db.SetMainDicomTag(a, 0x0008, 0x0020, "date");
+  db.RollbackTransaction();
+
+  db.StartTransaction();
+  db.CommitTransaction();
+  ASSERT_EQ(3, db.GetTableRecordCount("MainDicomTags"));
+
+  // The tags are flushed before the deletion of their resource
+  db.StartTransaction();
+  db.SetMainDicomTag(a, 0x0008, 0x0020, "date");
+  db.DeleteResource(a);
+  db.CommitTransaction();
+  ASSERT_EQ(0, db.GetTableRecordCount("MainDicomTags"));
+  ASSERT_EQ(0, db.GetTableRecordCount("DicomIdentifiers"));
 }
@@ -18,7 +18,7 @@
  **/
 
 
-#include "../Core/PostgreSQLConnection.h"
+#include "../Core/PostgreSQLConnectionPool.h"
 
 #include <gtest/gtest.h>
 #include <memory>
@@ -48,6 +48,12 @@ OrthancPlugins::PostgreSQLConnection* CreateTestConnection(bool clearAll)
 }
 
 
+OrthancPlugins::PostgreSQLConnectionPool* CreateTestConnectionPool(bool clearAll)
+{
+  return new OrthancPlugins::PostgreSQLConnectionPool(CreateTestConnection(clearAll), 1, 4);
+}
+
+
 
 int main(int argc, char **argv)
 {